@@ -113,6 +113,10 @@ HEADERS  += asyncTest-framework.h \
             ../bindings/qt/QTMegaChatNotificationListener.h \
             ../bindings/qt/QTMegaChatNodeHistoryListener.h \
             base/asyncTools.h \
+            base/flatMap.h \
+            base/workerPool.h \
+            base/initTracer.h \
+            base/mpscQueue.h \
             base/addrinfo.hpp \
             base/cservices-thread.h \
             base/cservices.h \
@@ -0,0 +1,220 @@
+#ifndef FLATMAP_H
+#define FLATMAP_H
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+#include <utility>
+#include <functional>
+#include <type_traits>
+
+namespace karere
+{
+/** @brief Hash map using open addressing with linear probing, meant for keys that
+ * are (or hash to) random 64-bit values, like the ids of chats, users and messages.
+ * All entries live inline in a single array, instead of a separately allocated node
+ * per entry like std::map, so lookups touch very few cache lines.
+ * The interface mimics the used subset of std::map, with these differences:
+ * - insertions and erasures invalidate all iterators and references to entries,
+ * except the iterator returned by erase(iterator)
+ * - iteration order is unspecified
+ * The hash of the key is mixed before use, so \c Hash may be the identity.
+ */
+template <class K, class T, class Hash=std::hash<K>>
+class FlatMap
+{
+public:
+    struct Entry
+    {
+        K first;
+        T second;
+        template <class... Args>
+        Entry(const K& key, Args&&... args): first(key), second(std::forward<Args>(args)...) {}
+    };
+    template <class E, class M>
+    class IteratorBase
+    {
+    protected:
+        M* mMap;
+        size_t mPos;
+        void skipUnused()
+        {
+            while ((mPos < mMap->mCapacity) && !mMap->mUsed[mPos])
+                mPos++;
+        }
+    public:
+        IteratorBase(M* map, size_t pos): mMap(map), mPos(pos) { skipUnused(); }
+        /** Converts an iterator into a const_iterator */
+        template <class E2, class M2, class = typename std::enable_if<std::is_convertible<M2*, M*>::value>::type>
+        IteratorBase(const IteratorBase<E2, M2>& other): mMap(other.mMap), mPos(other.mPos) {}
+        E& operator*() const { return mMap->entry(mPos); }
+        E* operator->() const { return &mMap->entry(mPos); }
+        IteratorBase& operator++() { mPos++; skipUnused(); return *this; }
+        bool operator==(const IteratorBase& other) const { return mPos == other.mPos; }
+        bool operator!=(const IteratorBase& other) const { return mPos != other.mPos; }
+        friend class FlatMap;
+        template <class, class> friend class IteratorBase;
+    };
+    typedef IteratorBase<Entry, FlatMap> iterator;
+    typedef IteratorBase<const Entry, const FlatMap> const_iterator;
+
+protected:
+    enum { kMinCapacity = 8 };
+    typedef typename std::aligned_storage<sizeof(Entry), alignof(Entry)>::type Slot;
+    std::unique_ptr<Slot[]> mSlots;
+    std::unique_ptr<uint8_t[]> mUsed;
+    size_t mCapacity = 0;
+    size_t mCount = 0;
+
+    Entry& entry(size_t pos) { return *reinterpret_cast<Entry*>(&mSlots[pos]); }
+    const Entry& entry(size_t pos) const { return *reinterpret_cast<const Entry*>(&mSlots[pos]); }
+    size_t homeSlot(const K& key) const
+    {
+        // Fibonacci hashing, so that sequential or low-entropy keys don't cluster
+        return (size_t)(((uint64_t)Hash()(key) * 0x9E3779B97F4A7C15ULL) >> 32) & (mCapacity - 1);
+    }
+    /** Returns the slot of \c key, or the capacity if not present */
+    size_t findSlot(const K& key) const
+    {
+        if (!mCount)
+            return mCapacity;
+
+        for (size_t i = homeSlot(key); mUsed[i]; i = (i + 1) & (mCapacity - 1))
+        {
+            if (entry(i).first == key)
+                return i;
+        }
+        return mCapacity;
+    }
+    size_t freeSlot(const K& key) const
+    {
+        size_t i = homeSlot(key);
+        while (mUsed[i])
+            i = (i + 1) & (mCapacity - 1);
+        return i;
+    }
+    void rehash(size_t capacity)
+    {
+        std::unique_ptr<Slot[]> oldSlots(std::move(mSlots));
+        std::unique_ptr<uint8_t[]> oldUsed(std::move(mUsed));
+        size_t oldCapacity = mCapacity;
+        mSlots.reset(new Slot[capacity]);
+        mUsed.reset(new uint8_t[capacity]());
+        mCapacity = capacity;
+        for (size_t i = 0; i < oldCapacity; i++)
+        {
+            if (!oldUsed[i])
+                continue;
+
+            Entry& old = *reinterpret_cast<Entry*>(&oldSlots[i]);
+            size_t slot = freeSlot(old.first);
+            new (&mSlots[slot]) Entry(std::move(old));
+            mUsed[slot] = 1;
+            old.~Entry();
+        }
+    }
+
+public:
+    FlatMap() {}
+    FlatMap(const FlatMap&) = delete;
+    FlatMap& operator=(const FlatMap&) = delete;
+    ~FlatMap() { clear(); }
+
+    size_t size() const { return mCount; }
+    bool empty() const { return mCount == 0; }
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, mCapacity); }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, mCapacity); }
+    iterator find(const K& key) { return iterator(this, findSlot(key)); }
+    const_iterator find(const K& key) const { return const_iterator(this, findSlot(key)); }
+    size_t count(const K& key) const { return (findSlot(key) != mCapacity) ? 1 : 0; }
+
+    /** @brief Makes room for \c count entries, keeping the load factor below 3/4 */
+    void reserve(size_t count)
+    {
+        if (count * 4 <= mCapacity * 3)
+            return;
+
+        size_t capacity = mCapacity ? mCapacity : (size_t)kMinCapacity;
+        while (count * 4 > capacity * 3)
+            capacity *= 2;
+        rehash(capacity);
+    }
+
+    /** @brief Adds an entry for \c key with a value constructed from \c args,
+     * unless the key is already present */
+    template <class... Args>
+    std::pair<iterator, bool> emplace(const K& key, Args&&... args)
+    {
+        size_t slot = findSlot(key);
+        if (slot != mCapacity)
+            return std::make_pair(iterator(this, slot), false);
+
+        reserve(mCount + 1);
+        slot = freeSlot(key);
+        new (&mSlots[slot]) Entry(key, std::forward<Args>(args)...);
+        mUsed[slot] = 1;
+        mCount++;
+        return std::make_pair(iterator(this, slot), true);
+    }
+    T& operator[](const K& key) { return emplace(key).first->second; }
+
+    /** @brief Removes the entry of \c key, if any, and returns the number of erased entries.
+     * The following entries of the same probe sequence are shifted back, so no
+     * tombstones are left behind */
+    size_t erase(const K& key)
+    {
+        size_t slot = findSlot(key);
+        if (slot == mCapacity)
+            return 0;
+
+        eraseSlot(slot);
+        return 1;
+    }
+    /** @brief Removes the entry at \c it and returns an iterator to the next entry.
+     * That is the erased slot itself if a following entry was shifted back into it,
+     * so erasing while iterating doesn't skip any entry. An entry that had wrapped
+     * around to the start of the array may be shifted to the end and visited twice */
+    iterator erase(iterator it)
+    {
+        size_t slot = it.mPos;
+        eraseSlot(slot);
+        return iterator(this, slot);
+    }
+    void clear()
+    {
+        for (size_t i = 0; i < mCapacity; i++)
+        {
+            if (mUsed[i])
+                entry(i).~Entry();
+        }
+        mSlots.reset();
+        mUsed.reset();
+        mCapacity = 0;
+        mCount = 0;
+    }
+
+protected:
+    void eraseSlot(size_t hole)
+    {
+        entry(hole).~Entry();
+        for (size_t i = (hole + 1) & (mCapacity - 1); mUsed[i]; i = (i + 1) & (mCapacity - 1))
+        {
+            // the entry can fill the hole only if its home slot is not cyclically within (hole, i]
+            size_t home = homeSlot(entry(i).first);
+            bool homeInRange = (hole <= i)
+                ? (home > hole && home <= i)
+                : (home > hole || home <= i);
+            if (!homeInRange)
+            {
+                new (&mSlots[hole]) Entry(std::move(entry(i)));
+                entry(i).~Entry();
+                hole = i;
+            }
+        }
+        mUsed[hole] = 0;
+        mCount--;
+    }
+};
+}
+#endif
@@ -0,0 +1,142 @@
+#ifndef INITTRACER_H
+#define INITTRACER_H
+#include <string>
+#include <vector>
+#include <chrono>
+#include <ctime>
+#include <stdint.h>
+#include <time.h>
+
+namespace karere
+{
+/** @brief Records the duration of each phase of the initialization of the client,
+ * in wall and CPU time of the calling thread, together with the number of db rows
+ * and objects loaded by it, and the time at which some milestones were reached
+ * (i.e. being connected). All times are in microseconds, milestones relative to
+ * the last \c reset().
+ */
+class InitTracer
+{
+public:
+    struct Phase
+    {
+        std::string name;
+        int64_t wallUsecs = 0;
+        int64_t cpuUsecs = 0;
+        size_t rows = 0;
+        size_t objects = 0;
+        Phase(const char* aName): name(aName) {}
+    };
+    struct Mark
+    {
+        std::string name;
+        int64_t usecs;
+        Mark(const char* aName, int64_t aUsecs): name(aName), usecs(aUsecs) {}
+    };
+    /** @brief Measures a phase from its construction to its destruction.
+     * Phases started after \c finish() are not recorded */
+    class Scope
+    {
+    protected:
+        enum: size_t { kNotRecorded = (size_t)-1 };
+        InitTracer& mTracer;
+        size_t mIndex;
+        std::chrono::steady_clock::time_point mStart;
+        int64_t mCpuStart;
+    public:
+        Scope(InitTracer& tracer, const char* name)
+        : mTracer(tracer), mIndex(tracer.mFinished ? kNotRecorded : tracer.mPhases.size()),
+          mStart(std::chrono::steady_clock::now()), mCpuStart(threadCpuUsecs())
+        {
+            if (mIndex != kNotRecorded)
+                tracer.mPhases.emplace_back(name);
+        }
+        ~Scope()
+        {
+            if (mIndex == kNotRecorded)
+                return;
+            auto& phase = mTracer.mPhases[mIndex];
+            phase.wallUsecs = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - mStart).count();
+            phase.cpuUsecs = threadCpuUsecs() - mCpuStart;
+        }
+        void setRows(size_t rows)
+        {
+            if (mIndex != kNotRecorded)
+                mTracer.mPhases[mIndex].rows = rows;
+        }
+        void setObjects(size_t objects)
+        {
+            if (mIndex != kNotRecorded)
+                mTracer.mPhases[mIndex].objects = objects;
+        }
+    };
+
+protected:
+    std::chrono::steady_clock::time_point mStart = std::chrono::steady_clock::now();
+    std::vector<Phase> mPhases;
+    std::vector<Mark> mMarks;
+    bool mFinished = false;
+
+public:
+    static int64_t threadCpuUsecs()
+    {
+#ifdef CLOCK_THREAD_CPUTIME_ID
+        struct timespec ts;
+        if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+            return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+        return (int64_t)std::clock() * 1000000 / CLOCKS_PER_SEC;
+    }
+    void reset()
+    {
+        mStart = std::chrono::steady_clock::now();
+        mPhases.clear();
+        mMarks.clear();
+        mFinished = false;
+    }
+    void mark(const char* name)
+    {
+        mMarks.emplace_back(name, std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - mStart).count());
+    }
+    /** @brief Records the last milestone of the initialization */
+    void finish(const char* name)
+    {
+        mark(name);
+        mFinished = true;
+    }
+    bool isFinished() const { return mFinished; }
+    const std::vector<Phase>& phases() const { return mPhases; }
+    const std::vector<Mark>& marks() const { return mMarks; }
+    /** @brief Returns the phases and milestones as a JSON object */
+    std::string report() const
+    {
+        std::string result("{\"phases\":[");
+        for (size_t i = 0; i < mPhases.size(); i++)
+        {
+            auto& phase = mPhases[i];
+            if (i)
+                result += ',';
+            result.append("{\"name\":\"").append(phase.name)
+                  .append("\",\"wall\":").append(std::to_string(phase.wallUsecs))
+                  .append(",\"cpu\":").append(std::to_string(phase.cpuUsecs))
+                  .append(",\"rows\":").append(std::to_string(phase.rows))
+                  .append(",\"objects\":").append(std::to_string(phase.objects))
+                  .append("}");
+        }
+        result.append("],\"marks\":[");
+        for (size_t i = 0; i < mMarks.size(); i++)
+        {
+            if (i)
+                result += ',';
+            result.append("{\"name\":\"").append(mMarks[i].name)
+                  .append("\",\"time\":").append(std::to_string(mMarks[i].usecs))
+                  .append("}");
+        }
+        result.append("]}");
+        return result;
+    }
+};
+}
+#endif
@@ -0,0 +1,123 @@
+#ifndef MPSCQUEUE_H
+#define MPSCQUEUE_H
+#include <atomic>
+#include <stddef.h>
+
+namespace karere
+{
+/** @brief Lock-free FIFO queue of pointers, with multiple producers and a single
+ * consumer.
+ * Producers push onto a shared lock-free stack. The consumer takes the whole
+ * stack at once when its own list runs empty, and reverses it, so it does a single
+ * atomic operation per batch of items instead of one per item.
+ * \c push() returns whether the queue was empty, so that the producers wake up the
+ * consumer only once per batch.
+ * All methods except \c push() must be called only by the consumer, or serialized
+ * with it.
+ */
+template <class T>
+class MpscQueue
+{
+protected:
+    struct Node
+    {
+        T item;
+        Node* next;
+        Node(T aItem): item(aItem), next(nullptr) {}
+    };
+    /** Items pushed by the producers, the most recent first */
+    std::atomic<Node*> mPushed;
+    /** Items taken by the consumer, the oldest first */
+    Node* mFirst = nullptr;
+    Node* mLast = nullptr;
+
+    /** Appends the items pushed so far to the consumer's list */
+    void takePushed()
+    {
+        Node* node = mPushed.exchange(nullptr, std::memory_order_acquire);
+        if (!node)
+            return;
+
+        Node* last = node;
+        Node* first = nullptr;
+        while (node)
+        {
+            Node* next = node->next;
+            node->next = first;
+            first = node;
+            node = next;
+        }
+        if (mLast)
+            mLast->next = first;
+        else
+            mFirst = first;
+        mLast = last;
+    }
+
+public:
+    MpscQueue(): mPushed(nullptr) {}
+    ~MpscQueue()
+    {
+        takePushed();
+        while (mFirst)
+        {
+            Node* next = mFirst->next;
+            delete mFirst;
+            mFirst = next;
+        }
+    }
+    /** @brief Adds an item at the end of the queue. Can be called from any thread.
+     * @return Whether the queue was empty, i.e. the consumer may be waiting for items.
+     * It may return true even if the consumer still has items not popped yet.
+     */
+    bool push(T item)
+    {
+        Node* node = new Node(item);
+        Node* head = mPushed.load(std::memory_order_relaxed);
+        do
+        {
+            node->next = head;
+        }
+        while (!mPushed.compare_exchange_weak(head, node, std::memory_order_release, std::memory_order_relaxed));
+        return head == nullptr;
+    }
+    /** @brief Removes and returns the first item, or a null item if the queue is empty */
+    T pop()
+    {
+        if (!mFirst)
+        {
+            takePushed();
+            if (!mFirst)
+                return T();
+        }
+        Node* node = mFirst;
+        mFirst = node->next;
+        if (!mFirst)
+            mLast = nullptr;
+        T item = node->item;
+        delete node;
+        return item;
+    }
+    bool empty()
+    {
+        return !mFirst && !mPushed.load(std::memory_order_acquire);
+    }
+    size_t size()
+    {
+        takePushed();
+        size_t count = 0;
+        for (Node* node = mFirst; node; node = node->next)
+            count++;
+        return count;
+    }
+    /** @brief Calls \c func for each item in the queue, in order */
+    template <class F>
+    void forEach(F&& func)
+    {
+        takePushed();
+        for (Node* node = mFirst; node; node = node->next)
+            func(node->item);
+    }
+};
+}
+#endif
@@ -24,129 +24,380 @@
 #include "cservices.h"
 #include "gcmpp.h"
 #include <memory>
+#include <chrono>
+#include <type_traits>
+#include <stdint.h>
 #include <assert.h>
 
 namespace karere
 {
+struct TimerLink
+{
+    TimerLink* prev;
+    TimerLink* next;
+};
 
-struct TimerMsg: public megaMessage
+/** @brief An entry of a TimerWheel. While scheduled, it's linked in the list of
+ * its slot, so that it can be unlinked in constant time */
+struct WheelTimer: public TimerLink
 {
-    timerevent* timerEvent = nullptr;
-    bool canceled = false;
-    megaHandle handle;
-    TimerMsg(megaMessageFunc aFunc)
-        :megaMessage(aFunc),
-          handle(services_hstore_add_handle(MEGA_HTYPE_TIMER, this))
+    enum: uint8_t { kUnlinked = 0xff, kExpiring = 0xfe };
+    uint64_t expires = 0;
+    uint8_t level = kUnlinked;
+    uint8_t slot = 0;
+    /** Called by TimerWheel::advance() once the timer expired, and was unlinked */
+    virtual void expire() = 0;
+    virtual ~WheelTimer() {}
+};
+
+/** @brief Hierarchical timer wheel, with O(1) insertion and removal of timers.
+ * Time is measured in ticks, with kLevels levels of kSlots slots each. A timer is
+ * stored in the level of the highest digit (of kSlotBits bits) in which its
+ * expiration differs from the current time, and in the slot of that digit. When the
+ * current time reaches the beginning of a slot, its timers are moved to the lower
+ * levels, until they are in level 0 and expire. The occupied slots of each level
+ * are kept in a bitmask, so the next event is found without scanning empty slots.
+ * The wheel doesn't own the timers, and is not thread-safe.
+ */
+class TimerWheel
+{
+public:
+    enum { kSlotBits = 6, kSlots = 1 << kSlotBits, kLevels = 8 };
+protected:
+    TimerLink mSlots[kLevels][kSlots];
+    uint64_t mOccupied[kLevels] = {};
+    uint64_t mNow = 0;
+    size_t mCount = 0;
+
+    static unsigned lowestBit(uint64_t val)
+    {
+        assert(val);
+#if defined(__GNUC__)
+        return __builtin_ctzll(val);
+#else
+        unsigned n = 0;
+        while (!(val & 1))
+        {
+            val >>= 1;
+            n++;
+        }
+        return n;
+#endif
+    }
+    static unsigned highestBit(uint64_t val)
+    {
+        assert(val);
+#if defined(__GNUC__)
+        return 63 - __builtin_clzll(val);
+#else
+        unsigned n = 0;
+        while (val >>= 1)
+            n++;
+        return n;
+#endif
+    }
+    static void initList(TimerLink& list) { list.prev = list.next = &list; }
+    static void append(TimerLink& list, TimerLink* item)
+    {
+        item->prev = list.prev;
+        item->next = &list;
+        list.prev->next = item;
+        list.prev = item;
+    }
+    void link(WheelTimer* timer)
+    {
+        assert(timer->expires > mNow);
+        unsigned level = highestBit(timer->expires ^ mNow) / kSlotBits;
+        assert(level < kLevels);
+        unsigned slot = (timer->expires >> (level * kSlotBits)) & (kSlots - 1);
+        timer->level = level;
+        timer->slot = slot;
+        append(mSlots[level][slot], timer);
+        mOccupied[level] |= (1ULL << slot);
+    }
+
+public:
+    TimerWheel()
+    {
+        for (auto& level: mSlots)
+        {
+            for (auto& slot: level)
+                initList(slot);
+        }
+    }
+    /** @brief The time up to which the timers were expired, in ticks */
+    uint64_t now() const { return mNow; }
+    /** @brief Number of scheduled timers */
+    size_t size() const { return mCount; }
+    /** @brief Schedules \c timer to expire at \c expires ticks. If that is not
+     * after now(), it will expire in the next tick */
+    void add(WheelTimer* timer, uint64_t expires)
+    {
+        assert(timer->level == WheelTimer::kUnlinked);
+        timer->expires = (expires > mNow) ? expires : mNow + 1;
+        link(timer);
+        mCount++;
+    }
+    /** @brief Unschedules \c timer. It can be called for timers not scheduled */
+    void remove(WheelTimer* timer)
+    {
+        if (timer->level == WheelTimer::kUnlinked)
+            return;
+
+        timer->prev->next = timer->next;
+        timer->next->prev = timer->prev;
+        if (timer->level < kLevels)
+        {
+            auto& list = mSlots[timer->level][timer->slot];
+            if (list.next == &list)
+                mOccupied[timer->level] &= ~(1ULL << timer->slot);
+            mCount--;
+        }
+        timer->level = WheelTimer::kUnlinked;
+    }
+    /** @brief The next time at which advance() has something to do - either expire
+     * timers or move them to a lower level. UINT64_MAX if there are no timers */
+    uint64_t nextEvent() const
+    {
+        uint64_t next = UINT64_MAX;
+        for (unsigned level = 0; level < kLevels; level++)
+        {
+            if (!mOccupied[level])
+                continue;
+
+            unsigned shift = level * kSlotBits;
+            // all the occupied slots of a level are after the current one
+            assert(!(mOccupied[level] & ((2ULL << ((mNow >> shift) & (kSlots - 1))) - 1)));
+            uint64_t ts = ((mNow >> (shift + kSlotBits)) << (shift + kSlotBits))
+                | ((uint64_t)lowestBit(mOccupied[level]) << shift);
+            if (ts < next)
+                next = ts;
+        }
+        return next;
+    }
+    /** @brief Expires all the timers scheduled up to \c now, in order of expiration.
+     * The expire() callbacks may add and remove timers */
+    void advance(uint64_t now)
+    {
+        for (;;)
+        {
+            uint64_t next = nextEvent();
+            if (next > now)
+                break;
+
+            mNow = next;
+            TimerLink expired;
+            initList(expired);
+            for (int level = kLevels - 1; level >= 0; level--)
+            {
+                unsigned slot = (mNow >> (level * kSlotBits)) & (kSlots - 1);
+                if (!(mOccupied[level] & (1ULL << slot)))
+                    continue;
+
+                auto& list = mSlots[level][slot];
+                TimerLink* item = list.next;
+                initList(list);
+                mOccupied[level] &= ~(1ULL << slot);
+                while (item != &list)
+                {
+                    auto timer = static_cast<WheelTimer*>(item);
+                    item = item->next;
+                    if (timer->expires <= mNow)
+                    {
+                        timer->level = WheelTimer::kExpiring;
+                        append(expired, timer);
+                        mCount--;
+                    }
+                    else
+                    {
+                        link(timer);
+                    }
+                }
+            }
+            // a timer may remove the next ones from the list, so unlink each before expiring it
+            while (expired.next != &expired)
+            {
+                auto timer = static_cast<WheelTimer*>(expired.next);
+                expired.next = timer->next;
+                timer->next->prev = &expired;
+                timer->level = WheelTimer::kUnlinked;
+                timer->expire();
+            }
+        }
+        if (now > mNow)
+            mNow = now;
+    }
+};
+
+void init_uv_timer(void *ctx, uv_timer_t *timer);
+
+class LoopTimerWheel;
+/** @brief Returns the timer wheel of the event loop of the \c ctx app context */
+LoopTimerWheel& loop_timer_wheel(void *ctx);
+
+/** @brief A TimerWheel driven by a single libuv timer of the event loop of an app
+ * context, with a tick of one millisecond. The timers are scheduled, expired and
+ * canceled in the app's context, and the libuv timer is only started and stopped
+ * in the event loop's thread, which posts a message to the app's context when
+ * it fires.
+ */
+class LoopTimerWheel: public TimerWheel
+{
+protected:
+    struct WheelMsg: public megaMessage
+    {
+        LoopTimerWheel* wheel;
+        WheelMsg(megaMessageFunc func, LoopTimerWheel* aWheel): megaMessage(func), wheel(aWheel) {}
+    };
+    void* mCtx;
+    std::chrono::steady_clock::time_point mEpoch = std::chrono::steady_clock::now();
+    uv_timer_t* mUvTimer = nullptr;
+    /** Time at which mUvTimer will fire */
+    uint64_t mArmedAt = UINT64_MAX;
+    bool mRearmPending = false;
+    WheelMsg mTickMsg;
+    WheelMsg mRearmMsg;
+
+    /** Restarts the libuv timer for the next event. Called in the event loop's thread */
+    void rearm()
+    {
+        if (!mUvTimer)
+        {
+            mUvTimer = new uv_timer_t();
+            mUvTimer->data = this;
+            init_uv_timer(mCtx, mUvTimer);
+        }
+        mArmedAt = nextEvent();
+        if (mArmedAt == UINT64_MAX)
+        {
+            uv_timer_stop(mUvTimer);
+            return;
+        }
+        uint64_t now = ticks();
+        uv_timer_start(mUvTimer, [](uv_timer_t* handle)
+        {
+            auto wheel = static_cast<LoopTimerWheel*>(handle->data);
+            megaPostMessageToGui(&wheel->mTickMsg, wheel->mCtx);
+        }, (mArmedAt > now) ? mArmedAt - now : 0, 0);
+    }
+
+public:
+    LoopTimerWheel(void* ctx)
+    : mCtx(ctx),
+      mTickMsg([](void* msg)
+      {
+          auto wheel = static_cast<WheelMsg*>(msg)->wheel;
+          wheel->advance(wheel->ticks());
+          wheel->rearm();
+      }, this),
+      mRearmMsg([](void* msg)
+      {
+          auto wheel = static_cast<WheelMsg*>(msg)->wheel;
+          wheel->mRearmPending = false;
+          wheel->rearm();
+      }, this)
     {}
-   ~TimerMsg()
+    ~LoopTimerWheel()
     {
-        services_hstore_remove_handle(MEGA_HTYPE_TIMER, handle);
-        if (timerEvent)
-        {            
-            uv_close((uv_handle_t *)timerEvent, [](uv_handle_t* handle)
+        if (mUvTimer)
+        {
+            uv_close((uv_handle_t *)mUvTimer, [](uv_handle_t* handle)
             {
                 delete handle;
             });
         }
     }
-};
+    /** @brief Milliseconds since the creation of the wheel */
+    uint64_t ticks() const
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - mEpoch).count();
+    }
+    /** @brief Schedules \c timer to expire in \c timeMs */
+    void schedule(WheelTimer* timer, unsigned timeMs)
+    {
+        add(timer, ticks() + timeMs);
+        if (timer->expires >= mArmedAt || mRearmPending)
+            return;
 
-void init_uv_timer(void *ctx, uv_timer_t *timer);
+        // the libuv timer can only be restarted in the event loop's thread
+        mRearmPending = true;
+        megaPostMessageToGui(&mRearmMsg, mCtx);
+    }
+};
 
-extern std::recursive_mutex timerMutex;
+/** @brief A timer of a LoopTimerWheel, identified by a handle */
+struct LoopTimer: public WheelTimer
+{
+    LoopTimerWheel& wheel;
+    unsigned period;    // 0 for one-shot timers
+    megaHandle handle;
+    bool running = false;
+    bool canceled = false;
+    LoopTimer(LoopTimerWheel& aWheel, unsigned aPeriod)
+    : wheel(aWheel), period(aPeriod),
+      handle(services_hstore_add_handle(MEGA_HTYPE_TIMER, this))
+    {}
+    ~LoopTimer()
+    {
+        services_hstore_remove_handle(MEGA_HTYPE_TIMER, handle);
+    }
+    virtual void call() = 0;
+    virtual void expire()
+    {
+        if (period)
+        {
+            wheel.schedule(this, period);
+        }
+        // the callback may cancel the timer, but it can't be deleted until it returns
+        running = true;
+        call();
+        running = false;
+        if (!period || canceled)
+        {
+            delete this;
+        }
+    }
+};
 
 template <int persist, class CB>
 inline megaHandle setTimer(CB&& callback, unsigned time, void *ctx)
 {
-    struct Msg: public TimerMsg
+    struct Timer: public LoopTimer
     {
-        CB cb;
-        void *appCtx;
-        Msg(CB&& aCb, megaMessageFunc cFunc)
-        :TimerMsg(cFunc), cb(aCb)
+        typename std::decay<CB>::type cb;
+        Timer(CB&& aCb, LoopTimerWheel& aWheel, unsigned aPeriod)
+        :LoopTimer(aWheel, aPeriod), cb(std::forward<CB>(aCb))
         {}
-        unsigned time;
-        int loop;
+        virtual void call() { cb(); }
     };
-    megaMessageFunc cfunc = persist
-        ? (megaMessageFunc) [](void* arg)
-          {
-              Msg* msg = static_cast<Msg*>(arg);
-              if (msg->canceled)
-                  return;
-              msg->cb();
-          }
-        : (megaMessageFunc) [](void* arg)
-          {
-              timerMutex.lock();
-              Msg* msg = static_cast<Msg*>(arg);
-              if (msg->canceled)
-              {
-                  timerMutex.unlock();
-                  return;
-              }
-              msg->cb();
-              if (msg->canceled)
-              {
-                  timerMutex.unlock();
-                  return;
-              }
-              delete msg;
-              timerMutex.unlock();
-          };
-
-    timerMutex.lock();
-    Msg* pMsg = new Msg(std::forward<CB>(callback), cfunc);
-    timerMutex.unlock();
-
-    pMsg->appCtx = ctx;
-    pMsg->time = time;
-    pMsg->loop = persist;  
-    marshallCall([pMsg, ctx]()
-    {
-        pMsg->timerEvent = new uv_timer_t();
-        pMsg->timerEvent->data = pMsg;
-        init_uv_timer(ctx, pMsg->timerEvent);
-        uv_timer_start(pMsg->timerEvent,
-                       [](uv_timer_t* handle)
-                       {
-                           megaPostMessageToGui(handle->data, ((Msg*)handle->data)->appCtx);
-                       }, pMsg->time, pMsg->loop ? pMsg->time : 0);
-    }, ctx);    
-    return pMsg->handle;
+    auto& wheel = loop_timer_wheel(ctx);
+    Timer* timer = new Timer(std::forward<CB>(callback), wheel, persist ? time : 0);
+    wheel.schedule(timer, time);
+    return timer->handle;
 }
 /** Cancels a previously set timeout with setTimeout()
  * @return \c false if the handle is not valid. This can happen if the timeout
  * already triggered, then the handle is invalidated. This situation is safe and
  * considered normal
  */
-static inline bool cancelTimeout(megaHandle handle, void *ctx)
+static inline bool cancelTimeout(megaHandle handle, void* /*ctx*/)
 {
-    timerMutex.lock();
-
     assert(handle);
-    TimerMsg* timer = static_cast<TimerMsg*>(services_hstore_get_handle(MEGA_HTYPE_TIMER, handle));
-    if (!timer)
-    {
-        timerMutex.unlock();
+    LoopTimer* timer = static_cast<LoopTimer*>(services_hstore_get_handle(MEGA_HTYPE_TIMER, handle));
+    if (!timer || timer->canceled)
         return false; //not valid anymore
-    }
 
-//we have to make sure that we delete the timer only after all possibly queued
-//timer messages in the app's message queue are processed. For this purpose,
-//we first stop the timer, and only then post a call to delete the timer.
-//That call should be processed after all timer messages
-    timer->canceled = true; //disable timer callback being called by possibly queued messages, and message freeing in one-shot timer handler
-    timerMutex.unlock();    
-    marshallCall([timer, ctx]()
+    timer->wheel.remove(timer);
+    if (timer->running)
     {
-        uv_timer_stop(timer->timerEvent);
-
-        marshallCall([timer, ctx]()
-        {
-            delete timer;
-        }, ctx);
-    }, ctx);
+        // canceled from its own callback, it's deleted once the callback returns
+        timer->canceled = true;
+    }
+    else
+    {
+        delete timer;
+    }
     return true;
 }
 /** @brief Cancels a previously set timer with setInterval.
@@ -0,0 +1,133 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+#include <deque>
+#include <gcmpp.h>
+
+namespace karere
+{
+/** @brief A set of threads that run CPU-bound jobs, like crypto operations, off the
+ * app's thread.
+ * Each job consists of a \c work function, which is executed by a worker thread,
+ * and a \c done function, which is then marshalled to the app's thread. The \c work
+ * function must not access any state shared with the app's thread, except the one
+ * owned by the job itself. Both functions are destroyed in the app's thread.
+ * Jobs may complete in any order.
+ * With zero threads (the default), jobs are executed synchronously by \c post()
+ */
+class WorkerPool
+{
+protected:
+    struct Job
+    {
+        std::function<void()> work;
+        std::function<void()> done;
+        Job(std::function<void()>&& aWork, std::function<void()>&& aDone)
+        : work(std::move(aWork)), done(std::move(aDone)) {}
+    };
+    void* mAppCtx;
+    std::vector<std::thread> mThreads;
+    std::deque<Job*> mJobs;
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    bool mTerminating = false;
+
+    void run()
+    {
+        for (;;)
+        {
+            Job* job;
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mCondition.wait(lock, [this]() { return mTerminating || !mJobs.empty(); });
+                if (mTerminating)
+                    return;
+
+                job = mJobs.front();
+                mJobs.pop_front();
+            }
+            job->work();
+            // from now on, the job is owned by the app's thread
+            marshallCall([job]()
+            {
+                std::unique_ptr<Job> autodel(job);
+                job->done();
+            }, mAppCtx);
+        }
+    }
+    void stopThreads()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mTerminating = true;
+        }
+        mCondition.notify_all();
+        for (auto& thread: mThreads)
+        {
+            thread.join();
+        }
+        mThreads.clear();
+        mTerminating = false;
+    }
+
+public:
+    WorkerPool(void* appCtx): mAppCtx(appCtx) {}
+    /** Pending jobs are discarded without calling their \c done function */
+    ~WorkerPool()
+    {
+        stopThreads();
+        for (auto job: mJobs)
+        {
+            delete job;
+        }
+    }
+    size_t threadCount() const { return mThreads.size(); }
+
+    /** @brief Changes the number of worker threads. Must be called from the app's thread.
+     * If the threads are stopped, the jobs still pending are executed synchronously */
+    void setThreadCount(size_t count)
+    {
+        if (count == mThreads.size())
+            return;
+
+        // the threads finish the job they are executing, but don't pick up new ones
+        stopThreads();
+        if (!count)
+        {
+            while (!mJobs.empty())
+            {
+                std::unique_ptr<Job> job(mJobs.front());
+                mJobs.pop_front();
+                job->work();
+                job->done();
+            }
+            return;
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            mThreads.emplace_back(&WorkerPool::run, this);
+        }
+    }
+
+    /** @brief Queues a job. Must be called from the app's thread */
+    void post(std::function<void()>&& work, std::function<void()>&& done)
+    {
+        if (mThreads.empty())
+        {
+            work();
+            done();
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mJobs.push_back(new Job(std::move(work), std::move(done)));
+        }
+        mCondition.notify_one();
+    }
+};
+}
+#endif
@@ -5,6 +5,7 @@
 #include <stdexcept>
 #include <string.h>
 #include <vector>
+#include <memory>
 
 #ifndef __arm__
     #define BUFFER_ALLOW_UNALIGNED_MEMORY_ACCESS 1
@@ -165,6 +166,9 @@ class Buffer: public StaticBuffer
 {
 protected:
     size_t mBufSize;
+    /** If set, mBuf points inside the memory of this (shared) buffer, which
+     * we don't own but keep alive. See assignSlice() */
+    std::shared_ptr<Buffer> mFrame;
     enum {kMinBufSize = 64};
     void zero()
     {
@@ -173,8 +177,16 @@ protected:
         mDataSize = 0;
     }
 public:
-    char* buf() { return mBuf;}
+    /** The non-const accessors give write access to the contents, so a slice gets
+     * its own copy first, without affecting the frame nor its other slices.
+     * Read-only code should use the const ones, which never copy */
+    char* buf() { detachFromFrame(); return mBuf;}
     const char* buf() const { return mBuf;}
+    using StaticBuffer::ubuf;
+    unsigned char* ubuf() { detachFromFrame(); return reinterpret_cast<unsigned char*>(mBuf); }
+    using StaticBuffer::typedBuf;
+    template<typename T>
+    T* typedBuf() { detachFromFrame(); return reinterpret_cast<T*>(mBuf); }
     size_t bufSize() const { return mBufSize;}
     Buffer(size_t size=kMinBufSize, size_t dataSize=0)
     {
@@ -210,7 +222,8 @@ public:
         }
     }
     Buffer(Buffer&& other)
-        :StaticBuffer(other.mBuf, other.mDataSize), mBufSize(other.mBufSize) { other.zero(); }
+        :StaticBuffer(other.mBuf, other.mDataSize), mBufSize(other.mBufSize),
+          mFrame(std::move(other.mFrame)) { other.zero(); }
 
     template <bool withNull>
     Buffer(const std::string& src)
@@ -222,7 +235,13 @@ public:
     }
     void assign(const void* data, size_t datalen)
     {
-        if (mBuf)
+        // data may point inside the frame we reference, keep it alive until copied
+        std::shared_ptr<Buffer> frame(std::move(mFrame));
+        if (frame)
+        {
+            zero();
+        }
+        else if (mBuf)
         {
             if (datalen <= mBufSize)
             {
@@ -245,8 +264,51 @@ public:
     template <bool withNull>
     void assign(const std::string& src) { assign(src.c_str(), withNull?(src.size()+1):src.size()); }
     void copyFrom(const StaticBuffer& src) { assign(src.buf(), src.dataSize()); }
+
+    /** @brief Makes the buffer reference \c len bytes at \c offset inside \c frame,
+     * without copying them. The frame is kept alive until the buffer is freed or
+     * its contents are modified, at which point the buffer gets its own copy.
+     * Allows many objects parsed from a single received packet to share its memory.
+     */
+    void assignSlice(const std::shared_ptr<Buffer>& frame, size_t offset, size_t len)
+    {
+        // frame may be a reference to our own mFrame, which is released by free()
+        std::shared_ptr<Buffer> newFrame(frame);
+        char* data = newFrame->readPtr(offset, len);
+        free();
+        if (!len)
+            return;
+
+        mBuf = data;
+        mBufSize = mDataSize = len;
+        mFrame = std::move(newFrame);
+    }
+    /** @brief Whether the buffer references memory of a shared frame instead of owning it */
+    bool isSlice() const { return mFrame.get() != nullptr; }
+    /** @brief If the buffer is a slice of a shared frame, copies the referenced
+     * data to a block of our own, so that it can be modified */
+    void detachFromFrame()
+    {
+        if (!mFrame)
+            return;
+
+        if (!mDataSize)
+        {
+            zero();
+            mFrame.reset();
+            return;
+        }
+        char* data = (char*)::malloc(mDataSize);
+        if (!data)
+            throw std::runtime_error("Buffer::detachFromFrame: Out of memory allocating block of size "+ std::to_string(mDataSize));
+        memcpy(data, mBuf, mDataSize);
+        mBuf = data;
+        mBufSize = mDataSize;
+        mFrame.reset();
+    }
     void reserve(size_t size)
     {
+        detachFromFrame();
         if (!mBuf)
         {
             mBuf = (char*)::malloc(size);
@@ -276,6 +338,7 @@ public:
     }
     char* writePtr(size_t offset, size_t dataLen)
     {
+        detachFromFrame();
         auto reqdSize = offset+dataLen;
         if (reqdSize > mBufSize)
         {
@@ -297,6 +360,8 @@ public:
     {
         if (!data)
             return *this;
+        std::shared_ptr<Buffer> frame(mFrame); // data may point inside the frame
+        detachFromFrame();
         auto reqdSize = offset+datalen;
         if (reqdSize <= mDataSize)
         {
@@ -341,9 +406,21 @@ public:
     {
         memset(appendPtr(count), value, count);
     }
-    void clear() { mDataSize = 0; }
+    void clear()
+    {
+        if (mFrame)
+            free();
+        else
+            mDataSize = 0;
+    }
     void free()
     {
+        if (mFrame)
+        {
+            mFrame.reset();
+            zero();
+            return;
+        }
         if (!mBuf)
             return;
         ::free(mBuf);
@@ -353,7 +430,7 @@ public:
 
     ~Buffer()
     {
-        if (mBuf)
+        if (mBuf && !mFrame)
             ::free(mBuf);
     }
 };
@@ -23,6 +23,7 @@
 #include "sdkApi.h"
 #include <serverListProvider.h>
 #include <memory>
+#include <limits>
 #include <chatd.h>
 #include <db.h>
 #include <buffer.h>
@@ -68,8 +69,10 @@ std::string encodeFirstName(const std::string& first);
           appCtx(ctx),
           api(sdk, ctx),
           app(aApp),
+          cryptoWorkers(ctx),
           contactList(new ContactList(*this)),
           chats(new ChatRoomList(*this)),
+          mSharedSecrets(new strongvelope::SharedSecretCache),
           mPresencedClient(&api, this, *this, caps)
 {
 }
@@ -238,6 +241,33 @@ bool Client::openDb(const std::string& sid)
                 KR_LOG_WARNING("%d messages added to node history", count);
                 ok = true;
             }
+            else if ((cachedVersionSuffix == "5" || cachedVersionSuffix == "6" || cachedVersionSuffix == "7")
+                     &&  gDbSchemaVersionSuffix == "8")
+            {
+                if (cachedVersionSuffix == "5")
+                {
+                    // clients with version 5 don't persist the unread count of chats. The column is
+                    // left empty, so the count is calculated and stored on first access.
+                    db.simpleQuery("alter table chats add column unread_count int");
+                }
+
+                // clients with version 6 or older don't have indexes for the per-chat queries
+                // on the sending queues, nor for the calculation of the unread count
+                db.simpleQuery("create index if not exists sending_chatid on sending(chatid)");
+                db.simpleQuery("create index if not exists manual_sending_chatid on manual_sending(chatid)");
+                db.simpleQuery("create index if not exists history_unread on history(chatid, idx, userid, type, is_encrypted) "
+                               "where not (updated != 0 and length(data) = 0)");
+
+                // clients with version 7 or older don't persist the shared secrets with other users
+                db.simpleQuery("create table if not exists shared_secrets(userid int64 not null primary key, pubkey blob not null, secret blob not null)");
+
+                // Update DB version number
+                db.query("update vars set value = ? where name = 'schema_version'", currentVersion);
+                db.commit();
+
+                KR_LOG_WARNING("Database version has been updated to %s", gDbSchemaVersionSuffix);
+                ok = true;
+            }
         }
     }
 
@@ -266,7 +296,7 @@ void Client::heartbeat()
 {
     if (db.isOpen())
     {
-        db.timedCommit();
+        db.idleCommit();
     }
 
     if (mConnState != kConnected)
@@ -324,6 +354,17 @@ void Client::onSyncReceived(Id chatid)
     }
 }
 
+void Client::createLazyChatRoom(Id chatid)
+{
+    auto it = chats->find(chatid);
+    if (it == chats->end())
+    {
+        KR_LOG_ERROR("createLazyChatRoom: Unknown chatroom %s", chatid.toString().c_str());
+        return;
+    }
+    it->second->chat();   // creates and connects the chat, if not created yet
+}
+
 bool Client::isChatRoomOpened(Id chatid)
 {
     auto it = chats->find(chatid);
@@ -396,7 +437,7 @@ promise::Promise<void> Client::pushReceived(Id chatid)
         for (auto& item: *chats)
         {
             ChatRoom *chat = item.second;
-            if (!chat->chat().isDisabled())
+            if (chat->hasChatdChat() && !chat->chat().isDisabled())   // lazy rooms are created by their first new message
             {
                 mSyncCount++;
                 chat->sendSync();
@@ -453,12 +494,22 @@ promise::Promise<void> Client::initWithNewSession(const char* sid, const std::st
             return;
         loadContactListFromApi(*contactList);
         mChatdClient.reset(new chatd::Client(this));
+        mChatdClient->setHistoryRamLimit(mHistoryRamLimit);
         assert(chats->empty());
         chats->onChatsUpdate(*chatList);
         commit(scsn);
     });
 }
 
+void Client::setHistoryRamLimit(size_t bytes)
+{
+    mHistoryRamLimit = bytes;
+    if (mChatdClient)
+    {
+        mChatdClient->setHistoryRamLimit(bytes);
+    }
+}
+
 void Client::setCommitMode(bool commitEach)
 {
     db.setCommitMode(commitEach);
@@ -529,15 +580,23 @@ void Client::initWithDbSession(const char* sid)
     try
     {
         assert(sid);
-        if (!openDb(sid))
         {
-            assert(mSid.empty());
-            setInitState(kInitErrNoCache);
-            return;
+            InitTracer::Scope phase(mInitTracer, "openDb");
+            if (!openDb(sid))
+            {
+                assert(mSid.empty());
+                setInitState(kInitErrNoCache);
+                return;
+            }
         }
         assert(db);
         assert(!mSid.empty());
-        mUserAttrCache.reset(new UserAttrCache(*this));        
+        {
+            InitTracer::Scope phase(mInitTracer, "userattrs");
+            mUserAttrCache.reset(new UserAttrCache(*this));
+            phase.setRows(mUserAttrCache->size());
+            phase.setObjects(mUserAttrCache->size());
+        }
         api.sdk.addGlobalListener(this);
 
         mMyHandle = getMyHandleFromDb();
@@ -556,11 +615,25 @@ void Client::initWithDbSession(const char* sid)
             name.assign(buf->buf(), buf->dataSize());
         });
 
-        loadOwnKeysFromDb();
-        contactList->loadFromDb();
+        {
+            InitTracer::Scope phase(mInitTracer, "ownKeys");
+            loadOwnKeysFromDb();
+        }
+        {
+            InitTracer::Scope phase(mInitTracer, "contacts");
+            contactList->loadFromDb();
+            phase.setRows(contactList->size());
+            phase.setObjects(contactList->size());
+        }
         mContactsLoaded = true;
         mChatdClient.reset(new chatd::Client(this));
-        chats->loadFromDb();
+        mChatdClient->setHistoryRamLimit(mHistoryRamLimit);
+        {
+            InitTracer::Scope phase(mInitTracer, "chats");
+            chats->loadFromDb();
+            phase.setRows(chats->size());
+            phase.setObjects(chats->chatdChatCount());
+        }
     }
     catch(std::runtime_error& e)
     {
@@ -569,6 +642,7 @@ void Client::initWithDbSession(const char* sid)
         return;
     }
 
+    mInitTracer.mark("offlineSession");
     setInitState(kInitHasOfflineSession);
     return;
 }
@@ -590,6 +664,7 @@ Client::InitState Client::init(const char* sid)
         return kInitErrAlready;
     }
 
+    mInitTracer.reset();
     if (sid)
     {
         initWithDbSession(sid);
@@ -681,7 +756,11 @@ void Client::onRequestFinish(::mega::MegaApi* /*apiObj*/, ::mega::MegaRequest *r
 //                  setInitState(kInitErrSidMismatch);
 //                  return;
 //              }
-                checkSyncWithSdkDb(scsn, *contactList, *chatList);
+                {
+                    InitTracer::Scope phase(mInitTracer, "syncWithSdk");
+                    checkSyncWithSdkDb(scsn, *contactList, *chatList);
+                }
+                mInitTracer.mark("onlineSession");
                 setInitState(kInitHasOnlineSession);
                 mSessionReadyPromise.resolve();
                 api.sdk.resumeActionPackets();
@@ -699,6 +778,7 @@ void Client::onRequestFinish(::mega::MegaApi* /*apiObj*/, ::mega::MegaRequest *r
                 })
                 .then([this]()
                 {
+                    mInitTracer.mark("onlineSession");
                     setInitState(kInitHasOnlineSession);
                     mSessionReadyPromise.resolve();
                     api.sdk.resumeActionPackets();
@@ -900,7 +980,11 @@ promise::Promise<void> Client::doConnect(Presence pres, bool isInBackground)
     rtc->init();
 #endif
 
-    connectToChatd(isInBackground);
+    {
+        InitTracer::Scope phase(mInitTracer, "connectToChatd");
+        connectToChatd(isInBackground);
+        phase.setObjects(chats->chatdChatCount());
+    }
 
     auto wptr = weakHandle();
     auto pms = connectToPresenced(mOwnPresence)
@@ -936,6 +1020,11 @@ void Client::setConnState(ConnState newState)
 {
     mConnState = newState;
     KR_LOG_DEBUG("Client connection state changed to %s", connStateToStr(newState));
+    if (newState == kConnected && !mInitTracer.isFinished())
+    {
+        mInitTracer.finish("connected");
+        KR_LOG_INFO("Init trace: %s", mInitTracer.report().c_str());
+    }
 }
 karere::Id Client::getMyHandleFromSdk()
 {
@@ -1047,6 +1136,7 @@ promise::Promise<void> Client::loadOwnKeysFromApi()
         db.query("insert or replace into vars(name, value) values('pr_ed25519', ?)", StaticBuffer(mMyPrivEd25519, sizeof(mMyPrivEd25519)));
         db.query("insert or replace into vars(name, value) values('pub_rsa', ?)", StaticBuffer(mMyPubRsa, mMyPubRsaLen));
         db.query("insert or replace into vars(name, value) values('pr_rsa', ?)", StaticBuffer(mMyPrivRsa, mMyPrivRsaLen));
+        loadSharedSecrets();
         KR_LOG_DEBUG("loadOwnKeysFromApi: success");
         return promise::_Void();
     });
@@ -1076,6 +1166,17 @@ void Client::loadOwnKeysFromDb()
     len = stmt.blobCol(0, mMyPrivEd25519, sizeof(mMyPrivEd25519));
     if (len != sizeof(mMyPrivEd25519))
         throw std::runtime_error("Unexpected length of privEd2519 in database");
+
+    loadSharedSecrets();
+}
+
+void Client::loadSharedSecrets()
+{
+    mSharedSecrets->clear();
+    if (mPersistSharedSecrets)
+    {
+        mSharedSecrets->attachDb(db, StaticBuffer(mMyPrivCu25519, sizeof(mMyPrivCu25519)));
+    }
 }
 
 
@@ -1219,6 +1320,13 @@ void Client::terminate(bool deleteDb)
         mPresencedClient.disconnect();
     }
 
+    auto secretStats = mSharedSecrets->stats();
+    KR_LOG_DEBUG("Shared secrets cache: %llu hits, %llu misses, %llu loaded from db, %llu computed (%llu stale)",
+                 (unsigned long long)secretStats.hits, (unsigned long long)secretStats.misses,
+                 (unsigned long long)secretStats.loaded, (unsigned long long)secretStats.computed,
+                 (unsigned long long)secretStats.stale);
+    mSharedSecrets->clear();
+
     // close or delete MEGAchat's DB file
     try
     {
@@ -1230,6 +1338,22 @@ void Client::terminate(bool deleteDb)
         {
             KR_LOG_INFO("Doing final COMMIT to database");
             db.commit();
+            auto& stats = db.stmtCacheStats();
+            KR_LOG_DEBUG("Prepared statements cache: %llu hits, %llu misses, %llu evictions",
+                         (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+                         (unsigned long long)stats.evictions);
+            auto commitStats = db.commitStats();
+            KR_LOG_DEBUG("Db commits: %llu (%llu by rows, %llu by spills, %llu by time, %llu when idle), max %llu rows, max %llu us",
+                         (unsigned long long)commitStats.commits, (unsigned long long)commitStats.rowCommits,
+                         (unsigned long long)commitStats.spillCommits, (unsigned long long)commitStats.timeCommits,
+                         (unsigned long long)commitStats.idleCommits, (unsigned long long)commitStats.maxPendingRows,
+                         (unsigned long long)commitStats.maxCommitUsecs);
+            if (db.walMode())
+            {
+                KR_LOG_DEBUG("Db checkpoints: %llu, max %llu us",
+                             (unsigned long long)commitStats.checkpoints,
+                             (unsigned long long)commitStats.maxCheckpointUsecs);
+            }
             db.close();
         }
     }
@@ -1281,6 +1405,10 @@ void Client::onUsersUpdate(mega::MegaApi* /*api*/, mega::MegaUserList *aUsers)
             {
                 if (user.isOwnChange() == 0)
                 {
+                    if (user.getChanges() & ::mega::MegaUser::CHANGE_TYPE_PUBKEY_CU255)
+                    {
+                        mSharedSecrets->forget(user.getHandle());
+                    }
                     mUserAttrCache->onUserAttrChange(user);
                 }
             }
@@ -1360,7 +1488,7 @@ strongvelope::ProtocolHandler* Client::newStrongvelope(karere::Id chatid)
 {
     return new strongvelope::ProtocolHandler(mMyHandle,
         StaticBuffer(mMyPrivCu25519, 32), StaticBuffer(mMyPrivEd25519, 32),
-        StaticBuffer(mMyPrivRsa, mMyPrivRsaLen), *mUserAttrCache, db, chatid, appCtx);
+        StaticBuffer(mMyPrivRsa, mMyPrivRsaLen), *mUserAttrCache, *mSharedSecrets, db, chatid, appCtx, &cryptoWorkers);
 }
 
 void ChatRoom::createChatdChat(const karere::SetOfIds& initialUsers)
@@ -1370,6 +1498,79 @@ void ChatRoom::createChatdChat(const karere::SetOfIds& initialUsers)
         parent.mKarereClient.newStrongvelope(chatid()), mCreationTs, mIsGroup);
 }
 
+bool ChatRoom::loadLazyState()
+{
+    SqliteDb& db = parent.mKarereClient.db;
+    SqliteStmt sending(db, chatd::sql::kSendingCount);
+    sending << mChatid;
+    if (sending.step() && sending.intCol(0))
+    {
+        return false;
+    }
+
+    // the chat is joined with a JOINRANGEHIST, so it needs history in the db
+    SqliteStmt info(db, chatd::sql::kChatHistoryInfo);
+    info << mChatid;
+    if (!info.step() || sqlite3_column_type(info, 2) == SQLITE_NULL || sqlite3_column_type(info, 3) == SQLITE_NULL)
+    {
+        return false;
+    }
+    chatd::ChatDbInfo dbInfo;
+    dbInfo.lastSeenId = info.uint64Col(0);
+    dbInfo.lastRecvId = info.uint64Col(1);
+    dbInfo.unreadCount = info.intCol(2);
+    dbInfo.unreadCountValid = true;
+    dbInfo.newestDbIdx = info.intCol(3);
+    dbInfo.oldestDbId = info.uint64Col(4);
+    dbInfo.newestDbId = info.uint64Col(5);
+    if (!dbInfo.oldestDbId || !dbInfo.newestDbId)
+    {
+        return false;
+    }
+    mLazyUnreadCount = dbInfo.unreadCount;
+
+    SqliteStmt lastMsg(db, chatd::sql::kHistoryLastTextMsg);
+    lastMsg << mChatid
+            << chatd::Message::kMsgTruncate
+            << chatd::Message::kMsgRevokeAttachment
+            << chatd::Message::kMsgInvalid
+            << std::numeric_limits<chatd::Idx>::max();
+    if (lastMsg.step())
+    {
+        Buffer buf(128);
+        lastMsg.blobCol(2, buf);
+        mLazyLastTextMsg.assign(buf, lastMsg.intCol(0), lastMsg.uint64Col(3), lastMsg.intCol(1), lastMsg.uint64Col(4));
+    }
+
+    SqliteStmt newest(db, chatd::sql::kHistoryNewestTs);
+    newest << mChatid;
+    mLazyLastMsgTs = newest.step() ? newest.uintCol(0) : mCreationTs;
+
+    parent.mKarereClient.mChatdClient->addLazyChat(mChatid, mShardNo, dbInfo);
+    return true;
+}
+
+void ChatRoom::createLazyChat()
+{
+    KR_LOG_DEBUG("Creating the chat of lazily loaded chatroom %s", Id(mChatid).toString().c_str());
+    initWithChatd();
+    if (parent.mKarereClient.connState() != Client::kDisconnected && !mChat->isDisabled())
+    {
+        connect();
+    }
+}
+
+uint8_t ChatRoom::lastTextMessage(chatd::LastTextMsg*& msg)
+{
+    if (mChat)
+    {
+        return mChat->lastTextMessage(msg);
+    }
+
+    msg = mLazyLastTextMsg.isValid() ? &mLazyLastTextMsg : nullptr;
+    return mLazyLastTextMsg.state();
+}
+
 template <class T, typename F>
 void callAfterInit(T* self, F&& func, void *ctx)
 {
@@ -1395,7 +1596,7 @@ void PeerChatRoom::initWithChatd()
 
 void PeerChatRoom::connect()
 {
-    mChat->connect();
+    chat().connect();
 }
 
 #ifndef KARERE_DISABLE_WEBRTC
@@ -1490,7 +1691,7 @@ GroupChatRoom::GroupChatRoom(ChatRoomList& parent, const uint64_t& chatid,
 :ChatRoom(parent, chatid, true, aShard, aOwnPriv, ts, aIsArchived, title),
 mHasTitle(!title.empty()), mRoomGui(nullptr)
 {
-    SqliteStmt stmt(parent.mKarereClient.db, "select userid, priv from chat_peers where chatid=?");
+    SqliteStmt stmt(parent.mKarereClient.db, chatd::sql::kChatPeersLoad);
     stmt << mChatid;
     std::vector<promise::Promise<void> > promises;
     while(stmt.step())
@@ -1510,7 +1711,10 @@ mHasTitle(!title.empty()), mRoomGui(nullptr)
     });
 
     notifyTitleChanged();
-    initWithChatd();
+    if (!parent.mKarereClient.lazyChatRooms() || !loadLazyState())
+    {
+        initWithChatd();
+    }
     mRoomGui = addAppItem();
     mIsInitializing = false;
 }
@@ -1560,7 +1764,10 @@ PeerChatRoom::PeerChatRoom(ChatRoomList& parent, const uint64_t& chatid,
   mRoomGui(nullptr)
 {
     initContact(peer);
-    initWithChatd();
+    if (!parent.mKarereClient.lazyChatRooms() || !loadLazyState())
+    {
+        initWithChatd();
+    }
     mRoomGui = addAppItem();
     mIsInitializing = false;
 }
@@ -1817,6 +2024,17 @@ ChatRoomList::ChatRoomList(Client& aClient)
 :mKarereClient(aClient)
 {}
 
+size_t ChatRoomList::chatdChatCount() const
+{
+    size_t count = 0;
+    for (auto& item: *this)
+    {
+        if (item.second->hasChatdChat())
+            count++;
+    }
+    return count;
+}
+
 void ChatRoomList::loadFromDb()
 {
     SqliteStmt stmt(mKarereClient.db, "select chatid, ts_created ,shard, own_priv, peer, peer_priv, title, archived from chats");
@@ -2296,7 +2514,7 @@ void ChatRoom::setAppChatHandler(IApp::IChatHandler* handler)
 // mAppChatHandler->init() may rely on some events, so we need to set mChatWindow as listener before
 // calling init(). This is safe, as and we will not get any async events before we
 //return to the event loop
-    mChat->setListener(mAppChatHandler);
+    chat().setListener(mAppChatHandler);
     mAppChatHandler->init(*mChat, dummyIntf);
 }
 
@@ -2306,6 +2524,7 @@ void ChatRoom::removeAppChatHandler()
         return;
     mAppChatHandler = nullptr;
     mChat->setListener(this);
+    mChat->resetGetHistory(); // the app is not showing the history anymore, release the oldest messages
 }
 
 bool ChatRoom::hasChatHandler() const
@@ -2575,7 +2794,7 @@ bool GroupChatRoom::syncWithApi(const mega::MegaTextChat& chat)
                 if (parent.mKarereClient.connected())
                 {
                     KR_LOG_DEBUG("Connecting existing room to chatd after re-join...");
-                    if (mChat->onlineState() != ::chatd::ChatState::kChatStateJoining)
+                    if (this->chat().onlineState() != ::chatd::ChatState::kChatStateJoining)
                     {
                         mChat->connect();
                     }
@@ -2705,6 +2924,12 @@ void Client::connectToChatd(bool isInBackground)
     for (auto& item: *chats)
     {
         auto& chat = *item.second;
+        if (!chat.hasChatdChat())   // lazily loaded, joined without creating its chat
+        {
+            mChatdClient->connectLazyChat(item.first);
+            continue;
+        }
+
         if (!chat.chat().isDisabled())
         {
             chat.connect();
@@ -13,11 +13,13 @@
 #include "presenced.h"
 #include "IGui.h"
 #include <base/trackDelete.h>
+#include <base/workerPool.h>
+#include <base/initTracer.h>
 #include "rtcModule/webrtc.h"
 
 namespace mega { class MegaTextChat; class MegaTextChatList; }
 
-namespace strongvelope { class ProtocolHandler; }
+namespace strongvelope { class ProtocolHandler; class SharedSecretCache; }
 
 struct sqlite3;
 class Buffer;
@@ -68,6 +70,19 @@ protected:
     void notifyTitleChanged();
     void switchListenerToApp();
     void createChatdChat(const karere::SetOfIds& initialUsers); //We can't do the join in the ctor, as chatd may fire callbcks synchronously from join(), and the derived class will not be constructed at that point.
+    /** Creates the chatd chat of the room. Rooms loaded from the db in lazy mode
+     * call it on the first access to \c chat(), see \c Client::setLazyChatRooms() */
+    virtual void initWithChatd() = 0;
+    /** State of a room loaded lazily, read from the db until its chat is created */
+    int mLazyUnreadCount = 0;
+    uint32_t mLazyLastMsgTs = 0;
+    chatd::LastTextMsgState mLazyLastTextMsg;
+    /** Reads the state of a room loaded lazily, and joins it to chatd without creating
+     * its chat, see chatd::Client::addLazyChat(). Returns false if its chat must be created
+     * anyway, i.e. it has unsent messages, no history or its unread count is not in the db */
+    bool loadLazyState();
+    /** Creates the chat of a room loaded lazily, and connects it if chatd is connected */
+    void createLazyChat();
     void notifyExcludedFromChat();
     void notifyRejoinedChat();
     bool syncOwnPriv(chatd::Priv priv);
@@ -93,11 +108,32 @@ public:
 
     virtual ~ChatRoom(){}
 
-    /** @brief returns the chatd::Chat chat object associated with the room */
-    chatd::Chat& chat() { return *mChat; }
+    /** @brief returns the chatd::Chat chat object associated with the room.
+     * If the room was loaded lazily, the chat is created by the first call */
+    chatd::Chat& chat()
+    {
+        if (!mChat)
+            createLazyChat();
+        return *mChat;
+    }
+
+    /** @brief returns the chatd::Chat chat object associated with the room.
+     * It must have been created already, see \c hasChatdChat() */
+    const chatd::Chat& chat() const { assert(mChat); return *mChat; }
+
+    /** @brief Whether the chatd::Chat object of the room was already created */
+    bool hasChatdChat() const { return mChat != nullptr; }
+
+    /** @brief The number of unread messages of the chat. Rooms loaded lazily
+     * return the count stored in the db, without creating their chat */
+    int unreadMsgCount() const { return mChat ? mChat->unreadMsgCount() : mLazyUnreadCount; }
+
+    /** @brief The last text message of the chat, see \c chatd::Chat::lastTextMessage().
+     * Rooms loaded lazily return the one in the db, without creating their chat */
+    uint8_t lastTextMessage(chatd::LastTextMsg*& msg);
 
-    /** @brief returns the chatd::Chat chat object associated with the room */
-    const chatd::Chat& chat() const { return *mChat; }
+    /** @brief The timestamp of the newest message of the chat, or its creation time */
+    uint32_t lastMessageTs() const { return mChat ? mChat->lastMessageTs() : mLazyLastMsgTs; }
 
     /** @brief The chatid of the chatroom */
     const uint64_t& chatid() const { return mChatid; }
@@ -125,15 +161,15 @@ public:
     bool isActive() const { return mIsGroup ? (mOwnPriv != chatd::PRIV_NOTPRESENT) : true; }
 
     /** @brief The online state reported by chatd for that chatroom */
-    chatd::ChatState chatdOnlineState() const { return mChat->onlineState(); }
+    chatd::ChatState chatdOnlineState() const { return mChat ? mChat->onlineState() : chatd::kChatStateOffline; }
 
     /** @brief send a notification to the chatroom that the user is typing. */
-    virtual void sendTypingNotification() { mChat->sendTypingNotification(); }
+    virtual void sendTypingNotification() { chat().sendTypingNotification(); }
 
     /** @brief send a notification to the chatroom that the user has stopped typing. */
-    virtual void sendStopTypingNotification() { mChat->sendStopTypingNotification(); }
+    virtual void sendStopTypingNotification() { chat().sendStopTypingNotification(); }
 
-    void sendSync() { mChat->sendSync(); }
+    void sendSync() { chat().sendSync(); }
 
     /** @brief The application-side event handler that receives events from
      * the chatd chatroom and events about title, online status and unread
@@ -217,7 +253,7 @@ protected:
     bool syncPeerPriv(chatd::Priv priv);
     static uint64_t getSdkRoomPeer(const ::mega::MegaTextChat& chat);
     static chatd::Priv getSdkRoomPeerPriv(const ::mega::MegaTextChat& chat);
-    void initWithChatd();
+    virtual void initWithChatd();
     virtual void connect();
     UserAttrCache::Handle mUsernameAttrCbId;
     void updateTitle(const std::string& title);
@@ -328,7 +364,7 @@ public:
     virtual IApp::IChatListItem* roomGui() { return mRoomGui; }
     void deleteSelf(); ///< Deletes the room from db and then immediately destroys itself (i.e. delete this)
     void makeTitleFromMemberNames();
-    void initWithChatd();
+    virtual void initWithChatd();
     void setRemoved();
     virtual void connect();
     promise::Promise<void> memberNamesResolved() const;
@@ -416,6 +452,8 @@ public:
     ~ChatRoomList();
     void loadFromDb();
     void onChatsUpdate(mega::MegaTextChatList& chats);
+    /** Number of rooms whose chatd::Chat is created, see Client::setLazyChatRooms() */
+    size_t chatdChatCount() const;
 /** @endcond PRIVATE */
 };
 
@@ -623,6 +661,10 @@ public:
     IApp& app;                  // app's interface
     SqliteDb db;                // db-layer interface
 
+    /** Threads to offload the decryption of messages from the app's thread. By default
+     * there are none. Must be declared before the chats, so it outlives them */
+    WorkerPool cryptoWorkers;
+
     std::unique_ptr<chatd::Client> mChatdClient;
 
 #ifndef KARERE_DISABLE_WEBRTC
@@ -659,6 +701,8 @@ protected:
     uint64_t mMyIdentity = 0; // seed for CLIENTID
     std::unique_ptr<UserAttrCache> mUserAttrCache;
     UserAttrCache::Handle mOwnNameAttrHandle;
+    /** Cu25519 shared secrets with other users, common to the crypto modules of all chats */
+    std::unique_ptr<strongvelope::SharedSecretCache> mSharedSecrets;
 
     std::string mSid;
     std::string mLastScsn;
@@ -678,6 +722,11 @@ protected:
 
     megaHandle mHeartbeatTimer = 0;
     bool mGroupCallsEnabled = false;
+    bool mLazyChatRooms = false;
+    bool mPersistSharedSecrets = false;
+    size_t mHistoryRamLimit = 0;
+    /** Timings of init() and of the first connection after it */
+    InitTracer mInitTracer;
 
 public:
 
@@ -703,6 +752,7 @@ public:
     const std::string& myEmail() const { return mMyEmail; }
     uint64_t myIdentity() const { return mMyIdentity; }
     UserAttrCache& userAttrCache() const { return *mUserAttrCache; }
+    strongvelope::SharedSecretCache& sharedSecrets() const { return *mSharedSecrets; }
 
     ConnState connState() const { return mConnState; }
     bool connected() const { return mConnState == kConnected; }
@@ -753,6 +803,10 @@ public:
     bool hasInitError() const { return mInitState >= kInitErrFirst; }
     bool isTerminated() const { return mInitState == kInitTerminated; }
     const char* initStateStr() const { return initStateToStr(mInitState); }
+
+    /** @brief The time spent in each phase of the initialization, the rows and
+     * objects loaded by them, and when the session was ready and connected */
+    const InitTracer& initTracer() const { return mInitTracer; }
     static const char* initStateToStr(unsigned char state);
     const char* connStateStr() const { return connStateToStr(mConnState); }
     static const char* connStateToStr(ConnState state);
@@ -843,9 +897,44 @@ public:
     void dumpContactList(::mega::MegaUserList& clist);
 
     bool isChatRoomOpened(Id chatid);
+
+    /** @brief Creates the chat of a room loaded lazily, if not created yet. Called by
+     * chatd when a command that changes the chat is received for it */
+    void createLazyChatRoom(Id chatid);
+
     bool areGroupCallsEnabled();
     void enableGroupCalls(bool enable);
 
+    /** @brief In lazy mode, the chatrooms loaded from the db at init don't create
+     * their chatd::Chat (with its crypto module, send queue and initial history)
+     * until it's accessed, or a push is received for them. Meanwhile, they are joined
+     * to chatd with their history range in the db, and their unread count and last
+     * message are the ones in the db. The chat is created when a new message, an update
+     * of a message, a change of the seen pointer or a call is received for the room, so
+     * its unread count and last message are updated and notified as usual.
+     * Rooms with unsent messages or without history in the db are created anyway.
+     * Must be set before init() to have effect.
+     */
+    void setLazyChatRooms(bool lazy) { mLazyChatRooms = lazy; }
+    bool lazyChatRooms() const { return mLazyChatRooms; }
+
+    /** @brief Persists the shared secrets with other users in the db, encrypted,
+     * so they don't need to be computed again in later sessions.
+     * Must be set before init() to have effect.
+     */
+    void setPersistSharedSecrets(bool persist) { mPersistSharedSecrets = persist; }
+    bool persistSharedSecrets() const { return mPersistSharedSecrets; }
+
+    /** @brief Opens the db in WAL mode, with the checkpoints done by a background thread.
+     * Must be set before init() to have effect.
+     */
+    void setDbWalMode(bool wal) { db.setWalMode(wal); }
+
+    /** @brief Sets the max RAM for the history messages of each chat, applied to
+     * the chatd client when it's created. See chatd::Chat::setHistoryRamLimit()
+     */
+    void setHistoryRamLimit(size_t bytes);
+
 protected:
     void heartbeat();
     void setInitState(InitState newState);
@@ -865,6 +954,7 @@ protected:
     uint64_t getMyIdentityFromDb();
     promise::Promise<void> loadOwnKeysFromApi();
     void loadOwnKeysFromDb();
+    void loadSharedSecrets();
     void loadContactListFromApi();
     void loadContactListFromApi(::mega::MegaUserList& contactList);
 
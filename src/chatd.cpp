@@ -3,6 +3,7 @@
 #include "chatdICrypto.h"
 #include "base64url.h"
 #include <algorithm>
+#include <chrono>
 #include <random>
 #include <regex>
 #include <rapidjson/document.h>
@@ -169,16 +170,8 @@ Client::Client(karere::Client *aKarereClient) :
        });
 }
 
-Chat& Client::createChat(Id chatid, int shardNo, const std::string& url,
-    Listener* listener, const karere::SetOfIds& users, ICrypto* crypto, uint32_t chatCreationTs, bool isGroup)
+Connection& Client::shardConnection(Id chatid, int shardNo, const std::string& url)
 {
-    auto chatit = mChatForChatId.find(chatid);
-    if (chatit != mChatForChatId.end())
-    {
-        CHATD_LOG_WARNING("Client::createChat: Chat with chatid %s already exists, returning existing instance", ID_CSTR(chatid));
-        return *chatit->second;
-    }
-
     // instantiate a Connection object for this shard if needed
     Connection* conn;
     auto it = mConnections.find(shardNo);
@@ -200,6 +193,30 @@ Chat& Client::createChat(Id chatid, int shardNo, const std::string& url,
     }
     // map chatid to this shard
     mConnectionForChatId[chatid] = conn;
+    return *conn;
+}
+
+Chat& Client::createChat(Id chatid, int shardNo, const std::string& url,
+    Listener* listener, const karere::SetOfIds& users, ICrypto* crypto, uint32_t chatCreationTs, bool isGroup)
+{
+    auto chatit = mChatForChatId.find(chatid);
+    if (chatit != mChatForChatId.end())
+    {
+        CHATD_LOG_WARNING("Client::createChat: Chat with chatid %s already exists, returning existing instance", ID_CSTR(chatid));
+        return *chatit->second;
+    }
+
+    Connection* conn = &shardConnection(chatid, shardNo, url);
+
+    // a chat joined lazily joins again by itself, with its Chat object
+    if (conn->mLazyChats.erase(chatid))
+    {
+        auto pending = std::find(conn->mPendingRejoins.begin(), conn->mPendingRejoins.end(), chatid);
+        if (pending != conn->mPendingRejoins.end())
+        {
+            conn->mPendingRejoins.erase(pending);
+        }
+    }
 
     // always update the URL to give the API an opportunity to migrate chat shards between hosts
     Chat* chat = new Chat(*conn, chatid, listener, users, chatCreationTs, crypto, isGroup);
@@ -208,6 +225,36 @@ Chat& Client::createChat(Id chatid, int shardNo, const std::string& url,
     mChatForChatId.emplace(chatid, std::shared_ptr<Chat>(chat));
     return *chat;
 }
+
+void Client::addLazyChat(Id chatid, int shardNo, const ChatDbInfo& dbInfo)
+{
+    assert(dbInfo.oldestDbId && dbInfo.newestDbId);
+    if (mChatForChatId.find(chatid) != mChatForChatId.end())
+    {
+        CHATD_LOG_WARNING("Client::addLazyChat: Chat with chatid %s already exists", ID_CSTR(chatid));
+        return;
+    }
+
+    Connection& conn = shardConnection(chatid, shardNo, std::string());
+    conn.mLazyChats[chatid].dbInfo = dbInfo;
+}
+
+void Client::connectLazyChat(Id chatid)
+{
+    auto it = mConnectionForChatId.find(chatid);
+    if (it == mConnectionForChatId.end() || !it->second->mLazyChats.count(chatid))
+    {
+        CHATD_LOG_ERROR("Client::connectLazyChat: Unknown lazy chat %s", ID_CSTR(chatid));
+        return;
+    }
+    it->second->connect(chatid);
+}
+
+bool Client::isLazyChat(Id chatid) const
+{
+    auto it = mConnectionForChatId.find(chatid);
+    return (it != mConnectionForChatId.end()) && it->second->mLazyChats.count(chatid);
+}
 void Client::sendKeepalive()
 {
     for (auto& conn: mConnections)
@@ -287,6 +334,46 @@ bool Client::isMessageReceivedConfirmationActive() const
     return mMessageReceivedConfirmation;
 }
 
+const RecvCommandStats& Client::recvStats(uint8_t opcode) const
+{
+    if (opcode > OP_LAST)
+        throw std::runtime_error("recvStats: Invalid opcode "+std::to_string(opcode));
+
+    return mRecvStats[opcode];
+}
+
+void Client::resetRecvStats()
+{
+    mRecvStats.fill(RecvCommandStats());
+    for (auto& it: mChatForChatId)
+    {
+        it.second->mRecvStats = RecvCommandStats();
+    }
+}
+
+void Client::setHistoryRamLimit(size_t bytes)
+{
+    mHistoryRamLimit = bytes;
+    for (auto& it: mChatForChatId)
+    {
+        it.second->setHistoryRamLimit(bytes);
+    }
+}
+
+void Client::onCommandHandled(uint8_t opcode, karere::Id chatid, size_t bytes, uint64_t usecs)
+{
+    assert(opcode <= OP_LAST);
+    mRecvStats[opcode].add(bytes, usecs);
+    if (!chatid)    // not a chat-specific command
+        return;
+
+    auto it = mChatForChatId.find(chatid);
+    if (it != mChatForChatId.end())
+    {
+        it->second->mRecvStats.add(bytes, usecs);
+    }
+}
+
 uint8_t Client::richLinkState() const
 {
     return mRichLinkState;
@@ -296,7 +383,7 @@ bool Client::areAllChatsLoggedIn()
 {
     bool allConnected = true;
 
-    for (map<Id, shared_ptr<Chat>>::iterator it = mChatForChatId.begin(); it != mChatForChatId.end(); it++)
+    for (auto it = mChatForChatId.begin(); it != mChatForChatId.end(); ++it)
     {
         Chat* chat = it->second.get();
         if (!chat->isLoggedIn() && !chat->isDisabled())
@@ -319,34 +406,7 @@ void Chat::connect()
     // attempt a connection ONLY if this is a new shard.
     if (mConnection.state() == Connection::kStateNew)
     {
-        mConnection.setState(Connection::kStateFetchingUrl);
-        auto wptr = getDelTracker();
-        mChatdClient.mApi->call(&::mega::MegaApi::getUrlChat, mChatId)
-        .then([wptr, this](ReqResult result)
-        {
-            if (wptr.deleted())
-            {
-                CHATD_LOG_DEBUG("Chatd URL request completed, but chatd client was deleted");
-                return;
-            }
-
-            const char* url = result->getLink();
-            if (!url || !url[0])
-            {
-                CHATID_LOG_ERROR("No chatd URL received from API");
-                return;
-            }
-
-            std::string sUrl = url;
-            mConnection.mUrl.parse(sUrl);
-            mConnection.mUrl.path.append("/").append(std::to_string(Client::chatdVersion));
-
-            mConnection.reconnect()
-            .fail([this](const ::promise::Error& err)
-            {
-                CHATID_LOG_ERROR("Chat::connect(): Error connecting to server after getting URL: %s", err.what());
-            });
-        });
+        mConnection.connect(mChatId);
     }
     else if (mConnection.isOnline())
     {
@@ -354,7 +414,42 @@ void Chat::connect()
     }
 }
 
-void Chat::login()
+void Connection::connect(Id chatid)
+{
+    if (mState != kStateNew)
+        return;
+
+    setState(kStateFetchingUrl);
+    auto wptr = weakHandle();
+    mChatdClient.mApi->call(&::mega::MegaApi::getUrlChat, chatid)
+    .then([wptr, this, chatid](ReqResult result)
+    {
+        if (wptr.deleted())
+        {
+            CHATD_LOG_DEBUG("Chatd URL request completed, but chatd client was deleted");
+            return;
+        }
+
+        const char* url = result->getLink();
+        if (!url || !url[0])
+        {
+            CHATDS_LOG_ERROR("%s: No chatd URL received from API", ID_CSTR(chatid));
+            return;
+        }
+
+        std::string sUrl = url;
+        mUrl.parse(sUrl);
+        mUrl.path.append("/").append(std::to_string(Client::chatdVersion));
+
+        reconnect()
+        .fail([this, chatid](const ::promise::Error& err)
+        {
+            CHATDS_LOG_ERROR("%s: Connection::connect(): Error connecting to server after getting URL: %s", ID_CSTR(chatid), err.what());
+        });
+    });
+}
+
+void Chat::login(const ChatDbInfo* info)
 {
     assert(mConnection.isOnline());
     mUserDump.clear();
@@ -362,11 +457,15 @@ void Chat::login()
     // In both cases (join/joinrangehist), don't block history messages being sent to app
     mServerOldHistCbEnabled = false;
 
-    ChatDbInfo info;
-    mDbInterface->getHistoryInfo(info);
-    mOldestKnownMsgId = info.oldestDbId;
+    ChatDbInfo dbInfo;
+    if (!info)
+    {
+        mDbInterface->getHistoryInfo(dbInfo);
+        info = &dbInfo;
+    }
+    mOldestKnownMsgId = info->oldestDbId;
     if (mOldestKnownMsgId) //if we have local history
-        joinRangeHist(info);
+        joinRangeHist(*info);
     else
         join();
 }
@@ -381,6 +480,32 @@ void Connection::wsConnectCb()
     setState(kStateConnected);
 }
 
+void Connection::wsSendQueueCb(bool full)
+{
+    if (full)
+    {
+        CHATDS_LOG_WARNING("Output queue is full (%zu bytes), pausing the sending of messages",
+                           wsSendQueueBytes());
+        return;
+    }
+
+    if (!isOnline())
+        return;
+
+    // resume the rejoins first, since the chats can't send anything before joining
+    rejoinPendingChats();
+
+    for (auto& chatid: mChatIds)
+    {
+        if (wsIsSendQueueFull())
+            return;
+
+        Chat& chat = mChatdClient.chats(chatid);
+        if (chat.onlineState() == kChatStateOnline)
+            chat.flushOutputQueue();
+    }
+}
+
 void Connection::wsCloseCb(int errcode, int errtype, const char *preason, size_t reason_len)
 {
     string reason;
@@ -406,6 +531,8 @@ void Connection::onSocketClose(int errcode, int errtype, const std::string& reas
 
     usingipv6 = !usingipv6;
     mTargetIp.clear();
+    mPendingRejoins.clear();
+    mRejoinInfos.clear();
 
     if (oldState == kStateConnected)
     {
@@ -565,6 +692,12 @@ void Connection::setState(State state)
             mChatdClient.mRtcHandler->stopCallsTimers(mShardNo);
         }
 #endif
+        // the lazy chats are joined again on login
+        for (auto& lazy: mLazyChats)
+        {
+            lazy.second.joined = false;
+            lazy.second.mustCreate = false;
+        }
     }
     else if (mState == kStateConnected)
     {
@@ -1110,23 +1243,125 @@ string KeyCommand::toString() const
 // rejoin all open chats after reconnection (this is mandatory)
 bool Connection::rejoinExistingChats()
 {
-    for (auto& chatid: mChatIds)
+    mPendingRejoins.assign(mChatIds.begin(), mChatIds.end());
+    for (auto& lazy: mLazyChats)
+    {
+        mPendingRejoins.push_back(lazy.first);
+    }
+
+    // load the history info of all the chats at once, instead of a few queries per chat
+    mRejoinInfos.clear();
+    if (!mChatIds.empty())
     {
         try
         {
+            Chat& chat = mChatdClient.chats(*mChatIds.begin());
+            chat.mDbInterface->getHistoryInfos(mChatIds, mRejoinInfos);
+        }
+        catch(std::exception& e)
+        {
+            // each chat will load its own info
+            CHATDS_LOG_ERROR("rejoinExistingChats: Exception loading history info: %s", e.what());
+            mRejoinInfos.clear();
+        }
+    }
+    return rejoinPendingChats();
+}
+
+// rejoins chats while the output queue has room, the rest are rejoined when it drains
+bool Connection::rejoinPendingChats()
+{
+    while (!mPendingRejoins.empty())
+    {
+        if (wsIsSendQueueFull())
+        {
+            CHATDS_LOG_DEBUG("Output queue is full, deferring the rejoin of %zu chats", mPendingRejoins.size());
+            return true;
+        }
+
+        Id chatid = mPendingRejoins.front();
+        mPendingRejoins.pop_front();
+        try
+        {
+            auto lazy = mLazyChats.find(chatid);
+            if (lazy != mLazyChats.end())
+            {
+                joinLazyChat(chatid, lazy->second);
+                continue;
+            }
+
             Chat& chat = mChatdClient.chats(chatid);
             if (!chat.isDisabled())
-                chat.login();
+            {
+                auto it = mRejoinInfos.find(chatid);
+                if (it != mRejoinInfos.end())
+                {
+                    ChatDbInfo info = it->second;
+                    mRejoinInfos.erase(it);
+                    chat.login(&info);
+                }
+                else
+                {
+                    chat.login();
+                }
+            }
         }
         catch(std::exception& e)
         {
             CHATDS_LOG_ERROR("rejoinExistingChats: Exception: %s", e.what());
+            mPendingRejoins.clear();
+            mRejoinInfos.clear();
             return false;
         }
     }
+    mRejoinInfos.clear();
     return true;
 }
 
+void Connection::joinLazyChat(Id chatid, LazyChat& lazy)
+{
+    lazy.joined = false;
+    lazy.mustCreate = false;
+    CHATDS_LOG_DEBUG("%s: Sending JOINRANGEHIST of lazy chat based on app db: %s - %s", ID_CSTR(chatid),
+                     ID_CSTR(lazy.dbInfo.oldestDbId), ID_CSTR(lazy.dbInfo.newestDbId));
+    sendCommand(Command(OP_JOINRANGEHIST) + chatid + lazy.dbInfo.oldestDbId + lazy.dbInfo.newestDbId);
+}
+
+void Connection::createLazyChat(Id chatid)
+{
+    CHATDS_LOG_DEBUG("%s: Creating the chat of a lazy chat", ID_CSTR(chatid));
+    mChatdClient.mKarereClient->createLazyChatRoom(chatid);
+    if (mLazyChats.erase(chatid))
+    {
+        CHATDS_LOG_ERROR("%s: Lazy chat not created, ignoring it from now on", ID_CSTR(chatid));
+    }
+}
+
+Chat* Connection::chatForCommand(CommandCtx& ctx, LazySignal signal)
+{
+    auto lazy = mLazyChats.find(ctx.chatid);
+    if (lazy == mLazyChats.end())
+    {
+        return &mChatdClient.chats(ctx.chatid);
+    }
+
+    if (signal == kLazyIgnore)
+    {
+        return nullptr;
+    }
+
+    if (!lazy->second.joined)
+    {
+        // the rest of the response to the JOINRANGEHIST would reach the chat
+        // in the middle of its own join, so it's created when it's complete
+        lazy->second.mustCreate = true;
+        return nullptr;
+    }
+
+    createLazyChat(ctx.chatid);
+    return (signal == kLazyCreateAndHandle) ? mChatdClient.chatFromId(ctx.chatid).get() : nullptr;
+}
+
 // send JOIN
 void Chat::join()
 {
@@ -1171,10 +1406,29 @@ void Chat::onDisconnect()
         }
     }
 
+    endHistoryBatch();
     mServerFetchState = kHistNotFetching;
     setOnlineState(kChatStateOffline);
 }
 
+void Chat::beginHistoryBatch()
+{
+    if (mInHistoryBatch)
+        return;
+
+    mInHistoryBatch = true;
+    CALL_DB(beginHistoryBatch);
+}
+
+void Chat::endHistoryBatch()
+{
+    if (!mInHistoryBatch)
+        return;
+
+    mInHistoryBatch = false;
+    CALL_DB(endHistoryBatch);
+}
+
 HistSource Chat::getHistory(unsigned count)
 {
     if (isNotifyingOldHistFromServer())
@@ -1322,39 +1576,146 @@ void Chat::requestNodeHistoryFromServer(Id oldestMsgid, uint32_t count)
 
 Message *Chat::oldest() const
 {
-    if (!mBackwardList.empty())
+    return mHistory.findOrNull(lownum());
+}
+
+Message *Chat::newest() const
+{
+    return mHistory.findOrNull(highnum());
+}
+
+Message* Chat::push_forward(Message* msg)
+{
+    Message& stored = mHistory.pushNewest(std::move(*msg));
+    delete msg;
+    return &stored;
+}
+
+Message* Chat::push_back(Message* msg)
+{
+    Message& stored = mHistory.pushOldest(std::move(*msg));
+    delete msg;
+    return &stored;
+}
+
+void HistoryStore::addFirstChunk(Idx idx)
+{
+    assert(mChunks.empty());
+    // leave room to grow in both directions
+    mChunksStart = idx - kChunkSize / 2;
+    mChunks.emplace_back(new Chunk);
+}
+
+Message& HistoryStore::pushNewest(Message&& msg)
+{
+    Idx idx = mHigh + 1;
+    if (mChunks.empty())
+    {
+        addFirstChunk(idx);
+    }
+    else if (idx - mChunksStart >= (Idx)(mChunks.size() * kChunkSize))
     {
-        return mBackwardList.back().get();
+        mChunks.emplace_back(new Chunk);
     }
+    Message* stored = new (slot(idx)) Message(std::move(msg));
+    mHigh = idx;
+    account(idx);
+    return *stored;
+}
 
-    if (!mForwardList.empty())
+Message& HistoryStore::pushOldest(Message&& msg)
+{
+    Idx idx = mLow - 1;
+    if (mChunks.empty())
+    {
+        addFirstChunk(idx);
+    }
+    else if (idx < mChunksStart)
     {
-        return mForwardList.front().get();
+        mChunks.emplace_front(new Chunk);
+        mChunksStart -= kChunkSize;
     }
+    Message* stored = new (slot(idx)) Message(std::move(msg));
+    mLow = idx;
+    account(idx);
+    return *stored;
+}
 
-    return NULL;
+void HistoryStore::popOldest()
+{
+    assert(!empty());
+    mRamSize -= accountedSize(mLow);
+    slot(mLow)->~Message();
+    mLow++;
+    if (empty())
+    {
+        mChunks.clear();
+    }
+    else if (mLow - mChunksStart >= kChunkSize)
+    {
+        mChunks.pop_front();
+        mChunksStart += kChunkSize;
+    }
 }
 
-Message *Chat::newest() const
+void HistoryStore::clear(Idx start)
 {
-    if (!mForwardList.empty())
+    for (Idx i = mLow; i <= mHigh; i++)
+    {
+        slot(i)->~Message();
+    }
+    mChunks.clear();
+    mArena.reset();
+    mRamSize = 0;
+    if (start != CHATD_IDX_INVALID)
     {
-        return mForwardList.back().get();
+        mLow = start;
     }
+    mHigh = mLow - 1;
+}
 
-    if (!mBackwardList.empty())
+void HistoryStore::account(Idx idx)
+{
+    uint32_t size = (uint32_t)msgRamSize(*slot(idx));
+    accountedSize(idx) = size;
+    mRamSize += size;
+}
+
+void HistoryStore::updateRamSize(Idx idx)
+{
+    assert(idx >= mLow && idx <= mHigh);
+    mRamSize -= accountedSize(idx);
+    account(idx);
+}
+
+void HistoryStore::pack(Idx idx)
+{
+    assert(idx >= mLow && idx <= mHigh);
+    Message& msg = *slot(idx);
+    size_t len = msg.dataSize();
+    if (!len || len > kArenaMaxPayload)
     {
-        return mBackwardList.front().get();
+        msg.detachFromFrame();
+        updateRamSize(idx);
+        return;
     }
 
-    return NULL;
+    if (!mArena || (mArena->bufSize() - mArena->dataSize() < len))
+    {
+        // the previous block is released when its last message is destroyed or modified
+        mArena = std::make_shared<Buffer>(kArenaBlockSize);
+    }
+    size_t offset = mArena->dataSize();
+    mArena->append(static_cast<const Message&>(msg).buf(), len);
+    msg.assignSlice(mArena, offset, len);
+    updateRamSize(idx);
 }
 
 Chat::Chat(Connection& conn, Id chatid, Listener* listener,
     const karere::SetOfIds& initialUsers, uint32_t chatCreationTs,
     ICrypto* crypto, bool isGroup)
     : mChatdClient(conn.mChatdClient), mConnection(conn), mChatId(chatid),
-      mListener(listener), mUsers(initialUsers), mCrypto(crypto),
+      mHistoryRamLimit(conn.mChatdClient.mHistoryRamLimit), mListener(listener), mUsers(initialUsers), mCrypto(crypto),
       mLastMsgTs(chatCreationTs), mIsGroup(isGroup)
 {
     assert(mChatId);
@@ -1375,6 +1736,7 @@ Chat::Chat(Connection& conn, Id chatid, Listener* listener,
     mLastReceivedId = info.lastRecvId;
     mLastSeenIdx = mDbInterface->getIdxOfMsgidFromHistory(mLastSeenId);
     mLastReceivedIdx = mDbInterface->getIdxOfMsgidFromHistory(mLastReceivedId);
+    mUnreadCount = info.unreadCount;
 
     if ((mHaveAllHistory = mDbInterface->haveAllHistory()))
     {
@@ -1386,7 +1748,7 @@ Chat::Chat(Connection& conn, Id chatid, Listener* listener,
     {
         //no history in db
         mHasMoreHistoryInDb = false;
-        mForwardStart = CHATD_IDX_RANGE_MIDDLE;
+        mHistory.clear(CHATD_IDX_RANGE_MIDDLE);
         CHATID_LOG_DEBUG("Db has no local history for chat");
         loadAndProcessUnsent();
     }
@@ -1394,16 +1756,24 @@ Chat::Chat(Connection& conn, Id chatid, Listener* listener,
     {
         assert(info.newestDbIdx != CHATD_IDX_INVALID);
         mHasMoreHistoryInDb = true;
-        mForwardStart = info.newestDbIdx + 1;
+        mHistory.clear(info.newestDbIdx + 1);
         CHATID_LOG_DEBUG("Db has local history: %s - %s (middle point: %u)",
-            ID_CSTR(info.oldestDbId), ID_CSTR(info.newestDbId), mForwardStart);
+            ID_CSTR(info.oldestDbId), ID_CSTR(info.newestDbId), lownum());
         loadAndProcessUnsent();
         getHistoryFromDb(initialHistoryFetchCount); // ensure we have a minimum set of messages loaded and ready
     }
+
+    if (!info.unreadCountValid)
+    {
+        // not calculated yet, i.e. a db migrated from a version without the count
+        mUnreadCount = calculateUnreadMsgCount();
+        CALL_DB(setUnreadCount, mUnreadCount);
+    }
 }
 Chat::~Chat()
 {
     CALL_LISTENER(onDestroy); //we don't delete because it may have its own idea of its lifetime (i.e. it could be a GUI class)
+    discardEncryptedAhead();
     try { delete mCrypto; }
     catch(std::exception& e)
     { CHATID_LOG_ERROR("EXCEPTION from ICrypto destructor: %s", e.what()); }
@@ -1426,7 +1796,7 @@ Idx Chat::getHistoryFromDb(unsigned count)
     }
     if (mNextHistFetchIdx == CHATD_IDX_INVALID)
     {
-        mNextHistFetchIdx = mForwardStart - 1 - messages.size();
+        mNextHistFetchIdx = lownum() - 1;
     }
     else
     {
@@ -1443,16 +1813,16 @@ Idx Chat::getHistoryFromDb(unsigned count)
 }
 
 #define READ_ID(varname, offset)\
-    assert(offset==pos-base); Id varname(buf.read<uint64_t>(pos)); pos+=sizeof(uint64_t)
+    assert(offset==ctx.pos-ctx.base); Id varname(ctx.buf.read<uint64_t>(ctx.pos)); ctx.pos+=sizeof(uint64_t)
 #define READ_CHATID(offset)\
-    assert(offset==pos-base); chatid = buf.read<uint64_t>(pos); pos+=sizeof(uint64_t)
+    assert(offset==ctx.pos-ctx.base); ctx.chatid = ctx.buf.read<uint64_t>(ctx.pos); ctx.pos+=sizeof(uint64_t)
 
 #define READ_32(varname, offset)\
-    assert(offset==pos-base); uint32_t varname(buf.read<uint32_t>(pos)); pos+=4
+    assert(offset==ctx.pos-ctx.base); uint32_t varname(ctx.buf.read<uint32_t>(ctx.pos)); ctx.pos+=4
 #define READ_16(varname, offset)\
-    assert(offset==pos-base); uint16_t varname(buf.read<uint16_t>(pos)); pos+=2
+    assert(offset==ctx.pos-ctx.base); uint16_t varname(ctx.buf.read<uint16_t>(ctx.pos)); ctx.pos+=2
 #define READ_8(varname, offset)\
-    assert(offset==pos-base); uint8_t varname(buf.read<uint8_t>(pos)); pos+=1
+    assert(offset==ctx.pos-ctx.base); uint8_t varname(ctx.buf.read<uint8_t>(ctx.pos)); ctx.pos+=1
 
 void Connection::wsHandleMsgCb(char *data, size_t len)
 {
@@ -1460,414 +1830,504 @@ void Connection::wsHandleMsgCb(char *data, size_t len)
     execCommand(StaticBuffer(data, len));
 }
 
+const Connection::CommandHandlers& Connection::commandHandlers()
+{
+    static const CommandHandlers handlers = []()
+    {
+        CommandHandlers table;
+        table.fill(nullptr);
+        table[OP_KEEPALIVE] = &Connection::recvKeepalive;
+        table[OP_BROADCAST] = &Connection::recvBroadcast;
+        table[OP_JOIN] = &Connection::recvJoin;
+        table[OP_OLDMSG] = &Connection::recvMsg;
+        table[OP_NEWMSG] = &Connection::recvMsg;
+        table[OP_MSGUPD] = &Connection::recvMsg;
+        table[OP_SEEN] = &Connection::recvSeen;
+        table[OP_RECEIVED] = &Connection::recvReceived;
+        table[OP_RETENTION] = &Connection::recvRetention;
+        table[OP_MSGID] = &Connection::recvMsgId;
+        table[OP_NEWMSGID] = &Connection::recvNewMsgId;
+        table[OP_REJECT] = &Connection::recvReject;
+        table[OP_HISTDONE] = &Connection::recvHistDone;
+        table[OP_NEWKEYID] = &Connection::recvNewKeyId;
+        table[OP_NEWKEY] = &Connection::recvNewKey;
+        table[OP_INCALL] = &Connection::recvInCall;
+        table[OP_ENDCALL] = &Connection::recvEndCall;
+        table[OP_CALLDATA] = &Connection::recvCallData;
+        table[OP_RTMSG_ENDPOINT] = &Connection::recvRtMessage;
+        table[OP_RTMSG_USER] = &Connection::recvRtMessage;
+        table[OP_RTMSG_BROADCAST] = &Connection::recvRtMessage;
+        table[OP_CLIENTID] = &Connection::recvClientId;
+        table[OP_ECHO] = &Connection::recvEcho;
+        table[OP_ADDREACTION] = &Connection::recvReaction;
+        table[OP_DELREACTION] = &Connection::recvReaction;
+        table[OP_SYNC] = &Connection::recvSync;
+        table[OP_CALLTIME] = &Connection::recvCallTime;
+        return table;
+    }();
+    return handlers;
+}
+
 // inbound command processing
 // multiple commands can appear as one WebSocket frame, but commands never cross frame boundaries
 // CHECK: is this assumption correct on all browsers and under all circumstances?
 void Connection::execCommand(const StaticBuffer& buf)
 {
-    size_t pos = 0;
+    const CommandHandlers& handlers = commandHandlers();
+    CommandCtx ctx(buf);
 //IMPORTANT: Increment pos before calling the command handler, because the handler may throw, in which
 //case the next iteration will not advance and will execute the same command again, resulting in
 //infinite loop
-    while (pos < buf.dataSize())
+    while (ctx.pos < buf.dataSize())
     {
-      char opcode = buf.buf()[pos];
-      Id chatid;
-      try
-      {
-        pos++;
-#ifndef NDEBUG
-        size_t base = pos;
-#endif
-        switch (opcode)
+        uint8_t opcode = buf.buf()[ctx.pos];
+        CommandHandler handler = (opcode <= OP_LAST) ? handlers[opcode] : nullptr;
+        if (!handler)
         {
-            case OP_KEEPALIVE:
-            {
-                CHATDS_LOG_DEBUG("recv KEEPALIVE");
-                sendKeepalive(mChatdClient.mKeepaliveType);
-                break;
-            }
-            case OP_BROADCAST:
-            {
-                READ_CHATID(0);
-                READ_ID(userid, 8);
-                READ_8(bcastType, 16);
-                auto& chat = mChatdClient.chats(chatid);
-                chat.handleBroadcast(userid, bcastType);
-                break;
-            }
-            case OP_JOIN:
-            {
-                READ_CHATID(0);
-                READ_ID(userid, 8);
-                Priv priv = (Priv)buf.read<int8_t>(pos);
-                pos++;
-                CHATDS_LOG_DEBUG("%s: recv JOIN - user '%s' with privilege level %d",
-                                ID_CSTR(chatid), ID_CSTR(userid), priv);
-
-                if (userid == Id::COMMANDER())
-                {
-                    CHATDS_LOG_ERROR("recv JOIN for API user");
-                    assert(false);
-                    break;
-                }
+            CHATDS_LOG_ERROR("Unknown opcode %d, ignoring all subsequent commands", opcode);
+            return;
+        }
 
-                auto& chat =  mChatdClient.chats(chatid);
-                if (priv == PRIV_NOTPRESENT)
-                    chat.onUserLeave(userid);
-                else
-                    chat.onUserJoin(userid, priv);
-                break;
-            }
-            case OP_OLDMSG:
-            case OP_NEWMSG:
-            case OP_MSGUPD:
-            {
-                READ_CHATID(0);
-                READ_ID(userid, 8);
-                READ_ID(msgid, 16);
-                READ_32(ts, 24);
-                READ_16(updated, 28);
-                READ_32(keyid, 30);
-                READ_32(msglen, 34);
-                const char* msgdata = buf.readPtr(pos, msglen);
-                pos += msglen;
-
-                CHATDS_LOG_DEBUG("%s: recv %s - msgid: '%s', from user '%s' with keyid %u, ts %u, tsdelta %u",
-                    ID_CSTR(chatid), Command::opcodeToStr(opcode), ID_CSTR(msgid),
-                    ID_CSTR(userid), keyid, ts, updated);
-
-                std::unique_ptr<Message> msg(new Message(msgid, userid, ts, updated, msgdata, msglen, false, keyid));
-                msg->setEncrypted(Message::kEncryptedPending);
-                Chat& chat = mChatdClient.chats(chatid);
-                if (opcode == OP_MSGUPD)
-                {
-                    chat.onMsgUpdated(msg.release());
-                }
-                else
-                {
-                    if (!chat.isFetchingNodeHistory() || opcode == OP_NEWMSG)
-                    {
-                        chat.msgIncoming((opcode == OP_NEWMSG), msg.release(), false);
-                    }
-                    else
-                    {
-                        chat.msgNodeHistIncoming(msg.release());
-                    }
-                }
-                break;
-            }
-            case OP_SEEN:
-            {
-                READ_CHATID(0);
-                READ_ID(msgid, 8);
-                CHATDS_LOG_DEBUG("%s: recv SEEN - msgid: '%s'", ID_CSTR(chatid), ID_CSTR(msgid));
-                mChatdClient.chats(chatid).onLastSeen(msgid);
-                break;
-            }
-            case OP_RECEIVED:
-            {
-                READ_CHATID(0);
-                READ_ID(msgid, 8);
-                CHATDS_LOG_DEBUG("%s: recv RECEIVED - msgid: '%s'", ID_CSTR(chatid), ID_CSTR(msgid));
-                mChatdClient.chats(chatid).onLastReceived(msgid);
-                break;
-            }
-            case OP_RETENTION:
-            {
-                READ_CHATID(0);
-                READ_ID(userid, 8);
-                READ_32(period, 16);
-                CHATDS_LOG_DEBUG("%s: recv RETENTION by user '%s' to %u second(s)",
-                                ID_CSTR(chatid), ID_CSTR(userid), period);
-                break;
-            }
-            case OP_MSGID:
-            {
-                READ_ID(msgxid, 0);
-                READ_ID(msgid, 8);
-                CHATDS_LOG_DEBUG("recv MSGID: '%s' -> '%s'", ID_CSTR(msgxid), ID_CSTR(msgid));
-                mChatdClient.onMsgAlreadySent(msgxid, msgid);
-                break;
-            }
-            case OP_NEWMSGID:
-            {
-                READ_ID(msgxid, 0);
-                READ_ID(msgid, 8);
-                CHATDS_LOG_DEBUG("recv NEWMSGID: '%s' -> '%s'", ID_CSTR(msgxid), ID_CSTR(msgid));
-                mChatdClient.msgConfirm(msgxid, msgid);
-                break;
-            }
-/*            case OP_RANGE:
-            {
-                READ_CHATID(0);
-                READ_ID(oldest, 8);
-                READ_ID(newest, 16);
-                CHATDS_LOG_DEBUG("%s: recv RANGE - (%s - %s)",
-                                ID_CSTR(chatid), ID_CSTR(oldest), ID_CSTR(newest));
-                auto& msgs = mClient.chats(chatid);
-                if (msgs.onlineState() == kChatStateJoining)
-                    msgs.initialFetchHistory(newest);
-                break;
-            }
-*/
-            case OP_REJECT:
-            {
-                READ_CHATID(0);
-                READ_ID(id, 8);
-                READ_8(op, 16);
-                READ_8(reason, 17);
-                CHATDS_LOG_WARNING("%s: recv REJECT of %s: id='%s', reason: %hu",
-                    ID_CSTR(chatid), Command::opcodeToStr(op), ID_CSTR(id), reason);
-                auto& chat = mChatdClient.chats(chatid);
-                if (op == OP_NEWMSG || op == OP_NEWNODEMSG) // the message was rejected
-                {
-                    chat.msgConfirm(id, Id::null());
-                }
-                else if ((op == OP_MSGUPD) || (op == OP_MSGUPDX))
-                {
-                    chat.rejectMsgupd(id, reason);
-                }
-                else if (op == OP_JOIN)
-                {
-                    chat.onJoinRejected();
-                }
-                else if (op == OP_RANGE && reason == 1)
-                {
-                    chat.clearHistory();
-                    // we were notifying NEWMSGs in result of JOINRANGEHIST, but after reload we start receiving OLDMSGs
-                    chat.mServerOldHistCbEnabled = mChatdClient.mKarereClient->isChatRoomOpened(chatid);
-                    chat.getHistoryFromDbOrServer(chat.initialHistoryFetchCount);
-                }
-                else if (op == OP_NEWKEY)
-                {
-                    chat.onKeyReject();
-                }
-                else if (op == OP_HIST)
-                {
-                    chat.onHistReject();
-                }
-                else
-                {
-                    chat.rejectGeneric(op, reason);
-                }
-                break;
-            }
-            case OP_HISTDONE:
-            {
-                READ_CHATID(0);
-                CHATDS_LOG_DEBUG("%s: recv HISTDONE - history retrieval finished", ID_CSTR(chatid));
-                Chat &chat = mChatdClient.chats(chatid);
-                chat.onHistDone();
-                break;
-            }
-            case OP_NEWKEYID:
-            {
-                READ_CHATID(0);
-                READ_32(keyxid, 8);
-                READ_32(keyid, 12);
-                CHATDS_LOG_DEBUG("%s: recv NEWKEYID: %u -> %u", ID_CSTR(chatid), keyxid, keyid);
-                mChatdClient.chats(chatid).keyConfirm(keyxid, keyid);
-                break;
-            }
-            case OP_NEWKEY:
-            {
-                READ_CHATID(0);
-                READ_32(keyid, 8);
-                READ_32(totalLen, 12);
-                const char* keys = buf.readPtr(pos, totalLen);
-                pos+=totalLen;
-                CHATDS_LOG_DEBUG("%s: recv NEWKEY %u", ID_CSTR(chatid), keyid);
-                mChatdClient.chats(chatid).onNewKeys(StaticBuffer(keys, totalLen));
-                break;
-            }
-            case OP_INCALL:
-            {
-                // opcode.1 chatid.8 userid.8 clientid.4
-                READ_CHATID(0);
-                READ_ID(userid, 8);
-                READ_32(clientid, 16);
-                CHATDS_LOG_DEBUG("%s: recv INCALL userid %s, clientid: %x", ID_CSTR(chatid), ID_CSTR(userid), clientid);
-                auto& chat = mChatdClient.chats(chatid);
-                // TODO: remove this block once the groucalls are fully supported by clients
-                if ((chat.isGroup() && !mChatdClient.mKarereClient->areGroupCallsEnabled()))
-                {
-                    CHATDS_LOG_DEBUG("Groupcalls are disabled, ignoring INCALL command");
-                    break;
-                }
-                chat.onInCall(userid, clientid);
-                break;
-            }
-            case OP_ENDCALL:
-            {
-                // opcode.1 chatid.8 userid.8 clientid.4
-                READ_CHATID(0);
-                READ_ID(userid, 8);
-                READ_32(clientid, 16);
-                CHATDS_LOG_DEBUG("%s: recv ENDCALL userid: %s, clientid: %x", ID_CSTR(chatid), ID_CSTR(userid), clientid);
-                auto& chat = mChatdClient.chats(chatid);
-                // TODO: remove this block once the groucalls are fully supported by clients
-                if ((chat.isGroup() && !mChatdClient.mKarereClient->areGroupCallsEnabled()))
-                {
-                    CHATDS_LOG_DEBUG("Groupcalls are disabled, ignoring ENDCALL command");
-                    break;
-                }
-                chat.onEndCall(userid, clientid);
-                break;
-            }
-            case OP_CALLDATA:
-            {
-                READ_CHATID(0);
-                READ_ID(userid, 8);
-                READ_32(clientid, 16);
-                READ_16(payloadLen, 20);
-                CHATDS_LOG_DEBUG("%s: recv CALLDATA userid: %s, clientid: %x, PayloadLen: %d", ID_CSTR(chatid), ID_CSTR(userid), clientid, payloadLen);
-                pos += payloadLen; // payload bytes will be consumed by handleCallData(), but does not update `pos` pointer
+        size_t cmdStart = ctx.pos;
+        ctx.opcode = opcode;
+        ctx.chatid = Id();
+        auto tsStart = std::chrono::steady_clock::now();
+        try
+        {
+            ctx.pos++;
+            ctx.base = ctx.pos;
+            (this->*handler)(ctx);
+        }
+        catch(BufferRangeError& e)
+        {
+            CHATDS_LOG_ERROR("%s: Buffer bound check error while parsing %s:\n\t%s\n\tAborting command processing", ID_CSTR(ctx.chatid), Command::opcodeToStr(opcode), e.what());
+            return;
+        }
+        catch(std::exception& e)
+        {
+            CHATDS_LOG_ERROR("%s: Exception while processing incoming %s: %s", ID_CSTR(ctx.chatid), Command::opcodeToStr(opcode), e.what());
+        }
+
+        auto usecs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tsStart).count();
+        mChatdClient.onCommandHandled(opcode, ctx.chatid, ctx.pos - cmdStart, usecs);
+    }
+}
+
+void Connection::recvKeepalive(CommandCtx& /*ctx*/)
+{
+    CHATDS_LOG_DEBUG("recv KEEPALIVE");
+    sendKeepalive(mChatdClient.mKeepaliveType);
+}
+
+void Connection::recvBroadcast(CommandCtx& ctx)
+{
+    READ_CHATID(0);
+    READ_ID(userid, 8);
+    READ_8(bcastType, 16);
+    Chat* chat = chatForCommand(ctx, kLazyIgnore);
+    if (!chat)
+        return;
+    chat->handleBroadcast(userid, bcastType);
+}
+
+void Connection::recvJoin(CommandCtx& ctx)
+{
+    READ_CHATID(0);
+    READ_ID(userid, 8);
+    Priv priv = (Priv)ctx.buf.read<int8_t>(ctx.pos);
+    ctx.pos++;
+    CHATDS_LOG_DEBUG("%s: recv JOIN - user '%s' with privilege level %d",
+                    ID_CSTR(ctx.chatid), ID_CSTR(userid), priv);
+
+    if (userid == Id::COMMANDER())
+    {
+        CHATDS_LOG_ERROR("recv JOIN for API user");
+        assert(false);
+        return;
+    }
+
+    // the members of a lazy chat are received again when the chat joins by itself
+    Chat* chat = chatForCommand(ctx, kLazyIgnore);
+    if (!chat)
+        return;
+    if (priv == PRIV_NOTPRESENT)
+        chat->onUserLeave(userid);
+    else
+        chat->onUserJoin(userid, priv);
+}
+
+void Connection::recvMsg(CommandCtx& ctx)
+{
+    READ_CHATID(0);
+    READ_ID(userid, 8);
+    READ_ID(msgid, 16);
+    READ_32(ts, 24);
+    READ_16(updated, 28);
+    READ_32(keyid, 30);
+    READ_32(msglen, 34);
+    ctx.buf.checkDataSize(ctx.pos+msglen);
+    size_t msgOffset = ctx.pos;
+    ctx.pos += msglen;
+
+    uint8_t opcode = ctx.opcode;
+    CHATDS_LOG_DEBUG("%s: recv %s - msgid: '%s', from user '%s' with keyid %u, ts %u, tsdelta %u",
+        ID_CSTR(ctx.chatid), Command::opcodeToStr(opcode), ID_CSTR(msgid),
+        ID_CSTR(userid), keyid, ts, updated);
+
+    // new messages of a lazy chat are received again, with their keys, when the chat
+    // joins by itself. Updates of messages in its db are handled by the created chat
+    Chat* chat = chatForCommand(ctx, (opcode == OP_MSGUPD) ? kLazyCreateAndHandle : kLazyCreate);
+    if (!chat)
+        return;
+
+    if (!ctx.frame)
+    {
+        ctx.frame = std::make_shared<Buffer>(ctx.buf.buf(), ctx.buf.dataSize());
+    }
+    std::unique_ptr<Message> msg(new Message(msgid, userid, ts, updated, ctx.frame, msgOffset, msglen, keyid));
+    msg->setEncrypted(Message::kEncryptedPending);
+    if (opcode == OP_MSGUPD)
+    {
+        chat->onMsgUpdated(msg.release());
+    }
+    else
+    {
+        if (!chat->isFetchingNodeHistory() || opcode == OP_NEWMSG)
+        {
+            chat->msgIncoming((opcode == OP_NEWMSG), msg.release(), false);
+        }
+        else
+        {
+            chat->msgNodeHistIncoming(msg.release());
+        }
+    }
+}
+
+void Connection::recvSeen(CommandCtx& ctx)
+{
+    READ_CHATID(0);
+    READ_ID(msgid, 8);
+    CHATDS_LOG_DEBUG("%s: recv SEEN - msgid: '%s'", ID_CSTR(ctx.chatid), ID_CSTR(msgid));
+    // the unread count of a lazy chat changes only if it was seen from elsewhere
+    auto lazy = mLazyChats.find(ctx.chatid);
+    bool changed = (lazy == mLazyChats.end()) || (lazy->second.dbInfo.lastSeenId != msgid);
+    Chat* chat = chatForCommand(ctx, changed ? kLazyCreateAndHandle : kLazyIgnore);
+    if (!chat)
+        return;
+    chat->onLastSeen(msgid);
+}
+
+void Connection::recvReceived(CommandCtx& ctx)
+{
+    READ_CHATID(0);
+    READ_ID(msgid, 8);
+    CHATDS_LOG_DEBUG("%s: recv RECEIVED - msgid: '%s'", ID_CSTR(ctx.chatid), ID_CSTR(msgid));
+    Chat* chat = chatForCommand(ctx, kLazyIgnore);
+    if (!chat)
+        return;
+    chat->onLastReceived(msgid);
+}
+
+void Connection::recvRetention(CommandCtx& ctx)
+{
+    READ_CHATID(0);
+    READ_ID(userid, 8);
+    READ_32(period, 16);
+    CHATDS_LOG_DEBUG("%s: recv RETENTION by user '%s' to %u second(s)",
+                    ID_CSTR(ctx.chatid), ID_CSTR(userid), period);
+}
+
+void Connection::recvMsgId(CommandCtx& ctx)
+{
+    READ_ID(msgxid, 0);
+    READ_ID(msgid, 8);
+    CHATDS_LOG_DEBUG("recv MSGID: '%s' -> '%s'", ID_CSTR(msgxid), ID_CSTR(msgid));
+    mChatdClient.onMsgAlreadySent(msgxid, msgid);
+}
+
+void Connection::recvNewMsgId(CommandCtx& ctx)
+{
+    READ_ID(msgxid, 0);
+    READ_ID(msgid, 8);
+    CHATDS_LOG_DEBUG("recv NEWMSGID: '%s' -> '%s'", ID_CSTR(msgxid), ID_CSTR(msgid));
+    mChatdClient.msgConfirm(msgxid, msgid);
+}
+
+void Connection::recvReject(CommandCtx& ctx)
+{
+    READ_CHATID(0);
+    READ_ID(id, 8);
+    READ_8(op, 16);
+    READ_8(reason, 17);
+    CHATDS_LOG_WARNING("%s: recv REJECT of %s: id='%s', reason: %hu",
+        ID_CSTR(ctx.chatid), Command::opcodeToStr(op), ID_CSTR(id), reason);
+    if (mLazyChats.count(ctx.chatid))
+    {
+        // the JOINRANGEHIST of a lazy chat was rejected, so no HISTDONE will be received.
+        // The chat handles the reject when its own join is rejected
+        createLazyChat(ctx.chatid);
+        return;
+    }
+    auto& chat = mChatdClient.chats(ctx.chatid);
+    if (op == OP_NEWMSG || op == OP_NEWNODEMSG) // the message was rejected
+    {
+        chat.msgConfirm(id, Id::null());
+    }
+    else if ((op == OP_MSGUPD) || (op == OP_MSGUPDX))
+    {
+        chat.rejectMsgupd(id, reason);
+    }
+    else if (op == OP_JOIN)
+    {
+        chat.onJoinRejected();
+    }
+    else if (op == OP_RANGE && reason == 1)
+    {
+        chat.clearHistory();
+        // we were notifying NEWMSGs in result of JOINRANGEHIST, but after reload we start receiving OLDMSGs
+        chat.mServerOldHistCbEnabled = mChatdClient.mKarereClient->isChatRoomOpened(ctx.chatid);
+        chat.getHistoryFromDbOrServer(chat.initialHistoryFetchCount);
+    }
+    else if (op == OP_NEWKEY)
+    {
+        chat.onKeyReject();
+    }
+    else if (op == OP_HIST)
+    {
+        chat.onHistReject();
+    }
+    else
+    {
+        chat.rejectGeneric(op, reason);
+    }
+}
+
+void Connection::recvHistDone(CommandCtx& ctx)
+{
+    READ_CHATID(0);
+    CHATDS_LOG_DEBUG("%s: recv HISTDONE - history retrieval finished", ID_CSTR(ctx.chatid));
+    auto lazy = mLazyChats.find(ctx.chatid);
+    if (lazy != mLazyChats.end())
+    {
+        lazy->second.joined = true;
+        if (lazy->second.mustCreate)
+        {
+            createLazyChat(ctx.chatid);
+        }
+        return;
+    }
+    Chat &chat = mChatdClient.chats(ctx.chatid);
+    chat.onHistDone();
+}
+
+void Connection::recvNewKeyId(CommandCtx& ctx)
+{
+    READ_CHATID(0);
+    READ_32(keyxid, 8);
+    READ_32(keyid, 12);
+    CHATDS_LOG_DEBUG("%s: recv NEWKEYID: %u -> %u", ID_CSTR(ctx.chatid), keyxid, keyid);
+    Chat* chat = chatForCommand(ctx, kLazyIgnore);
+    if (!chat)
+        return;
+    chat->keyConfirm(keyxid, keyid);
+}
+
+void Connection::recvNewKey(CommandCtx& ctx)
+{
+    READ_CHATID(0);
+    READ_32(keyid, 8);
+    READ_32(totalLen, 12);
+    const char* keys = ctx.buf.readPtr(ctx.pos, totalLen);
+    ctx.pos+=totalLen;
+    CHATDS_LOG_DEBUG("%s: recv NEWKEY %u", ID_CSTR(ctx.chatid), keyid);
+    // keys of lazy chats are received again with the messages that use them
+    Chat* chat = chatForCommand(ctx, kLazyIgnore);
+    if (!chat)
+        return;
+    chat->onNewKeys(StaticBuffer(keys, totalLen));
+}
+
+void Connection::recvInCall(CommandCtx& ctx)
+{
+    // opcode.1 chatid.8 userid.8 clientid.4
+    READ_CHATID(0);
+    READ_ID(userid, 8);
+    READ_32(clientid, 16);
+    CHATDS_LOG_DEBUG("%s: recv INCALL userid %s, clientid: %x", ID_CSTR(ctx.chatid), ID_CSTR(userid), clientid);
+    Chat* chat = chatForCommand(ctx, kLazyCreateAndHandle);
+    if (!chat)
+        return;
+    // TODO: remove this block once the groucalls are fully supported by clients
+    if ((chat->isGroup() && !mChatdClient.mKarereClient->areGroupCallsEnabled()))
+    {
+        CHATDS_LOG_DEBUG("Groupcalls are disabled, ignoring INCALL command");
+        return;
+    }
+    chat->onInCall(userid, clientid);
+}
+
+void Connection::recvEndCall(CommandCtx& ctx)
+{
+    // opcode.1 chatid.8 userid.8 clientid.4
+    READ_CHATID(0);
+    READ_ID(userid, 8);
+    READ_32(clientid, 16);
+    CHATDS_LOG_DEBUG("%s: recv ENDCALL userid: %s, clientid: %x", ID_CSTR(ctx.chatid), ID_CSTR(userid), clientid);
+    Chat* chat = chatForCommand(ctx, kLazyIgnore);
+    if (!chat)
+        return;
+    // TODO: remove this block once the groucalls are fully supported by clients
+    if ((chat->isGroup() && !mChatdClient.mKarereClient->areGroupCallsEnabled()))
+    {
+        CHATDS_LOG_DEBUG("Groupcalls are disabled, ignoring ENDCALL command");
+        return;
+    }
+    chat->onEndCall(userid, clientid);
+}
+
+void Connection::recvCallData(CommandCtx& ctx)
+{
+    READ_CHATID(0);
+    READ_ID(userid, 8);
+    READ_32(clientid, 16);
+    READ_16(payloadLen, 20);
+    CHATDS_LOG_DEBUG("%s: recv CALLDATA userid: %s, clientid: %x, PayloadLen: %d", ID_CSTR(ctx.chatid), ID_CSTR(userid), clientid, payloadLen);
+    ctx.pos += payloadLen; // payload bytes will be consumed by handleCallData(), but does not update `pos` pointer
 
 #ifndef KARERE_DISABLE_WEBRTC
-                if (mChatdClient.mRtcHandler && userid != mChatdClient.mKarereClient->myHandle())
-                {
-                    StaticBuffer cmd(buf.buf() + 23, payloadLen);
-                    auto& chat = mChatdClient.chats(chatid);                    
-                    // TODO: remove this block once the groucalls are fully supported by clients
-                    if ((chat.isGroup() && !mChatdClient.mKarereClient->areGroupCallsEnabled()))
-                    {
-                        CHATDS_LOG_DEBUG("Groupcalls are disabled, ignoring CALLDATA command");
-                        break;
-                    }
-                    mChatdClient.mRtcHandler->handleCallData(chat, chatid, userid, clientid, cmd);
-                }
+    if (mChatdClient.mRtcHandler && userid != mChatdClient.mKarereClient->myHandle())
+    {
+        StaticBuffer cmd(ctx.buf.buf() + 23, payloadLen);
+        Chat* chat = chatForCommand(ctx, kLazyCreateAndHandle);
+        if (!chat)
+            return;
+        // TODO: remove this block once the groucalls are fully supported by clients
+        if ((chat->isGroup() && !mChatdClient.mKarereClient->areGroupCallsEnabled()))
+        {
+            CHATDS_LOG_DEBUG("Groupcalls are disabled, ignoring CALLDATA command");
+            return;
+        }
+        mChatdClient.mRtcHandler->handleCallData(*chat, ctx.chatid, userid, clientid, cmd);
+    }
 #else
-                READ_ID(callid, 22);
-                READ_8(state, 30);
-                if (state == rtcModule::kCallDataRinging) // Ringing state
-                {
-                    sendCallReqDeclineNoSupport(chatid, callid);
-                }
+    READ_ID(callid, 22);
+    READ_8(state, 30);
+    if (state == rtcModule::kCallDataRinging) // Ringing state
+    {
+        sendCallReqDeclineNoSupport(ctx.chatid, callid);
+    }
+
+    ctx.pos += payloadLen - 9;  // 9 -> callid(8) + state(1)
+#endif
+}
+
+void Connection::recvRtMessage(CommandCtx& ctx)
+{
+    //opcode.1 chatid.8 userid.8 clientid.4 len.2 data.len
+    READ_CHATID(0);
+    size_t cmdstart = ctx.pos - 9; //pos points after opcode
+    (void)cmdstart; //disable unused var warning if webrtc is disabled
+    READ_ID(userid, 8);
+    READ_32(clientid, 16);
+    (void)clientid; //disable unused var warning if webrtc is enabled
+    READ_16(payloadLen, 20);
+    ctx.pos += payloadLen; //skip the payload
+#ifndef KARERE_DISABLE_WEBRTC
+    StaticBuffer cmd(ctx.buf.buf() + cmdstart, 23 + payloadLen);
+    CHATDS_LOG_DEBUG("%s: recv %s", ID_CSTR(ctx.chatid), ::rtcModule::rtmsgCommandToString(cmd).c_str());
+    Chat* chat = chatForCommand(ctx, kLazyCreateAndHandle);
+    if (!chat)
+        return;
+    if (mChatdClient.mRtcHandler)
+    {
+        mChatdClient.mRtcHandler->handleMessage(*chat, cmd);
+    }
+#else
+    CHATDS_LOG_DEBUG("%s: recv %s userid: %s, clientid: %x", ID_CSTR(ctx.chatid), Command::opcodeToStr(ctx.opcode), ID_CSTR(userid), clientid);
+#endif
+}
+
+void Connection::recvClientId(CommandCtx& ctx)
+{
+    // clientid.4 reserved.4
+    READ_32(clientid, 0);
+    mClientId = clientid;
+    CHATDS_LOG_DEBUG("recv CLIENTID - %x", clientid);
+}
+
+void Connection::recvEcho(CommandCtx& /*ctx*/)
+{
+    CHATDS_LOG_DEBUG("recv ECHO");
+    if (mEchoTimer)
+    {
+        CHATDS_LOG_DEBUG("Socket is still alive");
+        cancelTimeout(mEchoTimer, mChatdClient.mKarereClient->appCtx);
+        mEchoTimer = 0;
+    }
+}
+
+void Connection::recvReaction(CommandCtx& ctx)
+{
+    //TODO: to be implemented
+    READ_CHATID(0);
+    READ_ID(userid, 8);
+    READ_ID(msgid, 16);
+    READ_32(reaction, 24);
+    CHATDS_LOG_DEBUG("%s: recv %s from user %s to message %s reaction %d",
+                    ID_CSTR(ctx.chatid), Command::opcodeToStr(ctx.opcode),
+                    ID_CSTR(userid), ID_CSTR(msgid), reaction);
+}
 
-                pos += payloadLen - 9;  // 9 -> callid(8) + state(1)
-#endif
+void Connection::recvSync(CommandCtx& ctx)
+{
+    READ_CHATID(0);
+    CHATDS_LOG_DEBUG("%s: recv SYNC", ID_CSTR(ctx.chatid));
+    mChatdClient.mKarereClient->onSyncReceived(ctx.chatid);
+}
 
-                break;
-            }
-            case OP_RTMSG_ENDPOINT:
-            case OP_RTMSG_USER:
-            case OP_RTMSG_BROADCAST:
-            {
-                //opcode.1 chatid.8 userid.8 clientid.4 len.2 data.len
-                READ_CHATID(0);
-                size_t cmdstart = pos - 9; //pos points after opcode
-                (void)cmdstart; //disable unused var warning if webrtc is disabled
-                READ_ID(userid, 8);
-                READ_32(clientid, 16);
-                (void)clientid; //disable unused var warning if webrtc is enabled
-                READ_16(payloadLen, 20);
-                pos += payloadLen; //skip the payload
-#ifndef KARERE_DISABLE_WEBRTC
-                auto& chat = mChatdClient.chats(chatid);
-                StaticBuffer cmd(buf.buf() + cmdstart, 23 + payloadLen);
-                CHATDS_LOG_DEBUG("%s: recv %s", ID_CSTR(chatid), ::rtcModule::rtmsgCommandToString(cmd).c_str());
-                if (mChatdClient.mRtcHandler)
-                {
-                    mChatdClient.mRtcHandler->handleMessage(chat, cmd);
-                }
-#else
-                CHATDS_LOG_DEBUG("%s: recv %s userid: %s, clientid: %x", ID_CSTR(chatid), Command::opcodeToStr(opcode), ID_CSTR(userid), clientid);
-#endif
-                break;
-            }
-            case OP_CLIENTID:
-            {
-                // clientid.4 reserved.4
-                READ_32(clientid, 0);
-                mClientId = clientid;
-                CHATDS_LOG_DEBUG("recv CLIENTID - %x", clientid);
-                break;
-            }
-            case OP_ECHO:
-            {
-                CHATDS_LOG_DEBUG("recv ECHO");
-                if (mEchoTimer)
-                {
-                    CHATDS_LOG_DEBUG("Socket is still alive");
-                    cancelTimeout(mEchoTimer, mChatdClient.mKarereClient->appCtx);
-                    mEchoTimer = 0;
-                }
-                break;
-            }
-            case OP_ADDREACTION:
-            {
-                //TODO: to be implemented
-                READ_CHATID(0);
-                READ_ID(userid, 8);
-                READ_ID(msgid, 16);
-                READ_32(reaction, 24);
-                CHATDS_LOG_DEBUG("%s: recv ADDREACTION from user %s to message %s reaction %d",
-                                ID_CSTR(chatid), ID_CSTR(userid), ID_CSTR(msgid), reaction);
-                break;
-            }
-            case OP_DELREACTION:
-            {
-                //TODO: to be implemented
-                READ_CHATID(0);
-                READ_ID(userid, 8);
-                READ_ID(msgid, 16);
-                READ_32(reaction, 24);
-                CHATDS_LOG_DEBUG("%s: recv DELREACTION from user %s to message %s reaction %d",
-                                ID_CSTR(chatid), ID_CSTR(userid), ID_CSTR(msgid), reaction);
-                break;
-            }
-            case OP_SYNC:
-            {
-                READ_CHATID(0);
-                CHATDS_LOG_DEBUG("%s: recv SYNC", ID_CSTR(chatid));
-                mChatdClient.mKarereClient->onSyncReceived(chatid);
-                break;
-            }
-            case OP_CALLTIME:
-            {
-                READ_CHATID(0);
-                READ_32(duration, 8);
-                CHATDS_LOG_DEBUG("%s: recv CALLTIME: %d", ID_CSTR(chatid), duration);
+void Connection::recvCallTime(CommandCtx& ctx)
+{
+    READ_CHATID(0);
+    READ_32(duration, 8);
+    CHATDS_LOG_DEBUG("%s: recv CALLTIME: %d", ID_CSTR(ctx.chatid), duration);
 #ifndef KARERE_DISABLE_WEBRTC
-                if (mChatdClient.mRtcHandler)
-                {
-                    auto& chat = mChatdClient.chats(chatid);
-                    if (!chat.isGroup() || (chat.isGroup() && mChatdClient.mKarereClient->areGroupCallsEnabled()))
-                    {
-                        mChatdClient.mRtcHandler->handleCallTime(chatid, duration);
-                    }
-                    else
-                    {
-                        CHATDS_LOG_DEBUG("Skip command");
-                    }
-                }
-#endif
-                break;
-            }
-            default:
-            {
-                CHATDS_LOG_ERROR("Unknown opcode %d, ignoring all subsequent commands", opcode);
-                return;
-            }
-        }
-      }
-      catch(BufferRangeError& e)
-      {
-            CHATDS_LOG_ERROR("%s: Buffer bound check error while parsing %s:\n\t%s\n\tAborting command processing", ID_CSTR(chatid), Command::opcodeToStr(opcode), e.what());
+    if (mChatdClient.mRtcHandler)
+    {
+        Chat* chat = chatForCommand(ctx, kLazyIgnore);
+        if (!chat)
             return;
-      }
-      catch(std::exception& e)
-      {
-            CHATDS_LOG_ERROR("%s: Exception while processing incoming %s: %s", ID_CSTR(chatid), Command::opcodeToStr(opcode), e.what());
-      }
+        if (!chat->isGroup() || (chat->isGroup() && mChatdClient.mKarereClient->areGroupCallsEnabled()))
+        {
+            mChatdClient.mRtcHandler->handleCallTime(ctx.chatid, duration);
+        }
+        else
+        {
+            CHATDS_LOG_DEBUG("Skip command");
+        }
     }
+#endif
 }
 
 void Chat::onNewKeys(StaticBuffer&& keybuf)
 {
     size_t pos = 0;
     size_t size = keybuf.dataSize();
+
+    // the keys from each sender are decrypted with their own public keys, so
+    // request the public keys of all senders before decrypting the first key
+    SetOfIds senders;
+    while ((pos + 14) < size)
+    {
+        senders.insert(Id(keybuf.read<uint64_t>(pos)));
+        uint16_t keylen = keybuf.read<uint16_t>(pos + 12);
+        pos += 14 + keylen;
+    }
+    if (!senders.empty())
+    {
+        CALL_CRYPTO(prefetchSenderKeys, senders);
+    }
+
+    pos = 0;
     while ((pos + 14) < size)
     {
         Id userid(keybuf.read<uint64_t>(pos));          pos += 8;
@@ -1893,6 +2353,9 @@ void Chat::onHistDone()
     mFetchRequest.pop();
     if (fetchType == FetchType::kFetchMessages)
     {
+        // messages decrypted from now on are not part of the batch anymore
+        endHistoryBatch();
+
         // We may be fetching from memory and db because of a resetHistFetch()
         // while fetching from server. In that case, we don't notify about
         // fetched messages and onHistDone()
@@ -1955,6 +2418,11 @@ void Chat::onFetchHistDone()
             mAttachmentNodes->setHaveAllHistory(true);
             CALL_DB(setHaveAllHistory, true);
             CHATID_LOG_DEBUG("Start of history reached");
+            if (mLastSeenIdx == CHATD_IDX_INVALID)
+            {
+                // all messages are unread, so the minimum count is now the exact one
+                setUnreadMsgCount(-mUnreadCount);
+            }
             //last text msg stuff
             if (mLastTextMsg.isFetching())
             {
@@ -1997,6 +2465,12 @@ void Chat::loadAndProcessUnsent()
     if (mSending.empty())
         return;
 
+    uint64_t seq = 0;
+    for (auto& item: mSending)
+    {
+        item.seq = seq++;
+    }
+
     mNextUnsent = mSending.begin();
     replayUnsentNotifications();
 
@@ -2088,6 +2562,7 @@ void Chat::clearHistory()
 {
     initChat();
     CALL_DB(clearHistory);
+    CALL_DB(setUnreadCount, mUnreadCount);
     CALL_CRYPTO(onHistoryReload);
     CALL_LISTENER(onHistoryReloaded);
 }
@@ -2177,19 +2652,17 @@ void Chat::onEndCall(karere::Id userid, uint32_t clientid)
 
 void Chat::initChat()
 {
-    mBackwardList.clear();
-    mForwardList.clear();
+    mHistory.clear(CHATD_IDX_RANGE_MIDDLE);
     mIdToIndexMap.clear();
     if (mAttachmentNodes)
     {
         mAttachmentNodes->clear();
     }
 
-    mForwardStart = CHATD_IDX_RANGE_MIDDLE;
-
     mOldestKnownMsgId = 0;
     mLastSeenIdx = CHATD_IDX_INVALID;
     mLastReceivedIdx = CHATD_IDX_INVALID;
+    mUnreadCount = 0;
     mNextHistFetchIdx = CHATD_IDX_INVALID;
     mLastIdReceivedFromServer = 0;
     mLastIdxReceivedFromServer = CHATD_IDX_INVALID;
@@ -2198,6 +2671,8 @@ void Chat::initChat()
 
     mLastTextMsg.clear();
     mEncryptionHalted = false;
+    mEncryptionHaltedItem = nullptr;
+    discardEncryptedAhead();
     mDecryptNewHaltedAt = CHATD_IDX_INVALID;
     mDecryptOldHaltedAt = CHATD_IDX_INVALID;
     mRefidToIdxMap.clear();
@@ -2454,27 +2929,14 @@ void Chat::msgSubmit(Message* msg, SetOfIds recipients)
 
 void Chat::createMsgBackRefs(Chat::OutputQueue::iterator msgit)
 {
-#ifndef _MSC_VER
-    static std::uniform_int_distribution<uint8_t>distrib(0, 0xff);
-#else
-//MSVC has a bug - no char template argument allowed
-    static std::uniform_int_distribution<uint32_t>distrib(0,0xff);
-#endif
-
-    static std::random_device rd;
+    // A fast generator seeded once: reading std::random_device for every backref
+    // may be a syscall, and a big offline send queue is encrypted in one go
+    static std::mt19937 rng(std::random_device{}());
 
-    // mSending is a list, so we don't have random access by index there.
-    // Therefore, we copy the relevant part of it to a vector
-    std::vector<SendingItem*> sendingIdx;
-    sendingIdx.reserve(mSending.size());
-    auto next = msgit;
-    next++;
-    for (auto it = mSending.begin(); it != next; it++)
-    {
-        sendingIdx.push_back(&(*it));
-    }
-
-    Idx maxEnd = size() - sendingIdx.size();
+    // Position of the message in the sending queue. Only the (at most 64) items
+    // preceding it are visited, walking back the list from it
+    Idx sendingCount = sendingPos(msgit);
+    Idx maxEnd = size() - sendingCount;
     if (maxEnd <= 0)
     {
         return;
@@ -2484,6 +2946,8 @@ void Chat::createMsgBackRefs(Chat::OutputQueue::iterator msgit)
     // The exact message in these ranges is picked randomly
     // The ranges (as backward offsets from the current message's position) are:
     // 1<<0 - 1<<1, 1<<1 - 1<<2, 1<<2 - 1<<3, etc
+    auto sendingIt = msgit;     // item of the sending queue at offset sendingOffset
+    Idx sendingOffset = 0;
     Idx rangeStart = 0;
     for (uint8_t i = 0; i < 7; i++)
     {
@@ -2502,24 +2966,35 @@ void Chat::createMsgBackRefs(Chat::OutputQueue::iterator msgit)
         Idx idx;
         if (span > 1)
         {
-            idx = rangeStart + (distrib(rd) % span);
+            idx = rangeStart + (rng() & 0xff) % span;
         }
         else
         {
             idx = rangeStart;
         }
 
-        Message &msg = (idx < (Idx)sendingIdx.size())
-                ? *(sendingIdx[sendingIdx.size()-1-idx]->msg)   // msg is from sending queue
-                : at(highnum()-(idx-sendingIdx.size()));        // msg is from history buffer
+        Message* msg;
+        if (idx < sendingCount) // msg is from sending queue
+        {
+            // offsets only grow from one range to the next, so keep walking back
+            for (; sendingOffset < idx; sendingOffset++)
+            {
+                sendingIt--;
+            }
+            msg = sendingIt->msg;
+        }
+        else    // msg is from history buffer
+        {
+            msg = &at(highnum()-(idx-sendingCount));
+        }
 
-        if (!msg.isManagementMessage()) // management-msgs don't have a valid backrefid
+        if (!msg->isManagementMessage()) // management-msgs don't have a valid backrefid
         {
-            msgit->msg->backRefs.push_back(msg.backRefId);
+            msgit->msg->backRefs.push_back(msg->backRefId);
         }
         else
         {
-            CHATID_LOG_WARNING("Skipping backrefid for a management message: %s", ID_CSTR(msg.id()));
+            CHATID_LOG_WARNING("Skipping backrefid for a management message: %s", ID_CSTR(msg->id()));
             // TODO: instead of skipping the backrefid for this range, we should try to find another
             // message with a valid backrefid within the current range
         }
@@ -2533,6 +3008,15 @@ void Chat::createMsgBackRefs(Chat::OutputQueue::iterator msgit)
     }
 }
 
+Chat::OutputQueue::iterator Chat::eraseFromSending(OutputQueue::iterator it)
+{
+    for (auto next = std::next(it); next != mSending.end(); next++)
+    {
+        next->seq--;
+    }
+    return mSending.erase(it);
+}
+
 Chat::SendingItem* Chat::postMsgToSending(uint8_t opcode, Message* msg, SetOfIds recipients)
 {
     // for NEWMSG/NEWNODEMSG, recipients is always current set of participants
@@ -2542,14 +3026,29 @@ Chat::SendingItem* Chat::postMsgToSending(uint8_t opcode, Message* msg, SetOfIds
            || (opcode == OP_MSGUPDX)    // can use unconfirmed or confirmed key
            || (opcode == OP_MSGUPD && !isLocalKeyId(msg->keyid)));
 
+    uint64_t seq = mSending.empty() ? 0 : mSending.back().seq + 1;
     mSending.emplace_back(opcode, msg, recipients);
-    CALL_DB(addSendingItem, mSending.back());
+    SendingItem& item = mSending.back();
+    item.seq = seq;
     if (mNextUnsent == mSending.end())
     {
         mNextUnsent--;
     }
+    // encrypt it before writing it to db, so that (usually) its commands are
+    // written in the same row insert instead of updating it afterwards. It's
+    // sent after the insert, so chatd never has a message missing in the db
+    if (mNextUnsent == std::prev(mSending.end()) && !mEncryptionHalted && !mConnection.wsIsSendQueueFull())
+    {
+        msgEncrypt(mNextUnsent);
+        if (!item.msgCmd)
+        {
+            // waiting for a new key, it will be sent with it
+            mNextUnsent++;
+        }
+    }
+    CALL_DB(addSendingItem, item);
     flushOutputQueue();
-    return &mSending.back();
+    return &item;
 }
 
 bool Chat::sendKeyAndMessage(std::pair<MsgCommand*, KeyCommand*> cmd)
@@ -2565,12 +3064,34 @@ bool Chat::sendKeyAndMessage(std::pair<MsgCommand*, KeyCommand*> cmd)
 
 bool Chat::msgEncryptAndSend(OutputQueue::iterator it)
 {
-    if (it->msgCmd)
+    if (mEncryptionHalted)
     {
-        sendKeyAndMessage(std::make_pair(it->msgCmd, it->keyCmd));
-        return true;
+        // the items before the one waiting for the new key are sent again after a rejoin
+        if (it->msgCmd && it->seq < mEncryptionHaltedItem->seq)
+        {
+            sendKeyAndMessage(std::make_pair(it->msgCmd, it->keyCmd));
+            return true;
+        }
+        return msgEncryptAhead(it);
+    }
+
+    if (!it->msgCmd)
+    {
+        msgEncrypt(it);
+        if (!it->msgCmd)
+        {
+            //we don't sent a msgStatusChange event to the listener, as the GUI should initialize the
+            //message's status with something already, so it's redundant.
+            //The GUI should by default show it as sending
+            return true;
+        }
     }
+    sendKeyAndMessage(std::make_pair(it->msgCmd, it->keyCmd));
+    return true;
+}
 
+void Chat::msgEncrypt(OutputQueue::iterator it)
+{
     Message* msg = it->msg;
     uint64_t rowid = it->rowid;
     assert(msg->id());
@@ -2581,9 +3102,6 @@ bool Chat::msgEncryptAndSend(OutputQueue::iterator it)
         createMsgBackRefs(it);  // only for new messages
     }
 
-    if (mEncryptionHalted)
-        return false;
-
     auto msgCmd = new MsgCommand(it->opcode(), mChatId, client().myHandle(),
          msg->id(), msg->ts, msg->updated);
 
@@ -2600,48 +3118,136 @@ bool Chat::msgEncryptAndSend(OutputQueue::iterator it)
 
         it->msgCmd = pms.value().first;
         it->keyCmd = pms.value().second;
-        CALL_DB(addBlobsToSendingItem, rowid, it->msgCmd, it->keyCmd, msg->keyid);
-
-        sendKeyAndMessage(pms.value());
-        return true;
+        if (rowid)  // otherwise, it's a new item and the commands are written with it
+        {
+            CALL_DB(addBlobsToSendingItem, rowid, it->msgCmd, it->keyCmd, msg->keyid);
+        }
+        return;
     }
     // else --> new key is required: KeyCommand != NULL in pms.value()
 
     mEncryptionHalted = true;
+    uint32_t haltId = ++mEncryptionHaltId;
+    assert(mEncryptedAhead.empty());
     CHATID_LOG_DEBUG("Can't encrypt message immediately, halting output");
 
-    pms.then([this, msg, rowid](std::pair<MsgCommand*, KeyCommand*> result)
+    SendingItem* item = &(*it);
+    mEncryptionHaltedItem = item;
+    auto wptr = weakHandle();
+    pms.then([this, wptr, item, msg, haltId](std::pair<MsgCommand*, KeyCommand*> result)
     {
-        assert(mEncryptionHalted);
-        assert(!mSending.empty());
-
         MsgCommand *msgCmd = result.first;
         KeyCommand *keyCmd = result.second;
+        if (wptr.deleted() || haltId != mEncryptionHaltId || !mEncryptionHalted)
+        {
+            // the output was reset meanwhile, the message will be encrypted again
+            delete msgCmd;
+            delete keyCmd;
+            return;
+        }
+
+        assert(!mSending.empty());
         assert(keyCmd);
         assert(keyCmd->localKeyid() == msg->keyid);
         assert(msgCmd->keyId() == CHATD_KEYID_UNCONFIRMED);
 
-        SendingItem &item = mSending.front();
-        item.msgCmd = msgCmd;
-        item.keyCmd = keyCmd;
-        CALL_DB(addBlobsToSendingItem, rowid, item.msgCmd, item.keyCmd, msg->keyid);
+        item->msgCmd = msgCmd;
+        item->keyCmd = keyCmd;
+        CALL_DB(addBlobsToSendingItem, item->rowid, item->msgCmd, item->keyCmd, msg->keyid);
+
+        // the NEWKEY, its message and the messages encrypted ahead go in a single frame
+        Buffer frame(keyCmd->dataSize() + msgCmd->dataSize() * (mEncryptedAhead.size() + 1));
+        frame.append(*keyCmd).append(*msgCmd);
+        CHATID_LOG_DEBUG("send %s", keyCmd->toString().c_str());
+        CHATID_LOG_DEBUG("send %s", msgCmd->toString().c_str());
+        for (auto& ahead: mEncryptedAhead)
+        {
+            auto aheadItem = ahead.first;
+            aheadItem->msgCmd = ahead.second;
+            CALL_DB(addBlobsToSendingItem, aheadItem->rowid, aheadItem->msgCmd, nullptr, aheadItem->msg->keyid);
+            frame.append(*aheadItem->msgCmd);
+            CHATID_LOG_DEBUG("send %s", aheadItem->msgCmd->toString().c_str());
+        }
+        if (!mEncryptedAhead.empty())
+        {
+            CHATID_LOG_DEBUG("Sending the new key with %zu messages encrypted ahead", mEncryptedAhead.size());
+            mEncryptedAhead.clear();
+        }
+        if (!mConnection.sendBuf(std::move(frame)))
+        {
+            CHATID_LOG_DEBUG("  Can't send, we are offline");
+        }
 
-        sendKeyAndMessage(result);
         mEncryptionHalted = false;
+        mEncryptionHaltedItem = nullptr;
         flushOutputQueue();
     });
 
-    pms.fail([this, msg, msgCmd](const ::promise::Error& err)
+    pms.fail([this, wptr, msg, msgCmd, haltId](const ::promise::Error& err)
     {
-        CHATID_LOG_ERROR("ICrypto::encrypt error encrypting message %s: %s", ID_CSTR(msg->id()), err.what());
         delete msgCmd;
+        if (wptr.deleted())
+            return err;
+
+        CHATID_LOG_ERROR("ICrypto::encrypt error encrypting message %s: %s", ID_CSTR(msg->id()), err.what());
+        if (haltId == mEncryptionHaltId)
+        {
+            discardEncryptedAhead();
+        }
         return err;
     });
+}
 
-    return false;
-    //we don't sent a msgStatusChange event to the listener, as the GUI should initialize the
-    //message's status with something already, so it's redundant.
-    //The GUI should by default show it as sending
+bool Chat::msgEncryptAhead(OutputQueue::iterator it)
+{
+    // Only new messages can be encrypted ahead, and only if they would use the key
+    // being prepared. Edits need the keyid of the message they edit, and commands
+    // already encrypted with other keys must not overtake the NEWKEY
+    Message* msg = it->msg;
+    if (it->msgCmd
+        || (it->opcode() != OP_NEWMSG && it->opcode() != OP_NEWNODEMSG)
+        || msg->keyid != CHATD_KEYID_INVALID
+        || !mCrypto->hasSendKeyFor(it->recipients))
+    {
+        return false;
+    }
+
+    if (msg->backRefs.empty())
+    {
+        createMsgBackRefs(it);
+    }
+
+    auto msgCmd = new MsgCommand(it->opcode(), mChatId, client().myHandle(),
+         msg->id(), msg->ts, msg->updated);
+
+    CHATD_LOG_CRYPTO_CALL("Calling ICrypto::encrypt() ahead of a new key");
+    auto pms = mCrypto->msgEncrypt(msg, it->recipients, msgCmd);
+    if (!pms.succeeded())
+    {
+        // hasSendKeyFor() guarantees that the message is encrypted immediately
+        CHATID_LOG_ERROR("msgEncryptAhead: message %s was not encrypted immediately", ID_CSTR(msg->id()));
+        assert(false);
+        return false;
+    }
+    assert(!pms.value().second);
+
+    mEncryptedAhead.emplace_back(it, pms.value().first);
+    return true;
+}
+
+void Chat::discardEncryptedAhead()
+{
+    if (mEncryptedAhead.empty())
+        return;
+
+    for (auto& ahead: mEncryptedAhead)
+    {
+        // encrypt it again, with whatever key is current by then
+        ahead.first->msg->keyid = CHATD_KEYID_INVALID;
+        delete ahead.second;
+    }
+    mNextUnsent = mEncryptedAhead.front().first;
+    mEncryptedAhead.clear();
 }
 
 // Can be called for a message in history or a NEWMSG,MSGUPD,MSGUPDX message in sending queue
@@ -2877,11 +3483,15 @@ void Chat::onLastSeen(Id msgid)
         //notify about messages that have become 'seen'
         Idx  notifyOldest = oldLastSeenIdx + 1;
         Idx low = lownum();
+
+        // the unread count can be updated only if all the messages that became seen are in RAM
+        bool allSeenInRam = (oldLastSeenIdx != CHATD_IDX_INVALID) && (notifyOldest >= low);
         if (notifyOldest < low) // consider only messages in RAM
         {
             notifyOldest = low;
         }
 
+        int seenCount = 0;
         for (Idx i = notifyOldest; i <= mLastSeenIdx; i++)
         {
             auto& msg = at(i);
@@ -2889,6 +3499,19 @@ void Chat::onLastSeen(Id msgid)
             {
                 CALL_LISTENER(onMessageStatusChange, i, Message::kSeen, msg);
             }
+            if (msg.isValidUnread(mChatdClient.mMyHandle))
+            {
+                seenCount++;
+            }
+        }
+
+        if (!allSeenInRam)
+        {
+            recalculateUnreadMsgCount();
+        }
+        else
+        {
+            setUnreadMsgCount(mUnreadCount - seenCount);
         }
     }
 
@@ -2924,19 +3547,23 @@ bool Chat::setMessageSeen(Idx idx)
         sendCommand(Command(OP_SEEN) + mChatId + id);
 
         Idx notifyStart;
+        bool allSeenInRam;
         if (mLastSeenIdx == CHATD_IDX_INVALID)
         {
             notifyStart = lownum()-1;
+            allSeenInRam = false;
         }
         else
         {
             Idx lowest = lownum()-1;
-            notifyStart = (mLastSeenIdx < lowest) ? lowest : mLastSeenIdx;
+            allSeenInRam = (mLastSeenIdx >= lowest);
+            notifyStart = allSeenInRam ? mLastSeenIdx : lowest;
         }
         mLastSeenIdx = idx;
         Idx highest = highnum();
         Idx notifyEnd = (mLastSeenIdx > highest) ? highest : mLastSeenIdx;
 
+        int seenCount = 0;
         for (Idx i=notifyStart+1; i<=notifyEnd; i++)
         {
             auto& m = at(i);
@@ -2944,9 +3571,21 @@ bool Chat::setMessageSeen(Idx idx)
             {
                 CALL_LISTENER(onMessageStatusChange, i, Message::kSeen, m);
             }
+            if (m.isValidUnread(mChatdClient.mMyHandle))
+            {
+                seenCount++;
+            }
         }
         mLastSeenId = id;
         CALL_DB(setLastSeen, mLastSeenId);
+        if (!allSeenInRam)
+        {
+            recalculateUnreadMsgCount();
+        }
+        else
+        {
+            setUnreadMsgCount(mUnreadCount - seenCount);
+        }
         CALL_LISTENER(onUnreadChanged);
     }, kSeenTimeout, mChatdClient.mKarereClient->appCtx);
 
@@ -2967,6 +3606,47 @@ bool Chat::setMessageSeen(Id msgid)
 }
 
 int Chat::unreadMsgCount() const
+{
+    return mUnreadCount;
+}
+
+bool Chat::checkUnreadMsgCount()
+{
+    int count = calculateUnreadMsgCount();
+    if (count != mUnreadCount)
+    {
+        CHATID_LOG_ERROR("checkUnreadMsgCount: cached unread count is %d, but it should be %d. Fixing it", mUnreadCount, count);
+        setUnreadMsgCount(count);
+        return false;
+    }
+    return true;
+}
+
+void Chat::setUnreadMsgCount(int count)
+{
+    if (count == mUnreadCount)
+        return;
+
+    mUnreadCount = count;
+    CALL_DB(setUnreadCount, count);
+}
+
+void Chat::recalculateUnreadMsgCount()
+{
+    setUnreadMsgCount(calculateUnreadMsgCount());
+}
+
+void Chat::updateUnreadMsgCount(Idx idx, int delta)
+{
+    if ((mLastSeenIdx != CHATD_IDX_INVALID) && (idx <= mLastSeenIdx))
+        return; // a seen message doesn't count
+
+    // if the last-seen message is not known yet, the count is a minimum and it's negative
+    bool isMinimum = (mLastSeenIdx == CHATD_IDX_INVALID) && !mHaveAllHistory;
+    setUnreadMsgCount(isMinimum ? (mUnreadCount - delta) : (mUnreadCount + delta));
+}
+
+int Chat::calculateUnreadMsgCount() const
 {
     if (mLastSeenIdx == CHATD_IDX_INVALID)
     {
@@ -3005,10 +3685,18 @@ void Chat::flushOutputQueue(bool fromStart)
 
     while (mNextUnsent != mSending.end())
     {
-        //kickstart encryption
-        //return true if we encrypted at least one message
-        if (!msgEncryptAndSend(mNextUnsent++))
+        // the connection resumes the flush when its output queue drains
+        if (mConnection.wsIsSendQueueFull())
+        {
+            CHATID_LOG_DEBUG("flushOutputQueue: output queue of the connection is full, pausing");
+            return;
+        }
+
+        // the item stays as the next unsent one if it can't be encrypted yet
+        if (!msgEncryptAndSend(mNextUnsent))
             return;
+
+        mNextUnsent++;
     }
 }
 
@@ -3018,7 +3706,7 @@ void Chat::moveItemToManualSending(OutputQueue::iterator it, ManualSendReason re
     CALL_DB(saveItemToManualSending, *it, reason);
     CALL_LISTENER(onManualSendRequired, it->msg, it->rowid, reason); //GUI should put this message at end of that list of messages requiring 'manual' resend
     it->msg = nullptr; //don't delete the Message object, it will be owned by the app
-    mSending.erase(it);
+    eraseFromSending(it);
 }
 
 void Chat::removeManualSend(uint64_t rowid)
@@ -3160,7 +3848,8 @@ Idx Chat::msgConfirm(Id msgxid, Id msgid)
     assert(!msg->isLocalKeyid());
 
     // add message to history
-    push_forward(msg);
+    msg = push_forward(msg);
+    mHistory.pack(highnum());
     auto idx = mIdToIndexMap[msgid] = highnum();
     CALL_DB(addMsgToHistory, *msg, idx);
 
@@ -3287,6 +3976,7 @@ void Chat::onHistReject()
 {
     CHATID_LOG_WARNING("HIST was rejected, setting chat offline and disabling it");
     assert(false);  // chatd should not REJECT a HIST, it indicates a more critical issue
+    endHistoryBatch();
     mServerFetchState = kHistNotFetching;
     setOnlineState(kChatStateOffline);
     disable(true);
@@ -3375,7 +4065,7 @@ void Chat::onMsgUpdated(Message* cipherMsg)
             auto erased = it;
             it++;
             mPendingEdits.erase(cipherMsg->id());
-            mSending.erase(erased);
+            eraseFromSending(erased);
             updateTs = item.msg->updated;
             richLinkRemoved = item.msg->richLinkRemoved;
         }
@@ -3424,12 +4114,12 @@ void Chat::onMsgUpdated(Message* cipherMsg)
     .then([this, updateTs, richLinkRemoved](Message* msg)
     {
         assert(!msg->isPendingToDecrypt()); //either decrypted or error
-        if (!msg->empty() && msg->type == Message::kMsgNormal && (*msg->buf() == 0))
+        if (!msg->empty() && msg->type == Message::kMsgNormal && (msg->read<uint8_t>(0) == 0))
         {
             if (msg->dataSize() < 2)
                 CHATID_LOG_ERROR("onMsgUpdated: Malformed special message received - starts with null char received, but its length is 1. Assuming type of normal message");
             else
-                msg->type = msg->buf()[1] + Message::Type::kMsgOffset;
+                msg->type = msg->read<uint8_t>(1) + Message::Type::kMsgOffset;
         }
 
         //update in memory, if loaded
@@ -3470,6 +4160,7 @@ void Chat::onMsgUpdated(Message* cipherMsg)
             CALL_DB(updateMsgInHistory, msg->id(), *msg);
 
             // update in RAM
+            bool wasUnread = histmsg.isValidUnread(mChatdClient.mMyHandle);
             histmsg.assign(*msg);     // content
             histmsg.updated = msg->updated;
             histmsg.type = msg->type;
@@ -3479,6 +4170,7 @@ void Chat::onMsgUpdated(Message* cipherMsg)
             {
                 histmsg.ts = msg->ts;   // truncates update the `ts` instead of `update`
             }
+            mHistory.updateRamSize(idx);
 
             if (idx > mNextHistFetchIdx)
             {
@@ -3490,13 +4182,15 @@ void Chat::onMsgUpdated(Message* cipherMsg)
                 CHATID_LOG_DEBUG("onMessageEdited() skipped for not-loaded-yet (by the app) message");
             }
 
-            if (msg->isDeleted())
+            bool isUnread = histmsg.isValidUnread(mChatdClient.mMyHandle);
+            if (isUnread != wasUnread)
             {
-                if (!msg->isOwnMessage(client().myHandle()))
-                {
-                    CALL_LISTENER(onUnreadChanged);
-                }
+                updateUnreadMsgCount(idx, isUnread ? 1 : -1);
+                CALL_LISTENER(onUnreadChanged);
+            }
 
+            if (msg->isDeleted())
+            {
                 if (histType == Message::kMsgAttachment)
                 {
                     mAttachmentNodes->deleteMessage(*msg);
@@ -3532,6 +4226,18 @@ void Chat::onMsgUpdated(Message* cipherMsg)
             {
                 //update in db
                 CALL_DB(updateMsgInHistory, msg->id(), *msg);
+
+                // the message is older than the ones in RAM, so it's unread only if the
+                // last-seen message is not in RAM either
+                if ((mLastSeenIdx == CHATD_IDX_INVALID) || (mLastSeenIdx < lownum()))
+                {
+                    int unreadCount = mUnreadCount;
+                    recalculateUnreadMsgCount();
+                    if (unreadCount != mUnreadCount)
+                    {
+                        CALL_LISTENER(onUnreadChanged);
+                    }
+                }
             }
 
             if (msg->isDeleted()) // previous type is unknown, so cannot check for attachment type here
@@ -3574,7 +4280,7 @@ void Chat::handleTruncate(const Message& msg, Idx idx)
 // To avoid this, we have to detect the replay. But if we detect it, we can actually
 // avoid the whole replay (even the idempotent part), and just bail out.
 
-    CHATID_LOG_DEBUG("Truncating chat history before msgid %s, idx %d, fwdStart %d", ID_CSTR(msg.id()), idx, mForwardStart);
+    CHATID_LOG_DEBUG("Truncating chat history before msgid %s, idx %d, lownum %d", ID_CSTR(msg.id()), idx, lownum());
     CALL_CRYPTO(resetSendKey);      // discard current key, if any
     CALL_DB(truncateHistory, msg);
     if (idx != CHATD_IDX_INVALID)   // message is loaded in RAM
@@ -3627,6 +4333,8 @@ void Chat::handleTruncate(const Message& msg, Idx idx)
     // if truncate was received for a message not loaded in RAM, we may have more history in DB
     mHasMoreHistoryInDb = at(lownum()).id() != mOldestKnownMsgId;
 
+    // the seen pointer and the history in RAM are already truncated
+    recalculateUnreadMsgCount();
     CALL_LISTENER(onUnreadChanged);
     findAndNotifyLastTextMsg();
 
@@ -3662,16 +4370,9 @@ Id Chat::makeRandomId()
 void Chat::deleteMessagesBefore(Idx idx)
 {
     //delete everything before idx, but not including idx
-    if (idx > mForwardStart)
+    while (lownum() < idx)
     {
-        mBackwardList.clear();
-        auto delCount = idx-mForwardStart;
-        mForwardList.erase(mForwardList.begin(), mForwardList.begin()+delCount);
-        mForwardStart += delCount;
-    }
-    else
-    {
-        mBackwardList.erase(mBackwardList.begin()+mForwardStart-idx, mBackwardList.end());
+        mHistory.popOldest();
     }
 }
 
@@ -3723,16 +4424,23 @@ Idx Chat::msgIncoming(bool isNew, Message* message, bool isLocal)
     assert(msgid);
     Idx idx;
 
+    if (!isLocal && isFetchingFromServer())
+    {
+        // group the writes to db of the messages up to HISTDONE
+        beginHistoryBatch();
+    }
+
     if (isNew)
     {
         auto it = mIdToIndexMap.find(message->id());
         if (it != mIdToIndexMap.end())  // message already received
         {
             CHATID_LOG_WARNING("Ignoring duplicated NEWMSG: msgid %s, idx %d", ID_CSTR(it->first), it->second);
+            delete message;
             return it->second;
         }
 
-        push_forward(message);
+        message = push_forward(message);
         idx = highnum();
         if (!mOldestKnownMsgId)
             mOldestKnownMsgId = msgid;
@@ -3753,7 +4461,7 @@ Idx Chat::msgIncoming(bool isNew, Message* message, bool isLocal)
             else
             {
                 //all history is in RAM, determine the index from RAM
-                push_back(message);
+                message = push_back(message);
                 idx = lownum();
             }
             //shouldn't we update this only after we save the msg to db?
@@ -3761,7 +4469,8 @@ Idx Chat::msgIncoming(bool isNew, Message* message, bool isLocal)
         }
         else //local history message - load from DB to RAM
         {
-            push_back(message);
+            message = push_back(message);
+            mHistory.pack(lownum());
             idx = lownum();
             if (msgid == mOldestKnownMsgId)
             //we have just processed the oldest message from the db
@@ -3811,6 +4520,10 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
                 if (message->isEncrypted() != Message::kEncryptedNoType)
                 {
                     CALL_DB(updateMsgInHistory, message->id(), *message);   // update 'data' & 'is_encrypted'
+                    if (message->isValidUnread(mChatdClient.mMyHandle))
+                    {
+                        updateUnreadMsgCount(idx, 1);
+                    }
                 }
                 msgIncomingAfterDecrypt(isNew, true, *message, idx);
             })
@@ -3851,6 +4564,7 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
         if (mDecryptNewHaltedAt != CHATD_IDX_INVALID)
         {
             CHATID_LOG_DEBUG("Decryption of new messages is halted, message queued for decryption");
+            mCrypto->prepareMsgDecrypt(&msg);
             return false;
         }
     }
@@ -3859,6 +4573,7 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
         if (mDecryptOldHaltedAt != CHATD_IDX_INVALID)
         {
             CHATID_LOG_DEBUG("Decryption of old messages is halted, message queued for decryption");
+            mCrypto->prepareMsgDecrypt(&msg);
             return false;
         }
     }
@@ -4008,16 +4723,29 @@ void Chat::msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx i
     if (!isLocal)
     {
         assert(!msg.isPendingToDecrypt()); //either decrypted or error
-        if (!msg.empty() && msg.type == Message::kMsgNormal && (*msg.buf() == 0)) //'special' message - attachment etc
+        if (findOrNull(idx) == &msg)
+        {
+            mHistory.pack(idx);
+        }
+        else
+        {
+            // undecryptable messages still reference the received frame, don't keep it alive
+            msg.detachFromFrame();
+        }
+        if (!msg.empty() && msg.type == Message::kMsgNormal && (msg.read<uint8_t>(0) == 0)) //'special' message - attachment etc
         {
             if (msg.dataSize() < 2)
                 CHATID_LOG_ERROR("Malformed special message received - starts with null char received, but its length is 1. Assuming type of normal message");
             else
-                msg.type = msg.buf()[1] + Message::Type::kMsgOffset;
+                msg.type = msg.read<uint8_t>(1) + Message::Type::kMsgOffset;
         }
 
         verifyMsgOrder(msg, idx);
         CALL_DB(addMsgToHistory, msg, idx);
+        if (msg.isValidUnread(mChatdClient.mMyHandle))
+        {
+            updateUnreadMsgCount(idx, 1);
+        }
 
         if (mChatdClient.isMessageReceivedConfirmationActive() && !isGroup() &&
                 (msg.userid != mChatdClient.mMyHandle) && // message is not ours
@@ -4275,7 +5003,9 @@ void Chat::onJoinComplete()
         CALL_CRYPTO(setUsers, &mUsers);
     }
     mUserDump.clear();
-    mEncryptionHalted = false;
+    // a new key being prepared keeps the output halted: the messages encrypted ahead
+    // weren't sent yet, but they are encrypted ahead again while flushing
+    discardEncryptedAhead();
     setOnlineState(kChatStateOnline);
     flushOutputQueue(true); //flush encrypted messages
 
@@ -4301,6 +5031,51 @@ void Chat::resetGetHistory()
 {
     mNextHistFetchIdx = CHATD_IDX_INVALID;
     mServerOldHistCbEnabled = false;
+    trimHistoryToRamLimit();
+}
+
+void Chat::trimHistoryToRamLimit()
+{
+    // messages being fetched or decrypted may not be in db yet, and decryption
+    // holds references to them
+    if (!mHistoryRamLimit || !mOldestKnownMsgId
+            || (mServerFetchState != kHistNotFetching)
+            || (mDecryptNewHaltedAt != CHATD_IDX_INVALID)
+            || (mDecryptOldHaltedAt != CHATD_IDX_INVALID))
+    {
+        return;
+    }
+
+    if (mHistory.ramSize() <= mHistoryRamLimit)
+        return;
+
+    // called after the history fetch is reset, so the app loads it again from the
+    // newest message, which is always kept
+    Idx last = highnum() - 1;
+    Idx count = 0;
+    while (mHistory.ramSize() > mHistoryRamLimit && lownum() <= last)
+    {
+        Message& msg = at(lownum());
+        if (msg.isPendingToDecrypt() || msg.isEncrypted() == Message::kEncryptedNoType)
+            break;
+
+        mIdToIndexMap.erase(msg.id());
+        mMsgsToUpdateWithRichLink.erase(msg.id());
+        if (msg.backRefId)
+        {
+            // otherwise it would be taken as a duplicate when the message is loaded again
+            mRefidToIdxMap.erase(msg.backRefId);
+        }
+        mHistory.popOldest();
+        count++;
+    }
+
+    if (count)
+    {
+        mHasMoreHistoryInDb = true;
+        CHATID_LOG_DEBUG("Evicted %d old messages from RAM history (limit: %zu bytes, now: %zu bytes)",
+                         count, mHistoryRamLimit, mHistory.ramSize());
+    }
 }
 
 void Chat::setOnlineState(ChatState state)
@@ -4510,6 +5285,7 @@ void Client::leave(Id chatid)
         return;
     }
     conn->second->mChatIds.erase(chatid);
+    conn->second->mLazyChats.erase(chatid);
     mConnectionForChatId.erase(conn);
     mChatForChatId.erase(chatid);
 }
@@ -4739,7 +5515,7 @@ void FilteredHistory::addMessage(Message &msg, bool isNew, bool isLocal)
 {
     if (msg.size()) // protect against deleted node-attachment messages
     {
-        msg.type = msg.buf()[1] + Message::Type::kMsgOffset;
+        msg.type = static_cast<const Message&>(msg).buf()[1] + Message::Type::kMsgOffset;
         assert(msg.type == Message::Type::kMsgAttachment);
     }
 
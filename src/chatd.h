@@ -8,6 +8,8 @@
 #include <set>
 #include <list>
 #include <deque>
+#include <array>
+#include <type_traits>
 #include <base/promise.h>
 #include <base/timers.hpp>
 #include <base/trackDelete.h>
@@ -22,6 +24,7 @@ namespace karere {
 }
 
 class MyMegaApi;
+class MegaChatApiTest; // the automated tests, which replay received frames
 
 #define CHATD_LOG_DEBUG(fmtString,...) KARERE_LOG_DEBUG(krLogChannel_chatd, fmtString, ##__VA_ARGS__)
 #define CHATD_LOG_INFO(fmtString,...) KARERE_LOG_INFO(krLogChannel_chatd, fmtString, ##__VA_ARGS__)
@@ -377,6 +380,35 @@ struct EndpointId
 
 class Client;
 
+struct ChatDbInfo
+{
+    karere::Id oldestDbId;
+    karere::Id newestDbId;
+    Idx newestDbIdx;
+    karere::Id lastSeenId;
+    karere::Id lastRecvId;
+    int unreadCount;
+    bool unreadCountValid;  ///< false if the unread count was not persisted yet, or was invalidated
+};
+
+/** @brief Counters of the commands received from chatd */
+struct RecvCommandStats
+{
+    /** Number of commands received */
+    uint64_t count = 0;
+    /** Total size of the commands, including the opcode (in bytes) */
+    uint64_t bytes = 0;
+    /** Cumulative time spent processing the commands (in microseconds) */
+    uint64_t usecs = 0;
+
+    void add(size_t aBytes, uint64_t aUsecs)
+    {
+        count++;
+        bytes += aBytes;
+        usecs += aUsecs;
+    }
+};
+
 // need DeleteTrackable for graceful disconnect timeout
 class Connection: public karere::DeleteTrackable, public WebsocketsClient
 {
@@ -445,11 +477,61 @@ protected:
 
     /** Handler of the timeout for the connection establishment */
     megaHandle mConnectTimer = 0;
-    
+
+    /** Chats pending to be rejoined once the output queue drains */
+    std::deque<karere::Id> mPendingRejoins;
+
+    /** History info of the chats being rejoined, loaded in bulk from the db */
+    karere::IdMap<ChatDbInfo> mRejoinInfos;
+
+    /** A chat joined without creating its Chat object, see Client::addLazyChat() */
+    struct LazyChat
+    {
+        /** History range and seen pointer in the db, sent in the JOINRANGEHIST */
+        ChatDbInfo dbInfo;
+        /** True once the response to the JOINRANGEHIST is complete */
+        bool joined = false;
+        /** True if a command received during the join requires to create the chat */
+        bool mustCreate = false;
+    };
+    karere::IdMap<LazyChat> mLazyChats;
+
+    /** How a command for a chat not created yet is handled, see chatForCommand() */
+    enum LazySignal
+    {
+        kLazyIgnore,            ///< The command doesn't change the chat, it's skipped
+        kLazyCreate,            ///< The chat is created, and receives the command again when it joins
+        kLazyCreateAndHandle    ///< The chat is created and handles the command
+    };
+
+    /** Parsing state of an incoming frame, passed to the command handlers */
+    struct CommandCtx
+    {
+        /** The received frame, that may contain several commands */
+        const StaticBuffer& buf;
+        /** Current read position inside the frame */
+        size_t pos = 0;
+        /** Position right after the opcode of the command being processed */
+        size_t base = 0;
+        uint8_t opcode = OP_INVALIDCODE;
+        /** Chatid of the command being processed, if any */
+        karere::Id chatid;
+        /** Copy of the frame shared by the messages received in it, created on demand */
+        std::shared_ptr<Buffer> frame;
+        CommandCtx(const StaticBuffer& aBuf): buf(aBuf) {}
+    };
+    typedef void (Connection::*CommandHandler)(CommandCtx& ctx);
+    typedef std::array<CommandHandler, OP_LAST+1> CommandHandlers;
+
+    /** Returns the handlers of incoming commands, indexed by opcode. Opcodes
+     * not expected from chatd have no handler */
+    static const CommandHandlers& commandHandlers();
+
     // ---- callbacks called from libwebsocketsIO ----
     virtual void wsConnectCb();
     virtual void wsCloseCb(int errcode, int errtype, const char *preason, size_t reason_len);
     virtual void wsHandleMsgCb(char *data, size_t len);
+    virtual void wsSendQueueCb(bool full);
 
     void onSocketClose(int ercode, int errtype, const std::string& reason);
     promise::Promise<void> reconnect();
@@ -459,16 +541,50 @@ protected:
 // Destroys the buffer content
     bool sendBuf(Buffer&& buf);
     bool rejoinExistingChats();
+    bool rejoinPendingChats();
     void resendPending();
     void join(karere::Id chatid);
     void hist(karere::Id chatid, long count);
+    /** Fetches the URL of the shard from API, if not connected yet, and connects */
+    void connect(karere::Id chatid);
+    void joinLazyChat(karere::Id chatid, LazyChat& lazy);
+    void createLazyChat(karere::Id chatid);
+    /** Returns the chat of the command. If it was not created yet, it's created or the
+     * command skipped according to \c signal. Returns nullptr if the command must be skipped */
+    Chat* chatForCommand(CommandCtx& ctx, LazySignal signal);
     bool sendCommand(Command&& cmd); // used internally only for OP_HELLO
     void execCommand(const StaticBuffer& buf);
+
+    // ---- handlers of incoming commands ----
+    void recvKeepalive(CommandCtx& ctx);
+    void recvBroadcast(CommandCtx& ctx);
+    void recvJoin(CommandCtx& ctx);
+    void recvMsg(CommandCtx& ctx);  // OLDMSG, NEWMSG and MSGUPD
+    void recvSeen(CommandCtx& ctx);
+    void recvReceived(CommandCtx& ctx);
+    void recvRetention(CommandCtx& ctx);
+    void recvMsgId(CommandCtx& ctx);
+    void recvNewMsgId(CommandCtx& ctx);
+    void recvReject(CommandCtx& ctx);
+    void recvHistDone(CommandCtx& ctx);
+    void recvNewKeyId(CommandCtx& ctx);
+    void recvNewKey(CommandCtx& ctx);
+    void recvInCall(CommandCtx& ctx);
+    void recvEndCall(CommandCtx& ctx);
+    void recvCallData(CommandCtx& ctx);
+    void recvRtMessage(CommandCtx& ctx);  // RTMSG_ENDPOINT, RTMSG_USER and RTMSG_BROADCAST
+    void recvClientId(CommandCtx& ctx);
+    void recvEcho(CommandCtx& ctx);
+    void recvReaction(CommandCtx& ctx);  // ADDREACTION and DELREACTION
+    void recvSync(CommandCtx& ctx);
+    void recvCallTime(CommandCtx& ctx);
+
     bool sendKeepalive(uint8_t opcode);
     void sendEcho();
     void sendCallReqDeclineNoSupport(karere::Id chatid, karere::Id callid);
     friend class Client;
     friend class Chat;
+    friend class ::MegaChatApiTest;
 
 public:
     void setState(State state);
@@ -660,7 +776,104 @@ protected:
     void init();
 };
 
-struct ChatDbInfo;
+/** @brief The RAM history buffer of a chat, indexed by Idx.
+ * Messages are constructed in place inside fixed-size chunks, which are added and
+ * released at both ends as the buffer grows and old history is evicted. This way a
+ * message doesn't need a heap block of its own, and its address doesn't change while
+ * it's in the buffer, so references to it remain valid. The payloads of messages
+ * that are not expected to change can be packed into shared arena blocks, see \c pack().
+ */
+class HistoryStore
+{
+public:
+    enum
+    {
+        kChunkSize = 128,           ///< Number of messages per chunk
+        kArenaBlockSize = 32768,    ///< Size of the arena blocks where payloads are packed
+        kArenaMaxPayload = 2048     ///< Bigger payloads are not packed, they keep their own buffer
+    };
+
+    /** @brief Creates an empty buffer, where the first message added will have index \c start */
+    explicit HistoryStore(Idx start = CHATD_IDX_RANGE_MIDDLE): mLow(start), mHigh(start - 1) {}
+    HistoryStore(const HistoryStore&) = delete;
+    HistoryStore& operator=(const HistoryStore&) = delete;
+    ~HistoryStore() { clear(); }
+
+    Idx lownum() const { return mLow; }
+    Idx highnum() const { return mHigh; }
+    Idx size() const { return mHigh - mLow + 1; }
+    bool empty() const { return mHigh < mLow; }
+    Message* findOrNull(Idx idx) const { return (idx < mLow || idx > mHigh) ? nullptr : slot(idx); }
+
+    /** @brief Moves \c msg to a new slot after the newest message, and returns it */
+    Message& pushNewest(Message&& msg);
+
+    /** @brief Moves \c msg to a new slot before the oldest message, and returns it */
+    Message& pushOldest(Message&& msg);
+
+    /** @brief Destroys the oldest message */
+    void popOldest();
+
+    /** @brief Destroys all messages. The buffer keeps its position, unless \c start is specified */
+    void clear(Idx start = CHATD_IDX_INVALID);
+
+    /** @brief Moves the payload of the message at \c idx to the current arena block. The
+     * message shares the block with the other packed ones, and gets a copy of its own again
+     * if modified. Payloads too big for the arena only get detached from the received frame,
+     * if any. The RAM used by the message is accounted again, see \c updateRamSize().
+     */
+    void pack(Idx idx);
+
+    /** @brief Accounts again the RAM used by the message at \c idx, after it was modified
+     * in place (decrypted, edited...). Otherwise \c ramSize() keeps the size it had when added.
+     */
+    void updateRamSize(Idx idx);
+
+    /** @brief Approximate RAM used by the messages in the buffer. It's a running total,
+     * updated when messages are added, removed or accounted again.
+     */
+    size_t ramSize() const { return mRamSize; }
+
+    /** @brief Approximate RAM used by a message stored in the buffer */
+    static size_t msgRamSize(const Message& msg)
+    {
+        return sizeof(Message) + msg.dataSize() + msg.backRefs.capacity() * sizeof(BackRefId);
+    }
+
+protected:
+    typedef std::aligned_storage<sizeof(Message), alignof(Message)>::type Slot;
+    struct Chunk
+    {
+        Slot slots[kChunkSize];
+        /** RAM accounted for each message, subtracted from the total when it's removed */
+        uint32_t ramSizes[kChunkSize];
+    };
+    std::deque<std::unique_ptr<Chunk>> mChunks;
+    /** Index of the first slot of the first chunk */
+    Idx mChunksStart = 0;
+    /** Index of the oldest message */
+    Idx mLow;
+    /** Index of the newest message, or mLow-1 if the buffer is empty */
+    Idx mHigh;
+    /** The arena block where payloads are currently being packed */
+    std::shared_ptr<Buffer> mArena;
+    /** Sum of the RAM accounted for the messages in the buffer */
+    size_t mRamSize = 0;
+
+    Message* slot(Idx idx) const
+    {
+        Idx offset = idx - mChunksStart;
+        return reinterpret_cast<Message*>(&mChunks[offset / kChunkSize]->slots[offset % kChunkSize]);
+    }
+    uint32_t& accountedSize(Idx idx) const
+    {
+        Idx offset = idx - mChunksStart;
+        return mChunks[offset / kChunkSize]->ramSizes[offset % kChunkSize];
+    }
+    void account(Idx idx);
+    void addFirstChunk(Idx idx);
+};
+
 
 /** @brief Represents a single chatroom together with the message history.
  * Message sending is done by calling methods on this class.
@@ -689,6 +902,9 @@ public:
         Message* msg;
         karere::SetOfIds recipients;
         uint64_t rowid; // in the sending table of DB cache
+        /** Consecutive along the sending queue, so the position of an item can be
+         * obtained without walking the list. @see Chat::sendingPos() */
+        uint64_t seq = 0;
 
         MsgCommand *msgCmd = NULL;  // stores the encrypted NEWMSG/NEWNODEMSG/MSGUPDX/MSGUPD
         KeyCommand *keyCmd = NULL;  // stores the encrypted NEWKEY, if needed
@@ -725,18 +941,22 @@ public:
 protected:
     Connection& mConnection;
     karere::Id mChatId;
-    Idx mForwardStart;
-    std::vector<std::unique_ptr<Message>> mForwardList;
-    std::vector<std::unique_ptr<Message>> mBackwardList;
+    /** The history messages loaded in RAM */
+    HistoryStore mHistory;
+    /** Max RAM for history messages, older ones are evicted (they remain in db). 0 means no limit */
+    size_t mHistoryRamLimit = 0;
     std::unique_ptr<FilteredHistory> mAttachmentNodes;
     OutputQueue mSending;
     OutputQueue::iterator mNextUnsent;
     bool mIsFirstJoin = true;
-    std::map<karere::Id, Idx> mIdToIndexMap;
+    karere::IdMap<Idx> mIdToIndexMap;
     karere::Id mLastReceivedId;
     Idx mLastReceivedIdx = CHATD_IDX_INVALID;
     karere::Id mLastSeenId;
     Idx mLastSeenIdx = CHATD_IDX_INVALID;
+    /** Result of \c unreadMsgCount(), maintained incrementally and persisted in the db.
+     * It's recalculated when the change can't be known from the messages in RAM */
+    int mUnreadCount = 0;
     Idx mLastIdxReceivedFromServer = CHATD_IDX_INVALID;
     karere::Id mLastIdReceivedFromServer;
     Listener* mListener;
@@ -760,6 +980,8 @@ protected:
     bool mHasMoreHistoryInDb = false;
     /** When true, OLDMSGs received from chatd are notified to the app */
     bool mServerOldHistCbEnabled = false;
+    /** Whether the messages being received from server are added to db in a batch */
+    bool mInHistoryBatch = false;
     /** @brief Have reached the beggining of the history (not necessarily the end of it) */
     bool mHaveAllHistory = false;
     bool mIsDisabled = false;
@@ -776,6 +998,19 @@ protected:
      * db table. This, until another (or the same) encrypt call can't encrypt immediately,
      * in which case the flag is set again and the queue is blocked again */
     bool mEncryptionHalted = false;
+    /** Incremented every time the output is halted, so that a new key prepared for a
+     * previous halt (i.e. before the chat was reinitialized) is ignored */
+    uint32_t mEncryptionHaltId = 0;
+    /** The item waiting for the new key while the output is halted. The halt is kept
+     * across rejoins: the items before it are sent again, and the NEWKEY is still sent
+     * with it once it's ready */
+    SendingItem* mEncryptionHaltedItem = nullptr;
+    /** While the output is halted, the new messages queued after the one that
+     * halted it are encrypted ahead with the key being prepared, if it's the
+     * current send key for their recipients. They are sent right after its NEWKEY,
+     * all in the same frame. Not written to db until then, since the key may never
+     * be sent */
+    std::vector<std::pair<OutputQueue::iterator, MsgCommand*>> mEncryptedAhead;
     /** If an incoming new message can't be decrypted immediately, this is set to its
      * index in the hitory buffer, as it is already added there (in memory only!).
      * Further received new messages are only added to memory history buffer, and
@@ -809,6 +1044,9 @@ protected:
     uint32_t mAttachNodesRequestedToServer = 0;
     /** Num of node-attachment messages received from server during fetch in-flight */
     uint32_t mAttachNodesReceived = 0;
+
+    /** Counters of the commands received from chatd for this chat */
+    RecvCommandStats mRecvStats;
     bool mAttachmentHistDoneReceived = false;
     std::queue <Message *> mAttachmentsPendingToDecrypt;
     bool mDecryptionAttachmentsHalted = false;
@@ -816,16 +1054,25 @@ protected:
     bool mTruncateAttachment = false;
     // ====
     std::map<karere::Id, Message*> mPendingEdits;
-    std::map<BackRefId, Idx> mRefidToIdxMap;
+    karere::FlatMap<BackRefId, Idx> mRefidToIdxMap;
     Chat(Connection& conn, karere::Id chatid, Listener* listener,
     const karere::SetOfIds& users, uint32_t chatCreationTs, ICrypto* crypto, bool isGroup);
-    void push_forward(Message* msg) { mForwardList.emplace_back(msg); }
-    void push_back(Message* msg) { mBackwardList.emplace_back(msg); }
-    void clear()
-    {
-        mBackwardList.clear();
-        mForwardList.clear();
-    }
+    /** Moves \c msg to the newest/oldest end of the history buffer, and deletes it.
+     * Returns the message as stored in the buffer */
+    Message* push_forward(Message* msg);
+    Message* push_back(Message* msg);
+    void clear() { mHistory.clear(); }
+    void trimHistoryToRamLimit();
+    int calculateUnreadMsgCount() const;
+    /** Sets and persists the unread count, if it changed */
+    void setUnreadMsgCount(int count);
+    /** Recalculates the unread count from the history in RAM, or in the db if the
+     * last-seen message is not in RAM. The state it depends on (last-seen index,
+     * history in RAM, and whether all history is known) must be already updated */
+    void recalculateUnreadMsgCount();
+    /** Updates the cached unread count when a message at \c idx becomes (or stops
+     * being) unread, i.e. \c delta is +1 or -1 */
+    void updateUnreadMsgCount(Idx idx, int delta);
     // msgid can be 0 in case of rejections
     Idx msgConfirm(karere::Id msgxid, karere::Id msgid);
     bool msgAlreadySent(karere::Id msgxid, karere::Id msgid);
@@ -851,7 +1098,7 @@ protected:
     bool sendKeyAndMessage(std::pair<MsgCommand*, KeyCommand*> cmd);
     void flushOutputQueue(bool fromStart=false);
     karere::Id makeRandomId();
-    void login();
+    void login(const ChatDbInfo* info=nullptr);
     void join();
     void joinRangeHist(const ChatDbInfo& dbInfo);
     void onDisconnect();
@@ -886,17 +1133,15 @@ public:
     Client& client() const { return mChatdClient; }
     Connection& connection() const { return mConnection; }
     /** @brief The lowest index of a message in the RAM history buffer */
-    Idx lownum() const { return mForwardStart - (Idx)mBackwardList.size(); }
+    Idx lownum() const { return mHistory.lownum(); }
     /** @brief The highest index of a message in the RAM history buffer */
-    Idx highnum() const { return mForwardStart + (Idx)mForwardList.size()-1;}
-    /** @brief Needed only for debugging purposes */
-    Idx forwardStart() const { return mForwardStart; }
+    Idx highnum() const { return mHistory.highnum(); }
     /** The number of messages currently in the history buffer (in RAM).
      * @note Note that there may be more messages in history db, but not loaded
      * into memory*/
-    Idx size() const { return mForwardList.size() + mBackwardList.size(); }
+    Idx size() const { return mHistory.size(); }
     /** @brief Whether we have any messages in the history buffer */
-    bool empty() const { return mForwardList.empty() && mBackwardList.empty();}
+    bool empty() const { return mHistory.empty(); }
     bool isDisabled() const { return mIsDisabled; }
     bool isFirstJoin() const { return mIsFirstJoin; }
     void disable(bool state) { mIsDisabled = state; }
@@ -989,23 +1234,7 @@ public:
      * Get the message with the specified index, or \c NULL if that
      * index is out of range
      */
-    inline Message* findOrNull(Idx num) const
-    {
-        if (num < mForwardStart) //look in mBackwardList
-        {
-            Idx idx = mForwardStart - num - 1; //always >= 0
-            if (static_cast<size_t>(idx) >= mBackwardList.size())
-                return nullptr;
-            return mBackwardList[idx].get();
-        }
-        else
-        {
-            Idx idx = num - mForwardStart;
-            if (static_cast<size_t>(idx) >= mForwardList.size())
-                return nullptr;
-            return mForwardList[idx].get();
-        }
-    }
+    inline Message* findOrNull(Idx num) const { return mHistory.findOrNull(num); }
 
     /**
      * @brief Returns the message at the specified index in the RAM history buffer.
@@ -1032,13 +1261,7 @@ public:
     /** @brief Returns whether the specified RAM history buffer index is valid or out
      * of range
      */
-    bool hasNum(Idx num) const
-    {
-        if (num < mForwardStart)
-            return (static_cast<size_t>(mForwardStart - num) <= mBackwardList.size());
-        else
-            return (num < mForwardStart + static_cast<int>(mForwardList.size()));
-    }
+    bool hasNum(Idx num) const { return (num >= lownum()) && (num <= highnum()); }
 
     /**
      * @brief Returns the index of the message with the specified msgid.
@@ -1093,9 +1316,22 @@ public:
      * will start from the newest known message. Note that this doesn't affect
      * the actual fetching of history from the server to the chatd client,
      * only the sending from the chatd client to the app.
+     * If a RAM limit for the history is set, the oldest messages exceeding it
+     * are evicted from RAM, since the app will not get them before loading newer ones.
      */
     void resetGetHistory();
 
+    /**
+     * @brief Sets the max amount of RAM used by the history messages of this chat.
+     * Messages beyond the limit are evicted from RAM, oldest first, when the history
+     * sent to the app is reset. They remain in the db and are loaded again on demand.
+     * @param bytes The limit, or 0 for no limit
+     */
+    void setHistoryRamLimit(size_t bytes) { mHistoryRamLimit = bytes; }
+    size_t historyRamLimit() const { return mHistoryRamLimit; }
+    /** @brief Approximate RAM used by the history messages in RAM, see HistoryStore::ramSize() */
+    size_t historyRamSize() const { return mHistory.ramSize(); }
+
     /**
      * @brief setMessageSeen Move the last-seen-by-us pointer to the message with the
      * specified index.
@@ -1172,9 +1408,22 @@ public:
       * as more history is fetched from server.
       * Example 1: Client has 1 message pre-fetched and its msgid is the same
       * as the last-seen-msgid. The count will be returned as 0.
+      * The count is kept up to date as messages are received, edited or seen, and
+      * persisted in the db, so it's normally returned without any calculation.
       */
     int unreadMsgCount() const;
 
+    /** @brief Recalculates the unread count from scratch and compares it with the
+     * incrementally maintained one. In case of mismatch, the error is logged and the
+     * cached count is fixed. Intended for testing, since it's as slow as the
+     * calculation that the cached count avoids.
+     * @return Whether the cached count was correct
+     */
+    bool checkUnreadMsgCount();
+
+    /** @brief Returns the counters of all commands received from chatd for this chat */
+    const RecvCommandStats& recvStats() const { return mRecvStats; }
+
     /** @brief Returns the text of the most-recent message in the chat that can
      * be displayed as text in the chat list. If it is not found in RAM,
      * the database will be queried. If not found there as well, server is queried,
@@ -1278,18 +1527,30 @@ public:
 protected:
     void msgSubmit(Message* msg, karere::SetOfIds recipients);
     bool msgEncryptAndSend(OutputQueue::iterator it);
+    /** Encrypts the item into its commands, or halts the output until the new key it
+     * needs is ready. Doesn't send anything */
+    void msgEncrypt(OutputQueue::iterator it);
+    bool msgEncryptAhead(OutputQueue::iterator it);
+    void discardEncryptedAhead();
     void continueEncryptNextPending();
     void onMsgUpdated(Message* msg);
     void onJoinRejected();
     void keyConfirm(KeyId keyxid, KeyId keyid);
     void onKeyReject();
     void onHistReject();
+    void beginHistoryBatch();
+    void endHistoryBatch();
     void rejectMsgupd(karere::Id id, uint8_t serverReason);
     void rejectGeneric(uint8_t opcode, uint8_t reason);
     void moveItemToManualSending(OutputQueue::iterator it, ManualSendReason reason);
     void handleTruncate(const Message& msg, Idx idx);
     void deleteMessagesBefore(Idx idx);
     void createMsgBackRefs(OutputQueue::iterator msgit);
+    /** @brief Number of items in the sending queue up to \c it, included */
+    size_t sendingPos(OutputQueue::const_iterator it) const { return it->seq - mSending.front().seq + 1; }
+    /** @brief Removes an item from any position of the sending queue, keeping
+     * the sequence numbers of the items consecutive */
+    OutputQueue::iterator eraseFromSending(OutputQueue::iterator it);
     void verifyMsgOrder(const Message& msg, Idx idx);
 
     /**
@@ -1319,10 +1580,10 @@ protected:
     std::map<int, std::shared_ptr<Connection>> mConnections;
 
     // maps a chatid to the handling Shard connection
-    std::map<karere::Id, Connection*> mConnectionForChatId;
+    karere::IdMap<Connection*> mConnectionForChatId;
 
-    // maps chatids to the Chat object
-    std::map<karere::Id, std::shared_ptr<Chat>> mChatForChatId;
+    // maps chatids to the Chat object. Looked up for every received command
+    karere::IdMap<std::shared_ptr<Chat>> mChatForChatId;
 
     // set of seen timers
     std::set<megaHandle> mSeenTimers;
@@ -1335,6 +1596,14 @@ protected:
     // to track changes in the richPreview's user-attribute
     karere::UserAttrCache::Handle mRichPrevAttrCbHandle;
 
+    // counters of the commands received from chatd, indexed by opcode
+    std::array<RecvCommandStats, OP_LAST+1> mRecvStats;
+
+    // max RAM for the history of each chat (0 means no limit)
+    size_t mHistoryRamLimit = 0;
+
+    void onCommandHandled(uint8_t opcode, karere::Id chatid, size_t bytes, uint64_t usecs);
+    Connection& shardConnection(karere::Id chatid, int shardNo, const std::string& url);
     bool onMsgAlreadySent(karere::Id msgxid, karere::Id msgid);
     void msgConfirm(karere::Id msgxid, karere::Id msgid);
     void sendKeepalive();
@@ -1381,6 +1650,21 @@ public:
     Chat& createChat(karere::Id chatid, int shardNo, const std::string& url,
     Listener* listener, const karere::SetOfIds& initialUsers, ICrypto* crypto, uint32_t chatCreationTs, bool isGroup);
 
+    /** @brief Joins the specified chatroom without creating its Chat object, with a
+     * JOINRANGEHIST of the history range in \c dbInfo. Commands that don't change the chat
+     * (e.g. the dump of its members) are skipped. The first new message, update of a message,
+     * change of the seen pointer or call signalling requests karere::Client to create the
+     * chat, see karere::Client::createLazyChatRoom(). Then the chat joins by itself as usual.
+     */
+    void addLazyChat(karere::Id chatid, int shardNo, const ChatDbInfo& dbInfo);
+
+    /** @brief Connects the shard of a chat added by \c addLazyChat(), if not connected yet.
+     * The chat is joined once logged in to the shard */
+    void connectLazyChat(karere::Id chatid);
+
+    /** @brief Whether the chat was added by \c addLazyChat() and not created yet */
+    bool isLazyChat(karere::Id chatid) const;
+
     /** @brief Leaves the specified chatroom */
     void leave(karere::Id chatid);
 
@@ -1400,6 +1684,18 @@ public:
     // True if clients send confirmation to chatd when they receive a new message
     bool isMessageReceivedConfirmationActive() const;
 
+    /** @brief Returns the counters of the commands with the specified opcode received
+     * from chatd, in all shards. The counters per chat are available via Chat::recvStats()
+     */
+    const RecvCommandStats& recvStats(uint8_t opcode) const;
+
+    /** @brief Resets the counters of received commands, per opcode and per chat */
+    void resetRecvStats();
+
+    /** @brief Sets the max RAM for the history messages of each chat, for existing
+     * and new chats. See Chat::setHistoryRamLimit() */
+    void setHistoryRamLimit(size_t bytes);
+
     friend class Connection;
     friend class Chat;
 };
@@ -1418,15 +1714,6 @@ static inline const char* connStateToStr(Connection::State state)
     }
 }
 
-struct ChatDbInfo
-{
-    karere::Id oldestDbId;
-    karere::Id newestDbId;
-    Idx newestDbIdx;
-    karere::Id lastSeenId;
-    karere::Id lastRecvId;
-};
-
 class DbInterface
 {
 public:
@@ -1452,6 +1739,11 @@ public:
     /// update a message in the history buffer with the specified \c msgid
     virtual void updateMsgInHistory(karere::Id msgid, const Message& msg) = 0;
 
+    /// called before a batch of messages from server is added to history (i.e. the
+    /// messages up to HISTDONE), so the writes can be grouped until \c endHistoryBatch
+    virtual void beginHistoryBatch() = 0;
+    virtual void endHistoryBatch() = 0;
+
 
 //  <<<--- Management of the SENDING QUEUE --->>>
 
@@ -1505,10 +1797,18 @@ public:
 //  <<<--- Additional methods: seen/received/delta/oldest/newest... --->>>
 
     virtual void getHistoryInfo(ChatDbInfo& info) = 0;
+    /**
+     * @brief Same as \c getHistoryInfo(), but for several chats of the same db at once
+     * Chats of \c chatids not found in the db are not added to \c infos
+     */
+    virtual void getHistoryInfos(const std::set<karere::Id>& chatids, karere::IdMap<ChatDbInfo>& infos) = 0;
 
     virtual void setLastSeen(karere::Id msgid) = 0;
     virtual void setLastReceived(karere::Id msgid) = 0;
 
+    /// persist the unread count
+    virtual void setUnreadCount(int count) = 0;
+
     virtual Idx getOldestIdx() = 0;
     virtual Idx getIdxOfMsgidFromHistory(karere::Id msgid) = 0;
     virtual Idx getUnreadMsgCountAfterIdx(Idx idx) = 0;
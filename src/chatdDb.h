@@ -5,19 +5,103 @@
 #include "chatd.h"
 //extern sqlite3* db;
 
+namespace chatd
+{
+/** The queries run on every history load, send or receive. They are kept here so that
+ * the test of their query plans checks the exact text that is executed */
+namespace sql
+{
+#define CHATD_SQL_UNREAD_COUNT \
+    "select count(*) from history where (chatid = ?1)" \
+    "and (userid != ?2)" \
+    "and not (updated != 0 and length(data) = 0)" \
+    "and (is_encrypted = ?3 or is_encrypted = ?4 or is_encrypted = ?5)" \
+    "and (type = ?6 or type = ?7 or type = ?8 or type = ?9 or type = ?10)"
+
+static const char* const kHistoryIdxRange = "select min(idx), max(idx) from history where chatid=?1";
+static const char* const kHistoryMsgidAtIdx = "select msgid from history where chatid=?1 and idx=?2";
+static const char* const kChatSeenState = "select last_seen, last_recv, unread_count from chats where chatid=?";
+/** Run for each chat being rejoined, each subquery is a lookup in the (chatid, idx) index */
+static const char* const kChatHistoryInfo = "select last_seen, last_recv, unread_count, "
+    "(select idx from history where chatid=?1 order by idx desc limit 1), "
+    "(select msgid from history where chatid=?1 order by idx asc limit 1), "
+    "(select msgid from history where chatid=?1 order by idx desc limit 1) "
+    "from chats where chatid=?1";
+static const char* const kHistoryMsgUpdated = "select updated from history where chatid = ? and msgid = ?";
+static const char* const kHistoryIdxOfMsgid = "select idx from history where chatid = ? and msgid = ?";
+static const char* const kNodeHistoryIdxOfMsgid = "select idx from node_history where chatid = ? and msgid = ?";
+/** Conditions should match the ones in Message::isValidUnread() */
+static const char* const kHistoryUnreadCount = CHATD_SQL_UNREAD_COUNT;
+static const char* const kHistoryUnreadCountAfterIdx = CHATD_SQL_UNREAD_COUNT " and (idx > ?)";
+static const char* const kHistoryOldestIdx = "select min(idx) from history where chatid = ?";
+static const char* const kHistoryLastTextMsg = "select type, idx, data, msgid, userid from history where chatid=?1 and "
+    "(length(data) > 0 OR type = ?2) and type != ?3  and type != ?4 and (idx <= ?5)"
+    "order by idx desc limit 1";
+static const char* const kHistoryLoadMsgs =
+    "select msgid, userid, ts, type, data, idx, keyid, backrefid, updated, is_encrypted from history "
+    "where chatid = ?1 and idx <= ?2 order by idx desc limit ?3";
+static const char* const kNodeHistoryLoadMsgs =
+    "select msgid, userid, ts, type, data, idx, keyid, backrefid, updated, is_encrypted from node_history "
+    "where chatid = ?1 and idx <= ?2 order by idx desc limit ?3";
+static const char* const kNodeHistoryIdxRange = "select min(idx), max(idx), count(*) from node_history where chatid=?1";
+static const char* const kSendingLoadQueue = "select rowid, opcode, msgid, keyid, msg, type, "
+    "ts, updated, backrefid, backrefs, recipients, msg_cmd, key_cmd "
+    "from sending where chatid=? order by rowid asc";
+static const char* const kSendingConfirmKeyid = "update sending set keyid = ? where keyid = ? and chatid = ?";
+static const char* const kSendingUpdateMsgid = "update sending set opcode=?, msgid=? where chatid=? and opcode=? and msgid=?";
+static const char* const kSendingUpdateMsg = "update sending set msg = ?, updated = ? where msgid = ? and chatid = ?";
+static const char* const kManualSendingLoad = "select rowid, msgid, type, ts, updated, msg, opcode, "
+    "reason from manual_sending where chatid=? order by rowid asc";
+static const char* const kSendKeysLoad = "select userid, keyid, key from sendkeys where chatid=?";
+static const char* const kSendingLoadKeyCmds = "select recipients, key_cmd, keyid from sending "
+    "where chatid=? and key_cmd not null order by rowid asc";
+static const char* const kChatPeersLoad = "select userid, priv from chat_peers where chatid=?";
+static const char* const kSendingCount = "select count(*) from sending where chatid=?";
+static const char* const kHistoryNewestTs = "select ts from history where chatid=?1 order by idx desc limit 1";
+
+#undef CHATD_SQL_UNREAD_COUNT
+
+/** All the queries above, for the checks of their query plans */
+static const char* const kHotQueries[] =
+{
+    kHistoryIdxRange, kHistoryMsgidAtIdx, kChatSeenState, kChatHistoryInfo,
+    kHistoryMsgUpdated, kHistoryIdxOfMsgid, kNodeHistoryIdxOfMsgid,
+    kHistoryUnreadCount, kHistoryUnreadCountAfterIdx, kHistoryOldestIdx, kHistoryLastTextMsg,
+    kHistoryLoadMsgs, kNodeHistoryLoadMsgs, kNodeHistoryIdxRange,
+    kSendingLoadQueue, kSendingConfirmKeyid, kSendingUpdateMsgid, kSendingUpdateMsg,
+    kManualSendingLoad, kSendKeysLoad, kSendingLoadKeyCmds, kChatPeersLoad,
+    kSendingCount, kHistoryNewestTs
+};
+}
+}
+
 class ChatdSqliteDb: public chatd::DbInterface
 {
 protected:
     SqliteDb& mDb;
     chatd::Chat& mChat;
-    std::string mSendingTblName;
-    std::string mHistTblName;
+    /** Whether a batch of history messages from server is being received */
+    bool mInHistoryBatch = false;
+#ifndef NDEBUG
+    /** Range of indexes added to history during the current batch */
+    chatd::Idx mBatchLowIdx = CHATD_IDX_INVALID;
+    chatd::Idx mBatchHighIdx = CHATD_IDX_INVALID;
+#endif
 public:
-    ChatdSqliteDb(chatd::Chat& chat, SqliteDb& db, const std::string& sendingTblName="sending", const std::string& histTblName="history")
-        :mDb(db), mChat(chat), mSendingTblName(sendingTblName), mHistTblName(histTblName){}
+    /** The tables that hold history messages, which share the same layout */
+    enum HistoryTable { kHistory, kNodeHistory };
+    static const char* tableName(HistoryTable table) { return (table == kHistory) ? "history" : "node_history"; }
+
+    ChatdSqliteDb(chatd::Chat& chat, SqliteDb& db)
+        :mDb(db), mChat(chat) {}
+    ~ChatdSqliteDb()
+    {
+        if (mInHistoryBatch)
+            mDb.endBatch();
+    }
     virtual void getHistoryInfo(chatd::ChatDbInfo& info)
     {
-        SqliteStmt stmt(mDb, "select min(idx), max(idx) from history where chatid=?1");
+        SqliteStmt stmt(mDb, chatd::sql::kHistoryIdxRange);
         stmt.bind(mChat.chatId()).step(); //will always return a row, even if table empty
         auto minIdx = stmt.intCol(0); //WARNING: the chatd implementation uses uint32_t values for idx.
         info.newestDbIdx = stmt.intCol(1);
@@ -26,7 +110,7 @@ public:
             memset(&info, 0, sizeof(info)); //actually need to zero only oldestDbId
             return;
         }
-        SqliteStmt stmt2(mDb, "select msgid from "+mHistTblName+" where chatid=?1 and idx=?2");
+        SqliteStmt stmt2(mDb, chatd::sql::kHistoryMsgidAtIdx);
         stmt2 << mChat.chatId() << minIdx;
         stmt2.stepMustHaveData();
         info.oldestDbId = stmt2.uint64Col(0);
@@ -39,11 +123,46 @@ public:
             CHATD_LOG_WARNING("Db: Newest msgid in db is null, telling chatd we don't have local history");
             info.oldestDbId = 0;
         }
-        SqliteStmt stmt3(mDb, "select last_seen, last_recv from chats where chatid=?");
+        SqliteStmt stmt3(mDb, chatd::sql::kChatSeenState);
         stmt3 << mChat.chatId();
         stmt3.stepMustHaveData();
         info.lastSeenId = stmt3.uint64Col(0);
         info.lastRecvId = stmt3.uint64Col(1);
+        info.unreadCountValid = (sqlite3_column_type(stmt3, 2) != SQLITE_NULL);
+        info.unreadCount = info.unreadCountValid ? stmt3.intCol(2) : 0;
+    }
+    virtual void getHistoryInfos(const std::set<karere::Id>& chatids, karere::IdMap<chatd::ChatDbInfo>& infos)
+    {
+        // a single statement, run once per chat
+        SqliteStmt stmt(mDb, chatd::sql::kChatHistoryInfo);
+        infos.reserve(chatids.size());
+        for (karere::Id chatid: chatids)
+        {
+            stmt.reset().clearBind();
+            stmt << chatid;
+            if (!stmt.step())
+                continue;
+
+            chatd::ChatDbInfo& info = infos[chatid];
+            if (sqlite3_column_type(stmt, 3) == SQLITE_NULL) //no db history
+            {
+                memset(&info, 0, sizeof(info));
+                continue;
+            }
+            info.lastSeenId = stmt.uint64Col(0);
+            info.lastRecvId = stmt.uint64Col(1);
+            info.unreadCountValid = (sqlite3_column_type(stmt, 2) != SQLITE_NULL);
+            info.unreadCount = info.unreadCountValid ? stmt.intCol(2) : 0;
+            info.newestDbIdx = stmt.intCol(3);
+            info.oldestDbId = stmt.uint64Col(4);
+            info.newestDbId = stmt.uint64Col(5);
+            if (!info.newestDbId)
+            {
+                assert(false);
+                CHATD_LOG_WARNING("Db: Newest msgid in db is null, telling chatd we don't have local history");
+                info.oldestDbId = 0;
+            }
+        }
     }
     void assertAffectedRowCount(int count, const char* opname=nullptr)
     {
@@ -59,11 +178,12 @@ public:
         throw std::runtime_error(msg);
     }
 
-    void addMessage(const chatd::Message& msg, chatd::Idx idx, const std::string& table)
-    {
 #ifndef NDEBUG
-        std::string checkQuery = "select min(idx), max(idx), count(*) from " + table + " where chatid = ?";
-        SqliteStmt stmt(mDb, checkQuery.c_str());
+    void checkHistoryContinuity(const chatd::Message& msg, chatd::Idx idx, HistoryTable table)
+    {
+        SqliteStmt stmt(mDb, (table == kHistory)
+            ? "select min(idx), max(idx), count(*) from history where chatid = ?"
+            : "select min(idx), max(idx), count(*) from node_history where chatid = ?");
         stmt << mChat.chatId();
         stmt.step();
         int low = stmt.intCol(0);
@@ -74,14 +194,21 @@ public:
             CHATD_LOG_ERROR("chatid %s: addMsgToHistory: %s discontinuity detected: "
                 "index of added msg %s is not adjacent to neither end of db history: "
                 "add idx=%d, histlow=%d, histhigh=%d, histcount= %d",
-                table.c_str(), mChat.chatId().toString().c_str(), msg.id().toString().c_str(),
+                tableName(table), mChat.chatId().toString().c_str(), msg.id().toString().c_str(),
                 idx, low, high, count);
             assert(false);
         }
+    }
 #endif
-        std::string query = "insert into " + table + " (idx, chatid, msgid, keyid, type, userid, ts, updated, data, backrefid, is_encrypted) " +
-                                                     "values(?,?,?,?,?,?,?,?,?,?,?)";
-        mDb.query(query.c_str(), idx, mChat.chatId(), msg.id(), msg.keyid,
+
+    void addMessage(const chatd::Message& msg, chatd::Idx idx, HistoryTable table)
+    {
+        mDb.query((table == kHistory)
+            ? "insert into history (idx, chatid, msgid, keyid, type, userid, ts, updated, data, backrefid, is_encrypted) "
+              "values(?,?,?,?,?,?,?,?,?,?,?)"
+            : "insert into node_history (idx, chatid, msgid, keyid, type, userid, ts, updated, data, backrefid, is_encrypted) "
+              "values(?,?,?,?,?,?,?,?,?,?,?)",
+            idx, mChat.chatId(), msg.id(), msg.keyid,
             msg.type, msg.userid, msg.ts, msg.updated, msg, msg.backRefId, msg.isEncrypted());
     }
 
@@ -98,10 +225,16 @@ public:
         Buffer rcpts;
         item.recipients.save(rcpts);
 
+        // if the item was encrypted right away, its commands are written in the
+        // same insert, so the row is written only once
         mDb.query("insert into sending (chatid, opcode, ts, msgid, msg, type, updated, "
-                         "recipients, backrefid, backrefs) values(?,?,?,?,?,?,?,?,?,?)",
+                         "recipients, backrefid, backrefs, keyid, msg_cmd, key_cmd) "
+                         "values(?,?,?,?,?,?,?,?,?,?,?,?,?)",
             (uint64_t)mChat.chatId(), opcode, msg->ts, msg->id(),
-            *msg, msg->type, msg->updated, rcpts, msg->backRefId, msg->backrefBuf());
+            *msg, msg->type, msg->updated, rcpts, msg->backRefId, msg->backrefBuf(),
+            item.msgCmd ? msg->keyid : (chatd::KeyId)CHATD_KEYID_INVALID,
+            item.msgCmd ? item.msgCmd->msg() : StaticBuffer(nullptr, 0),
+            item.keyCmd ? item.keyCmd->keyblob() : StaticBuffer(nullptr, 0));
 
         // assign the given rowid to the SendingItem
         item.rowid = sqlite3_last_insert_rowid(mDb);
@@ -109,7 +242,7 @@ public:
 
     virtual int updateSendingItemsKeyid(chatd::KeyId localkeyid, chatd::KeyId keyid)
     {
-        mDb.query("update sending set keyid = ? where keyid = ? and chatid = ?", keyid, localkeyid, mChat.chatId());
+        mDb.query(chatd::sql::kSendingConfirmKeyid, keyid, localkeyid, mChat.chatId());
         return sqlite3_changes(mDb);
     }
 
@@ -129,7 +262,7 @@ public:
     virtual int updateSendingItemsMsgidAndOpcode(karere::Id msgxid, karere::Id msgid)
     {
         mDb.query(
-            "update sending set opcode=?, msgid=? where chatid=? and opcode=? and msgid=?",
+            chatd::sql::kSendingUpdateMsgid,
             chatd::OP_MSGUPD, msgid, mChat.chatId(), chatd::OP_MSGUPDX, msgxid);
         return sqlite3_changes(mDb);
     }
@@ -141,13 +274,56 @@ public:
     }
     virtual int updateSendingItemsContentAndDelta(const chatd::Message& msg)
     {
-        mDb.query("update sending set msg = ?, updated = ? where msgid = ? and chatid = ?",
+        mDb.query(chatd::sql::kSendingUpdateMsg,
                   msg, msg.updated, msg.id(), mChat.chatId());
         return sqlite3_changes(mDb);
     }
     virtual void addMsgToHistory(const chatd::Message& msg, chatd::Idx idx)
     {
-        addMessage(msg, idx, "history");
+#ifndef NDEBUG
+        // avoid querying the db range for every message of a batch
+        if (!mInHistoryBatch)
+        {
+            checkHistoryContinuity(msg, idx, kHistory);
+        }
+        else if (mBatchLowIdx == CHATD_IDX_INVALID)
+        {
+            checkHistoryContinuity(msg, idx, kHistory);
+            mBatchLowIdx = mBatchHighIdx = idx;
+        }
+        else if (idx == mBatchLowIdx - 1)
+        {
+            mBatchLowIdx = idx;
+        }
+        else if (idx == mBatchHighIdx + 1)
+        {
+            mBatchHighIdx = idx;
+        }
+        else
+        {
+            CHATD_LOG_ERROR("chatid %s: addMsgToHistory: history discontinuity detected: "
+                "index of added msg %s is not adjacent to neither end of the current batch: "
+                "add idx=%d, batchlow=%d, batchhigh=%d", mChat.chatId().toString().c_str(),
+                msg.id().toString().c_str(), idx, mBatchLowIdx, mBatchHighIdx);
+            assert(false);
+        }
+#endif
+        addMessage(msg, idx, kHistory);
+    }
+    virtual void beginHistoryBatch()
+    {
+        assert(!mInHistoryBatch);
+        mInHistoryBatch = true;
+        mDb.beginBatch();
+    }
+    virtual void endHistoryBatch()
+    {
+        assert(mInHistoryBatch);
+        mInHistoryBatch = false;
+#ifndef NDEBUG
+        mBatchLowIdx = mBatchHighIdx = CHATD_IDX_INVALID;
+#endif
+        mDb.endBatch();
     }
     virtual void updateMsgInHistory(karere::Id msgid, const chatd::Message& msg)
     {
@@ -166,17 +342,16 @@ public:
 
     virtual void getMessageDelta(karere::Id msgid, uint16_t *updated)
     {
-        SqliteStmt stmt3(mDb, "select updated from history where chatid = ? and msgid = ?");
-        stmt3 << mChat.chatId() << msgid;
-        stmt3.stepMustHaveData();
-        *updated = stmt3.intCol(0);
+        SqliteStmt& stmt = mDb.cachedStmt(chatd::sql::kHistoryMsgUpdated);
+        stmt << mChat.chatId() << msgid;
+        stmt.stepMustHaveData();
+        *updated = stmt.intCol(0);
+        stmt.reset();
     }
 
     virtual void loadSendQueue(chatd::Chat::OutputQueue& queue)
     {
-        SqliteStmt stmt(mDb, "select rowid, opcode, msgid, keyid, msg, type, "
-            "ts, updated, backrefid, backrefs, recipients, msg_cmd, key_cmd "
-            "from sending where chatid=? order by rowid asc");
+        SqliteStmt stmt(mDb, chatd::sql::kSendingLoadQueue);
         stmt << mChat.chatId();
 
         // Fill the sending queue with SendingItems from DB
@@ -244,33 +419,30 @@ public:
     }
     virtual void fetchDbHistory(chatd::Idx idx, unsigned count, std::vector<chatd::Message*>& messages)
     {
-        loadMessages(count, idx, messages, "history");
+        loadMessages(count, idx, messages, kHistory);
     }
 
-    virtual chatd::Idx getIdxOfMsgid(karere::Id msgid, const std::string &table)
+    chatd::Idx getIdxOfMsgid(karere::Id msgid, HistoryTable table)
     {
-        std::string query = "select idx from " + table + " where chatid = ? and msgid = ?";
-        SqliteStmt stmt(mDb, query.c_str());
+        SqliteStmt& stmt = mDb.cachedStmt((table == kHistory)
+            ? chatd::sql::kHistoryIdxOfMsgid
+            : chatd::sql::kNodeHistoryIdxOfMsgid);
         stmt << mChat.chatId() << msgid;
-        return (stmt.step()) ? stmt.int64Col(0) : CHATD_IDX_INVALID;
+        chatd::Idx idx = (stmt.step()) ? stmt.int64Col(0) : CHATD_IDX_INVALID;
+        stmt.reset();
+        return idx;
     }
 
     virtual chatd::Idx getIdxOfMsgidFromHistory(karere::Id msgid)
     {
-        return getIdxOfMsgid(msgid, "history");
+        return getIdxOfMsgid(msgid, kHistory);
     }
     virtual chatd::Idx getUnreadMsgCountAfterIdx(chatd::Idx idx)
     {
         // get the unread messages count --> conditions should match the ones in Message::isValidUnread()
-        std::string sql = "select count(*) from history where (chatid = ?1)"
-                "and (userid != ?2)"
-                "and not (updated != 0 and length(data) = 0)"
-                "and (is_encrypted = ?3 or is_encrypted = ?4 or is_encrypted = ?5)"
-                "and (type = ?6 or type = ?7 or type = ?8 or type = ?9 or type = ?10)";
-        if (idx != CHATD_IDX_INVALID)
-            sql+=" and (idx > ?)";
-
-        SqliteStmt stmt(mDb, sql);
+        SqliteStmt stmt(mDb, (idx != CHATD_IDX_INVALID)
+            ? chatd::sql::kHistoryUnreadCountAfterIdx
+            : chatd::sql::kHistoryUnreadCount);
         stmt << mChat.chatId() << mChat.client().myHandle()   // skip own messages
              << chatd::Message::kNotEncrypted               // include decrypted messages
              << chatd::Message::kEncryptedMalformed         // include encrypted messages due to malformed payload
@@ -295,8 +467,7 @@ public:
     }
     virtual void loadManualSendItems(std::vector<chatd::Chat::ManualSendItem>& items)
     {
-        SqliteStmt stmt(mDb, "select rowid, msgid, type, ts, updated, msg, opcode, "
-            "reason from manual_sending where chatid=? order by rowid asc");
+        SqliteStmt stmt(mDb, chatd::sql::kManualSendingLoad);
         stmt << mChat.chatId();
         while(stmt.step())
         {
@@ -347,10 +518,12 @@ public:
     }
     virtual chatd::Idx getOldestIdx()
     {
-        SqliteStmt stmt(mDb, "select min(idx) from history where chatid = ?");
+        SqliteStmt& stmt = mDb.cachedStmt(chatd::sql::kHistoryOldestIdx);
         stmt << mChat.chatId();
         stmt.stepMustHaveData(__FUNCTION__);
-        return stmt.uint64Col(0);
+        chatd::Idx idx = stmt.uint64Col(0);
+        stmt.reset();
+        return idx;
     }
     virtual void setLastSeen(karere::Id msgid)
     {
@@ -362,6 +535,10 @@ public:
         mDb.query("update chats set last_recv=? where chatid=?", msgid, mChat.chatId());
         assertAffectedRowCount(1);
     }
+    virtual void setUnreadCount(int count)
+    {
+        mDb.query("update chats set unread_count=? where chatid=?", count, mChat.chatId());
+    }
     virtual void setHaveAllHistory(bool haveAllHistory)
     {
         mDb.query(
@@ -378,10 +555,7 @@ public:
     }
     virtual void getLastTextMessage(chatd::Idx from, chatd::LastTextMsgState& msg)
     {
-        SqliteStmt stmt(mDb,
-            "select type, idx, data, msgid, userid from history where chatid=?1 and "
-            "(length(data) > 0 OR type = ?2) and type != ?3  and type != ?4 and (idx <= ?5)"
-            "order by idx desc limit 1");
+        SqliteStmt stmt(mDb, chatd::sql::kHistoryLastTextMsg);
         stmt << mChat.chatId()
              << chatd::Message::kMsgTruncate
              << chatd::Message::kMsgRevokeAttachment
@@ -405,9 +579,12 @@ public:
 
     virtual void addMsgToNodeHistory(const chatd::Message& msg, chatd::Idx idx)
     {
-        if (getIdxOfMsgid(msg.id(), "node_history") == CHATD_IDX_INVALID)
+        if (getIdxOfMsgid(msg.id(), kNodeHistory) == CHATD_IDX_INVALID)
         {
-            addMessage(msg, idx, "node_history");
+#ifndef NDEBUG
+            checkHistoryContinuity(msg, idx, kNodeHistory);
+#endif
+            addMessage(msg, idx, kNodeHistory);
             assertAffectedRowCount(1, "addMsgToNodeHistory");
         }
     }
@@ -421,7 +598,7 @@ public:
 
     virtual void truncateNodeHistory(karere::Id id)
     {
-        auto idx = getIdxOfMsgid(id, "node_history");
+        auto idx = getIdxOfMsgid(id, kNodeHistory);
         mDb.query("delete from node_history where chatid = ? and idx <= ?", mChat.chatId(), idx);
     }
 
@@ -432,7 +609,7 @@ public:
 
     virtual void getNodeHistoryInfo(chatd::Idx &newest, chatd::Idx &oldest)
     {
-        SqliteStmt stmt(mDb, "select min(idx), max(idx), count(*) from node_history where chatid=?1");
+        SqliteStmt stmt(mDb, chatd::sql::kNodeHistoryIdxRange);
         stmt.bind(mChat.chatId()).step(); //will always return a row, even if table empty
 
         int count = stmt.intCol(2);
@@ -443,20 +620,19 @@ public:
 
     virtual void fetchDbNodeHistory(chatd::Idx idx, unsigned count, std::vector<chatd::Message*>& messages)
     {
-        loadMessages(count, idx, messages, "node_history");
+        loadMessages(count, idx, messages, kNodeHistory);
     }
 
     virtual chatd::Idx getIdxOfMsgidFromNodeHistory(karere::Id msgid)
     {
-        return getIdxOfMsgid(msgid, "node_history");
+        return getIdxOfMsgid(msgid, kNodeHistory);
     }
 
-    void loadMessages(int count, chatd::Idx idx, std::vector<chatd::Message*>& messages, const std::string &table)
+    void loadMessages(int count, chatd::Idx idx, std::vector<chatd::Message*>& messages, HistoryTable table)
     {
-        std::string query = "select msgid, userid, ts, type, data, idx, keyid, backrefid, updated, is_encrypted from " + table +
-                            " where chatid = ?1 and idx <= ?2 order by idx desc limit ?3";
-
-        SqliteStmt stmt(mDb, query.c_str());
+        SqliteStmt stmt(mDb, (table == kHistory)
+            ? chatd::sql::kHistoryLoadMsgs
+            : chatd::sql::kNodeHistoryLoadMsgs);
         stmt << mChat.chatId() << idx << count;
         int i = 0;
         while(stmt.step())
@@ -473,7 +649,7 @@ public:
             if(tableIdx != idx - (int)messages.size()) //we go backward in history, hence the -messages.size()
             {
                 CHATD_LOG_ERROR("chatid %s: loadMessages from table %s: History discontinuity detected: "
-                    "expected idx %d, retrieved from db:%d", mChat.chatId().toString().c_str(), table.c_str(),
+                    "expected idx %d, retrieved from db:%d", mChat.chatId().toString().c_str(), tableName(table),
                     idx - (int)messages.size(), tableIdx);
                 assert(false);
             }
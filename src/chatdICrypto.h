@@ -69,6 +69,14 @@ public:
     virtual promise::Promise<std::pair<MsgCommand*, KeyCommand*> >
     msgEncrypt(Message* msg, const karere::SetOfIds &recipients, MsgCommand* cmd) = 0;
 
+    /**
+     * @brief Whether \c msgEncrypt() would encrypt a new message for \c recipients
+     * immediately, with the current send key, even if the NEWKEY of that key has not
+     * been sent yet. Used by the client to encrypt the sending queue ahead while a
+     * new key is being prepared.
+     */
+    virtual bool hasSendKeyFor(const karere::SetOfIds& /*recipients*/) const { return false; }
+
     /**
      * @brief Called by the client for received messages to decrypt them.
      * The crypto module \b must also set the type of the message, so that the client
@@ -77,6 +85,14 @@ public:
      */
     virtual promise::Promise<Message*> msgDecrypt(Message* src) = 0;
 
+    /**
+     * @brief Called by the client for received messages that are queued for decryption,
+     * because a previous message is still being decrypted. Messages are delivered to the
+     * app in order, so \c msgDecrypt() will be called for this message later on. Meanwhile,
+     * the crypto module may start the work, but must not modify the message.
+     */
+    virtual void prepareMsgDecrypt(Message* /*src*/) {}
+
     /**
      * @brief The chatroom connection (to the chatd server shard) state state has changed.
      */
@@ -92,6 +108,13 @@ public:
     /**  @brief A user has left the room */
     virtual void onUserLeave(karere::Id /*userid*/){}
 
+    /**
+     * @brief A NEWKEY command with keys from \c senders was received. Called before
+     * \c onKeyReceived() for each of the keys, so the crypto module can start
+     * fetching what it needs to decrypt all of them at once.
+     */
+    virtual void prefetchSenderKeys(const karere::SetOfIds& /*senders*/) {}
+
     /**
     * @brief A key was received from the server, and added to Chat.keys
     */
@@ -567,12 +567,30 @@ public:
         :Buffer(msg, msglen), mId(aMsgid), mIdIsXid(aIsSending), userid(aUserid), ts(aTs),
             updated(aUpdated), keyid(aKeyid), type(aType), userp(aUserp){}
 
+    /** @brief Creates a message whose contents reference \c msglen bytes at \c offset
+     * inside a received \c frame, without copying them. The message gets its own copy
+     * of the data once its contents are modified (i.e. upon decryption) */
+    explicit Message(karere::Id aMsgid, karere::Id aUserid, uint32_t aTs, uint16_t aUpdated,
+            const std::shared_ptr<Buffer>& frame, size_t offset, size_t msglen,
+            KeyId aKeyid=CHATD_KEYID_INVALID, unsigned char aType=kMsgInvalid)
+        :Buffer(0), mId(aMsgid), mIdIsXid(false), userid(aUserid), ts(aTs),
+            updated(aUpdated), keyid(aKeyid), type(aType), userp(nullptr)
+    {
+        assignSlice(frame, offset, msglen);
+    }
+
     Message(const Message& msg)
         : Buffer(msg.buf(), msg.dataSize()), mId(msg.id()), mIdIsXid(msg.mIdIsXid), mIsEncrypted(msg.mIsEncrypted),
           userid(msg.userid), ts(msg.ts), updated(msg.updated), keyid(msg.keyid), type(msg.type), backRefId(msg.backRefId),
           backRefs(msg.backRefs), userp(msg.userp), userFlags(msg.userFlags), richLinkRemoved(msg.richLinkRemoved)
     {}
 
+    Message(Message&& msg)
+        : Buffer(std::move(msg)), mId(msg.mId), mIdIsXid(msg.mIdIsXid), mIsEncrypted(msg.mIsEncrypted),
+          userid(msg.userid), ts(msg.ts), updated(msg.updated), keyid(msg.keyid), type(msg.type), backRefId(msg.backRefId),
+          backRefs(std::move(msg.backRefs)), userp(msg.userp), userFlags(msg.userFlags), richLinkRemoved(msg.richLinkRemoved)
+    {}
+
     /** @brief Returns the ManagementInfo structure contained within the message
      * content. Throws if the message is not a management message, or if the
      * size of the message contents is smaller than the size of ManagementInfo,
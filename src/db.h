@@ -2,6 +2,13 @@
 #define _KARERE_DB_H
 
 #include <sqlite3.h>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 
 struct SqliteString
 {
@@ -16,6 +23,119 @@ struct SqliteString
 };
 class SqliteStmt;
 
+/** @brief Counters of the cache of prepared statements of SqliteDb */
+struct SqliteStmtCacheStats
+{
+    uint64_t hits = 0;      ///< statements found already prepared
+    uint64_t misses = 0;    ///< statements that had to be prepared
+    uint64_t evictions = 0; ///< statements finalized to make room for others
+};
+
+/** @brief Counters of the commits and checkpoints of SqliteDb. Times are in microseconds */
+struct SqliteCommitStats
+{
+    uint64_t commits = 0;
+    uint64_t commitUsecs = 0;
+    uint64_t maxCommitUsecs = 0;
+    // why the transaction was committed by timedCommit()/idleCommit(), the rest are explicit commits
+    uint64_t rowCommits = 0;        ///< too many rows changed
+    uint64_t spillCommits = 0;      ///< dirty pages didn't fit in the page cache anymore
+    uint64_t timeCommits = 0;       ///< the commit interval elapsed
+    uint64_t idleCommits = 0;       ///< no writes for a while
+    uint64_t maxPendingRows = 0;    ///< the biggest transaction committed, in changed rows
+    uint64_t checkpoints = 0;       ///< only in WAL mode, done by the background thread
+    uint64_t checkpointUsecs = 0;
+    uint64_t maxCheckpointUsecs = 0;
+};
+
+/** @brief Thread that checkpoints a database in WAL mode, using its own connection.
+ * Commits in WAL mode with synchronous=NORMAL only append to the WAL file without
+ * syncing it, so the syncing is done here, off the thread that writes the db.
+ * Requests made while a checkpoint is pending are merged into it, so at most one
+ * is queued.
+ */
+class SqliteCheckpointer
+{
+protected:
+    sqlite3* mDb = nullptr;
+    std::thread mThread;
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    bool mRequested = false;
+    bool mTerminating = false;
+    uint64_t mCount = 0;
+    uint64_t mUsecs = 0;
+    uint64_t mMaxUsecs = 0;
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        for (;;)
+        {
+            mCondition.wait(lock, [this]() { return mTerminating || mRequested; });
+            if (mTerminating)
+                return;
+
+            mRequested = false;
+            lock.unlock();
+            // a passive checkpoint doesn't wait for the writer nor the readers,
+            // it copies what it can and the rest is done by the next one
+            auto start = std::chrono::steady_clock::now();
+            sqlite3_wal_checkpoint_v2(mDb, nullptr, SQLITE_CHECKPOINT_PASSIVE, nullptr, nullptr);
+            uint64_t usecs = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+            lock.lock();
+
+            mCount++;
+            mUsecs += usecs;
+            if (usecs > mMaxUsecs)
+                mMaxUsecs = usecs;
+        }
+    }
+
+public:
+    /** Returns false if the database could not be opened */
+    bool start(const char* fname)
+    {
+        assert(!mDb);
+        if (sqlite3_open_v2(fname, &mDb, SQLITE_OPEN_READWRITE | SQLITE_OPEN_FULLMUTEX, nullptr) != SQLITE_OK)
+        {
+            sqlite3_close(mDb);
+            mDb = nullptr;
+            return false;
+        }
+        mThread = std::thread(&SqliteCheckpointer::run, this);
+        return true;
+    }
+    ~SqliteCheckpointer()
+    {
+        if (!mDb)
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mTerminating = true;
+        }
+        mCondition.notify_one();
+        mThread.join();
+        sqlite3_close(mDb);
+    }
+    void request()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mRequested = true;
+        }
+        mCondition.notify_one();
+    }
+    void addStats(SqliteCommitStats& stats)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        stats.checkpoints = mCount;
+        stats.checkpointUsecs = mUsecs;
+        stats.maxCheckpointUsecs = mMaxUsecs;
+    }
+};
+
 class SqliteDb
 {
 protected:
@@ -25,7 +145,29 @@ protected:
     bool mHasOpenTransaction = false;
     uint16_t mCommitInterval = 20;
     time_t mLastCommitTs = 0;
+    /** Rows changed by the open transaction */
+    uint32_t mPendingRows = 0;
+    /** Number of changed rows after which the transaction is committed */
+    uint32_t mCommitMaxRows = kDefaultCommitMaxRows;
+    time_t mLastWriteTs = 0;
+    /** Number of nested beginBatch() calls not yet ended */
+    int mBatchCount = 0;
+    /** Whether the open transaction was started by beginBatch() */
+    bool mBatchTransaction = false;
+    typedef std::list<std::pair<std::string, std::unique_ptr<SqliteStmt>>> StmtList;
+    /** Prepared statements reused across calls, the most recently used first. See cachedStmt() */
+    StmtList mStmtCache;
+    /** Index of mStmtCache by sql */
+    std::unordered_map<std::string, StmtList::iterator> mStmtCacheIndex;
+    /** Max number of statements in mStmtCache */
+    size_t mStmtCacheSize = kDefaultStmtCacheSize;
+    SqliteStmtCacheStats mStmtCacheStats;
+    /** Whether the db is opened in WAL mode, with the checkpoints done by mCheckpointer */
+    bool mWalMode = false;
+    std::unique_ptr<SqliteCheckpointer> mCheckpointer;
+    SqliteCommitStats mCommitStats;
     inline int step(SqliteStmt& stmt);
+    inline void clearStmtCache();
     void beginTransaction()
     {
         assert(!mHasOpenTransaction);
@@ -36,12 +178,93 @@ protected:
     {
         if (!mHasOpenTransaction)
             return false;
+        auto start = std::chrono::steady_clock::now();
         simpleQuery("COMMIT TRANSACTION");
+        uint64_t usecs = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
         mHasOpenTransaction = false;
         mLastCommitTs = time(NULL);
+        mCommitStats.commits++;
+        mCommitStats.commitUsecs += usecs;
+        if (usecs > mCommitStats.maxCommitUsecs)
+            mCommitStats.maxCommitUsecs = usecs;
+        if (mPendingRows > mCommitStats.maxPendingRows)
+            mCommitStats.maxPendingRows = mPendingRows;
+        mPendingRows = 0;
+        mLastWriteTs = 0;
+        if (mCheckpointer)
+            mCheckpointer->request();
+        return true;
+    }
+    /** Runs a journal_mode pragma and returns the resulting mode */
+    std::string journalModeQuery(const char* sql)
+    {
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(mDb, sql, -1, &stmt, nullptr) != SQLITE_OK)
+            throw std::runtime_error(sqlite3_errmsg(mDb));
+        std::string mode;
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+            mode = (const char*)sqlite3_column_text(stmt, 0);
+        sqlite3_finalize(stmt);
+        return mode;
+    }
+    /** Switches the journal to WAL, or back to the default one if the db was left
+     * in WAL mode. Must be called without an open transaction */
+    void setupJournal(const char* fname)
+    {
+        std::string mode = journalModeQuery("pragma journal_mode");
+        if (!mWalMode)
+        {
+            if (mode == "wal")
+                journalModeQuery("pragma journal_mode=DELETE");
+            return;
+        }
+        if (mode != "wal" && journalModeQuery("pragma journal_mode=WAL") != "wal")
+            return; // not supported, i.e. an in-memory db
+
+        simpleQuery("pragma synchronous=NORMAL");
+        simpleQuery("pragma wal_autocheckpoint=0");
+        mCheckpointer.reset(new SqliteCheckpointer);
+        if (!mCheckpointer->start(fname))
+        {
+            // fall back to the automatic checkpoints, done by the commits
+            mCheckpointer.reset();
+            simpleQuery("pragma wal_autocheckpoint=1000");
+        }
+    }
+    /** Returns the counter of the reason to commit the open transaction, or nullptr if it
+     * can wait. Besides the max commit interval, the transaction is committed when it
+     * gets big: too many changed rows, or dirty pages that sqlite had to spill to the
+     * db file because they didn't fit in the page cache */
+    uint64_t* commitReason()
+    {
+        if (mPendingRows >= mCommitMaxRows)
+            return &mCommitStats.rowCommits;
+#ifdef SQLITE_DBSTATUS_CACHE_SPILL
+        if (mPendingRows)
+        {
+            int spills = 0, highwater = 0;
+            if (sqlite3_db_status(mDb, SQLITE_DBSTATUS_CACHE_SPILL, &spills, &highwater, 1) == SQLITE_OK
+                && spills)
+                return &mCommitStats.spillCommits;
+        }
+#endif
+        if (time(NULL) - mLastCommitTs >= mCommitInterval)
+            return &mCommitStats.timeCommits;
+        return nullptr;
+    }
+    bool autoCommit(uint64_t* reason)
+    {
+        commitTransaction();
+        beginTransaction();
+        (*reason)++;
         return true;
     }
 public:
+    enum { kDefaultStmtCacheSize = 64 };
+    enum { kDefaultCommitMaxRows = 1000 };
+    /** Seconds without writes after which idleCommit() commits the pending changes */
+    enum { kIdleCommitDelay = 2 };
     SqliteDb(sqlite3* db=nullptr, uint16_t commitInterval=20)
     : mDb(db), mCommitInterval(commitInterval)
     {}
@@ -57,6 +280,17 @@ public:
             mDb = nullptr;
             return false;
         }
+        try
+        {
+            setupJournal(fname);
+        }
+        catch(std::exception&)
+        {
+            mCheckpointer.reset();
+            sqlite3_close(mDb);
+            mDb = nullptr;
+            return false;
+        }
         mCommitEach = commitEach;
         if (!mCommitEach)
         {
@@ -69,11 +303,18 @@ public:
     {
         if (!mDb)
             return;
-        if (!mCommitEach)
+        if (!mCommitEach || mBatchTransaction)
             commitTransaction();
+        clearStmtCache();
+        mBatchCount = 0;
+        mBatchTransaction = false;
+        // closing the last connection checkpoints the remaining of the WAL
+        mCheckpointer.reset();
         sqlite3_close(mDb);
         mDb = nullptr;
         mLastCommitTs = 0;
+        mPendingRows = 0;
+        mLastWriteTs = 0;
     }
     bool isOpen() const { return mDb != nullptr; }
     void setCommitMode(bool commitEach)
@@ -86,12 +327,40 @@ public:
             commitTransaction();
         }
     }
+    /** @brief Sets the max time a change stays uncommitted, if not committed before
+     * because the transaction got big or the db went idle */
     void setCommitInterval(uint16_t sec) { mCommitInterval = sec; }
+    void setCommitMaxRows(uint32_t rows) { mCommitMaxRows = rows; }
+    uint32_t pendingRows() const { return mPendingRows; }
+    /** @brief Enables the WAL mode, applied the next time the db is opened.
+     * Commits then don't sync the disk, and the WAL is checkpointed (and synced)
+     * by a background thread after each commit. */
+    void setWalMode(bool enable) { mWalMode = enable; }
+    bool walMode() const { return mWalMode; }
+    SqliteCommitStats commitStats()
+    {
+        SqliteCommitStats stats = mCommitStats;
+        if (mCheckpointer)
+            mCheckpointer->addStats(stats);
+        return stats;
+    }
     bool hasOpenTransaction() const { return !mHasOpenTransaction; }
     operator sqlite3*() { return mDb; }
     operator const sqlite3*() const { return mDb; }
     template <class... Args>
     inline bool query(const char* sql, Args&&... args);
+    /** @brief Returns a prepared statement for \c sql, reset and with no bindings,
+     * ready to be bound and stepped. The statement is prepared only if it's not already
+     * in the cache of the most recently used statements.
+     * It is owned by the db, and remains valid until the db is closed or the statement
+     * is evicted from the cache, so the reference should not be kept across calls that
+     * may use other cached statements. It should be reset after use if it returned
+     * rows, so it doesn't keep the read transaction open.
+     */
+    inline SqliteStmt& cachedStmt(const char* sql);
+    /** @brief Sets the max number of prepared statements kept by \c cachedStmt() */
+    inline void setStmtCacheSize(size_t size);
+    const SqliteStmtCacheStats& stmtCacheStats() const { return mStmtCacheStats; }
     void simpleQuery(const char* sql)
     {
         SqliteString err;
@@ -127,16 +396,50 @@ public:
     }
     bool timedCommit()
     {
-        if (mCommitEach)
+        if (mCommitEach && !mBatchTransaction)
             return false;
 
-        auto now = time(NULL);
-        if (now - mLastCommitTs < mCommitInterval)
+        auto reason = commitReason();
+        return reason ? autoCommit(reason) : false;
+    }
+    /** @brief To be called periodically: besides the checks of timedCommit(), it
+     * commits the pending changes if there were no writes for kIdleCommitDelay, so
+     * that a burst of writes is committed at once, soon after it ends */
+    bool idleCommit()
+    {
+        if (mCommitEach && !mBatchTransaction)
             return false;
 
-        commit();
-        return true;
+        if (mPendingRows && time(NULL) - mLastWriteTs >= kIdleCommitDelay)
+            return autoCommit(&mCommitStats.idleCommits);
+        return timedCommit();
+    }
+    /** @brief Groups all the writes until the matching endBatch() in a single
+     * transaction, instead of committing each of them separately. Calls can be nested.
+     * If not in commit-each mode, the writes are already grouped and this has no effect.
+     * The batch is still committed periodically, as in non-commit-each mode.
+     */
+    void beginBatch()
+    {
+        if (mBatchCount++ || !mCommitEach || mHasOpenTransaction)
+            return;
+
+        beginTransaction();
+        mBatchTransaction = true;
+        mLastCommitTs = time(NULL);
     }
+    void endBatch()
+    {
+        if (!mBatchCount) // the db was closed meanwhile
+            return;
+        if (--mBatchCount || !mBatchTransaction)
+            return;
+
+        mBatchTransaction = false;
+        if (mCommitEach)
+            commitTransaction();
+    }
+    bool isInBatch() const { return mBatchCount > 0; }
 };
 
 class SqliteStmt
@@ -286,9 +589,51 @@ public:
 template <class... Args>
 inline bool SqliteDb::query(const char* sql, Args&&... args)
 {
-    SqliteStmt stmt(*this, sql);
+    SqliteStmt& stmt = cachedStmt(sql);
     stmt.bindV(args...);
-    return stmt.step();
+    bool hasRow = stmt.step();
+    sqlite3_reset(stmt);
+    return hasRow;
+}
+
+inline SqliteStmt& SqliteDb::cachedStmt(const char* sql)
+{
+    std::string key(sql);
+    auto it = mStmtCacheIndex.find(key);
+    if (it != mStmtCacheIndex.end())
+    {
+        mStmtCacheStats.hits++;
+        mStmtCache.splice(mStmtCache.begin(), mStmtCache, it->second);
+        SqliteStmt& stmt = *mStmtCache.front().second;
+        // sqlite3_reset() returns the error of the last step, if any, which doesn't concern us anymore
+        sqlite3_reset(stmt);
+        stmt.clearBind();
+        return stmt;
+    }
+
+    mStmtCacheStats.misses++;
+    std::unique_ptr<SqliteStmt> stmt(new SqliteStmt(*this, sql));
+    mStmtCache.emplace_front(key, std::move(stmt));
+    mStmtCacheIndex[key] = mStmtCache.begin();
+    setStmtCacheSize(mStmtCacheSize); // evict the least recently used, if needed
+    return *mStmtCache.front().second;
+}
+
+inline void SqliteDb::setStmtCacheSize(size_t size)
+{
+    mStmtCacheSize = size ? size : 1;
+    while (mStmtCacheIndex.size() > mStmtCacheSize)
+    {
+        mStmtCacheIndex.erase(mStmtCache.back().first);
+        mStmtCache.pop_back();
+        mStmtCacheStats.evictions++;
+    }
+}
+
+inline void SqliteDb::clearStmtCache()
+{
+    mStmtCacheIndex.clear();
+    mStmtCache.clear();
 }
 
 inline int SqliteDb::step(SqliteStmt& stmt)
@@ -296,6 +641,11 @@ inline int SqliteDb::step(SqliteStmt& stmt)
     auto ret = sqlite3_step(stmt);
     if (ret == SQLITE_DONE)
     {
+        if (mHasOpenTransaction && !sqlite3_stmt_readonly(stmt))
+        {
+            mPendingRows += sqlite3_changes(mDb);
+            mLastWriteTs = time(NULL);
+        }
         timedCommit();
     }
     return ret;
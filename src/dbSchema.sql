@@ -3,16 +3,21 @@ CREATE TABLE sending(rowid integer primary key autoincrement, msgid int64, keyid
     opcode smallint not null, msg_cmd blob, key_cmd blob, recipients blob not null,
     backrefid int64 not null, backrefs blob);
 
+CREATE INDEX sending_chatid ON sending(chatid);
+
 CREATE TABLE manual_sending(rowid integer primary key autoincrement, msgid int64,
     chatid int64 not null, type tinyint, ts int, updated smallint, msg blob,
     opcode smallint not null, reason smallint not null);
 
+CREATE INDEX manual_sending_chatid ON manual_sending(chatid);
+
 CREATE TABLE vars(name text not null primary key, value blob);
 
 CREATE TABLE chats(chatid int64 unique primary key, shard tinyint,
     own_priv tinyint, peer int64 default -1, peer_priv tinyint default 0,
     title text, ts_created int64 not null default 0,
-    last_seen int64 default 0, last_recv int64 default 0, archived tinyint);
+    last_seen int64 default 0, last_recv int64 default 0, archived tinyint,
+    unread_count int);
 
 CREATE TABLE contacts(userid int64 PRIMARY KEY, email text, visibility int,
     since int64 not null default 0);
@@ -31,9 +36,14 @@ CREATE TABLE history(idx int not null, chatid int64 not null, msgid int64 not nu
     userid int64, keyid int not null, type tinyint, updated smallint, ts int,
     is_encrypted tinyint, data blob, backrefid int64 not null, UNIQUE(chatid,msgid), UNIQUE(chatid,idx));
 
+CREATE INDEX history_unread ON history(chatid, idx, userid, type, is_encrypted)
+    WHERE not (updated != 0 and length(data) = 0);
+
 CREATE TABLE sendkeys(chatid int64 not null, userid int64 not null, keyid int64 not null, key blob not null,
     ts int not null, UNIQUE(chatid, userid, keyid));
 
+CREATE TABLE shared_secrets(userid int64 not null primary key, pubkey blob not null, secret blob not null);
+
 CREATE TABLE node_history(idx int not null, chatid int64 not null, msgid int64 not null,
     userid int64, keyid int not null, type tinyint, updated smallint, ts int,
     is_encrypted tinyint, data blob, backrefid int64 not null, UNIQUE(chatid,msgid), UNIQUE(chatid,idx));
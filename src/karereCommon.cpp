@@ -11,7 +11,7 @@ namespace rtcModule {void globalCleanup(); }
 
 namespace karere
 {
-const char* gDbSchemaVersionSuffix = "5";
+const char* gDbSchemaVersionSuffix = "8";
 // 2 --> +3: invalidate cached chats to reload history (so call-history msgs are fetched)
 // 3 --> +4: invalidate both caches, SDK + MEGAchat, if there's at least one chat (so deleted chats are re-fetched from API)
 // 4 --> +5: modify attachment, revoke, contact and containsMeta and create a new table node_history
@@ -72,4 +72,9 @@ void init_uv_timer(void *ctx, uv_timer_t *timer)
 {
     uv_timer_init(((::mega::LibuvWaiter *)(((megachat::MegaChatApiImpl *)ctx)->waiter))->eventloop, timer);
 }
+
+LoopTimerWheel& loop_timer_wheel(void *ctx)
+{
+    return ((megachat::MegaChatApiImpl *)ctx)->timerWheel;
+}
 }
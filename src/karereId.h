@@ -6,6 +6,7 @@
 #include <set>
 #include "base64url.h"
 #include <buffer.h>
+#include <base/flatMap.h>
 
 namespace karere
 {
@@ -79,4 +80,11 @@ namespace std
     struct hash<karere::Id> { size_t operator()(const karere::Id& id) const { return hash<uint64_t>()(id.val); } };
 }
 
+namespace karere
+{
+/** @brief Hash map with karere::Id keys, see FlatMap */
+template <class T>
+using IdMap = FlatMap<Id, T>;
+}
+
 #endif
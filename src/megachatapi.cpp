@@ -252,6 +252,31 @@ void MegaChatApi::setLogToConsole(bool enable)
     MegaChatApiImpl::setLogToConsole(enable);
 }
 
+void MegaChatApi::setPersistSharedSecrets(bool enable)
+{
+    pImpl->setPersistSharedSecrets(enable);
+}
+
+void MegaChatApi::setDbWalMode(bool enable)
+{
+    pImpl->setDbWalMode(enable);
+}
+
+void MegaChatApi::setCryptoThreadCount(unsigned int count)
+{
+    pImpl->setCryptoThreadCount(count);
+}
+
+void MegaChatApi::setLazyChatRooms(bool enable)
+{
+    pImpl->setLazyChatRooms(enable);
+}
+
+void MegaChatApi::setHistoryRamLimit(unsigned int bytes)
+{
+    pImpl->setHistoryRamLimit(bytes);
+}
+
 int MegaChatApi::init(const char *sid)
 {
     return pImpl->init(sid);
@@ -422,6 +447,11 @@ char *MegaChatApi::getMyEmail()
     return pImpl->getMyEmail();
 }
 
+char *MegaChatApi::getInitTrace()
+{
+    return pImpl->getInitTrace();
+}
+
 MegaChatRoomList *MegaChatApi::getChatRooms()
 {
     return pImpl->getChatRooms();
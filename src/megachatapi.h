@@ -26,6 +26,7 @@
 #include <megaapi.h>
 
 namespace mega { class MegaApi; }
+class MegaChatApiTest; // the automated tests, which also check some internals of the client
 
 namespace megachat
 {
@@ -2071,6 +2072,98 @@ public:
      */
     static void setLogToConsole(bool enable);
 
+    /**
+     * @brief Enable/disable the persistence of the shared secrets with other users
+     *
+     * The keys of messages are encrypted to each participant with a secret shared with
+     * that user, which is costly to compute. When enabled, those secrets are stored
+     * (encrypted) in the local cache, so they are not computed again in later sessions.
+     * A secret is discarded when the public key of the user changes.
+     *
+     * By default, it's disabled.
+     *
+     * This method should be called before MegaChatApi::init. It takes effect on the
+     * next call to MegaChatApi::init.
+     *
+     * @param enable True to persist the shared secrets. False to compute them in every session.
+     */
+    void setPersistSharedSecrets(bool enable);
+
+    /**
+     * @brief Enable/disable the WAL journal mode of the local cache
+     *
+     * In WAL mode, the commits of changes to the local cache don't wait for the disk
+     * to be synced, which is done afterwards by a background thread. The last changes
+     * may be lost if the device loses power, but not if the app crashes.
+     *
+     * By default, it's disabled.
+     *
+     * This method should be called before MegaChatApi::init. It takes effect on the
+     * next call to MegaChatApi::init.
+     *
+     * @param enable True to use the WAL journal mode. False to use the default journal.
+     */
+    void setDbWalMode(bool enable);
+
+    /**
+     * @brief Set the number of threads that verify and decrypt the received messages
+     *
+     * The messages are still notified in the same order they were received. With several
+     * threads, big batches of history are decrypted faster and the thread of MegaChatApi
+     * is freed for other tasks.
+     *
+     * By default, zero threads are used and the messages are decrypted by the thread
+     * of MegaChatApi.
+     *
+     * This method should be called before MegaChatApi::init. It takes effect on the
+     * next call to MegaChatApi::init.
+     *
+     * @param count Number of threads
+     */
+    void setCryptoThreadCount(unsigned int count);
+
+    /**
+     * @brief Enable/disable the lazy loading of the chatrooms from the local cache
+     *
+     * When enabled, the chatrooms loaded from the local cache don't load their history,
+     * their pending messages or their keys until the app opens them, sends messages to
+     * them or a push notification is received for them. Meanwhile, they are still joined
+     * to the chat server, and their unread count and last message are the ones in the local
+     * cache. When a new message, an edited message, a change of the unread count from another
+     * client or a call is received for one of them, the chatroom is loaded, and the changes
+     * are notified as usual. Chatrooms with messages pending to be sent or without messages
+     * in the local cache are loaded anyway.
+     *
+     * It reduces the time and memory needed to initialize accounts with many chatrooms.
+     *
+     * By default, it's disabled.
+     *
+     * This method should be called before MegaChatApi::init. It takes effect on the
+     * next call to MegaChatApi::init.
+     *
+     * @param enable True to load the chatrooms lazily. False to load all of them on init.
+     */
+    void setLazyChatRooms(bool enable);
+
+    /**
+     * @brief Set the max amount of RAM used by the history messages of each chatroom
+     *
+     * When the history loaded by the app is reset (i.e. when the chatroom is closed or
+     * the history is loaded again from the newest message), the oldest messages beyond
+     * the limit are removed from RAM. They remain in the local cache, so MegaChatApi::loadMessages
+     * loads them again from there when needed. The newest message is always kept.
+     *
+     * It reduces the memory used by accounts with long histories in many chatrooms.
+     *
+     * By default, there's no limit.
+     *
+     * This method should be called before MegaChatApi::init. It takes effect on the
+     * next call to MegaChatApi::init.
+     *
+     * @param bytes Max amount of RAM per chatroom, in bytes, or 0 for no limit
+     */
+    void setHistoryRamLimit(unsigned int bytes);
+
     /**
      * @brief Initializes karere
      *
@@ -2634,6 +2727,22 @@ public:
      */
     char *getMyEmail();
 
+    /**
+     * @brief Returns a report of the initialization of MEGAchat, in JSON format
+     *
+     * The report has a list of "phases", each of them with its "name", the "wall" and
+     * "cpu" time it took in microseconds, and the number of "rows" loaded from the
+     * local cache and "objects" created by it. It also has a list of "marks", with the
+     * "time" in microseconds since MegaChatApi::init at which the offline/online session
+     * was ready and the client was connected for the first time.
+     * The same report is logged once connected.
+     *
+     * You take the ownership of the returned value
+     *
+     * @return The report, or NULL if MegaChatApi::init was not called
+     */
+    char *getInitTrace();
+
 
     /**
      * @brief Get all chatrooms (1on1 and groupal) of this MEGA account
@@ -2642,6 +2751,12 @@ public:
      * state should be \c MegaChatApi::INIT_OFFLINE_SESSION or \c MegaChatApi::INIT_ONLINE_SESSION)
      * before calling this function.
      *
+     * The data is not read from the chat engine, but from a copy that is updated
+     * right before every change of the chatroom is notified to MegaChatRoomListener::onChatRoomUpdate
+     * or MegaChatListener::onChatListItemUpdate, and before the MegaChatRequestListener::onRequestFinish
+     * of the requests related to the chatroom. New chatrooms are available before their
+     * first notification. Hence, this function doesn't block while the chat engine is busy.
+     *
      * You take the ownership of the returned value
      *
      * @return List of MegaChatRoom objects with all chatrooms of this account.
@@ -2658,6 +2773,8 @@ public:
      * state should be \c MegaChatApi::INIT_OFFLINE_SESSION or \c MegaChatApi::INIT_ONLINE_SESSION)
      * before calling this function.
      *
+     * Like \c getChatRooms, it returns the data as of the latest notification of the chatroom.
+     *
      * You take the ownership of the returned value
      *
      * @param chatid MegaChatHandle that identifies the chat room
@@ -2675,6 +2792,9 @@ public:
      * state should be \c MegaChatApi::INIT_OFFLINE_SESSION or \c MegaChatApi::INIT_ONLINE_SESSION)
      * before calling this function.
      *
+     * Unlike \c getChatRoom, this function reads the data from the chat engine, so it
+     * may block while the chat engine is busy.
+     *
      * You take the ownership of the returned value
      *
      * @param userhandle MegaChatHandle that identifies the user
@@ -2696,6 +2816,12 @@ public:
      * This function filters out archived chatrooms. You can retrieve them by using
      * the function \c getArchivedChatListItems.
      *
+     * The data is not read from the chat engine, but from a copy that is updated
+     * right before every change of the chatroom is notified to MegaChatRoomListener::onChatRoomUpdate
+     * or MegaChatListener::onChatListItemUpdate, and before the MegaChatRequestListener::onRequestFinish
+     * of the requests related to the chatroom. New chatrooms are available before their
+     * first notification. Hence, this function doesn't block while the chat engine is busy.
+     *
      * You take the ownership of the returned value
      *
      * @return List of MegaChatListItemList objects with all chatrooms of this account.
@@ -2715,6 +2841,8 @@ public:
      *
      * This function returns even archived chatrooms.
      *
+     * Like \c getChatListItems, it returns the data as of the latest notification of each chatroom.
+     *
      * You take the ownership of the returned value
      *
      * @param peers MegaChatPeerList that contains the user handles of the chat participants,
@@ -2738,6 +2866,8 @@ public:
      * MegaChatRoom objects, but a limited set of data that is usually displayed
      * at the list of chatrooms, like the title of the chat or the unread count.
      *
+     * Like \c getChatListItems, it returns the data as of the latest notification of the chatroom.
+     *
      * You take the ownership of the returned value
      *
      * @param chatid MegaChatHandle that identifies the chat room
@@ -2748,6 +2878,8 @@ public:
     /**
      * @brief Return the number of chatrooms with unread messages
      *
+     * Like \c getChatListItems, it returns the data as of the latest notification of each chatroom.
+     *
      * Archived chatrooms with unread messages are not considered.
      *
      * @return The number of chatrooms with unread messages
@@ -2757,6 +2889,8 @@ public:
     /**
      * @brief Return the chatrooms that are currently active
      *
+     * Like \c getChatListItems, it returns the data as of the latest notification of each chatroom.
+     *
      * You take the onwership of the returned value.
      *
      * @return MegaChatListItemList including all the active chatrooms
@@ -2766,6 +2900,8 @@ public:
     /**
      * @brief Return the chatrooms that are currently inactive
      *
+     * Like \c getChatListItems, it returns the data as of the latest notification of each chatroom.
+     *
      * Chatrooms became inactive when you left a groupchat or you are removed by
      * a moderator. 1on1 chats do not become inactive, just read-only.
      *
@@ -2778,6 +2914,8 @@ public:
     /**
      * @brief Return the archived chatrooms
      *
+     * Like \c getChatListItems, it returns the data as of the latest notification of each chatroom.
+     *
      * You take the onwership of the returned value.
      *
      * @return MegaChatListItemList including all the archived chatrooms
@@ -2787,6 +2925,8 @@ public:
     /**
      * @brief Return the chatrooms that have unread messages
      *
+     * Like \c getChatListItems, it returns the data as of the latest notification of each chatroom.
+     *
      * Archived chatrooms with unread messages are not considered.
      *
      * You take the onwership of the returned value.
@@ -4219,6 +4359,7 @@ public:
 
 private:
     MegaChatApiImpl *pImpl;
+    friend class ::MegaChatApiTest;
 };
 
 /**
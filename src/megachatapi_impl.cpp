@@ -59,7 +59,7 @@ using namespace chatd;
 LoggerHandler *MegaChatApiImpl::loggerHandler = NULL;
 
 MegaChatApiImpl::MegaChatApiImpl(MegaChatApi *chatApi, MegaApi *megaApi)
-: sdkMutex(true), videoMutex(true)
+: sdkMutex(true), videoMutex(true), timerWheel(this)
 {
     init(chatApi, megaApi);
 }
@@ -67,8 +67,7 @@ MegaChatApiImpl::MegaChatApiImpl(MegaChatApi *chatApi, MegaApi *megaApi)
 MegaChatApiImpl::~MegaChatApiImpl()
 {
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_DELETE);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
     thread.join();
 
     // TODO: destruction of waiter hangs forever or may cause crashes
@@ -91,6 +90,13 @@ void MegaChatApiImpl::init(MegaChatApi *chatApi, MegaApi *megaApi)
 
     this->mClient = NULL;
     this->terminating = false;
+    this->mPersistSharedSecrets = false;
+    this->mDbWalMode = false;
+    this->mCryptoThreadCount = 0;
+    this->mLazyChatRooms = false;
+    this->mHistoryRamLimit = 0;
+    this->mChatSnapshots = std::make_shared<ChatSnapshotMap>();
+    this->mChatSnapshotsStale = false;
     this->waiter = new MegaChatWaiter();
     this->websocketsIO = new MegaWebsocketsIO(&sdkMutex, waiter, megaApi, this);
 
@@ -130,6 +136,11 @@ void MegaChatApiImpl::loop()
         sendPendingEvents();
         sendPendingRequests();
 
+        if (mChatSnapshotsStale)
+        {
+            publishChatSnapshots();
+        }
+
         if (threadExit)
         {
             // There must be only one pending events, at maximum: the logout marshall call to delete the client
@@ -165,8 +176,18 @@ void MegaChatApiImpl::megaApiPostMessage(void* msg, void* ctx)
 
 void MegaChatApiImpl::postMessage(void *msg)
 {
-    eventQueue.push(msg);
-    waiter->notify();
+    if (eventQueue.push(msg))
+    {
+        waiter->notify();
+    }
+}
+
+void MegaChatApiImpl::postRequest(MegaChatRequestPrivate *request)
+{
+    if (requestQueue.push(request))
+    {
+        waiter->notify();
+    }
 }
 
 void MegaChatApiImpl::sendPendingRequests()
@@ -323,6 +344,7 @@ void MegaChatApiImpl::sendPendingRequests()
             bool deleteDb = request->getFlag();
             terminating = true;
             mClient->terminate(deleteDb);
+            mChatSnapshotsStale = true;
 
             API_LOG_INFO("Chat engine is logged out!");
             marshallCall([request, this]() //post destruction asynchronously so that all pending messages get processed before that
@@ -986,6 +1008,10 @@ void MegaChatApiImpl::sendPendingRequests()
                         if (it->second->isArchived())
                             continue;
 
+                        // nor to create the chats of lazily loaded rooms without unread messages
+                        if (!it->second->hasChatdChat() && !it->second->unreadMsgCount())
+                            continue;
+
                         MegaHandleList *msgids = MegaHandleList::createInstance();
 
                         MegaChatHandle chatid = it->first;
@@ -1409,6 +1435,41 @@ void MegaChatApiImpl::setLoggerClass(MegaChatLogger *megaLogger)
     }
 }
 
+void MegaChatApiImpl::setPersistSharedSecrets(bool enable)
+{
+    sdkMutex.lock();
+    mPersistSharedSecrets = enable;
+    sdkMutex.unlock();
+}
+
+void MegaChatApiImpl::setDbWalMode(bool enable)
+{
+    sdkMutex.lock();
+    mDbWalMode = enable;
+    sdkMutex.unlock();
+}
+
+void MegaChatApiImpl::setCryptoThreadCount(unsigned int count)
+{
+    sdkMutex.lock();
+    mCryptoThreadCount = count;
+    sdkMutex.unlock();
+}
+
+void MegaChatApiImpl::setLazyChatRooms(bool enable)
+{
+    sdkMutex.lock();
+    mLazyChatRooms = enable;
+    sdkMutex.unlock();
+}
+
+void MegaChatApiImpl::setHistoryRamLimit(unsigned int bytes)
+{
+    sdkMutex.lock();
+    mHistoryRamLimit = bytes;
+    sdkMutex.unlock();
+}
+
 int MegaChatApiImpl::init(const char *sid)
 {
     sdkMutex.lock();
@@ -1423,6 +1484,11 @@ int MegaChatApiImpl::init(const char *sid)
         mClient = new karere::Client(*this->megaApi, websocketsIO, *this, this->megaApi->getBasePath(), caps, this);
         terminating = false;
     }
+    mClient->setPersistSharedSecrets(mPersistSharedSecrets);
+    mClient->setDbWalMode(mDbWalMode);
+    mClient->cryptoWorkers.setThreadCount(mCryptoThreadCount);
+    mClient->setLazyChatRooms(mLazyChatRooms);
+    mClient->setHistoryRamLimit(mHistoryRamLimit);
 
     int state = mClient->init(sid);
     if (state != karere::Client::kInitErrNoCache &&
@@ -1432,6 +1498,11 @@ int MegaChatApiImpl::init(const char *sid)
         // there's been an error during initialization
         localLogout();
     }
+    else
+    {
+        // chatrooms loaded from cache, if any
+        publishChatSnapshots();
+    }
 
     sdkMutex.unlock();
 
@@ -1501,6 +1572,98 @@ ChatRoom *MegaChatApiImpl::findChatRoom(MegaChatHandle chatid)
     return chatroom;
 }
 
+void MegaChatApiImpl::publishChatSnapshots()
+{
+    std::shared_ptr<ChatSnapshotMap> snapshots = std::make_shared<ChatSnapshotMap>();
+    if (mClient && !terminating)
+    {
+        ChatRoomList::iterator it;
+        for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
+        {
+            std::shared_ptr<ChatSnapshotSlot> slot = std::make_shared<ChatSnapshotSlot>();
+            slot->store(std::make_shared<ChatSnapshot>(*it->second));
+            snapshots->emplace(it->first, slot);
+        }
+    }
+
+    mChatSnapshotsStale = false;
+    std::atomic_store(&mChatSnapshots, std::shared_ptr<const ChatSnapshotMap>(snapshots));
+}
+
+void MegaChatApiImpl::addChatSnapshot(ChatRoom &chatroom)
+{
+    // the chatroom is available to the getters before it's notified to the listeners
+    std::shared_ptr<ChatSnapshotMap> snapshots = std::make_shared<ChatSnapshotMap>(*std::atomic_load(&mChatSnapshots));
+    std::shared_ptr<ChatSnapshotSlot> slot = std::make_shared<ChatSnapshotSlot>();
+    slot->store(std::make_shared<ChatSnapshot>(chatroom));
+    (*snapshots)[chatroom.chatid()] = slot;
+    std::atomic_store(&mChatSnapshots, std::shared_ptr<const ChatSnapshotMap>(snapshots));
+}
+
+void MegaChatApiImpl::removeChatSnapshot(MegaChatHandle chatid)
+{
+    std::shared_ptr<ChatSnapshotMap> snapshots = std::make_shared<ChatSnapshotMap>(*std::atomic_load(&mChatSnapshots));
+    if (snapshots->erase(chatid))
+    {
+        std::atomic_store(&mChatSnapshots, std::shared_ptr<const ChatSnapshotMap>(snapshots));
+    }
+}
+
+void MegaChatApiImpl::updateChatSnapshot(const MegaChatRoomPrivate &chatroom)
+{
+    std::shared_ptr<const ChatSnapshotMap> snapshots = std::atomic_load(&mChatSnapshots);
+    ChatSnapshotMap::const_iterator it = snapshots->find(chatroom.getChatId());
+    if (it == snapshots->end())
+    {
+        return;
+    }
+
+    // the chatlist item is notified separately
+    std::shared_ptr<MegaChatRoomPrivate> room = std::make_shared<MegaChatRoomPrivate>(&chatroom);
+    room->removeChanges();
+    it->second->store(std::make_shared<ChatSnapshot>(room, it->second->load()->item));
+}
+
+void MegaChatApiImpl::updateChatSnapshot(const MegaChatListItemPrivate &item)
+{
+    std::shared_ptr<const ChatSnapshotMap> snapshots = std::atomic_load(&mChatSnapshots);
+    ChatSnapshotMap::const_iterator it = snapshots->find(item.getChatId());
+    ChatRoom *chatRoom = findChatRoom(item.getChatId());
+    if (it == snapshots->end() || !chatRoom)
+    {
+        return;
+    }
+
+    // the changes of the chatroom are notified to its chatlist item even if the
+    // app hasn't opened it, so its data is taken again
+    std::shared_ptr<MegaChatListItemPrivate> listItem = std::make_shared<MegaChatListItemPrivate>(&item);
+    listItem->removeChanges();
+    it->second->store(std::make_shared<ChatSnapshot>(std::make_shared<MegaChatRoomPrivate>(*chatRoom), listItem));
+}
+
+void MegaChatApiImpl::refreshChatSnapshot(MegaChatHandle chatid)
+{
+    std::shared_ptr<const ChatSnapshotMap> snapshots = std::atomic_load(&mChatSnapshots);
+    ChatSnapshotMap::const_iterator it = snapshots->find(chatid);
+    ChatRoom *chatRoom = findChatRoom(chatid);
+    if (it != snapshots->end() && chatRoom)
+    {
+        it->second->store(std::make_shared<ChatSnapshot>(*chatRoom));
+    }
+}
+
+std::shared_ptr<const ChatSnapshot> MegaChatApiImpl::findChatSnapshot(MegaChatHandle chatid) const
+{
+    std::shared_ptr<const ChatSnapshotMap> snapshots = std::atomic_load(&mChatSnapshots);
+    ChatSnapshotMap::const_iterator it = snapshots->find(chatid);
+    if (it == snapshots->end())
+    {
+        return std::shared_ptr<const ChatSnapshot>();
+    }
+
+    return it->second->load();
+}
+
 karere::ChatRoom *MegaChatApiImpl::findChatRoomByUser(MegaChatHandle userhandle)
 {
     ChatRoom *chatroom = NULL;
@@ -1734,6 +1897,12 @@ void MegaChatApiImpl::fireOnChatRequestFinish(MegaChatRequestPrivate *request, M
         API_LOG_INFO("Request (%s) finished", request->getRequestString());
     }
 
+    // a request may change data of the chatroom that is not notified to the listeners
+    if (request->getChatHandle() != MEGACHAT_INVALID_HANDLE)
+    {
+        refreshChatSnapshot(request->getChatHandle());
+    }
+
     for (set<MegaChatRequestListener *>::iterator it = requestListeners.begin(); it != requestListeners.end() ; it++)
     {
         (*it)->onRequestFinish(chatApi, request, e);
@@ -1844,6 +2013,9 @@ void MegaChatApiImpl::fireOnChatVideoData(MegaChatHandle chatid, MegaChatHandle
 
 void MegaChatApiImpl::fireOnChatListItemUpdate(MegaChatListItem *item)
 {
+    // so the listeners get the updated chatroom if they call any getter
+    updateChatSnapshot(*static_cast<MegaChatListItemPrivate*>(item));
+
     for(set<MegaChatListener *>::iterator it = listeners.begin(); it != listeners.end() ; it++)
     {
         (*it)->onChatListItemUpdate(chatApi, item);
@@ -1914,23 +2086,20 @@ void MegaChatApiImpl::fireOnChatNotification(MegaChatHandle chatid, MegaChatMess
 void MegaChatApiImpl::connect(MegaChatRequestListener *listener)
 {
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_CONNECT, listener);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 void MegaChatApiImpl::connectInBackground(MegaChatRequestListener *listener)
 {
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_CONNECT, listener);
     request->setFlag(true);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 void MegaChatApiImpl::disconnect(MegaChatRequestListener *listener)
 {
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_DISCONNECT, listener);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 int MegaChatApiImpl::getConnectionState()
@@ -1972,32 +2141,28 @@ void MegaChatApiImpl::retryPendingConnections(bool disconnect, MegaChatRequestLi
 {
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_RETRY_PENDING_CONNECTIONS, listener);
     request->setFlag(disconnect);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 void MegaChatApiImpl::logout(MegaChatRequestListener *listener)
 {
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_LOGOUT, listener);
     request->setFlag(true);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 void MegaChatApiImpl::localLogout(MegaChatRequestListener *listener)
 {
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_LOGOUT, listener);
     request->setFlag(false);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 void MegaChatApiImpl::setOnlineStatus(int status, MegaChatRequestListener *listener)
 {
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_SET_ONLINE_STATUS, listener);
     request->setNumber(status);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 void MegaChatApiImpl::setPresenceAutoaway(bool enable, int64_t timeout, MegaChatRequestListener *listener)
@@ -2005,39 +2170,34 @@ void MegaChatApiImpl::setPresenceAutoaway(bool enable, int64_t timeout, MegaChat
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_SET_PRESENCE_AUTOAWAY, listener);
     request->setFlag(enable);
     request->setNumber(timeout);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 void MegaChatApiImpl::setPresencePersist(bool enable, MegaChatRequestListener *listener)
 {
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_SET_PRESENCE_PERSIST, listener);
     request->setFlag(enable);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 void MegaChatApiImpl::signalPresenceActivity(MegaChatRequestListener *listener)
 {
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_SIGNAL_ACTIVITY, listener);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 void MegaChatApiImpl::setLastGreenVisible(bool enable, MegaChatRequestListener *listener)
 {
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_SET_LAST_GREEN_VISIBLE, listener);
     request->setFlag(enable);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 void MegaChatApiImpl::requestLastGreen(MegaChatHandle userid, MegaChatRequestListener *listener)
 {
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_LAST_GREEN, listener);
     request->setUserHandle(userid);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 MegaChatPresenceConfig *MegaChatApiImpl::getPresenceConfig()
@@ -2139,8 +2299,7 @@ void MegaChatApiImpl::setBackgroundStatus(bool background, MegaChatRequestListen
 {
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_SET_BACKGROUND_STATUS, listener);
     request->setFlag(background);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 int MegaChatApiImpl::getBackgroundStatus()
@@ -2163,24 +2322,21 @@ void MegaChatApiImpl::getUserFirstname(MegaChatHandle userhandle, MegaChatReques
 {
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_GET_FIRSTNAME, listener);
     request->setUserHandle(userhandle);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 void MegaChatApiImpl::getUserLastname(MegaChatHandle userhandle, MegaChatRequestListener *listener)
 {
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_GET_LASTNAME, listener);
     request->setUserHandle(userhandle);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 void MegaChatApiImpl::getUserEmail(MegaChatHandle userhandle, MegaChatRequestListener *listener)
 {
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_GET_EMAIL, listener);
     request->setUserHandle(userhandle);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 char *MegaChatApiImpl::getContactEmail(MegaChatHandle userhandle)
@@ -2265,41 +2421,39 @@ char *MegaChatApiImpl::getMyEmail()
     return MegaApi::strdup(mClient->myEmail().c_str());
 }
 
-MegaChatRoomList *MegaChatApiImpl::getChatRooms()
+char *MegaChatApiImpl::getInitTrace()
 {
-    MegaChatRoomListPrivate *chats = new MegaChatRoomListPrivate();
+    // the tracer is updated by the karere thread while the initialization is in progress
+    char *report = NULL;
 
     sdkMutex.lock();
-
-    if (mClient && !terminating)
+    if (mClient)
     {
-        ChatRoomList::iterator it;
-        for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
-        {
-            chats->addChatRoom(new MegaChatRoomPrivate(*it->second));
-        }
+        report = MegaApi::strdup(mClient->initTracer().report().c_str());
     }
-
     sdkMutex.unlock();
 
-    return chats;
+    return report;
 }
 
-MegaChatRoom *MegaChatApiImpl::getChatRoom(MegaChatHandle chatid)
+MegaChatRoomList *MegaChatApiImpl::getChatRooms()
 {
-    MegaChatRoomPrivate *chat = NULL;
-
-    sdkMutex.lock();
+    MegaChatRoomListPrivate *chats = new MegaChatRoomListPrivate();
 
-    ChatRoom *chatRoom = findChatRoom(chatid);
-    if (chatRoom)
+    std::shared_ptr<const ChatSnapshotMap> snapshots = std::atomic_load(&mChatSnapshots);
+    ChatSnapshotMap::const_iterator it;
+    for (it = snapshots->begin(); it != snapshots->end(); it++)
     {
-        chat = new MegaChatRoomPrivate(*chatRoom);
+        chats->addChatRoom(it->second->load()->room->copy());
     }
 
-    sdkMutex.unlock();
+    return chats;
+}
 
-    return chat;
+MegaChatRoom *MegaChatApiImpl::getChatRoom(MegaChatHandle chatid)
+{
+    std::shared_ptr<const ChatSnapshot> snapshot = findChatSnapshot(chatid);
+    return snapshot ? snapshot->room->copy() : NULL;
 }
 
 MegaChatRoom *MegaChatApiImpl::getChatRoomByUser(MegaChatHandle userhandle)
@@ -2323,22 +2477,17 @@ MegaChatListItemList *MegaChatApiImpl::getChatListItems()
 {
     MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
 
-    sdkMutex.lock();
-
-    if (mClient && !terminating)
+    std::shared_ptr<const ChatSnapshotMap> snapshots = std::atomic_load(&mChatSnapshots);
+    ChatSnapshotMap::const_iterator it;
+    for (it = snapshots->begin(); it != snapshots->end(); it++)
     {
-        ChatRoomList::iterator it;
-        for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
+        std::shared_ptr<const ChatSnapshot> snapshot = it->second->load();
+        if (!snapshot->item->isArchived())
         {
-            if (!it->second->isArchived())
-            {
-                items->addChatListItem(new MegaChatListItemPrivate(*it->second));
-            }
+            items->addChatListItem(snapshot->item->copy());
         }
     }
 
-    sdkMutex.unlock();
-
     return items;
 }
 
@@ -2346,97 +2495,74 @@ MegaChatListItemList *MegaChatApiImpl::getChatListItemsByPeers(MegaChatPeerList
 {
     MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
 
-    sdkMutex.lock();
-
-    if (mClient && !terminating)
+    std::shared_ptr<const ChatSnapshotMap> snapshots = std::atomic_load(&mChatSnapshots);
+    ChatSnapshotMap::const_iterator it;
+    for (it = snapshots->begin(); it != snapshots->end(); it++)
     {
-        ChatRoomList::iterator it;
-        for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
+        std::shared_ptr<const ChatSnapshot> snapshot = it->second->load();
+        const MegaChatRoomPrivate &chatroom = *snapshot->room;
+        if (chatroom.isGroup())
         {
-            bool sameParticipants = true;
-            if (it->second->isGroup())
+            if ((int)chatroom.getPeerCount() != peers->size())
             {
-                GroupChatRoom *chatroom = (GroupChatRoom*) it->second;
-                if ((int)chatroom->peers().size() != peers->size())
-                {
-                    continue;
-                }
+                continue;
+            }
 
-                for (int i = 0; i < peers->size(); i++)
-                {
-                    // if the peer in the list is part of the members in the chatroom...
-                    MegaChatHandle uh = peers->getPeerHandle(i);
-                    if (chatroom->peers().find(uh) == chatroom->peers().end())
-                    {
-                        sameParticipants = false;
-                        break;
-                    }
-                }
-                if (sameParticipants == true)
+            bool sameParticipants = true;
+            for (int i = 0; i < peers->size(); i++)
+            {
+                // if the peer in the list is part of the members in the chatroom...
+                MegaChatHandle uh = peers->getPeerHandle(i);
+                if (chatroom.getPeerPrivilegeByHandle(uh) == MegaChatRoom::PRIV_UNKNOWN)
                 {
-                    items->addChatListItem(new MegaChatListItemPrivate(*it->second));
+                    sameParticipants = false;
+                    break;
                 }
-
             }
-            else    // 1on1
+            if (sameParticipants == true)
             {
-                if (peers->size() != 1)
-                {
-                    continue;
-                }
+                items->addChatListItem(snapshot->item->copy());
+            }
 
-                PeerChatRoom *chatroom = (PeerChatRoom*) it->second;
-                if (chatroom->peer() == peers->getPeerHandle(0))
-                {
-                    items->addChatListItem(new MegaChatListItemPrivate(*it->second));
-                }
+        }
+        else    // 1on1
+        {
+            if (peers->size() != 1)
+            {
+                continue;
+            }
+
+            if (snapshot->item->getPeerHandle() == peers->getPeerHandle(0))
+            {
+                items->addChatListItem(snapshot->item->copy());
             }
         }
     }
 
-    sdkMutex.unlock();
-
     return items;
 }
 
 MegaChatListItem *MegaChatApiImpl::getChatListItem(MegaChatHandle chatid)
 {
-    MegaChatListItemPrivate *item = NULL;
-
-    sdkMutex.lock();
-
-    ChatRoom *chatRoom = findChatRoom(chatid);
-    if (chatRoom)
-    {
-        item = new MegaChatListItemPrivate(*chatRoom);
-    }
-
-    sdkMutex.unlock();
-
-    return item;
+    std::shared_ptr<const ChatSnapshot> snapshot = findChatSnapshot(chatid);
+    return snapshot ? snapshot->item->copy() : NULL;
 }
 
 int MegaChatApiImpl::getUnreadChats()
 {
     int count = 0;
 
-    sdkMutex.lock();
-
-    if (mClient && !terminating)
+    std::shared_ptr<const ChatSnapshotMap> snapshots = std::atomic_load(&mChatSnapshots);
+    ChatSnapshotMap::const_iterator it;
+    for (it = snapshots->begin(); it != snapshots->end(); it++)
     {
-        ChatRoomList::iterator it;
-        for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
+        std::shared_ptr<const ChatSnapshot> snapshot = it->second->load();
+        if (!snapshot->item->isArchived() && snapshot->item->getUnreadCount())
         {
-            ChatRoom *room = it->second;
-            if (!room->isArchived() && room->chat().unreadMsgCount())
-            {
-                count++;
-            }
+            count++;
         }
     }
 
-    sdkMutex.unlock();
-
     return count;
 }
 
@@ -2444,22 +2570,17 @@ MegaChatListItemList *MegaChatApiImpl::getActiveChatListItems()
 {
     MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
 
-    sdkMutex.lock();
-
-    if (mClient && !terminating)
+    std::shared_ptr<const ChatSnapshotMap> snapshots = std::atomic_load(&mChatSnapshots);
+    ChatSnapshotMap::const_iterator it;
+    for (it = snapshots->begin(); it != snapshots->end(); it++)
     {
-        ChatRoomList::iterator it;
-        for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
+        std::shared_ptr<const ChatSnapshot> snapshot = it->second->load();
+        if (!snapshot->item->isArchived() && snapshot->item->isActive())
         {
-            if (!it->second->isArchived() && it->second->isActive())
-            {
-                items->addChatListItem(new MegaChatListItemPrivate(*it->second));
-            }
+            items->addChatListItem(snapshot->item->copy());
         }
     }
 
-    sdkMutex.unlock();
-
     return items;
 }
 
@@ -2467,22 +2588,17 @@ MegaChatListItemList *MegaChatApiImpl::getInactiveChatListItems()
 {
     MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
 
-    sdkMutex.lock();
-
-    if (mClient && !terminating)
+    std::shared_ptr<const ChatSnapshotMap> snapshots = std::atomic_load(&mChatSnapshots);
+    ChatSnapshotMap::const_iterator it;
+    for (it = snapshots->begin(); it != snapshots->end(); it++)
     {
-        ChatRoomList::iterator it;
-        for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
+        std::shared_ptr<const ChatSnapshot> snapshot = it->second->load();
+        if (!snapshot->item->isArchived() && !snapshot->item->isActive())
         {
-            if (!it->second->isArchived() && !it->second->isActive())
-            {
-                items->addChatListItem(new MegaChatListItemPrivate(*it->second));
-            }
+            items->addChatListItem(snapshot->item->copy());
         }
     }
 
-    sdkMutex.unlock();
-
     return items;
 }
 
@@ -2490,22 +2606,17 @@ MegaChatListItemList *MegaChatApiImpl::getArchivedChatListItems()
 {
     MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
 
-    sdkMutex.lock();
-
-    if (mClient && !terminating)
+    std::shared_ptr<const ChatSnapshotMap> snapshots = std::atomic_load(&mChatSnapshots);
+    ChatSnapshotMap::const_iterator it;
+    for (it = snapshots->begin(); it != snapshots->end(); it++)
     {
-        ChatRoomList::iterator it;
-        for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
+        std::shared_ptr<const ChatSnapshot> snapshot = it->second->load();
+        if (snapshot->item->isArchived())
         {
-            if (it->second->isArchived())
-            {
-                items->addChatListItem(new MegaChatListItemPrivate(*it->second));
-            }
+            items->addChatListItem(snapshot->item->copy());
         }
     }
 
-    sdkMutex.unlock();
-
     return items;
 }
 
@@ -2513,23 +2624,17 @@ MegaChatListItemList *MegaChatApiImpl::getUnreadChatListItems()
 {
     MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
 
-    sdkMutex.lock();
-
-    if (mClient && !terminating)
+    std::shared_ptr<const ChatSnapshotMap> snapshots = std::atomic_load(&mChatSnapshots);
+    ChatSnapshotMap::const_iterator it;
+    for (it = snapshots->begin(); it != snapshots->end(); it++)
     {
-        ChatRoomList::iterator it;
-        for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
+        std::shared_ptr<const ChatSnapshot> snapshot = it->second->load();
+        if (!snapshot->item->isArchived() && snapshot->item->getUnreadCount())
         {
-            ChatRoom *room = it->second;
-            if (!room->isArchived() && room->chat().unreadMsgCount())
-            {
-                items->addChatListItem(new MegaChatListItemPrivate(*it->second));
-            }
+            items->addChatListItem(snapshot->item->copy());
         }
     }
 
-    sdkMutex.unlock();
-
     return items;
 }
 
@@ -2555,8 +2660,7 @@ void MegaChatApiImpl::createChat(bool group, MegaChatPeerList *peerList, MegaCha
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_CREATE_CHATROOM, listener);
     request->setFlag(group);
     request->setMegaChatPeerList(peerList);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 void MegaChatApiImpl::inviteToChat(MegaChatHandle chatid, MegaChatHandle uh, int privilege, MegaChatRequestListener *listener)
@@ -2565,8 +2669,7 @@ void MegaChatApiImpl::inviteToChat(MegaChatHandle chatid, MegaChatHandle uh, int
     request->setChatHandle(chatid);
     request->setUserHandle(uh);
     request->setPrivilege(privilege);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 void MegaChatApiImpl::removeFromChat(MegaChatHandle chatid, MegaChatHandle uh, MegaChatRequestListener *listener)
@@ -2574,8 +2677,7 @@ void MegaChatApiImpl::removeFromChat(MegaChatHandle chatid, MegaChatHandle uh, M
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_REMOVE_FROM_CHATROOM, listener);
     request->setChatHandle(chatid);
     request->setUserHandle(uh);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 void MegaChatApiImpl::updateChatPermissions(MegaChatHandle chatid, MegaChatHandle uh, int privilege, MegaChatRequestListener *listener)
@@ -2584,8 +2686,7 @@ void MegaChatApiImpl::updateChatPermissions(MegaChatHandle chatid, MegaChatHandl
     request->setChatHandle(chatid);
     request->setUserHandle(uh);
     request->setPrivilege(privilege);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 void MegaChatApiImpl::truncateChat(MegaChatHandle chatid, MegaChatHandle messageid, MegaChatRequestListener *listener)
@@ -2593,8 +2694,7 @@ void MegaChatApiImpl::truncateChat(MegaChatHandle chatid, MegaChatHandle message
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_TRUNCATE_HISTORY, listener);
     request->setChatHandle(chatid);
     request->setUserHandle(messageid);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 void MegaChatApiImpl::setChatTitle(MegaChatHandle chatid, const char *title, MegaChatRequestListener *listener)
@@ -2602,8 +2702,7 @@ void MegaChatApiImpl::setChatTitle(MegaChatHandle chatid, const char *title, Meg
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_EDIT_CHATROOM_NAME, listener);
     request->setChatHandle(chatid);
     request->setText(title);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 void MegaChatApiImpl::archiveChat(MegaChatHandle chatid, bool archive, MegaChatRequestListener *listener)
@@ -2611,8 +2710,7 @@ void MegaChatApiImpl::archiveChat(MegaChatHandle chatid, bool archive, MegaChatR
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_ARCHIVE_CHATROOM, listener);
     request->setChatHandle(chatid);
     request->setFlag(archive);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 bool MegaChatApiImpl::openChatRoom(MegaChatHandle chatid, MegaChatRoomListener *listener)
@@ -2918,8 +3016,7 @@ void MegaChatApiImpl::attachNodes(MegaChatHandle chatid, MegaNodeList *nodes, Me
     request->setChatHandle(chatid);
     request->setMegaNodeList(nodes);
     request->setParamType(0);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 void MegaChatApiImpl::attachNode(MegaChatHandle chatid, MegaChatHandle nodehandle, MegaChatRequestListener *listener)
@@ -2928,8 +3025,7 @@ void MegaChatApiImpl::attachNode(MegaChatHandle chatid, MegaChatHandle nodehandl
     request->setChatHandle(chatid);
     request->setUserHandle(nodehandle);
     request->setParamType(0);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 void MegaChatApiImpl::attachVoiceMessage(MegaChatHandle chatid, MegaChatHandle nodehandle, MegaChatRequestListener *listener)
@@ -2938,8 +3034,7 @@ void MegaChatApiImpl::attachVoiceMessage(MegaChatHandle chatid, MegaChatHandle n
     request->setChatHandle(chatid);
     request->setUserHandle(nodehandle);
     request->setParamType(1);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 MegaChatMessage * MegaChatApiImpl::sendGeolocation(MegaChatHandle chatid, float longitude, float latitude, const char *img)
@@ -2961,8 +3056,7 @@ void MegaChatApiImpl::revokeAttachment(MegaChatHandle chatid, MegaChatHandle han
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_REVOKE_NODE_MESSAGE, listener);
     request->setChatHandle(chatid);
     request->setUserHandle(handle);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 bool MegaChatApiImpl::isRevoked(MegaChatHandle chatid, MegaChatHandle nodeHandle)
@@ -3167,8 +3261,7 @@ void MegaChatApiImpl::sendTypingNotification(MegaChatHandle chatid, MegaChatRequ
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_SEND_TYPING_NOTIF, listener);
     request->setChatHandle(chatid);
     request->setFlag(true);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 void MegaChatApiImpl::sendStopTypingNotification(MegaChatHandle chatid, MegaChatRequestListener *listener)
@@ -3176,8 +3269,7 @@ void MegaChatApiImpl::sendStopTypingNotification(MegaChatHandle chatid, MegaChat
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_SEND_TYPING_NOTIF, listener);
     request->setChatHandle(chatid);
     request->setFlag(false);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 bool MegaChatApiImpl::isMessageReceptionConfirmationActive() const
@@ -3203,8 +3295,7 @@ void MegaChatApiImpl::pushReceived(bool beep, MegaChatHandle chatid, int type, M
     request->setFlag(beep);
     request->setChatHandle(chatid);
     request->setParamType(type);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 #ifndef KARERE_DISABLE_WEBRTC
@@ -3287,8 +3378,7 @@ void MegaChatApiImpl::startChatCall(MegaChatHandle chatid, bool enableVideo, Meg
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_START_CHAT_CALL, listener);
     request->setChatHandle(chatid);
     request->setFlag(enableVideo);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 void MegaChatApiImpl::answerChatCall(MegaChatHandle chatid, bool enableVideo, MegaChatRequestListener *listener)
@@ -3296,24 +3386,21 @@ void MegaChatApiImpl::answerChatCall(MegaChatHandle chatid, bool enableVideo, Me
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_ANSWER_CHAT_CALL, listener);
     request->setChatHandle(chatid);
     request->setFlag(enableVideo);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 void MegaChatApiImpl::hangChatCall(MegaChatHandle chatid, MegaChatRequestListener *listener)
 {
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_HANG_CHAT_CALL, listener);
     request->setChatHandle(chatid);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 void MegaChatApiImpl::hangAllChatCalls(MegaChatRequestListener *listener = NULL)
 {
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_HANG_CHAT_CALL, listener);
     request->setChatHandle(MEGACHAT_INVALID_HANDLE);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 void MegaChatApiImpl::setAudioEnable(MegaChatHandle chatid, bool enable, MegaChatRequestListener *listener)
@@ -3322,8 +3409,7 @@ void MegaChatApiImpl::setAudioEnable(MegaChatHandle chatid, bool enable, MegaCha
     request->setChatHandle(chatid);
     request->setFlag(enable);
     request->setParamType(MegaChatRequest::AUDIO);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 void MegaChatApiImpl::setVideoEnable(MegaChatHandle chatid, bool enable, MegaChatRequestListener *listener)
@@ -3332,15 +3418,13 @@ void MegaChatApiImpl::setVideoEnable(MegaChatHandle chatid, bool enable, MegaCha
     request->setChatHandle(chatid);
     request->setFlag(enable);
     request->setParamType(MegaChatRequest::VIDEO);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 void MegaChatApiImpl::loadAudioVideoDeviceList(MegaChatRequestListener *listener)
 {
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_LOAD_AUDIO_VIDEO_DEVICES, listener);
-    requestQueue.push(request);
-    waiter->notify();
+    postRequest(request);
 }
 
 void MegaChatApiImpl::setIgnoredCall(MegaChatHandle chatId)
@@ -3891,6 +3975,7 @@ IApp::IGroupChatListItem *MegaChatApiImpl::addGroupChatItem(GroupChatRoom &chat)
 {
     MegaChatGroupListItemHandler *itemHandler = new MegaChatGroupListItemHandler(*this, chat);
     chatGroupListItemHandler.insert(itemHandler);
+    addChatSnapshot(chat);
 
     // notify the app about the new chatroom
     MegaChatListItemPrivate *item = new MegaChatListItemPrivate(chat);
@@ -3903,6 +3988,7 @@ IApp::IPeerChatListItem *MegaChatApiImpl::addPeerChatItem(PeerChatRoom &chat)
 {
     MegaChatPeerListItemHandler *itemHandler = new MegaChatPeerListItemHandler(*this, chat);
     chatPeerListItemHandler.insert(itemHandler);
+    addChatSnapshot(chat);
 
     // notify the app about the new chatroom
     MegaChatListItemPrivate *item = new MegaChatListItemPrivate(chat);
@@ -3919,6 +4005,7 @@ void MegaChatApiImpl::removeGroupChatItem(IGroupChatListItem &item)
         IGroupChatListItem *itemHandler = (*it);
         if (itemHandler == &item)
         {
+            removeChatSnapshot((*it)->getChatRoom().chatid());
             delete (itemHandler);
             chatGroupListItemHandler.erase(it);
             return;
@@ -3936,6 +4023,7 @@ void MegaChatApiImpl::removePeerChatItem(IPeerChatListItem &item)
         IPeerChatListItem *itemHandler = (*it);
         if (itemHandler == &item)
         {
+            removeChatSnapshot((*it)->getChatRoom().chatid());
             delete (itemHandler);
             chatPeerListItemHandler.erase(it);
             return;
@@ -3969,108 +4057,43 @@ void MegaChatApiImpl::onPresenceLastGreenUpdated(Id userid, uint16_t lastGreen)
     fireOnChatPresenceLastGreenUpdated(userid, lastGreen);
 }
 
-ChatRequestQueue::ChatRequestQueue()
-{
-    mutex.init(false);
-}
-
-void ChatRequestQueue::push(MegaChatRequestPrivate *request)
-{
-    mutex.lock();
-    requests.push_back(request);
-    mutex.unlock();
-}
-
-void ChatRequestQueue::push_front(MegaChatRequestPrivate *request)
+bool ChatRequestQueue::push(MegaChatRequestPrivate *request)
 {
-    mutex.lock();
-    requests.push_front(request);
-    mutex.unlock();
+    return requests.push(request);
 }
 
 MegaChatRequestPrivate *ChatRequestQueue::pop()
 {
-    mutex.lock();
-    if(requests.empty())
-    {
-        mutex.unlock();
-        return NULL;
-    }
-    MegaChatRequestPrivate *request = requests.front();
-    requests.pop_front();
-    mutex.unlock();
-    return request;
+    return requests.pop();
 }
 
 void ChatRequestQueue::removeListener(MegaChatRequestListener *listener)
 {
-    mutex.lock();
-
-    deque<MegaChatRequestPrivate *>::iterator it = requests.begin();
-    while(it != requests.end())
+    requests.forEach([listener](MegaChatRequestPrivate *request)
     {
-        MegaChatRequestPrivate *request = (*it);
-        if(request->getListener()==listener)
+        if (request->getListener() == listener)
             request->setListener(NULL);
-        it++;
-    }
-
-    mutex.unlock();
+    });
 }
 
-EventQueue::EventQueue()
+bool EventQueue::push(void *event)
 {
-    mutex.init(false);
-}
-
-void EventQueue::push(void *transfer)
-{
-    mutex.lock();
-    events.push_back(transfer);
-    mutex.unlock();
-}
-
-void EventQueue::push_front(void *event)
-{
-    mutex.lock();
-    events.push_front(event);
-    mutex.unlock();
+    return events.push(event);
 }
 
 void* EventQueue::pop()
 {
-    mutex.lock();
-    if(events.empty())
-    {
-        mutex.unlock();
-        return NULL;
-    }
-    void* event = events.front();
-    events.pop_front();
-    mutex.unlock();
-    return event;
+    return events.pop();
 }
 
 bool EventQueue::isEmpty()
 {
-    bool ret;
-
-    mutex.lock();
-    ret = events.empty();
-    mutex.unlock();
-
-    return ret;
+    return events.empty();
 }
 
 size_t EventQueue::size()
 {
-    size_t ret;
-
-    mutex.lock();
-    ret = events.size();
-    mutex.unlock();
-
-    return ret;
+    return events.size();
 }
 
 MegaChatRequestPrivate::MegaChatRequestPrivate(int type, MegaChatRequestListener *listener)
@@ -5076,6 +5099,13 @@ void MegaChatRoomHandler::removeChatRoomListener(MegaChatRoomListener *listener)
 
 void MegaChatRoomHandler::fireOnChatRoomUpdate(MegaChatRoom *chat)
 {
+    // typing notifications don't change the data of the chatroom
+    if (!chat->hasChanged(MegaChatRoom::CHANGE_TYPE_USER_TYPING)
+            && !chat->hasChanged(MegaChatRoom::CHANGE_TYPE_USER_STOP_TYPING))
+    {
+        chatApiImpl->updateChatSnapshot(*static_cast<MegaChatRoomPrivate*>(chat));
+    }
+
     for(set<MegaChatRoomListener *>::iterator it = roomListeners.begin(); it != roomListeners.end() ; it++)
     {
         (*it)->onChatRoomUpdate(chatApi, chat);
@@ -5126,7 +5156,7 @@ void MegaChatRoomHandler::fireOnHistoryReloaded(MegaChatRoom *chat)
 
 void MegaChatRoomHandler::onUserTyping(karere::Id user)
 {
-    MegaChatRoomPrivate *chat = (MegaChatRoomPrivate *) chatApiImpl->getChatRoom(chatid);
+    MegaChatRoomPrivate *chat = new MegaChatRoomPrivate(*chatApiImpl->findChatRoom(chatid));
     chat->setUserTyping(user.val);
 
     fireOnChatRoomUpdate(chat);
@@ -5134,7 +5164,7 @@ void MegaChatRoomHandler::onUserTyping(karere::Id user)
 
 void MegaChatRoomHandler::onUserStopTyping(karere::Id user)
 {
-    MegaChatRoomPrivate *chat = (MegaChatRoomPrivate *) chatApiImpl->getChatRoom(chatid);
+    MegaChatRoomPrivate *chat = new MegaChatRoomPrivate(*chatApiImpl->findChatRoom(chatid));
     chat->setUserStopTyping(user.val);
 
     fireOnChatRoomUpdate(chat);
@@ -5160,7 +5190,7 @@ void MegaChatRoomHandler::onLastMessageTsUpdated(uint32_t ts)
 
 void MegaChatRoomHandler::onHistoryReloaded()
 {
-    MegaChatRoomPrivate *chat = (MegaChatRoomPrivate *) chatApiImpl->getChatRoom(chatid);
+    MegaChatRoomPrivate *chat = new MegaChatRoomPrivate(*chatApiImpl->findChatRoom(chatid));
     fireOnHistoryReloaded(chat);
 }
 
@@ -5248,7 +5278,7 @@ std::set<MegaChatHandle> *MegaChatRoomHandler::handleNewMessage(MegaChatMessage
 
 void MegaChatRoomHandler::onMemberNameChanged(uint64_t /*userid*/, const std::string &/*newName*/)
 {
-    MegaChatRoomPrivate *chat = (MegaChatRoomPrivate *) chatApiImpl->getChatRoom(chatid);
+    MegaChatRoomPrivate *chat = new MegaChatRoomPrivate(*chatApiImpl->findChatRoom(chatid));
     chat->setMembersUpdated();
 
     fireOnChatRoomUpdate(chat);
@@ -5256,7 +5286,7 @@ void MegaChatRoomHandler::onMemberNameChanged(uint64_t /*userid*/, const std::st
 
 void MegaChatRoomHandler::onChatArchived(bool archived)
 {
-    MegaChatRoomPrivate *chat = (MegaChatRoomPrivate *) chatApiImpl->getChatRoom(chatid);
+    MegaChatRoomPrivate *chat = new MegaChatRoomPrivate(*chatApiImpl->findChatRoom(chatid));
     chat->setArchived(archived);
 
     fireOnChatRoomUpdate(chat);
@@ -5264,7 +5294,7 @@ void MegaChatRoomHandler::onChatArchived(bool archived)
 
 void MegaChatRoomHandler::onTitleChanged(const string &title)
 {
-    MegaChatRoomPrivate *chat = (MegaChatRoomPrivate *) chatApiImpl->getChatRoom(chatid);
+    MegaChatRoomPrivate *chat = new MegaChatRoomPrivate(*chatApiImpl->findChatRoom(chatid));
     chat->setTitle(title);
 
     fireOnChatRoomUpdate(chat);
@@ -5272,7 +5302,7 @@ void MegaChatRoomHandler::onTitleChanged(const string &title)
 
 void MegaChatRoomHandler::onUnreadCountChanged(int count)
 {
-    MegaChatRoomPrivate *chat = (MegaChatRoomPrivate *) chatApiImpl->getChatRoom(chatid);
+    MegaChatRoomPrivate *chat = new MegaChatRoomPrivate(*chatApiImpl->findChatRoom(chatid));
     chat->setUnreadCount(count);
 
     fireOnChatRoomUpdate(chat);
@@ -5668,7 +5698,7 @@ MegaChatRoomPrivate::MegaChatRoomPrivate(const ChatRoom &chat)
     this->group = chat.isGroup();
     this->title = chat.titleString();
     this->mHasCustomTitle = chat.isGroup() ? ((GroupChatRoom*)&chat)->hasTitle() : false;
-    this->unreadCount = chat.chat().unreadMsgCount();
+    this->unreadCount = chat.unreadMsgCount();
     this->active = chat.isActive();
     this->archived = chat.isArchived();
     this->uh = MEGACHAT_INVALID_HANDLE;
@@ -5965,6 +5995,11 @@ void MegaChatRoomPrivate::setArchived(bool archived)
     this->changed |= MegaChatRoom::CHANGE_TYPE_ARCHIVE;
 }
 
+void MegaChatRoomPrivate::removeChanges()
+{
+    this->changed = 0;
+}
+
 char *MegaChatRoomPrivate::firstnameFromBuffer(const string &buffer)
 {
     char *ret = NULL;
@@ -6111,7 +6146,7 @@ MegaChatListItemPrivate::MegaChatListItemPrivate(ChatRoom &chatroom)
 {
     this->chatid = chatroom.chatid();
     this->title = chatroom.titleString();
-    this->unreadCount = chatroom.chat().unreadMsgCount();
+    this->unreadCount = chatroom.unreadMsgCount();
     this->group = chatroom.isGroup();
     this->active = chatroom.isActive();
     this->ownPriv = chatroom.ownPriv();
@@ -6125,7 +6160,7 @@ MegaChatListItemPrivate::MegaChatListItemPrivate(ChatRoom &chatroom)
     LastTextMsg tmp;
     LastTextMsg *message = &tmp;
     LastTextMsg *&msg = message;
-    uint8_t lastMsgStatus = chatroom.chat().lastTextMessage(msg);
+    uint8_t lastMsgStatus = chatroom.lastTextMessage(msg);
     if (lastMsgStatus == LastTextMsgState::kHave)
     {        
         this->lastMsgSender = msg->sender();
@@ -6190,7 +6225,7 @@ MegaChatListItemPrivate::MegaChatListItemPrivate(ChatRoom &chatroom)
         this->mLastMsgId = MEGACHAT_INVALID_HANDLE;
     }
 
-    this->lastTs = chatroom.chat().lastMessageTs();
+    this->lastTs = chatroom.lastMessageTs();
 }
 
 MegaChatListItemPrivate::MegaChatListItemPrivate(const MegaChatListItem *item)
@@ -6358,6 +6393,11 @@ void MegaChatListItemPrivate::setCallInProgress()
     this->changed |= MegaChatListItem::CHANGE_TYPE_CALL;
 }
 
+void MegaChatListItemPrivate::removeChanges()
+{
+    this->changed = 0;
+}
+
 void MegaChatListItemPrivate::setLastMessage()
 {
     this->changed |= MegaChatListItem::CHANGE_TYPE_LAST_MSG;
@@ -41,6 +41,7 @@
 #include <sdkApi.h>
 #include <karereCommon.h>
 #include <logger.h>
+#include <base/mpscQueue.h>
 #include <rapidjson/document.h>
 #include <stdint.h>
 #include "net/libwebsocketsIO.h"
@@ -355,6 +356,7 @@ public:
     void setLastTimestamp(int64_t ts);
     void setArchived(bool);
     void setCallInProgress();
+    void removeChanges();
 
     /**
      * If the message is of type MegaChatMessage::TYPE_ATTACHMENT, this function
@@ -697,6 +699,7 @@ public:
     void setUserStopTyping(MegaChatHandle uh);
     void setClosed();
     void setArchived(bool archived);
+    void removeChanges();
 
 private:
     int changed;
@@ -818,36 +821,61 @@ private:
 };
 
 //Thread safe request queue
+// Thread safe queues, without locks. Any thread can push, only the MegaChatApi thread
+// pops. push() returns true when the queue was empty, and the waiter must be notified
 class ChatRequestQueue
 {
     protected:
-        std::deque<MegaChatRequestPrivate *> requests;
-        mega::MegaMutex mutex;
+        karere::MpscQueue<MegaChatRequestPrivate *> requests;
 
     public:
-        ChatRequestQueue();
-        void push(MegaChatRequestPrivate *request);
-        void push_front(MegaChatRequestPrivate *request);
+        bool push(MegaChatRequestPrivate *request);
         MegaChatRequestPrivate * pop();
         void removeListener(MegaChatRequestListener *listener);
 };
 
-//Thread safe transfer queue
 class EventQueue
 {
 protected:
-    std::deque<void *> events;
-    mega::MegaMutex mutex;
+    karere::MpscQueue<void *> events;
 
 public:
-    EventQueue();
-    void push(void* event);
-    void push_front(void *event);
+    bool push(void* event);
     void* pop();
     bool isEmpty();
     size_t size();
 };
 
+// Immutable copy of the data of a chatroom, as returned by the getters of MegaChatApiImpl.
+// The chatroom and its chatlist item are shared with the snapshots that replace it,
+// so a change notified for one of them doesn't copy the other
+class ChatSnapshot
+{
+public:
+    const std::shared_ptr<const MegaChatRoomPrivate> room;
+    const std::shared_ptr<const MegaChatListItemPrivate> item;
+
+    ChatSnapshot(karere::ChatRoom& chatroom)
+        : room(std::make_shared<MegaChatRoomPrivate>(chatroom)),
+          item(std::make_shared<MegaChatListItemPrivate>(chatroom)) {}
+    ChatSnapshot(std::shared_ptr<const MegaChatRoomPrivate> aRoom, std::shared_ptr<const MegaChatListItemPrivate> aItem)
+        : room(aRoom), item(aItem) {}
+};
+
+// The latest snapshot of a chatroom. The karere thread replaces it when the
+// chatroom changes, while other threads may be reading it
+class ChatSnapshotSlot
+{
+protected:
+    std::shared_ptr<const ChatSnapshot> mSnapshot;
+
+public:
+    std::shared_ptr<const ChatSnapshot> load() const { return std::atomic_load(&mSnapshot); }
+    void store(std::shared_ptr<const ChatSnapshot> snapshot) { std::atomic_store(&mSnapshot, snapshot); }
+};
+
+typedef std::map<MegaChatHandle, std::shared_ptr<ChatSnapshotSlot>> ChatSnapshotMap;
+
 class MegaChatApiImpl :
         public karere::IApp,
         public karere::IApp::IChatListHandler
@@ -860,13 +888,33 @@ public:
     mega::MegaMutex sdkMutex;
     mega::MegaMutex videoMutex;
     mega::Waiter *waiter;
+    karere::LoopTimerWheel timerWheel;
 private:
+    friend class ::MegaChatApiTest;
     MegaChatApi *chatApi;
     mega::MegaApi *megaApi;
     WebsocketsIO *websocketsIO;
     karere::Client *mClient;
     bool terminating;
 
+    // settings applied to the client on init()
+    bool mPersistSharedSecrets;
+    bool mDbWalMode;
+    unsigned int mCryptoThreadCount;
+    bool mLazyChatRooms;
+    unsigned int mHistoryRamLimit;
+
+    // Snapshots of the chatrooms, so the getters of chatrooms and chatlist items
+    // don't need to take sdkMutex. The map is only replaced, under sdkMutex, when
+    // chatrooms are added or removed, and a slot when its chatroom changes.
+    // Readers take the map with std::atomic_load()
+    std::shared_ptr<const ChatSnapshotMap> mChatSnapshots;
+    bool mChatSnapshotsStale;
+    void publishChatSnapshots();
+    void addChatSnapshot(karere::ChatRoom& chatroom);
+    void removeChatSnapshot(MegaChatHandle chatid);
+    std::shared_ptr<const ChatSnapshot> findChatSnapshot(MegaChatHandle chatid) const;
+
     mega::MegaThread thread;
     int threadExit;
     static void *threadEntryPoint(void *param);
@@ -904,6 +952,7 @@ private:
 public:
     static void megaApiPostMessage(void* msg, void* ctx);
     void postMessage(void *msg);
+    void postRequest(MegaChatRequestPrivate *request);
 
     void sendPendingRequests();
     void sendPendingEvents();
@@ -913,12 +962,22 @@ public:
     static void setLogWithColors(bool useColors);
     static void setLogToConsole(bool enable);
 
+    void setPersistSharedSecrets(bool enable);
+    void setDbWalMode(bool enable);
+    void setCryptoThreadCount(unsigned int count);
+    void setLazyChatRooms(bool enable);
+    void setHistoryRamLimit(unsigned int bytes);
     int init(const char *sid);
     int getInitState();
 
     MegaChatRoomHandler* getChatRoomHandler(MegaChatHandle chatid);
     void removeChatRoomHandler(MegaChatHandle chatid);
 
+    // replace the snapshot of a chatroom with the object notified to the listeners
+    void updateChatSnapshot(const MegaChatRoomPrivate& chatroom);
+    void updateChatSnapshot(const MegaChatListItemPrivate& item);
+    // rebuild the snapshot of a chatroom, for changes that are not notified
+    void refreshChatSnapshot(MegaChatHandle chatid);
     karere::ChatRoom *findChatRoom(MegaChatHandle chatid);
     karere::ChatRoom *findChatRoomByUser(MegaChatHandle userhandle);
     chatd::Message *findMessage(MegaChatHandle chatid, MegaChatHandle msgid);
@@ -1020,6 +1079,7 @@ public:
     char *getMyLastname();
     char *getMyFullname();
     char *getMyEmail();
+    char *getInitTrace();
     MegaChatRoomList* getChatRooms();
     MegaChatRoom* getChatRoom(MegaChatHandle chatid);
     MegaChatRoom *getChatRoomByUser(MegaChatHandle userhandle);
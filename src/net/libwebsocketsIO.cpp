@@ -188,19 +188,32 @@ bool LibwebsocketsClient::wsSendMessage(char *msg, size_t len)
         return false;
     }
     
-    if (!sendbuffer.size())
+    // messages are never split, so a message larger than the maximum goes in its own frame
+    if (sendQueue.empty() || sendQueue.back().size() - LWS_PRE + len > kMaxFrameSize)
     {
-        sendbuffer.reserve(LWS_PRE + len);
-        sendbuffer.resize(LWS_PRE);
+        sendQueue.emplace_back();
+        std::string& frame = sendQueue.back();
+        frame.reserve(LWS_PRE + len);
+        frame.resize(LWS_PRE);
     }
-    sendbuffer.append(msg, len);
+    sendQueue.back().append(msg, len);
+    sendQueueBytes += len;
 
-    if (lws_callback_on_writable(wsi) <= 0)
+    // if there are more frames, a write was already requested for the ones ahead
+    if (sendQueue.size() == 1 && lws_callback_on_writable(wsi) <= 0)
     {
         WEBSOCKETS_LOG_ERROR("lws_callback_on_writable() failed");
         assert(false);
         return false;
     }
+
+    if (!sendQueueFull && sendQueueBytes >= kSendQueueHighWatermark)
+    {
+        WEBSOCKETS_LOG_WARNING("Output queue reached the high watermark: %zu bytes in %zu frames",
+                               sendQueueBytes, sendQueue.size());
+        sendQueueFull = true;
+        wsSendQueueCb(true);
+    }
     return true;
 }
 
@@ -249,19 +262,65 @@ bool LibwebsocketsClient::wsIsConnected()
     return wsi != NULL;
 }
 
-const char *LibwebsocketsClient::getOutputBuffer()
+size_t LibwebsocketsClient::wsSendQueueLength()
 {
-    return sendbuffer.size() ? sendbuffer.data() + LWS_PRE : NULL;
+    return sendQueue.size();
 }
 
-size_t LibwebsocketsClient::getOutputBufferLength()
+size_t LibwebsocketsClient::wsSendQueueBytes()
 {
-    return sendbuffer.size() ? sendbuffer.size() - LWS_PRE : 0;
+    return sendQueueBytes;
 }
 
-void LibwebsocketsClient::resetOutputBuffer()
+bool LibwebsocketsClient::wsIsSendQueueFull()
 {
-    sendbuffer.clear();
+    return sendQueueFull;
+}
+
+// returns -1 if the connection must be closed
+int LibwebsocketsClient::writeNextFrame()
+{
+    if (sendQueue.empty())
+    {
+        return 0;
+    }
+
+    if (lws_send_pipe_choked(wsi))
+    {
+        // libwebsockets is still flushing a partially written frame
+        lws_callback_on_writable(wsi);
+        return 0;
+    }
+
+    std::string frame;
+    frame.swap(sendQueue.front());
+    sendQueue.pop_front();
+    size_t len = frame.size() - LWS_PRE;
+    sendQueueBytes -= len;
+
+    int written = lws_write(wsi, (unsigned char *)frame.data() + LWS_PRE, len, LWS_WRITE_BINARY);
+    if (written < 0)
+    {
+        WEBSOCKETS_LOG_ERROR("lws_write() failed writing %zu bytes", len);
+        return -1;
+    }
+    if ((size_t)written < len)
+    {
+        // libwebsockets keeps the remainder and sends it before the next writeable callback
+        WEBSOCKETS_LOG_DEBUG("Partial write of %d out of %zu bytes", written, len);
+    }
+
+    if (!sendQueue.empty())
+    {
+        lws_callback_on_writable(wsi);
+    }
+
+    if (sendQueueFull && sendQueueBytes <= kSendQueueLowWatermark)
+    {
+        sendQueueFull = false;
+        wsSendQueueCb(false);
+    }
+    return 0;
 }
 
 #if (OPENSSL_VERSION_NUMBER < 0x10100000L) || defined (LIBRESSL_VERSION_NUMBER) || defined (OPENSSL_IS_BORINGSSL)
@@ -436,14 +495,7 @@ int LibwebsocketsClient::wsCallback(struct lws *wsi, enum lws_callback_reasons r
                 return -1;
             }
             
-            data = (void *)client->getOutputBuffer();
-            len = client->getOutputBufferLength();
-            if (len && data)
-            {
-                lws_write(wsi, (unsigned char *)data, len, LWS_WRITE_BINARY);
-                client->resetOutputBuffer();
-            }
-            break;
+            return client->writeNextFrame();
         }
         default:
             break;
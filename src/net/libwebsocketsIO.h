@@ -5,6 +5,7 @@
 #include <openssl/ssl.h>
 #include <iostream>
 #include <functional>
+#include <deque>
 
 #include "net/websocketsIO.h"
 
@@ -34,21 +35,33 @@ public:
     virtual ~LibwebsocketsClient();
     
 protected:
+    enum
+    {
+        kMaxFrameSize = 64 * 1024,          // messages are coalesced into frames up to this size
+        kSendQueueHighWatermark = 1024 * 1024,
+        kSendQueueLowWatermark = 256 * 1024
+    };
+
     std::string recbuffer;
-    std::string sendbuffer;
+
+    // frames pending to be written, each one prefixed by LWS_PRE bytes for libwebsockets' header
+    std::deque<std::string> sendQueue;
+    size_t sendQueueBytes = 0;
+    bool sendQueueFull = false;
 
     void appendMessageFragment(char *data, size_t len, size_t remaining);
     bool hasFragments();
     const char *getMessage();
     size_t getMessageLength();
     void resetMessage();
-    const char *getOutputBuffer();
-    size_t getOutputBufferLength();
-    void resetOutputBuffer();
+    int writeNextFrame();
     
     virtual bool wsSendMessage(char *msg, size_t len);
     virtual void wsDisconnect(bool immediate);
     virtual bool wsIsConnected();
+    virtual size_t wsSendQueueLength();
+    virtual size_t wsSendQueueBytes();
+    virtual bool wsIsSendQueueFull();
     
 public:
     struct lws *wsi;
@@ -75,6 +75,13 @@ void WebsocketsClientImpl::wsHandleMsgCb(char *data, size_t len)
     client->wsHandleMsgCb(data, len);
 }
 
+void WebsocketsClientImpl::wsSendQueueCb(bool full)
+{
+    ScopedLock lock(this->mutex);
+    WEBSOCKETS_LOG_DEBUG("Output queue %s (%zu bytes queued)", full ? "full" : "drained", wsSendQueueBytes());
+    client->wsSendQueueCb(full);
+}
+
 WebsocketsClient::WebsocketsClient()
 {
     ctx = NULL;
@@ -184,6 +191,21 @@ bool WebsocketsClient::wsIsConnected()
     return ctx->wsIsConnected();
 }
 
+size_t WebsocketsClient::wsSendQueueLength()
+{
+    return ctx ? ctx->wsSendQueueLength() : 0;
+}
+
+size_t WebsocketsClient::wsSendQueueBytes()
+{
+    return ctx ? ctx->wsSendQueueBytes() : 0;
+}
+
+bool WebsocketsClient::wsIsSendQueueFull()
+{
+    return ctx ? ctx->wsIsSendQueueFull() : false;
+}
+
 void WebsocketsClient::wsCloseCbPrivate(int errcode, int errtype, const char *preason, size_t reason_len)
 {
     if (!ctx)   // immediate disconnect ocurred before the marshall is executed (only applies to libws)
@@ -91,9 +91,18 @@ public:
     bool wsIsConnected();
     void wsCloseCbPrivate(int errcode, int errtype, const char *preason, size_t reason_len);
 
+    // metrics of the output queue
+    size_t wsSendQueueLength();     // number of frames waiting to be written
+    size_t wsSendQueueBytes();      // bytes accepted by wsSendMessage() and not yet written
+    bool wsIsSendQueueFull();       // true from the high watermark until draining to the low watermark
+
     virtual void wsConnectCb() = 0;
     virtual void wsCloseCb(int errcode, int errtype, const char *preason, size_t reason_len) = 0;
     virtual void wsHandleMsgCb(char *data, size_t len) = 0;
+
+    // called when the output queue reaches the high watermark (full = true) and
+    // when it drains down to the low watermark (full = false), so the sender can pace itself
+    virtual void wsSendQueueCb(bool /*full*/) {}
 };
 
 
@@ -110,10 +119,14 @@ public:
     void wsConnectCb();
     void wsCloseCb(int errcode, int errtype, const char *preason, size_t reason_len);
     void wsHandleMsgCb(char *data, size_t len);
+    void wsSendQueueCb(bool full);
     
     virtual bool wsSendMessage(char *msg, size_t len) = 0;
     virtual void wsDisconnect(bool immediate) = 0;
     virtual bool wsIsConnected() = 0;
+    virtual size_t wsSendQueueLength() { return 0; }
+    virtual size_t wsSendQueueBytes() { return 0; }
+    virtual bool wsIsSendQueueFull() { return false; }
 };
 
 #endif /* websocketsIO_h */
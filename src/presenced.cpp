@@ -88,6 +88,22 @@ void Client::wsCloseCb(int errcode, int errtype, const char *preason, size_t /*r
     onSocketClose(errcode, errtype, preason);
 }
     
+void Client::wsSendQueueCb(bool full)
+{
+    if (full)
+    {
+        PRESENCED_LOG_WARNING("Output queue is full (%zu bytes)", wsSendQueueBytes());
+        return;
+    }
+
+    // a KEEPALIVE queued behind the backlog has only been written now,
+    // so don't count the time it was waiting towards the reply timeout
+    if (mTsLastPingSent)
+    {
+        mTsLastPingSent = time(NULL);
+    }
+}
+
 void Client::onSocketClose(int errcode, int errtype, const std::string& reason)
 {
     if (mKarereClient->isTerminated())
@@ -31,20 +31,23 @@ void RtcCrypto::mac(const std::string& data, const SdpKey& key, SdpKey& output)
 
 void RtcCrypto::computeSymmetricKey(karere::Id peer, strongvelope::SendKey& output)
 {
-    //No symmetric key cache here, unlike strongvelope
-    auto pms = mClient.userAttrCache().getAttr(peer, ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY);
-    if (!pms.done())
-        throw std::runtime_error("RtcCrypto::computeSymmetricKey: Key not readily available in cache");
-    if (pms.failed())
-        throw std::runtime_error("RtcCrypto:computeSymmetricKey: Error getting key for user "+ peer.toString()+" :"+pms.error().msg());
+    //The shared secret is the same as in strongvelope, only the derived key differs
+    auto sharedSecret = mClient.sharedSecrets().get(peer);
+    if (!sharedSecret)
+    {
+        auto pms = mClient.userAttrCache().getAttr(peer, ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY);
+        if (!pms.done())
+            throw std::runtime_error("RtcCrypto::computeSymmetricKey: Key not readily available in cache");
+        if (pms.failed())
+            throw std::runtime_error("RtcCrypto:computeSymmetricKey: Error getting key for user "+ peer.toString()+" :"+pms.error().msg());
 
-    Buffer* pubKey = pms.value();
-    if (pubKey->empty())
-        throw std::runtime_error("RtcCrypto:computeSymmetricKey: Empty Cu25519 chat key for user "+peer.toString());
-    strongvelope::Key<crypto_scalarmult_BYTES> sharedSecret;
-    auto ignore = crypto_scalarmult(sharedSecret.ubuf(), (const unsigned char*)mClient.mMyPrivCu25519, pubKey->ubuf());
-    (void)ignore;
-    strongvelope::deriveSharedKey(sharedSecret, output, "webrtc pairwise key\x01");
+        Buffer* pubKey = pms.value();
+        if (pubKey->empty())
+            throw std::runtime_error("RtcCrypto:computeSymmetricKey: Empty Cu25519 chat key for user "+peer.toString());
+        sharedSecret = mClient.sharedSecrets().compute(peer,
+            StaticBuffer(mClient.mMyPrivCu25519, sizeof(mClient.mMyPrivCu25519)), *pubKey);
+    }
+    strongvelope::deriveSharedKey(*sharedSecret, output, "webrtc pairwise key\x01");
 }
 
 void RtcCrypto::encryptKeyTo(karere::Id peer, const SdpKey& data, SdpKey& output)
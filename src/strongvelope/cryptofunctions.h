@@ -110,6 +110,18 @@ static inline std::string aesCTREncrypt(const std::string& text,
     return cipher;
 }
 
+//works in place too (input == output). Encryption and decryption are the same
+//operation in CTR mode
+static inline void aesCTRProcess(const char* input, char* output, size_t len,
+                        const StaticBuffer& derivedkey, const StaticBuffer& iv)
+{
+    assert(iv.dataSize() == CryptoPP::AES::BLOCKSIZE);
+    assert(derivedkey.dataSize() == CryptoPP::AES::BLOCKSIZE);
+    CryptoPP::CTR_Mode<CryptoPP::AES>::Encryption encryptor;
+    encryptor.SetKeyWithIV(derivedkey.ubuf(), derivedkey.dataSize(), iv.ubuf());
+    encryptor.ProcessData((byte*)output, (const byte*)input, len);
+}
+
 static inline std::string aesCTRDecrypt(const std::string& ciphertext,
                             const StaticBuffer& derivedkey, const StaticBuffer& iv)
 {
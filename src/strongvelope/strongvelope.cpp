@@ -24,12 +24,15 @@
 #include "strongvelope.h"
 #include "cryptofunctions.h"
 #include <ctime>
+#include <chrono>
 #include "sodium.h"
 #include "tlvstore.h"
 #include <userAttrCache.h>
+#include <base/workerPool.h>
 #include <mega.h>
 #include <megaapi.h>
 #include <db.h>
+#include <chatdDb.h>
 #ifndef _MSC_VER
 #include <codecvt>   // deprecated
 #endif
@@ -74,17 +77,28 @@ uint32_t getKeyIdLength(uint32_t protocolVersion)
     return (protocolVersion == 1) ? 8 : 4;
 }
 
+/**
+ * Derives the IV of AES-128-CTR for a message payload from the nonce of the message:
+ * the nonce-size first bytes of the derived nonce secret, followed by a 32-bit
+ * counter initialized to zero.
+ */
+static void derivePayloadIv(const StaticBuffer& nonce, Key<32>& iv)
+{
+    iv.setDataSize(32); //deriveNonceSecret uses dataSize() to confirm there is buffer space
+    deriveNonceSecret(nonce, iv);
+    iv.setDataSize(SVCRYPTO_NONCE_SIZE+4); //truncate to nonce size+32bit counter
+
+    *reinterpret_cast<uint32_t*>(iv.buf()+SVCRYPTO_NONCE_SIZE) = 0; //zero the 32-bit counter
+    assert(iv.dataSize() == AES::BLOCKSIZE);
+}
+
 EncryptedMessage::EncryptedMessage(const Message& msg, const StaticBuffer& aKey)
 : key(aKey), backRefId(msg.backRefId)
 {
     assert(!key.empty());
     randombytes_buf(nonce.buf(), nonce.bufSize());
-    Key<32> derivedNonce(32); //deriveNonceSecret uses dataSize() to confirm there is buffer space
-    deriveNonceSecret(nonce, derivedNonce);
-    derivedNonce.setDataSize(SVCRYPTO_NONCE_SIZE+4); //truncate to nonce size+32bit counter
-
-    *reinterpret_cast<uint32_t*>(derivedNonce.buf()+SVCRYPTO_NONCE_SIZE) = 0; //zero the 32-bit counter
-    assert(derivedNonce.dataSize() == AES::BLOCKSIZE);
+    Key<32> derivedNonce;
+    derivePayloadIv(nonce, derivedNonce);
 
     size_t brsize = msg.backRefs.size()*8;
     size_t binsize = 10+brsize;
@@ -110,6 +124,32 @@ EncryptedMessage::EncryptedMessage(const Message& msg, const StaticBuffer& aKey)
  * @param outMsg The message object to write the decrypted data to.
  */
 void ParsedMessage::symmetricDecrypt(const StaticBuffer& key, Message& outMsg)
+{
+    setDecryptedPayload(decryptPayload(key), outMsg);
+}
+
+std::string ParsedMessage::decryptPayload(const StaticBuffer& key) const
+{
+    return decryptMessagePayload(nonce, payload, key);
+}
+
+std::string decryptMessagePayload(const StaticBuffer& nonce, const StaticBuffer& payload,
+    const StaticBuffer& key)
+{
+    if (payload.empty())
+    {
+        return std::string();
+    }
+    Key<32> derivedNonce;
+    derivePayloadIv(nonce, derivedNonce);
+
+    // decrypt straight into the result, without copying the ciphertext first
+    std::string cleartext(payload.dataSize(), '\0');
+    aesCTRProcess(payload.buf(), &cleartext[0], payload.dataSize(), key, derivedNonce);
+    return cleartext;
+}
+
+void ParsedMessage::setDecryptedPayload(const std::string& cleartext, Message& outMsg)
 {
     if (payload.empty())
     {
@@ -118,15 +158,6 @@ void ParsedMessage::symmetricDecrypt(const StaticBuffer& key, Message& outMsg)
     }
     Id chatid = mProtoHandler.chatid;
     STRONGVELOPE_LOG_DEBUG("Decrypting msg %s", outMsg.id().toString().c_str());
-    Key<32> derivedNonce;
-    // deriveNonceSecret() needs at least 32 bytes output buffer
-    deriveNonceSecret(nonce, derivedNonce);
-    derivedNonce.setDataSize(AES::BLOCKSIZE);
-    // For AES CRT mode, we take the first 12 bytes as the nonce,
-    // and the remaining 4 bytes as the counter, which is initialized to zero
-    *reinterpret_cast<uint32_t*>(derivedNonce.buf()+SVCRYPTO_NONCE_SIZE) = 0;
-    std::string cleartext = aesCTRDecrypt(std::string(payload.buf(), payload.dataSize()),
-        key, derivedNonce);
     parsePayload(StaticBuffer(cleartext, false), outMsg);
     outMsg.setEncrypted(Message::kNotEncrypted);
 }
@@ -151,11 +182,11 @@ void deriveNonceSecret(const StaticBuffer& masterNonce, const StaticBuffer& resu
                        Id recipient)
 {
     result.checkDataSize(32);
-    Buffer recipientStr;
+    Key<8> recipientStr;
     if (recipient == Id::null())
-        recipientStr.append(std::string("payload"));
+        recipientStr.assign("payload", 7);
     else
-        recipientStr.append(recipient.val);
+        recipientStr.assign((const char*)&recipient.val, sizeof(recipient.val));
 
     // Equivalent to first block of HKDF, see RFC 5869.
     hmac_sha256_bytes(recipientStr, masterNonce, result);
@@ -166,11 +197,6 @@ void ProtocolHandler::signMessage(const StaticBuffer& signedData,
         StaticBuffer& signature)
 {
     assert(signature.dataSize() == crypto_sign_BYTES);
-// To save space, myPrivEd25519 holds only the 32-bit seed of the priv key,
-// without the pubkey part, so we add it here
-    Buffer key(myPrivEd25519.dataSize()+myPubEd25519.dataSize());
-    key.append(myPrivEd25519).append(myPubEd25519);
-
     Buffer toSign(msgKey.dataSize()+signedData.dataSize()+SVCRYPTO_SIG.size()+10);
     toSign.append(SVCRYPTO_SIG)
           .append<uint8_t>(protoVersion)
@@ -179,7 +205,104 @@ void ProtocolHandler::signMessage(const StaticBuffer& signedData,
           .append(signedData);
 
     crypto_sign_detached(signature.ubuf(), NULL, toSign.ubuf(),
-        toSign.dataSize(), key.ubuf());
+        toSign.dataSize(), mSigningKey.ubuf());
+}
+
+/**
+ * Writes the data that is prepended to the content of a message to sign it
+ * (protocol version 2 or later), and returns its size.
+ */
+static size_t writeSignPrefix(char* dest, uint8_t protoVersion, uint8_t msgType,
+    const StaticBuffer& msgKey)
+{
+    memcpy(dest, SVCRYPTO_SIG.c_str(), SVCRYPTO_SIG.size());
+    size_t pos = SVCRYPTO_SIG.size();
+    dest[pos++] = protoVersion;
+    dest[pos++] = msgType;
+    memcpy(dest+pos, msgKey.buf(), msgKey.dataSize());
+    return pos+msgKey.dataSize();
+}
+
+void encryptMessageContent(const Message& msg, MsgCommand& dest,
+    const StaticBuffer& key, const StaticBuffer& signingKey)
+{
+    assert(key.dataSize() == SVCRYPTO_KEY_SIZE);
+    assert(signingKey.dataSize() == crypto_sign_SECRETKEYBYTES);
+    size_t brsize = msg.backRefs.size()*8;
+    size_t plainSize = 10+brsize+msg.dataSize();
+    size_t prefixSize = SVCRYPTO_SIG.size()+2+key.dataSize();
+    assert(prefixSize <= crypto_sign_BYTES);
+
+    // a single allocation for the whole content
+    dest.reserve(2+3+crypto_sign_BYTES+3+SVCRYPTO_NONCE_SIZE+3+plainSize);
+    dest.append<uint8_t>(SVCRYPTO_PROTOCOL_VERSION)
+        .append<uint8_t>(SVCRYPTO_MSGTYPE_FOLLOWUP);
+    TlvWriter::appendRecordHeader(dest, TLV_TYPE_SIGNATURE, crypto_sign_BYTES);
+    size_t sigOffset = dest.dataSize();
+    dest.appendPtr(crypto_sign_BYTES); // filled once the content is signed
+
+    // content: <nonce><payload>. The payload must always be last, because it may
+    // span till end of message (len code = 0xffff)
+    size_t contentOffset = dest.dataSize();
+    Key<SVCRYPTO_NONCE_SIZE> nonce;
+    randombytes_buf(nonce.buf(), nonce.bufSize());
+    TlvWriter::appendRecord(dest, TLV_TYPE_NONCE, nonce);
+    TlvWriter::appendRecordHeader(dest, TLV_TYPE_PAYLOAD, plainSize);
+    size_t payloadOffset = dest.dataSize();
+    dest.append<uint64_t>(msg.backRefId)
+        .append<uint16_t>(brsize);
+    if (brsize)
+    {
+        dest.append(&msg.backRefs[0], brsize);
+    }
+    if (!msg.empty())
+    {
+        dest.append(msg);
+    }
+    assert(dest.dataSize() == payloadOffset+plainSize);
+
+    // encrypt the plaintext in place
+    Key<32> derivedNonce;
+    derivePayloadIv(nonce, derivedNonce);
+    char* payload = dest.buf()+payloadOffset;
+    aesCTRProcess(payload, payload, plainSize, key, derivedNonce);
+
+    // the data to sign is <prefix><content>: the prefix is written where the
+    // signature goes, right before the content, so the content is not copied
+    char* signedData = dest.buf()+contentOffset-prefixSize;
+    writeSignPrefix(signedData, SVCRYPTO_PROTOCOL_VERSION, SVCRYPTO_MSGTYPE_FOLLOWUP, key);
+    Key<crypto_sign_BYTES> signature;
+    crypto_sign_detached(signature.ubuf(), NULL, (const unsigned char*)signedData,
+        dest.dataSize()-(contentOffset-prefixSize), signingKey.ubuf());
+    memcpy(dest.buf()+sigOffset, signature.buf(), crypto_sign_BYTES);
+    dest.updateMsgSize();
+}
+
+bool verifyMessageSignature(Buffer& data, size_t contentOffset, size_t overwritable,
+    uint8_t protoVersion, uint8_t msgType, const StaticBuffer& sendKey,
+    const StaticBuffer& signature, const StaticBuffer& pubKey)
+{
+    assert(sendKey.dataSize() == 16);
+    assert(contentOffset <= data.dataSize());
+    if (signature.dataSize() != crypto_sign_BYTES)
+        return false;
+
+    size_t prefixSize = SVCRYPTO_SIG.size()+2+sendKey.dataSize();
+    size_t contentSize = data.dataSize()-contentOffset;
+    if (prefixSize > overwritable || prefixSize > contentOffset)
+    {
+        Buffer messageStr(prefixSize+contentSize);
+        writeSignPrefix(messageStr.appendPtr(prefixSize), protoVersion, msgType, sendKey);
+        messageStr.append(data.buf()+contentOffset, contentSize);
+        return (crypto_sign_verify_detached(signature.ubuf(), messageStr.ubuf(),
+                messageStr.dataSize(), pubKey.ubuf()) == 0);
+    }
+
+    char* signedData = data.buf()+contentOffset-prefixSize;
+    writeSignPrefix(signedData, protoVersion, msgType, sendKey);
+    // if crypto_sign_verify_detached does not return 0, it means Incorrect signature!
+    return (crypto_sign_verify_detached(signature.ubuf(), (const unsigned char*)signedData,
+            prefixSize+contentSize, pubKey.ubuf()) == 0);
 }
 
 bool ParsedMessage::verifySignature(const StaticBuffer& pubKey, const SendKey& sendKey)
@@ -195,21 +318,12 @@ bool ParsedMessage::verifySignature(const StaticBuffer& pubKey, const SendKey& s
                 messageStr.dataSize(), pubKey.ubuf()) == 0);
     }
 
-    assert(sendKey.dataSize() == 16);
-    Buffer messageStr(SVCRYPTO_SIG.size()+sendKey.dataSize()+signedContent.dataSize()+2);
-
-    messageStr.append(SVCRYPTO_SIG.c_str(), SVCRYPTO_SIG.size())
-    .append<uint8_t>(protocolVersion)
-    .append<uint8_t>(type)
-    .append(sendKey)
-    .append(signedContent);
+    if (!signedContent.buf())
+        return false;
 
-//    STRONGVELOPE_LOG_DEBUG("signature:\n%s", signature.toString().c_str());
-//    STRONGVELOPE_LOG_DEBUG("message:\n%s", messageStr.toString().c_str());
-//    STRONGVELOPE_LOG_DEBUG("pubKey:\n%s", pubKey.toString().c_str());
-    // if crypto_sign_verify_detached does not return 0, it means Incorrect signature!
-    return (crypto_sign_verify_detached(signature.ubuf(), messageStr.ubuf(),
-            messageStr.dataSize(), pubKey.ubuf()) == 0);
+    // the signed content is preceded by the signature, which was copied out of mData
+    return verifyMessageSignature(mData, signedContent.buf()-mData.buf(), signature.dataSize(),
+        protocolVersion, type, sendKey, signature, pubKey);
 }
 
 /**
@@ -236,8 +350,160 @@ void deriveSharedKey(const StaticBuffer& sharedSecret, SendKey& output, const st
     memcpy(output.buf(), step2.buf(), AES::BLOCKSIZE);
 }
 
+const std::string SVCRYPTO_LOCAL_SECRETS_KEY = "strongvelope local secrets key\x02";
+
+/** Size of a secret persisted in the db: the nonce followed by the secretbox of the secret */
+static const size_t kSecretBoxSize = crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES + 32;
+
+/** Derives the key of the secrets persisted in the db from our private Cu25519 key. Like
+ * deriveSharedKey(), but keeping the whole output of the HKDF, the size of a secretbox key */
+static void deriveLocalSecretsKey(const StaticBuffer& privCu25519, Key<crypto_secretbox_KEYBYTES>& output)
+{
+    Key<32> prk;
+    hmac_sha256_bytes(privCu25519, StaticBuffer(nullptr, 0), prk);
+    hmac_sha256_bytes(StaticBuffer(SVCRYPTO_LOCAL_SECRETS_KEY, false), prk, output);
+}
+
+std::shared_ptr<const EcKey> SharedSecretCache::get(karere::Id userid)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mSecrets.find(userid);
+    if (it == mSecrets.end() || !it->second.confirmed)
+    {
+        mStats.misses++;
+        return nullptr;
+    }
+    mStats.hits++;
+    return it->second.secret;
+}
+
+static bool samePubKey(const EcKey& cached, const StaticBuffer& pubKey)
+{
+    return cached.dataSize() == pubKey.dataSize()
+        && memcmp(cached.buf(), pubKey.buf(), pubKey.dataSize()) == 0;
+}
+
+std::shared_ptr<const EcKey> SharedSecretCache::compute(karere::Id userid,
+    const StaticBuffer& privCu25519, const StaticBuffer& pubCu25519)
+{
+    {
+        // the public key may have been requested by several chats at once, or the
+        // secret may have been restored from the db
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mSecrets.find(userid);
+        if (it != mSecrets.end() && samePubKey(it->second.pubKey, pubCu25519))
+        {
+            it->second.confirmed = true;
+            return it->second.secret;
+        }
+    }
+
+    auto secret = std::make_shared<EcKey>();
+    auto ignore = crypto_scalarmult(secret->ubuf(), privCu25519.ubuf(), pubCu25519.ubuf());
+    (void)ignore;
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    Entry& entry = mSecrets[userid];
+    if (entry.secret)
+    {
+        if (samePubKey(entry.pubKey, pubCu25519)) // computed meanwhile by another thread
+        {
+            entry.confirmed = true;
+            return entry.secret;
+        }
+        KARERE_LOG_WARNING(krLogChannel_strongvelope, "Public Cu25519 key of user %s has changed, replacing the shared secret with it",
+            userid.toString().c_str());
+        mStats.stale++;
+    }
+    mStats.computed++;
+    entry.secret = secret;
+    entry.pubKey.assign(pubCu25519.buf(), pubCu25519.dataSize());
+    entry.confirmed = true;
+
+    if (mDb)
+    {
+        // a new nonce for every row, since they are all encrypted with the same key
+        Key<kSecretBoxSize> box;
+        randombytes_buf(box.ubuf(), crypto_secretbox_NONCEBYTES);
+        crypto_secretbox_easy(box.ubuf() + crypto_secretbox_NONCEBYTES, secret->ubuf(), secret->dataSize(),
+            box.ubuf(), mDbKey.ubuf());
+        mDb->query("insert or replace into shared_secrets(userid, pubkey, secret) values(?,?,?)",
+            userid, entry.pubKey, box);
+    }
+    return secret;
+}
+
+void SharedSecretCache::forget(karere::Id userid)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mSecrets.erase(userid);
+    if (mDb)
+    {
+        mDb->query("delete from shared_secrets where userid = ?", userid);
+    }
+}
+
+void SharedSecretCache::attachDb(SqliteDb& db, const StaticBuffer& privCu25519)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mDb = &db;
+    deriveLocalSecretsKey(privCu25519, mDbKey);
+
+    uint64_t count = 0;
+    std::vector<Id> dropped;
+    SqliteStmt stmt(db, "select userid, pubkey, secret from shared_secrets");
+    while (stmt.step())
+    {
+        Id userid(stmt.uint64Col(0));
+        if (mSecrets.find(userid) != mSecrets.end())
+            continue;
+
+        // rows of unexpected size, tampered with or persisted with another key are dropped
+        EcKey pubKey;
+        Key<kSecretBoxSize> box;
+        auto secret = std::make_shared<EcKey>();
+        if (sqlite3_column_bytes(stmt, 1) != (int)pubKey.bufSize()
+            || sqlite3_column_bytes(stmt, 2) != (int)box.bufSize()
+            || stmt.blobCol(1, pubKey.buf(), pubKey.bufSize()) != pubKey.bufSize()
+            || stmt.blobCol(2, box.buf(), box.bufSize()) != box.bufSize()
+            || crypto_secretbox_open_easy(secret->ubuf(), box.ubuf() + crypto_secretbox_NONCEBYTES,
+                   box.dataSize() - crypto_secretbox_NONCEBYTES, box.ubuf(), mDbKey.ubuf()) != 0)
+        {
+            dropped.push_back(userid);
+            continue;
+        }
+
+        // not confirmed until compared with the current public key of the user
+        Entry& entry = mSecrets[userid];
+        entry.secret = secret;
+        entry.pubKey.assign(pubKey.buf(), pubKey.dataSize());
+        count++;
+    }
+    for (Id userid: dropped)
+    {
+        KARERE_LOG_WARNING(krLogChannel_strongvelope, "Dropping shared secret with user %s from local db, it can't be authenticated",
+            userid.toString().c_str());
+        db.query("delete from shared_secrets where userid = ?", userid);
+    }
+    mStats.loaded += count;
+    KARERE_LOG_DEBUG(krLogChannel_strongvelope, "Loaded %llu shared secrets from database", (unsigned long long)count);
+}
+
+void SharedSecretCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mSecrets.clear();
+    mDb = nullptr;
+}
+
+SharedSecretCache::Stats SharedSecretCache::stats() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mStats;
+}
+
 ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& protoHandler)
-: mProtoHandler(protoHandler)
+: mProtoHandler(protoHandler), mData(binaryMessage.buf(), binaryMessage.dataSize())
 {
     if(binaryMessage.empty())
     {
@@ -268,8 +534,8 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
             callEndedInfo.reset(new chatd::Message::CallEndedInfo());
         }
     }
-    TlvParser tlv(binaryMessage, offset, isLegacy);
-    TlvRecord record(binaryMessage);
+    TlvParser tlv(mData, offset, isLegacy);
+    TlvRecord record(mData);
     std::string recordNames;
     while (tlv.getRecord(record))
     {
@@ -280,7 +546,7 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
             {
                 signature.assign(record.buf(), record.dataLen);
                 auto nextOffset = record.dataOffset+record.dataLen;
-                signedContent.assign(binaryMessage.buf()+nextOffset, binaryMessage.dataSize()-nextOffset);
+                signedContent.assign(mData.buf()+nextOffset, mData.dataSize()-nextOffset);
                 break;
             }
             case TLV_TYPE_NONCE:
@@ -351,7 +617,7 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
             }
             case TLV_TYPE_KEYBLOB:
             {
-                encryptedKey.assign(record.buf(), record.dataLen);
+                encryptedKey = record.view();
                 break;
             }
             //legacy key stuff
@@ -373,7 +639,7 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
             case TLV_TYPE_KEYS:
             {
 //KEYS, not KEY, because these can be pairs of current+previous key, concatenated and encrypted together
-                encryptedKey.assign(record.buf(), record.dataLen);
+                encryptedKey = record.view();
                 break;
             }
             case TLV_TYPE_KEY_IDS:
@@ -408,7 +674,7 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
             {
 //                if (type != SVCRYPTO_MSGTYPE_KEYED && type != SVCRYPTO_MSGTYPE_FOLLOWUP)
 //                    throw std::runtime_error("Payload record found in a non-regular message");
-                payload.assign(binaryMessage.buf()+record.dataOffset, record.dataLen);
+                payload = record.view();
                 break;
             }
             default:
@@ -513,12 +779,19 @@ ProtocolHandler::ProtocolHandler(karere::Id ownHandle,
     const StaticBuffer& privCu25519,
     const StaticBuffer& privEd25519,
     const StaticBuffer& privRsa,
-    karere::UserAttrCache& userAttrCache, SqliteDb &db, Id aChatId, void *ctx)
+    karere::UserAttrCache& userAttrCache, SharedSecretCache& sharedSecrets,
+    SqliteDb &db, Id aChatId, void *ctx, karere::WorkerPool* workers)
 : chatd::ICrypto(ctx), mOwnHandle(ownHandle), myPrivCu25519(privCu25519),
  myPrivEd25519(privEd25519), myPrivRsaKey(privRsa),
- mUserAttrCache(userAttrCache), mDb(db), chatid(aChatId)
+ mUserAttrCache(userAttrCache), mDb(db), mSharedSecrets(sharedSecrets),
+ mWorkers(workers), chatid(aChatId)
 {
     getPubKeyFromPrivKey(myPrivEd25519, kKeyTypeEd25519, myPubEd25519);
+// To save space, myPrivEd25519 holds only the 32-byte seed of the priv key,
+// without the pubkey part, so we add it here once
+    assert(myPrivEd25519.dataSize()+myPubEd25519.dataSize() == mSigningKey.bufSize());
+    memcpy(mSigningKey.buf(), myPrivEd25519.buf(), myPrivEd25519.dataSize());
+    memcpy(mSigningKey.buf()+myPrivEd25519.dataSize(), myPubEd25519.buf(), myPubEd25519.dataSize());
     loadKeysFromDb();
     loadUnconfirmedKeysFromDb();
     auto var = getenv("KRCHAT_FORCE_RSA");
@@ -536,7 +809,7 @@ unsigned int ProtocolHandler::getCacheVersion() const
 
 void ProtocolHandler::loadKeysFromDb()
 {
-    SqliteStmt stmt(mDb, "select userid, keyid, key from sendkeys where chatid=?");
+    SqliteStmt stmt(mDb, chatd::sql::kSendKeysLoad);
     stmt << chatid;
     while(stmt.step())
     {
@@ -548,9 +821,7 @@ void ProtocolHandler::loadKeysFromDb()
 #ifndef NDEBUG
         auto ret =
 #endif
-        mKeys.emplace(std::piecewise_construct,
-            std::forward_as_tuple(userid, keyid),
-            std::forward_as_tuple(key));
+        mKeys.emplace(UserKeyId(userid, keyid), key);
         assert(ret.second);
     }
     STRONGVELOPE_LOG_DEBUG("(%" PRId64 "): Loaded %zu send keys from database", chatid, mKeys.size());
@@ -558,8 +829,7 @@ void ProtocolHandler::loadKeysFromDb()
 
 void ProtocolHandler::loadUnconfirmedKeysFromDb()
 {
-    SqliteStmt stmt(mDb, "select recipients, key_cmd, keyid from sending "
-                    "where chatid=? and key_cmd not null order by rowid asc");
+    SqliteStmt stmt(mDb, chatd::sql::kSendingLoadKeyCmds);
     stmt << chatid;
     while(stmt.step())
     {
@@ -631,59 +901,32 @@ void ProtocolHandler::loadUnconfirmedKeysFromDb()
 void ProtocolHandler::msgEncryptWithKey(const Message& src, MsgCommand& dest,
     const StaticBuffer& key)
 {
-    // create 'nonce' and encrypt plaintext --> `ciphertext`
-    EncryptedMessage encryptedMessage(src, key);
-    assert(!encryptedMessage.ciphertext.empty());
-
-    // prepare TLV for content: <nonce><ciphertext>
-    TlvWriter tlv(encryptedMessage.ciphertext.size()+128); //only signed content goes here
-    tlv.addRecord(TLV_TYPE_NONCE, encryptedMessage.nonce);
-    tlv.addRecord(TLV_TYPE_PAYLOAD, StaticBuffer(encryptedMessage.ciphertext, false));
-
-    // prepare TLV for signature: <signature>
-    Key<64> signature;
-    signMessage(tlv, SVCRYPTO_PROTOCOL_VERSION, SVCRYPTO_MSGTYPE_FOLLOWUP,
-                encryptedMessage.key, signature);
-    TlvWriter sigTlv;
-    sigTlv.addRecord(TLV_TYPE_SIGNATURE, signature);
-
-    // finally, prepare the MsgCommand: <protVer><msgType><sigTLV><contentTLV>
-    dest.reserve(tlv.dataSize()+sigTlv.dataSize()+2);
-    dest.append<uint8_t>(SVCRYPTO_PROTOCOL_VERSION)
-        .append<uint8_t>(SVCRYPTO_MSGTYPE_FOLLOWUP)
-        .append(sigTlv)
-        .append(tlv.buf(), tlv.dataSize()); //tlv must always be last, and the payload must always be last within the tlv, because the payload may span till end of message, (len code = 0xffff)
-    dest.updateMsgSize();
+    encryptMessageContent(src, dest, key, mSigningKey);
 }
 
 promise::Promise<std::shared_ptr<SendKey>>
 ProtocolHandler::computeSymmetricKey(karere::Id userid, const std::string& padString)
 {
-    auto it = mSymmKeyCache.find(userid);
-    if (it != mSymmKeyCache.end())
+    auto sharedSecret = mSharedSecrets.get(userid);
+    if (sharedSecret)
     {
-        return it->second;
+        auto result = std::make_shared<SendKey>();
+        deriveSharedKey(*sharedSecret, *result, padString);
+        return result;
     }
     auto wptr = weakHandle();
     return mUserAttrCache.getAttr(userid, ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY)
     .then([wptr, this, userid, padString](const StaticBuffer* pubKey) -> promise::Promise<std::shared_ptr<SendKey>>
     {
         wptr.throwIfDeleted();
-        // We may have had 2 almost parallel requests, and the second may
-        // have put the key into the cache already
-        auto it = mSymmKeyCache.find(userid);
-        if (it != mSymmKeyCache.end())
-            return it->second;
-
         if (pubKey->empty())
             return promise::Error("Empty Cu25519 chat key for user "+userid.toString());
-        Key<crypto_scalarmult_BYTES> sharedSecret;
-        sharedSecret.setDataSize(crypto_scalarmult_BYTES);
-        auto ignore = crypto_scalarmult(sharedSecret.ubuf(), myPrivCu25519.ubuf(), pubKey->ubuf());
-        (void)ignore;
+
+        // We may have had 2 almost parallel requests, from this or other chats. In
+        // that case, the secret computed by the first one is returned
+        auto sharedSecret = mSharedSecrets.compute(userid, myPrivCu25519, *pubKey);
         auto result = std::make_shared<SendKey>();
-        deriveSharedKey(sharedSecret, *result, padString);
-        mSymmKeyCache.emplace(userid, result);
+        deriveSharedKey(*sharedSecret, *result, padString);
         return result;
     });
 }
@@ -904,6 +1147,11 @@ ProtocolHandler::msgEncrypt(Message* msg, const SetOfIds &recipients, MsgCommand
     }
 }
 
+bool ProtocolHandler::hasSendKeyFor(const SetOfIds& recipients) const
+{
+    return mCurrentKey && mCurrentKeyParticipants == recipients;
+}
+
 Message* ProtocolHandler::legacyMsgDecrypt(const std::shared_ptr<ParsedMessage>& parsedMsg,
     Message* msg, const SendKey& key)
 {
@@ -941,6 +1189,8 @@ ProtocolHandler::decryptChatTitle(const Buffer& data)
 void ProtocolHandler::onHistoryReload()
 {
     mCacheVersion++;
+    mPreparedDecrypts.clear();
+    mDecryptBatch.clear();
 }
 
 promise::Promise<Message*> ProtocolHandler::handleManagementMessage(
@@ -1010,62 +1260,45 @@ Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
             return Promise<Message*>(message);
         }
 
-        // Get type
-        auto parsedMsg = std::make_shared<ParsedMessage>(*message, *this);
-        message->type = parsedMsg->type;
-
-        // if message comes from API and uses keyid=0, it's a management message
-        if (message->userid == karere::Id::COMMANDER() && message->keyid == 0)
-        {
-            return handleManagementMessage(parsedMsg, message);
-        }
-
-        // check tampering of management messages
-        if (message->keyid == 0 || message->userid == karere::Id::COMMANDER())
+        std::shared_ptr<DecryptJob> job;
+        auto it = mPreparedDecrypts.find(message->id());
+        if (it != mPreparedDecrypts.end())  // decryption was started by prepareMsgDecrypt()
         {
-            return promise::Error("Invalid message. type: "+std::to_string(message->type)+
-                                  " userid: "+message->userid.toString()+
-                                  " keyid: "+std::to_string(message->keyid), EINVAL, SVCRYPTO_EMALFORMED);
-        }
-
-        // Get keyid
-        uint64_t keyid;
-        bool isLegacy = (parsedMsg->protocolVersion <= 1);
-        if (isLegacy)
-        {
-            keyid = parsedMsg->keyId;
+            job = it->second;
+            mPreparedDecrypts.erase(it);
+            message->type = job->parsedMsg->type;
+            if (job->inBatch)   // the message is needed now, don't wait for the rest of the batch
+            {
+                flushDecryptBatch();
+            }
         }
         else
         {
-            keyid = message->keyid;
-        }
+            // Get type
+            auto parsedMsg = std::make_shared<ParsedMessage>(*message, *this);
+            message->type = parsedMsg->type;
 
-        // Get sender key
-        struct Context
-        {
-            std::shared_ptr<SendKey> sendKey;
-            EcKey edKey;
-        };
-        auto ctx = std::make_shared<Context>();
+            // if message comes from API and uses keyid=0, it's a management message
+            if (message->userid == karere::Id::COMMANDER() && message->keyid == 0)
+            {
+                return handleManagementMessage(parsedMsg, message);
+            }
 
-        auto symPms = getKey(UserKeyId(message->userid, keyid), isLegacy)
-        .then([ctx](const std::shared_ptr<SendKey>& key)
-        {
-            ctx->sendKey = key;
-        });
+            // check tampering of management messages
+            if (message->keyid == 0 || message->userid == karere::Id::COMMANDER())
+            {
+                return promise::Error("Invalid message. type: "+std::to_string(message->type)+
+                                      " userid: "+message->userid.toString()+
+                                      " keyid: "+std::to_string(message->keyid), EINVAL, SVCRYPTO_EMALFORMED);
+            }
 
-        // Get signing key
-        auto edPms = mUserAttrCache.getAttr(parsedMsg->sender,
-            ::mega::MegaApi::USER_ATTR_ED25519_PUBLIC_KEY)
-        .then([ctx](Buffer* key)
-        {
-            ctx->edKey.assign(key->buf(), key->dataSize());
-        });
+            job = startDecryptJob(parsedMsg, *message);
+        }
 
         // Verify signature and decrypt
         auto wptr = weakHandle();
-        return promise::when(symPms, edPms)
-        .then([this, wptr, message, parsedMsg, ctx, isLegacy, keyid, cacheVersion]() ->promise::Promise<Message*>
+        return job->done
+        .then([this, wptr, message, job, cacheVersion]() ->promise::Promise<Message*>
         {
             if (wptr.deleted())
             {
@@ -1077,19 +1310,24 @@ Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
                 return promise::Error("msgDecrypt: history was reloaded, ignore message", EINVAL, SVCRYPTO_ENOMSG);
             }
 
-            if (!parsedMsg->verifySignature(ctx->edKey, *ctx->sendKey))
+            if (!job->error.empty())
+            {
+                return promise::Error(job->error, EINVAL, SVCRYPTO_EMALFORMED);
+            }
+
+            if (!job->signatureOk)
             {
                 return promise::Error("Signature invalid for message "+
                                       message->id().toString(), EINVAL, SVCRYPTO_ESIGNATURE);
             }
 
-            if (isLegacy)
+            if (job->isLegacy)
             {
-                return legacyMsgDecrypt(parsedMsg, message, *ctx->sendKey);
+                return legacyMsgDecrypt(job->parsedMsg, message, *job->sendKey);
             }
 
             // Decrypt message payload.
-            parsedMsg->symmetricDecrypt(*ctx->sendKey, *message);
+            job->parsedMsg->setDecryptedPayload(job->cleartext, *message);
             return message;
         });
     }
@@ -1100,6 +1338,221 @@ Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
     }
 }
 
+void ProtocolHandler::prepareMsgDecrypt(Message* message)
+{
+    // without worker threads, the decryption would be done here instead of later,
+    // with no benefit
+    if (!mWorkers || !mWorkers->threadCount())
+        return;
+
+    // management messages and the ones from legacy protocol are cheap or need
+    // other messages to be processed first, so leave them to msgDecrypt()
+    if (message->empty() || message->keyid == 0 || message->userid == karere::Id::COMMANDER()
+            || mPreparedDecrypts.count(message->id()))
+        return;
+
+    try
+    {
+        auto parsedMsg = std::make_shared<ParsedMessage>(*message, *this);
+        if (parsedMsg->protocolVersion <= 1)
+            return;
+
+        mPreparedDecrypts.emplace(message->id(), startDecryptJob(parsedMsg, *message, true));
+    }
+    catch(std::runtime_error& e)
+    {
+        // msgDecrypt() will fail in the same way and report it
+    }
+}
+
+void ProtocolHandler::DecryptJob::execute()
+{
+    try
+    {
+        signatureOk = parsedMsg->verifySignature(edKey, *sendKey);
+        if (signatureOk && !isLegacy)
+        {
+            cleartext = parsedMsg->decryptPayload(*sendKey);
+        }
+    }
+    catch(std::exception& e)
+    {
+        error = e.what();
+    }
+}
+
+std::shared_ptr<ProtocolHandler::DecryptJob>
+ProtocolHandler::startDecryptJob(const std::shared_ptr<ParsedMessage>& parsedMsg, const Message& msg, bool batch)
+{
+    // Get keyid
+    bool isLegacy = (parsedMsg->protocolVersion <= 1);
+    uint64_t keyid = isLegacy ? parsedMsg->keyId : msg.keyid;
+    auto job = std::make_shared<DecryptJob>(parsedMsg, isLegacy);
+
+    // Get sender key
+    auto symPms = getKey(UserKeyId(msg.userid, keyid), isLegacy)
+    .then([job](const std::shared_ptr<SendKey>& key)
+    {
+        job->sendKey = key;
+    });
+
+    auto wptr = weakHandle();
+    if (batch)
+    {
+        // the signing key is obtained when the batch is flushed, once per sender
+        symPms.then([this, wptr, job]()
+        {
+            if (wptr.deleted())
+            {
+                job->done.reject(promise::Error("startDecryptJob: strongvelop deleted, ignore message", EINVAL, SVCRYPTO_EEXPIRED));
+                return;
+            }
+            addToDecryptBatch(job);
+        })
+        .fail([job](const promise::Error& err)
+        {
+            job->done.reject(err);
+            return err;
+        });
+        return job;
+    }
+
+    // Get signing key
+    auto edPms = mUserAttrCache.getAttr(parsedMsg->sender,
+        ::mega::MegaApi::USER_ATTR_ED25519_PUBLIC_KEY)
+    .then([job](Buffer* key)
+    {
+        job->edKey.assign(key->buf(), key->dataSize());
+    });
+
+    promise::when(symPms, edPms)
+    .then([this, wptr, job]()
+    {
+        if (wptr.deleted())
+        {
+            job->done.reject(promise::Error("startDecryptJob: strongvelop deleted, ignore message", EINVAL, SVCRYPTO_EEXPIRED));
+            return;
+        }
+
+        if (!mWorkers)
+        {
+            job->execute();
+            job->done.resolve();
+            return;
+        }
+
+        // the job is kept alive by the 'done' callback, which is destroyed in this thread
+        DecryptJob* rawJob = job.get();
+        mWorkers->post([rawJob]() { rawJob->execute(); },
+                       [job]() { job->done.resolve(); });
+    })
+    .fail([job](const promise::Error& err)
+    {
+        job->done.reject(err);
+        return err;
+    });
+
+    return job;
+}
+
+void ProtocolHandler::addToDecryptBatch(const std::shared_ptr<DecryptJob>& job)
+{
+    job->inBatch = true;
+    mDecryptBatch.push_back(job);
+    if (mDecryptBatch.size() == 1)
+    {
+        // flush the messages received in this iteration of the event loop together
+        auto wptr = weakHandle();
+        marshallCall([this, wptr]()
+        {
+            if (wptr.deleted())
+                return;
+
+            flushDecryptBatch();
+        }, appCtx);
+    }
+    else if (mDecryptBatch.size() >= kDecryptBatchMaxSize)
+    {
+        flushDecryptBatch();
+    }
+}
+
+void ProtocolHandler::flushDecryptBatch()
+{
+    if (mDecryptBatch.empty())
+        return;
+
+    IdMap<std::vector<std::shared_ptr<DecryptJob>>> bySender;
+    for (auto& job: mDecryptBatch)
+    {
+        job->inBatch = false;
+        bySender[job->parsedMsg->sender].push_back(job);
+    }
+    mDecryptBatch.clear();
+
+    struct VerifyBatch
+    {
+        std::vector<std::shared_ptr<DecryptJob>> jobs;
+        uint64_t usecs = 0;
+    };
+    auto wptr = weakHandle();
+    for (auto& group: bySender)
+    {
+        Id sender = group.first;
+        auto batch = std::make_shared<VerifyBatch>();
+        batch->jobs.swap(group.second);
+        mUserAttrCache.getAttr(sender, ::mega::MegaApi::USER_ATTR_ED25519_PUBLIC_KEY)
+        .then([this, wptr, batch, sender](Buffer* key)
+        {
+            if (wptr.deleted())
+                return;
+
+            for (auto& job: batch->jobs)
+            {
+                job->edKey.assign(key->buf(), key->dataSize());
+            }
+
+            // the batch is kept alive by the 'done' callback, which is destroyed in this thread
+            VerifyBatch* rawBatch = batch.get();
+            mWorkers->post([rawBatch]()
+            {
+                auto start = std::chrono::steady_clock::now();
+                for (auto& job: rawBatch->jobs)
+                {
+                    job->execute();
+                }
+                rawBatch->usecs = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+            },
+            [this, wptr, batch, sender]()
+            {
+                if (!wptr.deleted())
+                {
+                    size_t count = batch->jobs.size();
+                    mVerifyStats.batches++;
+                    mVerifyStats.signatures += count;
+                    mVerifyStats.usecs += batch->usecs;
+                    STRONGVELOPE_LOG_DEBUG("Verified %zu messages from user %s in %llu us (%.0f msg/s)",
+                        count, sender.toString().c_str(), (unsigned long long)batch->usecs,
+                        batch->usecs ? (count * 1000000.0 / batch->usecs) : 0.0);
+                }
+                for (auto& job: batch->jobs)
+                {
+                    job->done.resolve();
+                }
+            });
+        })
+        .fail([batch](const promise::Error& err)
+        {
+            for (auto& job: batch->jobs)
+            {
+                job->done.reject(err);
+            }
+            return err;
+        });
+    }
+}
+
 Promise<void>
 ProtocolHandler::legacyExtractKeys(const std::shared_ptr<ParsedMessage>& parsedMsg)
 {
@@ -1179,12 +1632,25 @@ void ProtocolHandler::onKeyReceived(KeyId keyid, Id sender, Id receiver,
         auto it = mKeys.find(ukid);
         assert(it != mKeys.end());
         assert(it->second.pms);
-        it->second.pms->reject(err);
+        // remove the entry before notifying, since the callbacks may add other keys
+        auto keyPms = it->second.pms;
         mKeys.erase(it);
+        keyPms->reject(err);
         return err;
     });
 }
 
+void ProtocolHandler::prefetchSenderKeys(const SetOfIds& senders)
+{
+    for (auto sender: senders)
+    {
+        // onKeyReceived() fetches the Cu25519 key of each sender, which unwraps all
+        // its keys at once. Meanwhile, fetch the signing keys too, which are needed
+        // to verify the messages that come right after the keys
+        mUserAttrCache.getAttr(sender, ::mega::MegaApi::USER_ATTR_ED25519_PUBLIC_KEY, nullptr, nullptr);
+    }
+}
+
 void ProtocolHandler::addDecryptedKey(UserKeyId ukid, const std::shared_ptr<SendKey>& key)
 {
     assert(key->dataSize() == SVCRYPTO_KEY_SIZE);
@@ -1214,10 +1680,13 @@ void ProtocolHandler::addDecryptedKey(UserKeyId ukid, const std::shared_ptr<Send
     }
 
     // finally, notify anyone waiting for decryption of the received key (if decryption was asynchronous)
+    // The callbacks may add other keys, which invalidates the reference to the entry
     if (entry.pms)
     {
-        entry.pms->resolve(entry.key);
+        auto keyPms = entry.pms;
+        auto entryKey = entry.key;
         entry.pms.reset();
+        keyPms->resolve(entryKey);
     }
 }
 promise::Promise<std::shared_ptr<SendKey>>
@@ -10,6 +10,8 @@
 #include <vector>
 #include <map>
 #include <string>
+#include <memory>
+#include <mutex>
 #include <assert.h>
 #include <iostream>
 #include <buffer.h>
@@ -44,6 +46,7 @@
 namespace karere
 {
     class UserAttrCache;
+    class WorkerPool;
 }
 class SqliteDb;
 
@@ -164,22 +167,29 @@ class ProtocolHandler;
 struct ParsedMessage: public karere::DeleteTrackable
 {
     ProtocolHandler& mProtoHandler;
+    /** Copy of the binary message. The records below are views into it, so it
+     * is copied only once, instead of once per record */
+    Buffer mData;
     uint8_t protocolVersion;
     karere::Id sender;
     Key<32> nonce;
-    Buffer payload;
-    Buffer signedContent;
-    Buffer signature;
+    StaticBuffer payload = StaticBuffer(nullptr, 0);
+    StaticBuffer signedContent = StaticBuffer(nullptr, 0);
+    Key<64> signature;
     unsigned char type;
     //legacy key stuff
     uint64_t keyId;
     uint64_t prevKeyId;
-    Buffer encryptedKey; //may contain also the prev key, concatenated
+    StaticBuffer encryptedKey = StaticBuffer(nullptr, 0); //may contain also the prev key, concatenated
     ParsedMessage(const chatd::Message& src, ProtocolHandler& protoHandler);
     bool verifySignature(const StaticBuffer& pubKey, const SendKey& sendKey);
     void parsePayload(const StaticBuffer& data, chatd::Message& msg);
     void parsePayloadWithUtfBackrefs(const StaticBuffer& data, chatd::Message& msg);
     void symmetricDecrypt(const StaticBuffer& key, chatd::Message& outMsg);
+    /** Decrypts the payload, without touching any state shared with other threads,
+     * so it can be called from a worker thread. Used by \c symmetricDecrypt() */
+    std::string decryptPayload(const StaticBuffer& key) const;
+    void setDecryptedPayload(const std::string& cleartext, chatd::Message& outMsg);
     promise::Promise<chatd::Message*> decryptChatTitle(chatd::Message* msg, bool msgCanBeDeleted);
     std::unique_ptr<chatd::Message::ManagementInfo> managementInfo;
     std::unique_ptr<chatd::Message::CallEndedInfo> callEndedInfo;
@@ -216,6 +226,32 @@ struct EncryptedMessage
     EncryptedMessage(const chatd::Message& msg, const StaticBuffer& aKey);
 };
 
+/**
+ * @brief Encrypts \c msg with \c key and writes it to \c dest as
+ * <protVer><msgType><sigTLV><nonceTLV><payloadTLV>, signed with \c signingKey
+ * (the Ed25519 seed followed by its public key).
+ * The records are written straight into \c dest, where the payload is encrypted
+ * and signed in place, so the ciphertext is never copied.
+ */
+void encryptMessageContent(const chatd::Message& msg, chatd::MsgCommand& dest,
+    const StaticBuffer& key, const StaticBuffer& signingKey);
+
+/** @brief Decrypts the payload of a message, given the nonce it was sent with */
+std::string decryptMessagePayload(const StaticBuffer& nonce, const StaticBuffer& payload,
+    const StaticBuffer& key);
+
+/**
+ * @brief Verifies the signature of a message (protocol version 2 or later), whose
+ * signed content starts at \c contentOffset of \c data and spans till its end.
+ * If the bytes before the content are at least as many as the data prepended to it
+ * for signing, that data is written there and the content is not copied: those
+ * bytes are overwritten, which is fine when they hold the signature record and
+ * \c signature has been copied out of it.
+ */
+bool verifyMessageSignature(Buffer& data, size_t contentOffset, size_t overwritable,
+    uint8_t protoVersion, uint8_t msgType, const StaticBuffer& sendKey,
+    const StaticBuffer& signature, const StaticBuffer& pubKey);
+
 /**
  * @brief The UserKeyId struct is used to identify keys used for encrypted messages.
  * For each chat, every user has its own set of keyids that used to send messages.
@@ -232,12 +268,80 @@ struct UserKeyId
         else
             return keyid < other.keyid;
     }
+    bool operator==(UserKeyId other) const { return (user == other.user) && (keyid == other.keyid); }
+    struct Hash
+    {
+        size_t operator()(UserKeyId ukid) const { return ukid.user.val ^ ukid.keyid; }
+    };
 };
 
 class TlvWriter;
 extern const std::string SVCRYPTO_PAIRWISE_KEY;
 void deriveSharedKey(const StaticBuffer& sharedSecret, SendKey& output, const std::string& padString=SVCRYPTO_PAIRWISE_KEY);
 
+/**
+ * @brief The SharedSecretCache class holds the Cu25519 shared secrets with other
+ * users (our private key * their public key). It is owned by the karere::Client and
+ * used by the ProtocolHandlers of all chats, so the key agreement with a user is done
+ * once, regardless of the number of chats in common.
+ *
+ * Each secret is kept together with the public key of the user it was computed with.
+ * If the user's key changes (i.e. after an account recovery), the secret is computed
+ * again instead of using the stale one.
+ *
+ * Lookups can be done from any thread. If a db is attached, the secrets are also
+ * persisted in it, in a secretbox with a key derived from our private Cu25519 key,
+ * and \c compute() and \c forget() must be called from the thread that owns the db.
+ */
+class SharedSecretCache
+{
+public:
+    struct Stats
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t loaded = 0;    // restored from the db
+        uint64_t computed = 0;  // key agreements done
+        uint64_t stale = 0;     // replaced because the public key of the user changed
+    };
+
+protected:
+    struct Entry
+    {
+        std::shared_ptr<const EcKey> secret;
+        EcKey pubKey;           // the public key of the user the secret was computed with
+        bool confirmed = false; // pubKey has been checked against the current one of the user
+    };
+    mutable std::mutex mMutex;
+    std::map<karere::Id, Entry> mSecrets;
+    Stats mStats;
+    SqliteDb* mDb = nullptr;
+    Key<32> mDbKey;     // encrypts the secrets persisted in mDb
+
+public:
+    /** @brief Returns the shared secret with \c userid, or null if it's not cached.
+     * Secrets restored from the db are not returned until \c compute() has checked
+     * them against the current public key of the user */
+    std::shared_ptr<const EcKey> get(karere::Id userid);
+
+    /** @brief Returns the shared secret with \c userid for its public Cu25519 key,
+     * computing and caching it unless the cached one was computed with the same key */
+    std::shared_ptr<const EcKey> compute(karere::Id userid, const StaticBuffer& privCu25519,
+        const StaticBuffer& pubCu25519);
+
+    /** @brief Removes the secret with \c userid, from the db too. To be called when
+     * the public Cu25519 key of the user changes */
+    void forget(karere::Id userid);
+
+    /** @brief Loads the secrets persisted in \c db and persists the new ones */
+    void attachDb(SqliteDb& db, const StaticBuffer& privCu25519);
+
+    /** @brief Forgets all the secrets and detaches the db, if any */
+    void clear();
+
+    Stats stats() const;
+};
+
 /**
  * @brief The ProtocolHandler class implements ICrypto.
  * @see chatd::ICrypto for more details.
@@ -266,6 +370,8 @@ protected:
     EcKey myPrivCu25519;
     EcKey myPrivEd25519;
     EcKey myPubEd25519;
+    /** myPrivEd25519 followed by myPubEd25519, as required to sign */
+    Key<64> mSigningKey;
     Key<768> myPrivRsaKey;
 
     karere::UserAttrCache& mUserAttrCache;
@@ -297,10 +403,10 @@ protected:
     bool mForceRsa = false; // for testing of legacy-mode
 
     // received and confirmed keys (doesn't include unconfirmed keys)
-    std::map<UserKeyId, KeyEntry> mKeys;
+    karere::FlatMap<UserKeyId, KeyEntry, UserKeyId::Hash> mKeys;
 
-    // cache of symmetric keys (pubCu255 * privCu255)
-    std::map<karere::Id, std::shared_ptr<SendKey>> mSymmKeyCache;
+    // cache of shared secrets (pubCu255 * privCu255), common to all chats
+    SharedSecretCache& mSharedSecrets;
 
     // current list of participants (mapped to the `chatd::Client::mUsers`)
     karere::SetOfIds* mParticipants = nullptr;
@@ -308,15 +414,61 @@ protected:
     bool mIsDestroying = false;
     unsigned int mCacheVersion = 0; // updated if history is reloaded
 
+    /**
+     * @brief The DecryptJob struct holds the decryption of a regular message. First the
+     * sender's keys are obtained, maybe asynchronously. Then, the signature is verified
+     * and the payload decrypted by \c execute(), in a worker thread if available.
+     * The message itself is not accessed until \c done is resolved, so the job can
+     * run ahead of the delivery of the message.
+     */
+    struct DecryptJob
+    {
+        std::shared_ptr<ParsedMessage> parsedMsg;
+        bool isLegacy;
+        std::shared_ptr<SendKey> sendKey;
+        EcKey edKey;
+        bool signatureOk = false;
+        std::string cleartext;
+        std::string error;  // set if verification or decryption threw
+        bool inBatch = false;   // waiting in mDecryptBatch
+        promise::Promise<void> done;
+        DecryptJob(const std::shared_ptr<ParsedMessage>& aParsedMsg, bool aIsLegacy)
+        : parsedMsg(aParsedMsg), isLegacy(aIsLegacy) {}
+        void execute();
+    };
+
+    // worker threads for the CPU-bound part of decryption, if any
+    karere::WorkerPool* mWorkers;
+
+    // jobs started by prepareMsgDecrypt(), until msgDecrypt() is called for their messages
+    karere::IdMap<std::shared_ptr<DecryptJob>> mPreparedDecrypts;
+
+    // prepared jobs whose send key is known, to be verified in groups by sender
+    std::vector<std::shared_ptr<DecryptJob>> mDecryptBatch;
+    enum { kDecryptBatchMaxSize = 256 };
+
+public:
+    /** @brief Counters of the signatures verified in batches */
+    struct VerifyStats
+    {
+        uint64_t batches = 0;
+        uint64_t signatures = 0;
+        uint64_t usecs = 0;     // time spent verifying and decrypting, in the worker threads
+    };
+protected:
+    VerifyStats mVerifyStats;
+
 public:
     karere::Id chatid;
     karere::Id ownHandle() const { return mOwnHandle; }
     unsigned int getCacheVersion() const;
+    const VerifyStats& verifyStats() const { return mVerifyStats; }
 
     ProtocolHandler(karere::Id ownHandle, const StaticBuffer& PrivCu25519,
         const StaticBuffer& PrivEd25519,
         const StaticBuffer& privRsa, karere::UserAttrCache& userAttrCache,
-        SqliteDb& db, karere::Id aChatId, void *ctx);
+        SharedSecretCache& sharedSecrets, SqliteDb& db, karere::Id aChatId, void *ctx,
+        karere::WorkerPool* workers=nullptr);
 
     promise::Promise<std::shared_ptr<SendKey>> //must be public to access from ParsedMessage
         decryptKey(std::shared_ptr<Buffer>& key, karere::Id sender, karere::Id receiver);
@@ -334,6 +486,14 @@ protected:
     void loadUnconfirmedKeysFromDb();
 
     promise::Promise<std::shared_ptr<SendKey>> getKey(UserKeyId ukid, bool legacy=false);
+    std::shared_ptr<DecryptJob> startDecryptJob(const std::shared_ptr<ParsedMessage>& parsedMsg,
+        const chatd::Message& msg, bool batch=false);
+    void addToDecryptBatch(const std::shared_ptr<DecryptJob>& job);
+    /**
+     * Groups the jobs of the batch by sender and, for each sender, gets the signing key
+     * once and verifies all its messages in a single worker job
+     */
+    void flushDecryptBatch();
     void addDecryptedKey(UserKeyId ukid, const std::shared_ptr<SendKey>& key);
     /**
      * Updates our own sender key. Done when a message is sent and users
@@ -393,7 +553,10 @@ public:
 //chatd::ICrypto interface
     promise::Promise<std::pair<chatd::MsgCommand*, chatd::KeyCommand*>>
     msgEncrypt(chatd::Message *message, const karere::SetOfIds &recipients, chatd::MsgCommand* msgCmd);
+    virtual bool hasSendKeyFor(const karere::SetOfIds& recipients) const;
     virtual promise::Promise<chatd::Message*> msgDecrypt(chatd::Message* message);
+    virtual void prepareMsgDecrypt(chatd::Message* message);
+    virtual void prefetchSenderKeys(const karere::SetOfIds& senders);
     virtual void onKeyReceived(chatd::KeyId keyid, karere::Id sender,
         karere::Id receiver, const char* data, uint16_t dataLen);
     virtual void onKeyConfirmed(chatd::KeyId localkeyid, chatd::KeyId keyid);
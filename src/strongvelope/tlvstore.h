@@ -30,6 +30,8 @@ struct TlvRecord
     {
         v.emplace_back(buf(), dataLen);
     }
+    /** Payload of the record, without copying it out of the container */
+    StaticBuffer view() const { return StaticBuffer(buf(), dataLen); }
 };
 
 class TlvParser
@@ -99,21 +101,32 @@ public:
 void addRecord(uint8_t type, const StaticBuffer& value)
 {
     assert(!mEnded);
-    append(type);
-    if (value.dataSize() >= 0xffff)
-    {
-        append<uint16_t>(0xffff);
+    appendRecordHeader(*this, type, value.dataSize());
 #ifdef NODEBUG
+    if (value.dataSize() >= 0xffff)
         mEnded = true;
 #endif
-    }
-    else
-    {
-        append<uint16_t>(htons(value.dataSize()));
-    }
     append(value);
 }
 
+/**
+ * Appends the type and length of a record to any buffer, i.e. straight to the
+ * command that will be sent, without an intermediate TlvWriter. The \c len bytes
+ * of payload must be appended right after it. A payload of 0xffff bytes or more
+ * is encoded as spanning till the end of the container, so it must be the last one.
+ */
+static void appendRecordHeader(Buffer& dest, uint8_t type, size_t len)
+{
+    dest.append(type);
+    dest.append<uint16_t>((len >= 0xffff) ? 0xffff : htons(len));
+}
+
+static void appendRecord(Buffer& dest, uint8_t type, const StaticBuffer& value)
+{
+    appendRecordHeader(dest, type, value.dataSize());
+    dest.append(value);
+}
+
 template <typename T, typename=typename std::enable_if<std::is_pod<T>::value>::type>
 void addRecord(uint8_t type, T val)
 {
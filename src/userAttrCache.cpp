@@ -208,8 +208,8 @@ UserAttrCache::UserAttrCache(Client& aClient): mClient(aClient)
         std::unique_ptr<Buffer> data(new Buffer((size_t)sqlite3_column_bytes(stmt, 2)));
         stmt.blobCol(2, *data);
         UserAttrPair key(stmt.uint64Col(0), stmt.intCol(1));
-        emplace(std::make_pair(key, std::make_shared<UserAttrCacheItem>(
-                *this, data.release(), kCacheFetchNotPending)));
+        emplace(key, std::make_shared<UserAttrCacheItem>(
+                *this, data.release(), kCacheFetchNotPending));
 //        UACACHE_LOG_DEBUG("loaded attr %s", key.toString().c_str());
     }
     UACACHE_LOG_DEBUG("loaded %zu entries from db", size());
@@ -255,7 +255,7 @@ void UserAttrCache::onUserAttrChange(uint64_t userid, int changed)
             UACACHE_LOG_DEBUG("Attr %s change received for unknown user, ignoring", attrName(type));
             continue;
         }
-        auto& item = it->second;
+        auto item = it->second; // fetching may add items to the cache, invalidating references to them
         if ((type & USER_ATTR_FLAG_COMPOSITE) == 0)
         {
             dbInvalidateItem(key); //immediately invalidate persistent cache
@@ -559,10 +559,16 @@ void UserAttrCache::invalidate()
 void UserAttrCache::onLogin()
 {
     mIsLoggedIn = true;
+    // fetching may add items to the cache, which invalidates the iterators
+    std::vector<std::pair<UserAttrPair, std::shared_ptr<UserAttrCacheItem>>> pendingItems;
     for (auto& item: *this)
     {
         if (item.second->pending != kCacheFetchNotPending)
-            fetchAttr(item.first, item.second);
+            pendingItems.emplace_back(item.first, item.second);
+    }
+    for (auto& item: pendingItems)
+    {
+        fetchAttr(item.first, item.second);
     }
 }
 
@@ -68,6 +68,14 @@ struct UserAttrPair
         else
             return user < other.user;
     }
+    bool operator==(const UserAttrPair& other) const
+    {
+        return (user == other.user) && (attrType == other.attrType);
+    }
+    struct Hash
+    {
+        size_t operator()(const UserAttrPair& key) const { return key.user.val ^ key.attrType; }
+    };
     UserAttrPair(uint64_t aUser, uint8_t aType): user(aUser), attrType(aType)
     {
         if ((attrType >= sizeof(gUserAttrDescs)/sizeof(gUserAttrDescs[0]))
@@ -120,7 +128,7 @@ struct UserAttrCacheItem
 /** @brief
  * User attribute cache, prividing notifications when an attribute is changed
  */
-class UserAttrCache: public std::map<UserAttrPair, std::shared_ptr<UserAttrCacheItem>>,
+class UserAttrCache: public FlatMap<UserAttrPair, std::shared_ptr<UserAttrCacheItem>, UserAttrPair::Hash>,
                      public ::mega::MegaGlobalListener, public karere::DeleteTrackable
 {
 protected:
@@ -2,7 +2,24 @@
 
 #include <megaapi.h>
 #include "../../src/megachatapi.h"
+#include "../../src/megachatapi_impl.h"
 #include "../../src/karereCommon.h" // for logging with karere facility
+#include "../../src/base/timers.hpp"
+#include "../../src/base/mpscQueue.h"
+#include "../../src/strongvelope/strongvelope.h"
+#ifndef _WIN32
+#include <arpa/inet.h>
+#endif
+#include "../../src/strongvelope/tlvstore.h"
+#include "../../src/db.h"
+#include "../../src/chatdDb.h"
+#include <sodium.h>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <deque>
+#include <map>
+#include <sqlite3.h>
 
 #include <signal.h>
 #include <stdio.h>
@@ -14,6 +31,67 @@ using namespace mega;
 using namespace megachat;
 using namespace std;
 
+#ifdef SDK_TEST_COUNT_ALLOCS
+// Counts the heap allocations done by the current thread while gAllocCounter is set.
+// The linker redirects to these wrappers the malloc/realloc/calloc calls of everything
+// statically linked into sdk_test (the test code, karere and the static libraries), see
+// CMakeLists.txt. Calls made from inside shared libraries are not redirected.
+// The wrappers are active during the whole run, but they only count while a scope is open
+static thread_local size_t* gAllocCounter = nullptr;
+extern "C" void* __real_malloc(size_t size);
+extern "C" void* __real_realloc(void* ptr, size_t size);
+extern "C" void* __real_calloc(size_t count, size_t size);
+
+extern "C" void* __wrap_malloc(size_t size)
+{
+    if (gAllocCounter)
+        (*gAllocCounter)++;
+    return __real_malloc(size);
+}
+extern "C" void* __wrap_realloc(void* ptr, size_t size)
+{
+    if (gAllocCounter)
+        (*gAllocCounter)++;
+    return __real_realloc(ptr, size);
+}
+extern "C" void* __wrap_calloc(size_t count, size_t size)
+{
+    if (gAllocCounter)
+        (*gAllocCounter)++;
+    return __real_calloc(count, size);
+}
+
+// the default operator new calls malloc from inside the C++ runtime, where it's not
+// redirected, so the global operators new/delete of the whole process are replaced by
+// ones that call malloc/free from here
+void* operator new(size_t size)
+{
+    void* ptr = malloc(size ? size : 1);
+    if (!ptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+void operator delete[](void* ptr) noexcept
+{
+    free(ptr);
+}
+
+/** Counts the allocations of the current thread in \c counter during its lifetime */
+struct AllocCounterScope
+{
+    explicit AllocCounterScope(size_t& counter) { gAllocCounter = &counter; }
+    ~AllocCounterScope() { gAllocCounter = nullptr; }
+};
+#endif
+
 const std::string MegaChatApiTest::DEFAULT_PATH = "../../tests/sdk_test/";
 const std::string MegaChatApiTest::FILE_IMAGE_NAME = "logo.png";
 const std::string MegaChatApiTest::PATH_IMAGE = "PATH_IMAGE";
@@ -44,6 +122,19 @@ int main(int argc, char **argv)
     EXECUTE_TEST(t.TEST_ChangeMyOwnName(0), "TEST Change my name");
     EXECUTE_TEST(t.TEST_RichLinkUserAttribute(0), "TEST Rich link user attributes");
     EXECUTE_TEST(t.TEST_SendRichLink(0, 1), "TEST Send Rich link");
+    EXECUTE_TEST(t.TEST_UnreadCount(0, 1), "TEST Unread count");
+    EXECUTE_TEST(t.TEST_DecryptWorkers(0, 1), "TEST Decryption of messages by worker threads");
+    EXECUTE_TEST(t.TEST_LazyChatRooms(0, 1), "TEST Lazy loading of chatrooms");
+    EXECUTE_TEST(t.TEST_HistoryRamLimit(0, 1), "TEST Limit of RAM of the history");
+    EXECUTE_TEST(t.TEST_DbQueryPlans(), "TEST Query plans of local database");
+    EXECUTE_TEST(t.TEST_DbWalMode(), "TEST WAL mode of local database");
+    EXECUTE_TEST(t.TEST_HistoryStore(), "TEST Chunked history buffer");
+    EXECUTE_TEST(t.TEST_TimerWheel(), "TEST Timer wheel");
+    EXECUTE_TEST(t.TEST_IdMapLookups(), "TEST Lookups in maps of ids");
+    EXECUTE_TEST(t.TEST_EventQueue(), "TEST Event queue");
+    EXECUTE_TEST(t.TEST_SharedSecretCache(), "TEST Cache of shared secrets");
+    EXECUTE_TEST(t.TEST_MessageCryptoAllocs(0, 1), "TEST Allocations of message encryption");
+    EXECUTE_TEST(t.TEST_FrameReplay(0, 1), "TEST Replay of received chatd frames");
 
 #ifndef KARERE_DISABLE_WEBRTC
     EXECUTE_TEST(t.TEST_Calls(0, 1), "TEST Signalling calls");
@@ -55,6 +146,7 @@ int main(int argc, char **argv)
 
     // The test below is a manual test. It requires to stop the intenet conection
 //    EXECUTE_TEST(t.TEST_OfflineMode(0), "TEST Offline mode");
+//    EXECUTE_TEST(t.TEST_OfflineSendQueue(0, 50000), "TEST Offline send queue");
 
     t.terminate();
 
@@ -303,6 +395,7 @@ void MegaChatApiTest::SetUp()
         lastErrorTransfer[i] = -1;
 
         chatid[i] = MEGACHAT_INVALID_HANDLE;  // chatroom id from request
+        chatroomFromRequest[i] = false;
         chatroom[i] = NULL;
         chatListItem[i] = NULL;
         chatUpdated[i] = false;
@@ -1513,6 +1606,100 @@ void MegaChatApiTest::TEST_OfflineMode(unsigned int accountIndex)
     delete [] session;
 }
 
+/**
+ * @brief TEST_OfflineSendQueue
+ *
+ * Requirements:
+ * - The account should have at least one chatroom
+ *
+ * This test does the following:
+ *
+ * - Queue \c count messages without internet connection
+ * - Connect to internet
+ * - Wait until the last message has been received by the server
+ *
+ * The time spent to queue the messages and to flush them is logged, since
+ * every new message in the sending queue gets backreferences to the previous ones.
+ */
+void MegaChatApiTest::TEST_OfflineSendQueue(unsigned int accountIndex, unsigned int count)
+{
+    char *session = login(accountIndex);
+
+    MegaChatRoomList *chats = megaChatApi[accountIndex]->getChatRooms();
+    const MegaChatRoom *chatroom = chats->get(0);
+    ASSERT_CHAT_TEST(chatroom, "No chatroom found for account " + std::to_string(accountIndex+1));
+
+    MegaChatHandle chatid = chatroom->getChatId();
+    TestChatRoomListener *chatroomListener = new TestChatRoomListener(this, megaChatApi, chatid);
+    ASSERT_CHAT_TEST(megaChatApi[accountIndex]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(accountIndex+1));
+
+    // Load some message to feed history, so backreferences also point to it
+    bool *flagHistoryLoaded = &chatroomListener->historyLoaded[accountIndex]; *flagHistoryLoaded = false;
+    megaChatApi[accountIndex]->loadMessages(chatid, 64);
+    ASSERT_CHAT_TEST(waitForResponse(flagHistoryLoaded), "Expired timeout for loading history");
+
+    std::stringstream buffer;
+    buffer << endl << endl << "Disconnect from the Internet now" << endl << endl;
+    postLog(buffer.str());
+
+//    system("pause");
+
+    MegaChatHandle lastTempId = MEGACHAT_INVALID_HANDLE;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < count; i++)
+    {
+        string msg = "Offline message #" + std::to_string(i);
+        MegaChatMessage *msgSent = megaChatApi[accountIndex]->sendMessage(chatid, msg.c_str());
+        ASSERT_CHAT_TEST(msgSent, "Failed to send message " + std::to_string(i));
+        lastTempId = msgSent->getTempId();
+        delete msgSent;
+    }
+    auto queued = std::chrono::steady_clock::now();
+
+    buffer.str("");
+    buffer << endl << endl << "Connect to the Internet now" << endl << endl;
+    postLog(buffer.str());
+
+//    system("pause");
+
+    bool *flagRetry = &requestFlagsChat[accountIndex][MegaChatRequest::TYPE_RETRY_PENDING_CONNECTIONS]; *flagRetry = false;
+    megaChatApi[accountIndex]->retryPendingConnections();
+    ASSERT_CHAT_TEST(waitForResponse(flagRetry), "Timeout expired for retry pending connections");
+    ASSERT_CHAT_TEST(!lastErrorChat[accountIndex], "Failed to retry pending connections");
+
+    // messages are confirmed in order, so the queue is flushed once the last one
+    // is not found in the sending queue anymore
+    bool *flagConfirmed = &chatroomListener->msgConfirmed[accountIndex];
+    while (true)
+    {
+        *flagConfirmed = false;
+        MegaChatMessage *msgPending = megaChatApi[accountIndex]->getMessage(chatid, lastTempId);
+        if (!msgPending || msgPending->getStatus() != MegaChatMessage::STATUS_SENDING)
+        {
+            delete msgPending;
+            break;
+        }
+        delete msgPending;
+        ASSERT_CHAT_TEST(waitForResponse(flagConfirmed), "Expired timeout for the confirmation of the queued messages");
+    }
+    auto flushed = std::chrono::steady_clock::now();
+
+    buffer.str("");
+    buffer << count << " messages queued in "
+           << std::chrono::duration_cast<std::chrono::milliseconds>(queued - start).count() << " ms, flushed in "
+           << std::chrono::duration_cast<std::chrono::milliseconds>(flushed - queued).count() << " ms" << endl;
+    postLog(buffer.str());
+
+    megaChatApi[accountIndex]->closeChatRoom(chatid, chatroomListener);
+    delete chatroomListener;
+    chatroomListener = NULL;
+
+    delete chats;
+    chats = NULL;
+
+    delete [] session;
+}
+
 /**
  * @brief TEST_ClearHistory
  *
@@ -2935,154 +3122,1310 @@ void MegaChatApiTest::TEST_SendRichLink(unsigned int a1, unsigned int a2)
     secondarySession = NULL;
 }
 
-int MegaChatApiTest::loadHistory(unsigned int accountIndex, MegaChatHandle chatid, TestChatRoomListener *chatroomListener)
+/**
+ * @brief TEST_UnreadCount
+ *
+ * This test does the following:
+ *
+ * - Send some messages from the primary account
+ * - Check the unread count of the secondary account, and compare it with the one
+ * calculated from scratch
+ * - Delete one of the messages and check the unread count again
+ * - Mark the messages as seen by the secondary account and check the unread count again
+ * - Clear the history and check the unread count again
+ *
+ */
+void MegaChatApiTest::TEST_UnreadCount(unsigned int a1, unsigned int a2)
 {
-    // first of all, ensure the chatd connection is ready
-    bool *flagChatdOnline = &mChatConnectionOnline[accountIndex]; *flagChatdOnline = false;
-    while (megaChatApi[accountIndex]->getChatConnectionState(chatid) != MegaChatApi::CHAT_CONNECTION_ONLINE)
-    {
-        postLog("Attempt to load history when still offline. Waiting for connection...");
-        ASSERT_CHAT_TEST(waitForResponse(flagChatdOnline), "Timeout expired for connecting to chatd");
-        *flagChatdOnline = false;
-    }
+    char *primarySession = login(a1);
+    char *secondarySession = login(a2);
 
-    chatroomListener->msgCount[accountIndex] = 0;
-    while (1)
+    MegaUser *user = megaApi[a1]->getContact(mAccounts[a2].getEmail().c_str());
+    if (!user || (user->getVisibility() != MegaUser::VISIBILITY_VISIBLE))
     {
-        bool *flagHistoryLoaded = &chatroomListener->historyLoaded[accountIndex];
-        *flagHistoryLoaded = false;
-        int source = megaChatApi[accountIndex]->loadMessages(chatid, 16);
-        if (source == MegaChatApi::SOURCE_NONE || source == MegaChatApi::SOURCE_ERROR)
-        {
-            break;  // no more history or cannot retrieve it
-        }
-        ASSERT_CHAT_TEST(waitForResponse(flagHistoryLoaded), "Timeout expired for loading history");
+        makeContact(a1, a2);
     }
+    delete user;
+    user = NULL;
 
-    return chatroomListener->msgCount[accountIndex];
-}
+    MegaChatHandle chatid = getPeerToPeerChatRoom(a1, a2);
 
-void MegaChatApiTest::makeContact(unsigned int a1, unsigned int a2)
-{
-    bool *flagRequestInviteContact = &requestFlags[a1][MegaRequest::TYPE_INVITE_CONTACT];
-    *flagRequestInviteContact = false;
-    bool *flagContactRequestUpdatedSecondary = &mContactRequestUpdated[a2];
-    *flagContactRequestUpdatedSecondary = false;
-    std::string contactRequestMessage = "Contact Request Message";
-    megaApi[a1]->inviteContact(mAccounts[a2].getEmail().c_str(),
-                                                contactRequestMessage.c_str(), MegaContactRequest::INVITE_ACTION_ADD);
+    TestChatRoomListener *chatroomListener = new TestChatRoomListener(this, megaChatApi, chatid);
+    ASSERT_CHAT_TEST(megaChatApi[a1]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(a1+1));
+    ASSERT_CHAT_TEST(megaChatApi[a2]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(a2+1));
 
-    ASSERT_CHAT_TEST(waitForResponse(flagRequestInviteContact), "Expired timeout for invite contact request");
-    ASSERT_CHAT_TEST(!lastError[a1], "Error invite contact. Error: " + std::to_string(lastError[a1]));
-    ASSERT_CHAT_TEST(waitForResponse(flagContactRequestUpdatedSecondary), "Expired timeout for receive contact request");
+    loadHistory(a1, chatid, chatroomListener);
+    loadHistory(a2, chatid, chatroomListener);
+    clearHistory(a1, a2, chatid, chatroomListener);
+    ASSERT_CHAT_TEST(checkUnreadCount(a2, chatid), "Wrong unread count after clearing the history");
 
-    getContactRequest(a2, false);
+    const int kMessages = 3;
+    MegaChatHandle msgIds[kMessages];
+    for (int i = 0; i < kMessages; i++)
+    {
+        MegaChatMessage *msgSent = sendTextMessageOrUpdate(a1, a2, chatid, "Unread message " + std::to_string(i), chatroomListener);
+        msgIds[i] = msgSent->getMsgId();
+        delete msgSent;
+    }
 
-    bool *flagReplyContactRequest = &requestFlags[a2][MegaRequest::TYPE_REPLY_CONTACT_REQUEST];
-    *flagReplyContactRequest = false;
-    bool *flagContactRequestUpdatedPrimary = &mContactRequestUpdated[a1];
-    *flagContactRequestUpdatedPrimary = false;
-    megaApi[a2]->replyContactRequest(mContactRequest[a2], MegaContactRequest::REPLY_ACTION_ACCEPT);
-    ASSERT_CHAT_TEST(waitForResponse(flagReplyContactRequest), "Expired timeout for reply contact request");
-    ASSERT_CHAT_TEST(!lastError[a2], "Error reply contact request. Error: " + std::to_string(lastError[a2]));
-    ASSERT_CHAT_TEST(waitForResponse(flagContactRequestUpdatedPrimary), "Expired timeout for receive contact request reply");
+    MegaChatListItem *item = megaChatApi[a2]->getChatListItem(chatid);
+    int count = item->getUnreadCount();
+    delete item;
+    ASSERT_CHAT_TEST(count == kMessages, "Wrong unread count after receiving messages: " + std::to_string(count));
+    ASSERT_CHAT_TEST(checkUnreadCount(a2, chatid), "Wrong unread count after receiving messages");
+
+    bool *msgDeleted1 = &chatroomListener->msgEdited[a1]; *msgDeleted1 = false;
+    bool *msgDeleted2 = &chatroomListener->msgEdited[a2]; *msgDeleted2 = false;
+    MegaChatMessage *msgDeleted = megaChatApi[a1]->deleteMessage(chatid, msgIds[0]);
+    ASSERT_CHAT_TEST(msgDeleted, "Failed to delete message");
+    delete msgDeleted;
+    ASSERT_CHAT_TEST(waitForResponse(msgDeleted1), "Timeout expired for receiving confirmation of deletion");
+    ASSERT_CHAT_TEST(waitForResponse(msgDeleted2), "Timeout expired for receiving deletion");
+    item = megaChatApi[a2]->getChatListItem(chatid);
+    count = item->getUnreadCount();
+    delete item;
+    ASSERT_CHAT_TEST(count == kMessages - 1, "Wrong unread count after deleting a message: " + std::to_string(count));
+    ASSERT_CHAT_TEST(checkUnreadCount(a2, chatid), "Wrong unread count after deleting a message");
+
+    bool *chatItemUpdated2 = &chatItemUpdated[a2]; *chatItemUpdated2 = false;
+    ASSERT_CHAT_TEST(megaChatApi[a2]->setMessageSeen(chatid, msgIds[kMessages - 1]), "Failed to set message seen");
+    ASSERT_CHAT_TEST(waitForResponse(chatItemUpdated2), "Timeout expired for receiving the update of the unread count");
+    item = megaChatApi[a2]->getChatListItem(chatid);
+    count = item->getUnreadCount();
+    delete item;
+    ASSERT_CHAT_TEST(count == 0, "Wrong unread count after setting the messages as seen: " + std::to_string(count));
+    ASSERT_CHAT_TEST(checkUnreadCount(a2, chatid), "Wrong unread count after setting the messages as seen");
 
-    delete mContactRequest[a2];
-    mContactRequest[a2] = NULL;
+    clearHistory(a1, a2, chatid, chatroomListener);
+    ASSERT_CHAT_TEST(checkUnreadCount(a1, chatid), "Wrong unread count of the primary account after clearing the history");
+    ASSERT_CHAT_TEST(checkUnreadCount(a2, chatid), "Wrong unread count of the secondary account after clearing the history");
+
+    megaChatApi[a1]->closeChatRoom(chatid, chatroomListener);
+    megaChatApi[a2]->closeChatRoom(chatid, chatroomListener);
+    delete chatroomListener;
+    chatroomListener = NULL;
+
+    delete [] primarySession;
+    primarySession = NULL;
+    delete [] secondarySession;
+    secondarySession = NULL;
 }
 
-MegaChatHandle MegaChatApiTest::getGroupChatRoom(unsigned int a1, unsigned int a2,
-                                                 MegaChatPeerList *peers, bool create)
+/**
+ * @brief TEST_DecryptWorkers
+ *
+ * This test does the following:
+ *
+ * - Set several threads to decrypt the messages of the secondary account
+ * - Check that the worker threads are running after login
+ * - Send a batch of messages from the primary account, without waiting for them
+ * - Check that the secondary account receives all of them, in the order they were sent
+ *
+ */
+void MegaChatApiTest::TEST_DecryptWorkers(unsigned int a1, unsigned int a2)
 {
-    MegaChatRoomList *chats = megaChatApi[a1]->getChatRooms();
+    const unsigned int kThreads = 4;
+    megaChatApi[a2]->setCryptoThreadCount(kThreads);
 
-    bool chatroomExist = false;
-    MegaChatHandle chatid = MEGACHAT_INVALID_HANDLE;
-    for (int i = 0; i < chats->size() && !chatroomExist; ++i)
-    {
-        const MegaChatRoom *chat = chats->get(i);
-        if (!chat->isGroup() || !chat->isActive())
-        {
-            continue;
-        }
+    char *primarySession = login(a1);
+    char *secondarySession = login(a2);
 
-        for (int userIndex = 0; userIndex < chat->getPeerCount(); userIndex++)
-        {
-            if (chat->getPeerHandle(userIndex) == peers->getPeerHandle(0))
-            {
-                bool a2LoggedIn = (megaChatApi[a2] &&
-                                   (megaChatApi[a2]->getInitState() == MegaChatApi::INIT_ONLINE_SESSION ||
-                                    megaChatApi[a2]->getInitState() == MegaChatApi::INIT_OFFLINE_SESSION));
+    MegaChatApiImpl *impl = megaChatApi[a2]->pImpl;
+    impl->sdkMutex.lock();
+    size_t threadCount = impl->mClient->cryptoWorkers.threadCount();
+    impl->sdkMutex.unlock();
+    ASSERT_CHAT_TEST(threadCount == kThreads, "Wrong number of decryption threads: " + std::to_string(threadCount));
 
-                MegaChatRoom *chatToCheck = a2LoggedIn ? megaChatApi[a2]->getChatRoom(chat->getChatId()) : NULL;
-                if (!a2LoggedIn || (chatToCheck))
-                {
-                    delete chatToCheck;
-                    chatroomExist = true;
-                    chatid = chat->getChatId();
-                    break;
-                }
-            }
-        }
+    MegaUser *user = megaApi[a1]->getContact(mAccounts[a2].getEmail().c_str());
+    if (!user || (user->getVisibility() != MegaUser::VISIBILITY_VISIBLE))
+    {
+        makeContact(a1, a2);
     }
+    delete user;
+    user = NULL;
 
-    delete chats;
-    chats = NULL;
+    MegaChatHandle chatid = getPeerToPeerChatRoom(a1, a2);
 
-    if (!chatroomExist && create)
-    {
-        bool *flagCreateChatRoom = &requestFlagsChat[a1][MegaChatRequest::TYPE_CREATE_CHATROOM]; *flagCreateChatRoom = false;
-        bool *chatItemPrimaryReceived = &chatItemUpdated[a1]; *chatItemPrimaryReceived = false;
-        bool *chatItemSecondaryReceived = &chatItemUpdated[a2]; *chatItemSecondaryReceived = false;
-        this->chatid[a1] = MEGACHAT_INVALID_HANDLE;
+    TestChatRoomListener *chatroomListener = new TestChatRoomListener(this, megaChatApi, chatid);
+    ASSERT_CHAT_TEST(megaChatApi[a1]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(a1+1));
+    ASSERT_CHAT_TEST(megaChatApi[a2]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(a2+1));
 
-        megaChatApi[a1]->createChat(true, peers, this);
-        ASSERT_CHAT_TEST(waitForResponse(flagCreateChatRoom), "Expired timeout for creating groupchat");
-        ASSERT_CHAT_TEST(!lastErrorChat[a1], "Failed to create groupchat. Error: " + lastErrorMsgChat[a1] + " (" + std::to_string(lastErrorChat[a1]) + ")");
-        chatid = this->chatid[a1];
-        ASSERT_CHAT_TEST(chatid != MEGACHAT_INVALID_HANDLE, "Wrong chat id");
-        ASSERT_CHAT_TEST(waitForResponse(chatItemPrimaryReceived), "Expired timeout for receiving the new chat list item");
+    loadHistory(a1, chatid, chatroomListener);
+    loadHistory(a2, chatid, chatroomListener);
+    chatroomListener->clearMessages(a1);
+    chatroomListener->clearMessages(a2);
 
-        // since we may have multiple notifications for other chats, check we received the right one
-        MegaChatListItem *chatItemSecondaryCreated = NULL;
-        do
-        {
-            ASSERT_CHAT_TEST(waitForResponse(chatItemSecondaryReceived), "Expired timeout for receiving the new chat list item");
-            *chatItemSecondaryReceived = false;
+    const unsigned int kMessages = 30;
+    for (unsigned int i = 0; i < kMessages; i++)
+    {
+        std::string text = "Decrypted in order " + std::to_string(i);
+        MegaChatMessage *msgSent = megaChatApi[a1]->sendMessage(chatid, text.c_str());
+        ASSERT_CHAT_TEST(msgSent, "Failed to send message");
+        delete msgSent;
+    }
 
-            chatItemSecondaryCreated = megaChatApi[a2]->getChatListItem(chatid);
-            if (!chatItemSecondaryCreated)
-            {
-                continue;
-            }
-            else
-            {
-                if (chatItemSecondaryCreated->getChatId() != chatid)
-                {
-                    delete chatItemSecondaryCreated; chatItemSecondaryCreated = NULL;
-                }
-            }
-        } while (!chatItemSecondaryCreated);
+    bool *flagReceived = &chatroomListener->msgReceived[a2];
+    while (chatroomListener->msgId[a2].size() < kMessages)
+    {
+        *flagReceived = false;
+        ASSERT_CHAT_TEST(waitForResponse(flagReceived), "Timeout expired for receiving messages. Received "
+                         + std::to_string(chatroomListener->msgId[a2].size()) + " of " + std::to_string(kMessages));
+    }
 
-        delete chatItemSecondaryCreated;    chatItemSecondaryCreated = NULL;
+    std::vector<MegaChatHandle> received = chatroomListener->msgId[a2];
+    for (unsigned int i = 0; i < kMessages; i++)
+    {
+        MegaChatMessage *msg = megaChatApi[a2]->getMessage(chatid, received[i]);
+        ASSERT_CHAT_TEST(msg, "Received message not found");
+        std::string expected = "Decrypted in order " + std::to_string(i);
+        std::string content = msg->getContent() ? msg->getContent() : "";
+        delete msg;
+        ASSERT_CHAT_TEST(content == expected, "Message received out of order. Expected: " + expected + " Received: " + content);
     }
 
-    return chatid;
-}
+    megaChatApi[a1]->closeChatRoom(chatid, chatroomListener);
+    megaChatApi[a2]->closeChatRoom(chatid, chatroomListener);
+    delete chatroomListener;
+    chatroomListener = NULL;
 
-MegaChatHandle MegaChatApiTest::getPeerToPeerChatRoom(unsigned int a1, unsigned int a2)
-{
-    MegaUser *peerPrimary = megaApi[a1]->getContact(mAccounts[a2].getEmail().c_str());
-    MegaUser *peerSecondary = megaApi[a2]->getContact(mAccounts[a1].getEmail().c_str());
-    ASSERT_CHAT_TEST(peerPrimary && peerSecondary, "Fail to get Peers");
+    megaChatApi[a2]->setCryptoThreadCount(0);
 
-    MegaChatRoom *chatroom0 = megaChatApi[a1]->getChatRoomByUser(peerPrimary->getHandle());
-    if (!chatroom0) // chat 1on1 doesn't exist yet --> create it
-    {
-        MegaChatPeerList *peers = MegaChatPeerList::createInstance();
-        peers->addPeer(peerPrimary->getHandle(), MegaChatPeerList::PRIV_STANDARD);
+    delete [] primarySession;
+    primarySession = NULL;
+    delete [] secondarySession;
+    secondarySession = NULL;
+}
 
-        bool *flag = &requestFlagsChat[a1][MegaChatRequest::TYPE_CREATE_CHATROOM]; *flag = false;
+/**
+ * @brief TEST_LazyChatRooms
+ *
+ * This test does the following:
+ *
+ * - Send a message from the primary account to the secondary one
+ * - Logout the secondary account keeping the local cache, and resume the session with
+ * lazy loading of chatrooms
+ * - Check that the chat of the chatroom is not created after connecting
+ * - Check that its chatlist item has the last message and the unread count of the cache
+ * - Send another message from the primary account, and check that the secondary one
+ * receives it in the chatroom it never opened: its chat is created, and its chatlist item
+ * is updated with the new last message and unread count
+ * - Open the chatroom and check that its history is loaded
+ *
+ */
+void MegaChatApiTest::TEST_LazyChatRooms(unsigned int a1, unsigned int a2)
+{
+    char *primarySession = login(a1);
+    char *secondarySession = login(a2);
+
+    MegaUser *user = megaApi[a1]->getContact(mAccounts[a2].getEmail().c_str());
+    if (!user || (user->getVisibility() != MegaUser::VISIBILITY_VISIBLE))
+    {
+        makeContact(a1, a2);
+    }
+    delete user;
+    user = NULL;
+
+    MegaChatHandle chatid = getPeerToPeerChatRoom(a1, a2);
+
+    TestChatRoomListener *chatroomListener = new TestChatRoomListener(this, megaChatApi, chatid);
+    ASSERT_CHAT_TEST(megaChatApi[a1]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(a1+1));
+    ASSERT_CHAT_TEST(megaChatApi[a2]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(a2+1));
+    loadHistory(a1, chatid, chatroomListener);
+    loadHistory(a2, chatid, chatroomListener);
+
+    std::string text = "Last message of a lazy chatroom";
+    MegaChatMessage *msgSent = sendTextMessageOrUpdate(a1, a2, chatid, text, chatroomListener);
+    delete msgSent;
+    megaChatApi[a2]->closeChatRoom(chatid, chatroomListener);
+
+    MegaChatListItem *item = megaChatApi[a2]->getChatListItem(chatid);
+    ASSERT_CHAT_TEST(item, "Chatlist item not found");
+    int unreadCount = item->getUnreadCount();
+    delete item;
+
+    logout(a2, false);
+    megaChatApi[a2]->setLazyChatRooms(true);
+    char *secondarySession2 = login(a2, secondarySession);
+
+    MegaChatApiImpl *impl = megaChatApi[a2]->pImpl;
+    impl->sdkMutex.lock();
+    auto it = impl->mClient->chats->find(chatid);
+    bool found = (it != impl->mClient->chats->end());
+    bool created = found && it->second->hasChatdChat();
+    impl->sdkMutex.unlock();
+    ASSERT_CHAT_TEST(found, "Chatroom not loaded from the cache");
+    ASSERT_CHAT_TEST(!created, "Chat of a lazy chatroom created on connection");
+
+    item = megaChatApi[a2]->getChatListItem(chatid);
+    ASSERT_CHAT_TEST(item, "Chatlist item of lazy chatroom not found");
+    std::string lastMessage = item->getLastMessage() ? item->getLastMessage() : "";
+    int lazyUnreadCount = item->getUnreadCount();
+    delete item;
+    ASSERT_CHAT_TEST(lastMessage == text, "Wrong last message of lazy chatroom: " + lastMessage);
+    ASSERT_CHAT_TEST(lazyUnreadCount == unreadCount, "Wrong unread count of lazy chatroom. Expected: "
+                     + std::to_string(unreadCount) + " Received: " + std::to_string(lazyUnreadCount));
+
+    impl->sdkMutex.lock();
+    created = impl->mClient->chats->find(chatid)->second->hasChatdChat();
+    impl->sdkMutex.unlock();
+    ASSERT_CHAT_TEST(!created, "Chat of a lazy chatroom created by its chatlist item");
+
+    // the lazy chatroom is joined in the background, so it receives new messages
+    std::string newText = "New message of a lazy chatroom";
+    bool *flagItemUpdated = &chatItemUpdated[a2]; *flagItemUpdated = false;
+    msgSent = megaChatApi[a1]->sendMessage(chatid, newText.c_str());
+    ASSERT_CHAT_TEST(msgSent, "Failed to send message");
+    delete msgSent;
+    msgSent = NULL;
+
+    while (lastMessage != newText)
+    {
+        ASSERT_CHAT_TEST(waitForResponse(flagItemUpdated), "Timeout expired for receiving a message in a lazy chatroom");
+        *flagItemUpdated = false;
+        item = megaChatApi[a2]->getChatListItem(chatid);
+        ASSERT_CHAT_TEST(item, "Chatlist item of lazy chatroom not found");
+        lastMessage = item->getLastMessage() ? item->getLastMessage() : "";
+        delete item;
+    }
+
+    impl->sdkMutex.lock();
+    created = impl->mClient->chats->find(chatid)->second->hasChatdChat();
+    bool lazy = impl->mClient->mChatdClient->isLazyChat(chatid);
+    impl->sdkMutex.unlock();
+    ASSERT_CHAT_TEST(created && !lazy, "Chat of a lazy chatroom not created by a new message");
+
+    item = megaChatApi[a2]->getChatListItem(chatid);
+    ASSERT_CHAT_TEST(item, "Chatlist item of lazy chatroom not found");
+    int newUnreadCount = item->getUnreadCount();
+    delete item;
+    ASSERT_CHAT_TEST(newUnreadCount != lazyUnreadCount, "Unread count of lazy chatroom not updated by a new message: "
+                     + std::to_string(newUnreadCount));
+
+    ASSERT_CHAT_TEST(megaChatApi[a2]->openChatRoom(chatid, chatroomListener), "Can't open lazy chatRoom account " + std::to_string(a2+1));
+    loadHistory(a2, chatid, chatroomListener);
+
+    megaChatApi[a1]->closeChatRoom(chatid, chatroomListener);
+    megaChatApi[a2]->closeChatRoom(chatid, chatroomListener);
+    delete chatroomListener;
+    chatroomListener = NULL;
+
+    megaChatApi[a2]->setLazyChatRooms(false);
+
+    delete [] primarySession;
+    primarySession = NULL;
+    delete [] secondarySession;
+    secondarySession = NULL;
+    delete [] secondarySession2;
+    secondarySession2 = NULL;
+}
+
+/**
+ * @brief TEST_HistoryRamLimit
+ *
+ * This test does the following:
+ *
+ * - Set a small limit of RAM for the history of the secondary account
+ * - Send from the primary account more messages than fit in the limit
+ * - Close the chatroom in the secondary account, and check that the oldest messages
+ * are removed from RAM and the RAM used is within the limit
+ * - Open the chatroom again and check that all the messages are loaded again from the cache
+ *
+ */
+void MegaChatApiTest::TEST_HistoryRamLimit(unsigned int a1, unsigned int a2)
+{
+    const unsigned int kRamLimit = 8192;
+    const unsigned int kMessages = 40;
+    megaChatApi[a2]->setHistoryRamLimit(kRamLimit);
+
+    char *primarySession = login(a1);
+    char *secondarySession = login(a2);
+
+    MegaUser *user = megaApi[a1]->getContact(mAccounts[a2].getEmail().c_str());
+    if (!user || (user->getVisibility() != MegaUser::VISIBILITY_VISIBLE))
+    {
+        makeContact(a1, a2);
+    }
+    delete user;
+    user = NULL;
+
+    MegaChatHandle chatid = getPeerToPeerChatRoom(a1, a2);
+
+    TestChatRoomListener *chatroomListener = new TestChatRoomListener(this, megaChatApi, chatid);
+    ASSERT_CHAT_TEST(megaChatApi[a1]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(a1+1));
+    ASSERT_CHAT_TEST(megaChatApi[a2]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(a2+1));
+
+    loadHistory(a1, chatid, chatroomListener);
+    loadHistory(a2, chatid, chatroomListener);
+    chatroomListener->clearMessages(a1);
+    chatroomListener->clearMessages(a2);
+
+    // each message takes more than 300 bytes, so all of them don't fit in the limit
+    std::string padding(300, 'x');
+    for (unsigned int i = 0; i < kMessages; i++)
+    {
+        std::string text = "Evicted from RAM " + std::to_string(i) + " " + padding;
+        MegaChatMessage *msgSent = megaChatApi[a1]->sendMessage(chatid, text.c_str());
+        ASSERT_CHAT_TEST(msgSent, "Failed to send message");
+        delete msgSent;
+    }
+
+    bool *flagReceived = &chatroomListener->msgReceived[a2];
+    while (chatroomListener->msgId[a2].size() < kMessages)
+    {
+        *flagReceived = false;
+        ASSERT_CHAT_TEST(waitForResponse(flagReceived), "Timeout expired for receiving messages. Received "
+                         + std::to_string(chatroomListener->msgId[a2].size()) + " of " + std::to_string(kMessages));
+    }
+    std::vector<MegaChatHandle> received = chatroomListener->msgId[a2];
+
+    MegaChatApiImpl *impl = megaChatApi[a2]->pImpl;
+    impl->sdkMutex.lock();
+    const chatd::Chat *chat = &impl->mClient->chats->find(chatid)->second->chat();
+    chatd::Idx lownum = chat->lownum();
+    size_t ramSize = chat->historyRamSize();
+    impl->sdkMutex.unlock();
+    ASSERT_CHAT_TEST(ramSize > kRamLimit, "History too small to exceed the limit: " + std::to_string(ramSize) + " bytes");
+
+    // the history is reset when the app closes the chatroom
+    megaChatApi[a2]->closeChatRoom(chatid, chatroomListener);
+
+    impl->sdkMutex.lock();
+    chatd::Idx lownumTrimmed = chat->lownum();
+    size_t ramSizeTrimmed = chat->historyRamSize();
+    impl->sdkMutex.unlock();
+    ASSERT_CHAT_TEST(lownumTrimmed > lownum, "Messages not evicted from RAM");
+    ASSERT_CHAT_TEST(ramSizeTrimmed <= kRamLimit, "RAM of the history over the limit: " + std::to_string(ramSizeTrimmed) + " bytes");
+
+    chatroomListener->clearMessages(a2);
+    ASSERT_CHAT_TEST(megaChatApi[a2]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(a2+1));
+    loadHistory(a2, chatid, chatroomListener);
+
+    std::string missing;
+    for (MegaChatHandle msgid: received)
+    {
+        if (!chatroomListener->hasArrivedMessage(a2, msgid))
+        {
+            missing.append(karere::Id(msgid).toString()).append(" ");
+        }
+    }
+    ASSERT_CHAT_TEST(missing.empty(), "Evicted messages not loaded again: " + missing);
+
+    impl->sdkMutex.lock();
+    chatd::Idx lownumReloaded = chat->lownum();
+    impl->sdkMutex.unlock();
+    ASSERT_CHAT_TEST(lownumReloaded <= lownum, "Evicted messages not loaded again in RAM");
+
+    megaChatApi[a1]->closeChatRoom(chatid, chatroomListener);
+    megaChatApi[a2]->closeChatRoom(chatid, chatroomListener);
+    delete chatroomListener;
+    chatroomListener = NULL;
+
+    megaChatApi[a2]->setHistoryRamLimit(0);
+
+    delete [] primarySession;
+    primarySession = NULL;
+    delete [] secondarySession;
+    secondarySession = NULL;
+}
+
+/**
+ * @brief TEST_DbQueryPlans
+ *
+ * This test does the following:
+ *
+ * - Create the local database schema in memory
+ * - Get the query plan of the frequent queries on the tables of chats, as defined in chatdDb.h
+ * - Check that none of them scans a whole table, except the single pass over the chats
+ *   that loads the state of all of them
+ *
+ */
+void MegaChatApiTest::TEST_DbQueryPlans()
+{
+    sqlite3 *db = NULL;
+    ASSERT_CHAT_TEST(sqlite3_open(":memory:", &db) == SQLITE_OK, "Failed to open in-memory database");
+    char *error = NULL;
+    if (sqlite3_exec(db, karere::gDbSchema, NULL, NULL, &error) != SQLITE_OK)
+    {
+        std::string msg = std::string("Failed to create the database schema: ") + (error ? error : "");
+        sqlite3_free(error);
+        sqlite3_close(db);
+        ASSERT_CHAT_TEST(false, msg);
+    }
+
+    std::string failures;
+    for (const char *query: chatd::sql::kHotQueries)
+    {
+        sqlite3_stmt *stmt = NULL;
+        std::string sql = std::string("explain query plan ") + query;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL) != SQLITE_OK)
+        {
+            failures.append("Failed to prepare: ").append(query).append("\n");
+            continue;
+        }
+
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            // the last column describes the step, either "SEARCH <table> USING ..." or "SCAN <table>"
+            const char *detail = (const char *)sqlite3_column_text(stmt, 3);
+            if (detail && !strncmp(detail, "SCAN", 4))
+            {
+                failures.append(detail).append(" in: ").append(query).append("\n");
+            }
+        }
+        sqlite3_finalize(stmt);
+    }
+    sqlite3_close(db);
+
+    ASSERT_CHAT_TEST(failures.empty(), "Queries without a supporting index:\n" + failures);
+}
+
+/**
+ * @brief TEST_DbWalMode
+ *
+ * This test does the following:
+ *
+ * - Open a database in WAL mode, with the commits grouped as the client does
+ * - Write and commit some rows, and check that the journal is a WAL
+ * - Check that the WAL is checkpointed by the background thread
+ * - Reopen the database without WAL mode, and check that the journal is switched back
+ * and that no row was lost
+ *
+ */
+void MegaChatApiTest::TEST_DbWalMode()
+{
+    std::string path = "waltest_" + std::to_string(getpid()) + ".db";
+    std::string walPath = path + "-wal";
+    remove(path.c_str());
+    remove(walPath.c_str());
+
+    SqliteDb db;
+    db.setWalMode(true);
+    ASSERT_CHAT_TEST(db.open(path.c_str(), false), "Failed to open database " + path);
+    {
+        SqliteStmt stmt(db, "pragma journal_mode");
+        ASSERT_CHAT_TEST(stmt.step() && stmt.stringCol(0) == "wal", "Database not in WAL mode");
+    }
+
+    db.simpleQuery("create table items(id int primary key, data blob)");
+    const int kRows = 100;
+    for (int i = 0; i < kRows; i++)
+    {
+        db.query("insert into items(id, data) values(?, ?)", i, std::to_string(i));
+        if (i % 10 == 9)
+        {
+            db.commit();
+        }
+    }
+
+    struct stat info;
+    ASSERT_CHAT_TEST(stat(walPath.c_str(), &info) == 0, "WAL file not found");
+
+    auto stats = db.commitStats();
+    ASSERT_CHAT_TEST(stats.commits >= kRows / 10, "Unexpected number of commits: " + std::to_string(stats.commits));
+    for (int i = 0; i < 50 && !stats.checkpoints; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        stats = db.commitStats();
+    }
+    ASSERT_CHAT_TEST(stats.checkpoints > 0, "The WAL was not checkpointed");
+    db.close();
+
+    db.setWalMode(false);
+    ASSERT_CHAT_TEST(db.open(path.c_str(), false), "Failed to reopen database " + path);
+    {
+        SqliteStmt stmt(db, "pragma journal_mode");
+        ASSERT_CHAT_TEST(stmt.step() && stmt.stringCol(0) == "delete", "Database still in WAL mode");
+    }
+    int count;
+    {
+        SqliteStmt stmt(db, "select count(*) from items");
+        stmt.stepMustHaveData();
+        count = stmt.intCol(0);
+    }
+    db.close();
+    remove(path.c_str());
+    ASSERT_CHAT_TEST(count == kRows, "Rows lost: " + std::to_string(kRows - count));
+    ASSERT_CHAT_TEST(stat(walPath.c_str(), &info) != 0, "WAL file not removed");
+}
+
+/**
+ * @brief TEST_HistoryStore
+ *
+ * This test does the following:
+ *
+ * - Add messages at both ends of a history buffer, across several chunks
+ * - Check their indexes and contents, and that the messages don't move when more are added
+ * - Pack the payloads into the arena, check the contents, and modify one of them
+ * - Check the running total of RAM of the buffer after adding, modifying and evicting messages
+ * - Evict the oldest messages, as done by the limit of RAM of the history, and
+ * check the remaining ones
+ * - Clear the buffer and start it at another index
+ *
+ */
+void MegaChatApiTest::TEST_HistoryStore()
+{
+    const chatd::Idx kStart = 1000;
+    const int kCount = 3 * chatd::HistoryStore::kChunkSize + 10;
+    chatd::HistoryStore store(kStart);
+    ASSERT_CHAT_TEST(store.empty() && !store.findOrNull(kStart), "History buffer not empty");
+
+    auto content = [](chatd::Idx idx) { return "message " + std::to_string(idx); };
+    auto addMsg = [&content, &store](chatd::Idx idx, bool newest) -> chatd::Message&
+    {
+        std::string text = content(idx);
+        chatd::Message msg(karere::Id((uint64_t)idx), karere::Id((uint64_t)1), 0, 0,
+                           text.c_str(), text.size(), false, CHATD_KEYID_INVALID, chatd::Message::kMsgNormal);
+        return newest ? store.pushNewest(std::move(msg)) : store.pushOldest(std::move(msg));
+    };
+
+    chatd::Message* first = &addMsg(kStart, true);
+    for (int i = 1; i < kCount; i++)
+    {
+        addMsg(kStart + i, true);
+        addMsg(kStart - i, false);
+    }
+    ASSERT_CHAT_TEST(store.lownum() == kStart - kCount + 1 && store.highnum() == kStart + kCount - 1,
+                     "Wrong range of indexes: " + std::to_string(store.lownum()) + " - " + std::to_string(store.highnum()));
+    ASSERT_CHAT_TEST(store.findOrNull(kStart) == first, "Message moved while adding others");
+
+    auto sumRamSizes = [&store]()
+    {
+        size_t sum = 0;
+        for (chatd::Idx i = store.lownum(); i <= store.highnum(); i++)
+        {
+            sum += chatd::HistoryStore::msgRamSize(*store.findOrNull(i));
+        }
+        return sum;
+    };
+    ASSERT_CHAT_TEST(store.ramSize() == sumRamSizes(), "Wrong RAM of the buffer after adding messages");
+    ASSERT_CHAT_TEST(!store.findOrNull(store.lownum() - 1) && !store.findOrNull(store.highnum() + 1),
+                     "Found a message out of range");
+
+    std::string failures;
+    for (chatd::Idx i = store.lownum(); i <= store.highnum(); i++)
+    {
+        store.pack(i);
+    }
+    for (chatd::Idx i = store.lownum(); i <= store.highnum(); i++)
+    {
+        chatd::Message* msg = store.findOrNull(i);
+        if (msg->id() != karere::Id((uint64_t)i) || std::string(msg->buf(), msg->dataSize()) != content(i))
+        {
+            failures.append(std::to_string(i)).append(" ");
+        }
+    }
+    ASSERT_CHAT_TEST(failures.empty(), "Wrong messages after packing: " + failures);
+
+    // a modified message gets a copy of its own, and the others are not affected
+    chatd::Message* modified = store.findOrNull(kStart + 1);
+    ASSERT_CHAT_TEST(modified->isSlice(), "Payload not packed");
+    modified->append("!", 1);
+    ASSERT_CHAT_TEST(!modified->isSlice() && std::string(modified->buf(), modified->dataSize()) == content(kStart + 1) + "!",
+                     "Wrong contents of a modified message");
+    chatd::Message* next = store.findOrNull(kStart + 2);
+    ASSERT_CHAT_TEST(std::string(next->buf(), next->dataSize()) == content(kStart + 2), "Message modified by its neighbour");
+    store.updateRamSize(kStart + 1);
+    ASSERT_CHAT_TEST(store.ramSize() == sumRamSizes(), "Wrong RAM of the buffer after modifying a message");
+
+    chatd::Idx evictTo = kStart + 10;
+    while (store.lownum() < evictTo)
+    {
+        store.popOldest();
+    }
+    ASSERT_CHAT_TEST(store.lownum() == evictTo && store.size() == kCount - 10, "Wrong size after evicting messages");
+    ASSERT_CHAT_TEST(!store.findOrNull(evictTo - 1), "Found an evicted message");
+    ASSERT_CHAT_TEST(store.ramSize() == sumRamSizes(), "Wrong RAM of the buffer after evicting messages");
+    for (chatd::Idx i = store.lownum(); i <= store.highnum(); i++)
+    {
+        chatd::Message* msg = store.findOrNull(i);
+        if (std::string(msg->buf(), msg->dataSize()) != content(i))
+        {
+            failures.append(std::to_string(i)).append(" ");
+        }
+    }
+    ASSERT_CHAT_TEST(failures.empty(), "Wrong messages after evicting the oldest ones: " + failures);
+
+    // evicted messages are loaded again from db at the oldest end
+    addMsg(evictTo - 1, false);
+    ASSERT_CHAT_TEST(store.lownum() == evictTo - 1 && store.findOrNull(evictTo)->id() == karere::Id((uint64_t)evictTo),
+                     "Wrong messages after loading an evicted message again");
+
+    store.clear(5);
+    ASSERT_CHAT_TEST(store.empty() && !store.ramSize(), "History buffer not empty after clearing it");
+    addMsg(5, true);
+    ASSERT_CHAT_TEST(store.lownum() == 5 && store.highnum() == 5, "Wrong index of a message after clearing the buffer");
+}
+
+/**
+ * @brief TEST_TimerWheel
+ *
+ * This test does the following:
+ *
+ * - Schedule 100k timers with random expirations, and cancel a third of them
+ * - Advance the time in random steps, until all of them expired
+ * - Check that each timer expired at its time, in order, and the canceled ones didn't
+ * - Measure the time to schedule and cancel 100k timers
+ *
+ */
+void MegaChatApiTest::TEST_TimerWheel()
+{
+    struct Timer: public karere::WheelTimer
+    {
+        karere::TimerWheel *wheel = NULL;
+        uint64_t expected = 0;
+        uint64_t expiredAt = 0;
+        bool canceled = false;
+        std::vector<Timer *> *expiredList = NULL;
+        virtual void expire()
+        {
+            expiredAt = wheel->now();
+            expiredList->push_back(this);
+        }
+    };
+
+    const unsigned count = 100000;
+    std::vector<Timer> timers(count);
+    std::vector<Timer *> expired;
+    karere::TimerWheel wheel;
+    unsigned seed = 1;
+    auto rand = [&seed]() { seed = seed * 1103515245 + 12345; return (seed >> 1) & 0x3fffffff; };
+
+    uint64_t now = 1000;
+    wheel.advance(now);
+    for (auto& timer: timers)
+    {
+        timer.wheel = &wheel;
+        timer.expiredList = &expired;
+        timer.expected = now + 1 + (rand() % (1 << (rand() % 30)));
+        wheel.add(&timer, timer.expected);
+    }
+    for (unsigned i = 0; i < count; i += 3)
+    {
+        wheel.remove(&timers[i]);
+        timers[i].canceled = true;
+    }
+    while (wheel.size())
+    {
+        now += rand() % (1 << (rand() % 28));
+        wheel.advance(now);
+    }
+
+    ASSERT_CHAT_TEST(expired.size() == count - (count + 2) / 3, "Unexpected number of expired timers: " + std::to_string(expired.size()));
+    for (size_t i = 0; i < expired.size(); i++)
+    {
+        Timer *timer = expired[i];
+        ASSERT_CHAT_TEST(!timer->canceled, "A canceled timer expired");
+        ASSERT_CHAT_TEST(timer->expiredAt == timer->expected, "A timer expired at " + std::to_string(timer->expiredAt)
+                         + " instead of " + std::to_string(timer->expected));
+        ASSERT_CHAT_TEST(!i || expired[i - 1]->expiredAt <= timer->expiredAt, "Timers expired out of order");
+    }
+
+    karere::TimerWheel benchWheel;
+    std::vector<Timer> benchTimers(count);
+    auto start = std::chrono::steady_clock::now();
+    for (auto& timer: benchTimers)
+    {
+        benchWheel.add(&timer, 1 + rand() % 60000);
+    }
+    for (auto& timer: benchTimers)
+    {
+        benchWheel.remove(&timer);
+    }
+    auto usecs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    ASSERT_CHAT_TEST(!benchWheel.size(), "Timers left in the wheel after canceling all of them");
+    postLog("Scheduled and canceled " + std::to_string(count) + " timers in " + std::to_string(usecs) + " us");
+}
+
+/**
+ * @brief TEST_IdMapLookups
+ *
+ * This test does the following:
+ *
+ * - Fill an IdMap and a std::map with the same chats, and another pair with the same
+ * message ids, with random ids as chatd uses them
+ * - Look up the chat and the message of 1M incoming commands in both kinds of map, a
+ * quarter of them for unknown messages, and check that both find the same entries
+ * - Measure the time of the lookups per command with each kind of map
+ * - Erase a third of the messages while iterating, and check that the maps still match
+ *
+ */
+void MegaChatApiTest::TEST_IdMapLookups()
+{
+    const unsigned chatCount = 2000;
+    const unsigned msgCount = 100000;
+    const unsigned cmdCount = 1000000;
+    uint64_t seed = 1;
+    auto rand = [&seed]() { seed = seed * 6364136223846793005ULL + 1442695040888963407ULL; return seed ^ (seed >> 29); };
+
+    karere::IdMap<unsigned> chats;
+    std::map<karere::Id, unsigned> refChats;
+    std::vector<karere::Id> chatids;
+    for (unsigned i = 0; i < chatCount; i++)
+    {
+        karere::Id chatid(rand());
+        chats[chatid] = i;
+        refChats[chatid] = i;
+        chatids.push_back(chatid);
+    }
+    karere::IdMap<unsigned> msgs;
+    std::map<karere::Id, unsigned> refMsgs;
+    std::vector<karere::Id> msgids;
+    for (unsigned i = 0; i < msgCount; i++)
+    {
+        karere::Id msgid(rand());
+        msgs[msgid] = i;
+        refMsgs[msgid] = i;
+        msgids.push_back(msgid);
+    }
+    ASSERT_CHAT_TEST(chats.size() == refChats.size() && msgs.size() == refMsgs.size(), "Wrong number of entries in maps of ids");
+
+    // the chat and the message targeted by each command, a quarter of the messages are new
+    std::vector<std::pair<karere::Id, karere::Id>> cmds;
+    cmds.reserve(cmdCount);
+    for (unsigned i = 0; i < cmdCount; i++)
+    {
+        karere::Id msgid = (i % 4) ? msgids[rand() % msgCount] : karere::Id(rand());
+        cmds.emplace_back(chatids[rand() % chatCount], msgid);
+    }
+
+    uint64_t sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (auto& cmd: cmds)
+    {
+        auto chatIt = chats.find(cmd.first);
+        auto msgIt = msgs.find(cmd.second);
+        sum += chatIt->second + ((msgIt != msgs.end()) ? msgIt->second : 0);
+    }
+    auto mid = std::chrono::steady_clock::now();
+    uint64_t refSum = 0;
+    for (auto& cmd: cmds)
+    {
+        auto chatIt = refChats.find(cmd.first);
+        auto msgIt = refMsgs.find(cmd.second);
+        refSum += chatIt->second + ((msgIt != refMsgs.end()) ? msgIt->second : 0);
+    }
+    auto end = std::chrono::steady_clock::now();
+    ASSERT_CHAT_TEST(sum == refSum, "IdMap and std::map found different entries");
+
+    double nsecs = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(mid - start).count() / cmdCount;
+    double refNsecs = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - mid).count() / cmdCount;
+    postLog("Lookups per incoming command: " + std::to_string(nsecs) + " ns with IdMap, "
+            + std::to_string(refNsecs) + " ns with std::map");
+
+    for (auto it = msgs.begin(); it != msgs.end();)
+    {
+        if (it->second % 3)
+            ++it;
+        else
+            it = msgs.erase(it);
+    }
+    for (auto it = refMsgs.begin(); it != refMsgs.end();)
+    {
+        if (it->second % 3)
+            ++it;
+        else
+            it = refMsgs.erase(it);
+    }
+    ASSERT_CHAT_TEST(msgs.size() == refMsgs.size(), "Wrong number of entries after erasing while iterating: "
+                     + std::to_string(msgs.size()) + " instead of " + std::to_string(refMsgs.size()));
+    for (auto& entry: refMsgs)
+    {
+        karere::IdMap<unsigned>::const_iterator it = msgs.find(entry.first);
+        ASSERT_CHAT_TEST(it != msgs.end() && it->second == entry.second, "Entry lost after erasing while iterating");
+    }
+}
+
+/**
+ * @brief TEST_EventQueue
+ *
+ * This test does the following:
+ *
+ * - Push 200k items from 4 threads to a lock-free queue, while another thread pops them
+ * - Check that all of them are popped, in the order each thread pushed them
+ * - Measure the time, and compare it with a deque protected by a mutex
+ *
+ */
+void MegaChatApiTest::TEST_EventQueue()
+{
+    const uintptr_t producers = 4;
+    const uintptr_t perProducer = 50000;
+    // items are (producer << 32 | sequence) + 1, so none of them is null
+    auto makeItem = [](uintptr_t producer, uintptr_t seq) { return (void *)(((uint64_t)producer << 32 | seq) + 1); };
+
+    karere::MpscQueue<void *> queue;
+    std::vector<uint64_t> nextSeq(producers, 0);
+    std::vector<std::thread> threads;
+    bool ordered = true;
+    std::atomic<size_t> wakeups(0);
+    auto start = std::chrono::steady_clock::now();
+    for (uintptr_t p = 0; p < producers; p++)
+    {
+        threads.emplace_back([&queue, &wakeups, makeItem, p, perProducer]()
+        {
+            for (uintptr_t i = 0; i < perProducer; i++)
+            {
+                if (queue.push(makeItem(p, i)))
+                {
+                    wakeups++;
+                }
+            }
+        });
+    }
+    size_t popped = 0;
+    while (popped < producers * perProducer)
+    {
+        void *item = queue.pop();
+        if (!item)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        uint64_t val = (uint64_t)(uintptr_t)item - 1;
+        uint64_t p = val >> 32;
+        ordered = ordered && (p < producers) && ((val & 0xffffffff) == nextSeq[p]);
+        if (p < producers)
+        {
+            nextSeq[p]++;
+        }
+        popped++;
+    }
+    for (auto& thread: threads)
+    {
+        thread.join();
+    }
+    auto lockFreeUsecs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    ASSERT_CHAT_TEST(ordered, "Items of a producer were popped out of order");
+    ASSERT_CHAT_TEST(queue.empty() && !queue.pop(), "The queue is not empty after popping all the items");
+
+    std::deque<void *> deque;
+    std::mutex mutex;
+    threads.clear();
+    start = std::chrono::steady_clock::now();
+    for (uintptr_t p = 0; p < producers; p++)
+    {
+        threads.emplace_back([&deque, &mutex, makeItem, p, perProducer]()
+        {
+            for (uintptr_t i = 0; i < perProducer; i++)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                deque.push_back(makeItem(p, i));
+            }
+        });
+    }
+    popped = 0;
+    while (popped < producers * perProducer)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (deque.empty())
+        {
+            lock.unlock();
+            std::this_thread::yield();
+            continue;
+        }
+        deque.pop_front();
+        popped++;
+    }
+    for (auto& thread: threads)
+    {
+        thread.join();
+    }
+    auto mutexUsecs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    postLog("Transferred " + std::to_string(producers * perProducer) + " items from " + std::to_string(producers)
+            + " threads in " + std::to_string(lockFreeUsecs) + " us (" + std::to_string(wakeups.load())
+            + " wakeups), with a mutex in " + std::to_string(mutexUsecs) + " us");
+}
+
+/**
+ * @brief TEST_SharedSecretCache
+ *
+ * This test does the following:
+ *
+ * - Create two Cu25519 key pairs
+ * - Compute the shared secret from both sides, and check they match
+ * - Check that the secret is cached, and not computed again
+ * - Check that the secret is persisted encrypted, and restored by a new cache
+ * - Check that a persisted secret that was tampered with is dropped
+ * - Check that the restored secret is used only after checking the public key of the user
+ * - Check that the secret is replaced when the public key of the user changes
+ *
+ */
+void MegaChatApiTest::TEST_SharedSecretCache()
+{
+    strongvelope::EcKey privA, pubA, privB, pubB;
+    randombytes_buf(privA.buf(), privA.dataSize());
+    crypto_scalarmult_base(pubA.ubuf(), privA.ubuf());
+    randombytes_buf(privB.buf(), privB.dataSize());
+    crypto_scalarmult_base(pubB.ubuf(), privB.ubuf());
+    karere::Id userA((uint64_t)1);
+    karere::Id userB((uint64_t)2);
+
+    SqliteDb db;
+    ASSERT_CHAT_TEST(db.open(":memory:"), "Failed to open in-memory database");
+    db.simpleQuery(karere::gDbSchema);
+
+    strongvelope::SharedSecretCache cacheA;
+    cacheA.attachDb(db, privA);
+    ASSERT_CHAT_TEST(!cacheA.get(userB), "Unexpected shared secret in an empty cache");
+    auto secretAB = cacheA.compute(userB, privA, pubB);
+
+    strongvelope::SharedSecretCache cacheB;
+    auto secretBA = cacheB.compute(userA, privB, pubA);
+    ASSERT_CHAT_TEST(!memcmp(secretAB->buf(), secretBA->buf(), secretAB->dataSize()), "Shared secrets don't match");
+
+    ASSERT_CHAT_TEST(cacheA.get(userB) == secretAB, "Shared secret not cached");
+    ASSERT_CHAT_TEST(cacheA.compute(userB, privA, pubB) == secretAB, "Cached shared secret computed again");
+    auto stats = cacheA.stats();
+    ASSERT_CHAT_TEST(stats.hits == 1 && stats.misses == 1, "Unexpected hits/misses: " + std::to_string(stats.hits)
+                     + "/" + std::to_string(stats.misses));
+
+    Buffer persisted;
+    {
+        SqliteStmt stmt(db, "select secret from shared_secrets where userid = ?");
+        stmt << userB;
+        ASSERT_CHAT_TEST(stmt.step(), "Shared secret not persisted");
+        stmt.blobCol(0, persisted);
+    }
+    // nonce, MAC and secret
+    ASSERT_CHAT_TEST(persisted.dataSize() == crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES + secretAB->dataSize(),
+                     "Unexpected size of persisted shared secret");
+    ASSERT_CHAT_TEST(memcmp(persisted.buf() + crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES,
+                            secretAB->buf(), secretAB->dataSize()), "Shared secret persisted in clear");
+
+    strongvelope::SharedSecretCache restored;
+    restored.attachDb(db, privA);
+    ASSERT_CHAT_TEST(restored.stats().loaded == 1, "Unexpected number of shared secrets loaded");
+    ASSERT_CHAT_TEST(!restored.get(userB), "Restored shared secret used without checking the public key");
+    auto loaded = restored.compute(userB, privA, pubB);
+    ASSERT_CHAT_TEST(!memcmp(loaded->buf(), secretAB->buf(), loaded->dataSize()), "Shared secret not restored from db");
+    ASSERT_CHAT_TEST(restored.stats().computed == 0, "Restored shared secret computed again");
+    ASSERT_CHAT_TEST(restored.get(userB) == loaded, "Checked shared secret not cached");
+
+    // userB gets a new key pair, i.e. after an account recovery
+    strongvelope::EcKey privB2, pubB2;
+    randombytes_buf(privB2.buf(), privB2.dataSize());
+    crypto_scalarmult_base(pubB2.ubuf(), privB2.ubuf());
+    auto secretAB2 = restored.compute(userB, privA, pubB2);
+    strongvelope::SharedSecretCache cacheB2;
+    auto secretB2A = cacheB2.compute(userA, privB2, pubA);
+    ASSERT_CHAT_TEST(!memcmp(secretAB2->buf(), secretB2A->buf(), secretAB2->dataSize()), "Shared secrets with the new key don't match");
+    ASSERT_CHAT_TEST(restored.stats().stale == 1, "Stale shared secret not replaced");
+
+    strongvelope::SharedSecretCache reloaded;
+    reloaded.attachDb(db, privA);
+    auto current = reloaded.compute(userB, privA, pubB2);
+    ASSERT_CHAT_TEST(!memcmp(current->buf(), secretAB2->buf(), current->dataSize()) && reloaded.stats().computed == 0,
+                     "Replaced shared secret not persisted");
+
+    reloaded.forget(userB);
+    ASSERT_CHAT_TEST(!reloaded.get(userB), "Forgotten shared secret still cached");
+    {
+        SqliteStmt stmt(db, "select count(*) from shared_secrets");
+        ASSERT_CHAT_TEST(stmt.step() && stmt.intCol(0) == 0, "Forgotten shared secret still persisted");
+    }
+
+    // flip a bit of the persisted secret
+    persisted.buf()[persisted.dataSize() - 1] ^= 1;
+    db.query("insert into shared_secrets(userid, pubkey, secret) values(?,?,?)", userB, pubB, persisted);
+    strongvelope::SharedSecretCache tampered;
+    tampered.attachDb(db, privA);
+    ASSERT_CHAT_TEST(tampered.stats().loaded == 0, "Tampered shared secret loaded");
+    {
+        SqliteStmt stmt(db, "select count(*) from shared_secrets");
+        ASSERT_CHAT_TEST(stmt.step() && stmt.intCol(0) == 0, "Tampered shared secret not dropped");
+    }
+
+    db.close();
+}
+
+/**
+ * @brief TEST_MessageCryptoAllocs
+ *
+ * This test does the following:
+ *
+ * - Encrypt and sign a message with a random key, as it is sent to chatd
+ * - Parse it with the ParsedMessage of a chat, verify it and decrypt it into the
+ * received message, as done by msgDecrypt(), and check the plaintext and backrefs
+ * - Repeat it many times with a small and a big message, and report the time and
+ * the heap allocations per message of each side
+ * - Check that the allocations per message are below a limit, and that a big message
+ * needs at most a couple more than a small one, i.e. the payload is not copied around
+ *
+ * Allocations are only counted if the test is built with SDK_TEST_COUNT_ALLOCS.
+ */
+void MegaChatApiTest::TEST_MessageCryptoAllocs(unsigned int a1, unsigned int a2)
+{
+    char *primarySession = login(a1);
+    char *secondarySession = login(a2);
+
+    MegaUser *user = megaApi[a1]->getContact(mAccounts[a2].getEmail().c_str());
+    if (!user || (user->getVisibility() != MegaUser::VISIBILITY_VISIBLE))
+    {
+        makeContact(a1, a2);
+    }
+    delete user;
+    user = NULL;
+
+    MegaChatHandle chatid = getPeerToPeerChatRoom(a1, a2);
+
+    // the chat's crypto module, which is not used by ParsedMessage beyond its chatid.
+    // It's owned by the client, so the lock is held until the measurement is done
+    MegaChatApiImpl *impl = megaChatApi[a1]->pImpl;
+    impl->sdkMutex.lock();
+    auto it = impl->mClient->chats->find(chatid);
+    strongvelope::ProtocolHandler *handler = (it != impl->mClient->chats->end())
+            ? static_cast<strongvelope::ProtocolHandler*>(it->second->chat().crypto())
+            : nullptr;
+    if (!handler)
+    {
+        impl->sdkMutex.unlock();
+        ASSERT_CHAT_TEST(false, "Crypto module of chatroom not found");
+    }
+
+    // upper limit of the allocations to encrypt or decrypt a small message
+    const size_t kMaxAllocsPerMsg = 24;
+    // upper limit of the extra allocations for a message 100 times bigger. The payload
+    // is never copied, but a buffer may need to grow once more than for the small one
+    const size_t kMaxExtraAllocsPerBigMsg = 2;
+    const unsigned int count = 10000;
+    strongvelope::SendKey key;
+    randombytes_buf(key.buf(), key.dataSize());
+    strongvelope::Key<crypto_sign_PUBLICKEYBYTES> pubKey;
+    strongvelope::Key<crypto_sign_SECRETKEYBYTES> signingKey;
+    crypto_sign_keypair(pubKey.ubuf(), signingKey.ubuf());
+    std::vector<chatd::BackRefId> backRefs = { 1, 2, 3, 4 };
+
+    // debug logs of every message would be counted as well
+    megaChatApi[a1]->setLogLevel(MegaChatApi::LOG_LEVEL_ERROR);
+    std::string failure;
+    size_t allocs[2][2] = { { 0, 0 }, { 0, 0 } };   // [small/big][encrypt/decrypt]
+    for (int big = 0; big < 2 && failure.empty(); big++)
+    {
+        std::string text(big ? 20000 : 200, 'x');
+        chatd::Message msg(karere::Id((uint64_t)1), karere::Id((uint64_t)2), 0, 0, text.c_str(), text.size(), true);
+        msg.backRefId = 0x1234;
+        msg.backRefs = backRefs;
+
+        int64_t encryptUsecs = 0;
+        int64_t decryptUsecs = 0;
+        for (unsigned int i = 0; i < count && failure.empty(); i++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            std::unique_ptr<chatd::MsgCommand> cmd;
+            {
+#ifdef SDK_TEST_COUNT_ALLOCS
+                AllocCounterScope counter(allocs[big][0]);
+#endif
+                cmd.reset(new chatd::MsgCommand(chatd::OP_NEWMSG, handler->chatid, msg.userid, msg.id(), msg.ts, msg.updated));
+                strongvelope::encryptMessageContent(msg, *cmd, key, signingKey);
+            }
+            auto mid = std::chrono::steady_clock::now();
+            encryptUsecs += std::chrono::duration_cast<std::chrono::microseconds>(mid - start).count();
+
+            // the received frame is owned by the connection, and the message only references it
+            auto frame = std::make_shared<Buffer>(cmd->buf(), cmd->dataSize());
+            StaticBuffer content = cmd->msg();
+            mid = std::chrono::steady_clock::now();
+            bool verified;
+            std::unique_ptr<chatd::Message> received;
+            {
+#ifdef SDK_TEST_COUNT_ALLOCS
+                AllocCounterScope counter(allocs[big][1]);
+#endif
+                received.reset(new chatd::Message(msg.id(), msg.userid, msg.ts, msg.updated,
+                                                  frame, content.buf() - cmd->buf(), content.dataSize()));
+                strongvelope::ParsedMessage parsedMsg(*received, *handler);
+                verified = parsedMsg.verifySignature(pubKey, key);
+                parsedMsg.symmetricDecrypt(key, *received);
+            }
+            decryptUsecs += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - mid).count();
+
+            if (!verified)
+            {
+                failure = "Signature of encrypted message not verified";
+            }
+            else if (received->dataSize() != text.size() || memcmp(received->buf(), text.data(), text.size())
+                     || received->backRefId != msg.backRefId || received->backRefs != backRefs)
+            {
+                failure = "Decrypted message doesn't match the original";
+            }
+        }
+
+        postLog("Encrypted " + std::to_string(count) + " messages of " + std::to_string(text.size()) + " bytes in "
+                + std::to_string(encryptUsecs) + " us (" + std::to_string((double)allocs[big][0] / count)
+                + " allocations/msg), decrypted in " + std::to_string(decryptUsecs) + " us ("
+                + std::to_string((double)allocs[big][1] / count) + " allocations/msg)");
+    }
+    megaChatApi[a1]->setLogLevel(MegaChatApi::LOG_LEVEL_DEBUG);
+    impl->sdkMutex.unlock();
+    ASSERT_CHAT_TEST(failure.empty(), failure);
+
+#ifdef SDK_TEST_COUNT_ALLOCS
+    for (int side = 0; side < 2; side++)
+    {
+        std::string what = side ? "decrypt" : "encrypt";
+        ASSERT_CHAT_TEST(allocs[0][side] <= kMaxAllocsPerMsg * count, "Too many allocations to " + what
+                         + " a message: " + std::to_string((double)allocs[0][side] / count));
+        ASSERT_CHAT_TEST(allocs[1][side] <= allocs[0][side] + kMaxExtraAllocsPerBigMsg * count,
+                         "Allocations to " + what + " a message grow with its size: "
+                         + std::to_string(allocs[0][side]) + " vs " + std::to_string(allocs[1][side]));
+    }
+#endif
+
+    delete [] primarySession;
+    primarySession = NULL;
+    delete [] secondarySession;
+    secondarySession = NULL;
+}
+
+int MegaChatApiTest::loadHistory(unsigned int accountIndex, MegaChatHandle chatid, TestChatRoomListener *chatroomListener)
+{
+    // first of all, ensure the chatd connection is ready
+    bool *flagChatdOnline = &mChatConnectionOnline[accountIndex]; *flagChatdOnline = false;
+    while (megaChatApi[accountIndex]->getChatConnectionState(chatid) != MegaChatApi::CHAT_CONNECTION_ONLINE)
+    {
+        postLog("Attempt to load history when still offline. Waiting for connection...");
+        ASSERT_CHAT_TEST(waitForResponse(flagChatdOnline), "Timeout expired for connecting to chatd");
+        *flagChatdOnline = false;
+    }
+
+    chatroomListener->msgCount[accountIndex] = 0;
+    while (1)
+    {
+        bool *flagHistoryLoaded = &chatroomListener->historyLoaded[accountIndex];
+        *flagHistoryLoaded = false;
+        int source = megaChatApi[accountIndex]->loadMessages(chatid, 16);
+        if (source == MegaChatApi::SOURCE_NONE || source == MegaChatApi::SOURCE_ERROR)
+        {
+            break;  // no more history or cannot retrieve it
+        }
+        ASSERT_CHAT_TEST(waitForResponse(flagHistoryLoaded), "Timeout expired for loading history");
+    }
+
+    return chatroomListener->msgCount[accountIndex];
+}
+
+void MegaChatApiTest::makeContact(unsigned int a1, unsigned int a2)
+{
+    bool *flagRequestInviteContact = &requestFlags[a1][MegaRequest::TYPE_INVITE_CONTACT];
+    *flagRequestInviteContact = false;
+    bool *flagContactRequestUpdatedSecondary = &mContactRequestUpdated[a2];
+    *flagContactRequestUpdatedSecondary = false;
+    std::string contactRequestMessage = "Contact Request Message";
+    megaApi[a1]->inviteContact(mAccounts[a2].getEmail().c_str(),
+                                                contactRequestMessage.c_str(), MegaContactRequest::INVITE_ACTION_ADD);
+
+    ASSERT_CHAT_TEST(waitForResponse(flagRequestInviteContact), "Expired timeout for invite contact request");
+    ASSERT_CHAT_TEST(!lastError[a1], "Error invite contact. Error: " + std::to_string(lastError[a1]));
+    ASSERT_CHAT_TEST(waitForResponse(flagContactRequestUpdatedSecondary), "Expired timeout for receive contact request");
+
+    getContactRequest(a2, false);
+
+    bool *flagReplyContactRequest = &requestFlags[a2][MegaRequest::TYPE_REPLY_CONTACT_REQUEST];
+    *flagReplyContactRequest = false;
+    bool *flagContactRequestUpdatedPrimary = &mContactRequestUpdated[a1];
+    *flagContactRequestUpdatedPrimary = false;
+    megaApi[a2]->replyContactRequest(mContactRequest[a2], MegaContactRequest::REPLY_ACTION_ACCEPT);
+    ASSERT_CHAT_TEST(waitForResponse(flagReplyContactRequest), "Expired timeout for reply contact request");
+    ASSERT_CHAT_TEST(!lastError[a2], "Error reply contact request. Error: " + std::to_string(lastError[a2]));
+    ASSERT_CHAT_TEST(waitForResponse(flagContactRequestUpdatedPrimary), "Expired timeout for receive contact request reply");
+
+    delete mContactRequest[a2];
+    mContactRequest[a2] = NULL;
+}
+
+MegaChatHandle MegaChatApiTest::getGroupChatRoom(unsigned int a1, unsigned int a2,
+                                                 MegaChatPeerList *peers, bool create)
+{
+    MegaChatRoomList *chats = megaChatApi[a1]->getChatRooms();
+
+    bool chatroomExist = false;
+    MegaChatHandle chatid = MEGACHAT_INVALID_HANDLE;
+    for (int i = 0; i < chats->size() && !chatroomExist; ++i)
+    {
+        const MegaChatRoom *chat = chats->get(i);
+        if (!chat->isGroup() || !chat->isActive())
+        {
+            continue;
+        }
+
+        for (int userIndex = 0; userIndex < chat->getPeerCount(); userIndex++)
+        {
+            if (chat->getPeerHandle(userIndex) == peers->getPeerHandle(0))
+            {
+                bool a2LoggedIn = (megaChatApi[a2] &&
+                                   (megaChatApi[a2]->getInitState() == MegaChatApi::INIT_ONLINE_SESSION ||
+                                    megaChatApi[a2]->getInitState() == MegaChatApi::INIT_OFFLINE_SESSION));
+
+                MegaChatRoom *chatToCheck = a2LoggedIn ? megaChatApi[a2]->getChatRoom(chat->getChatId()) : NULL;
+                if (!a2LoggedIn || (chatToCheck))
+                {
+                    delete chatToCheck;
+                    chatroomExist = true;
+                    chatid = chat->getChatId();
+                    break;
+                }
+            }
+        }
+    }
+
+    delete chats;
+    chats = NULL;
+
+    if (!chatroomExist && create)
+    {
+        bool *flagCreateChatRoom = &requestFlagsChat[a1][MegaChatRequest::TYPE_CREATE_CHATROOM]; *flagCreateChatRoom = false;
+        bool *chatItemPrimaryReceived = &chatItemUpdated[a1]; *chatItemPrimaryReceived = false;
+        bool *chatItemSecondaryReceived = &chatItemUpdated[a2]; *chatItemSecondaryReceived = false;
+        this->chatid[a1] = MEGACHAT_INVALID_HANDLE;
+
+        megaChatApi[a1]->createChat(true, peers, this);
+        ASSERT_CHAT_TEST(waitForResponse(flagCreateChatRoom), "Expired timeout for creating groupchat");
+        ASSERT_CHAT_TEST(!lastErrorChat[a1], "Failed to create groupchat. Error: " + lastErrorMsgChat[a1] + " (" + std::to_string(lastErrorChat[a1]) + ")");
+        chatid = this->chatid[a1];
+        ASSERT_CHAT_TEST(chatid != MEGACHAT_INVALID_HANDLE, "Wrong chat id");
+        ASSERT_CHAT_TEST(chatroomFromRequest[a1], "New chatroom not available when its request finished");
+        ASSERT_CHAT_TEST(waitForResponse(chatItemPrimaryReceived), "Expired timeout for receiving the new chat list item");
+
+        // since we may have multiple notifications for other chats, check we received the right one
+        MegaChatListItem *chatItemSecondaryCreated = NULL;
+        do
+        {
+            ASSERT_CHAT_TEST(waitForResponse(chatItemSecondaryReceived), "Expired timeout for receiving the new chat list item");
+            *chatItemSecondaryReceived = false;
+
+            chatItemSecondaryCreated = megaChatApi[a2]->getChatListItem(chatid);
+            if (!chatItemSecondaryCreated)
+            {
+                continue;
+            }
+            else
+            {
+                if (chatItemSecondaryCreated->getChatId() != chatid)
+                {
+                    delete chatItemSecondaryCreated; chatItemSecondaryCreated = NULL;
+                }
+            }
+        } while (!chatItemSecondaryCreated);
+
+        delete chatItemSecondaryCreated;    chatItemSecondaryCreated = NULL;
+    }
+
+    return chatid;
+}
+
+MegaChatHandle MegaChatApiTest::getPeerToPeerChatRoom(unsigned int a1, unsigned int a2)
+{
+    MegaUser *peerPrimary = megaApi[a1]->getContact(mAccounts[a2].getEmail().c_str());
+    MegaUser *peerSecondary = megaApi[a2]->getContact(mAccounts[a1].getEmail().c_str());
+    ASSERT_CHAT_TEST(peerPrimary && peerSecondary, "Fail to get Peers");
+
+    MegaChatRoom *chatroom0 = megaChatApi[a1]->getChatRoomByUser(peerPrimary->getHandle());
+    if (!chatroom0) // chat 1on1 doesn't exist yet --> create it
+    {
+        MegaChatPeerList *peers = MegaChatPeerList::createInstance();
+        peers->addPeer(peerPrimary->getHandle(), MegaChatPeerList::PRIV_STANDARD);
+
+        bool *flag = &requestFlagsChat[a1][MegaChatRequest::TYPE_CREATE_CHATROOM]; *flag = false;
         bool *chatCreated = &chatItemUpdated[a1]; *chatCreated = false;
         bool *chatReceived = &chatItemUpdated[a2]; *chatReceived = false;
         megaChatApi[a1]->createChat(false, peers, this);
@@ -3271,6 +4614,17 @@ void MegaChatApiTest::clearHistory(unsigned int a1, unsigned int a2, MegaChatHan
     delete itemSecondary; itemSecondary = NULL;
 }
 
+bool MegaChatApiTest::checkUnreadCount(unsigned int accountIndex, MegaChatHandle chatid)
+{
+    // the chat is owned by the thread of MegaChatApi, which holds sdkMutex while it runs
+    MegaChatApiImpl *impl = megaChatApi[accountIndex]->pImpl;
+    impl->sdkMutex.lock();
+    auto it = impl->mClient->chats->find(chatid);
+    bool ok = (it != impl->mClient->chats->end()) && it->second->chat().checkUnreadMsgCount();
+    impl->sdkMutex.unlock();
+    return ok;
+}
+
 void MegaChatApiTest::leaveChat(unsigned int accountIndex, MegaChatHandle chatid)
 {
     bool *flagRemoveFromchatRoom = &requestFlagsChat[accountIndex][MegaChatRequest::TYPE_REMOVE_FROM_CHATROOM]; *flagRemoveFromchatRoom = false;
@@ -3627,8 +4981,13 @@ void MegaChatApiTest::onRequestFinish(MegaChatApi *api, MegaChatRequest *request
         switch(request->getType())
         {
             case MegaChatRequest::TYPE_CREATE_CHATROOM:
+            {
                 chatid[apiIndex] = request->getChatHandle();
+                MegaChatRoom *room = api->getChatRoom(chatid[apiIndex]);
+                chatroomFromRequest[apiIndex] = (room != NULL);
+                delete room;
                 break;
+            }
 
             case MegaChatRequest::TYPE_GET_FIRSTNAME:
                 mChatFirstname = request->getText() ? request->getText() : "";
@@ -4114,3 +5473,169 @@ void MegaLoggerTest::log(int loglevel, const char *message)
     // message comes with a line-break at the end
     testlog  << message;
 }
+
+/**
+ * @brief TEST_FrameReplay
+ *
+ * This test does the following:
+ *
+ * - Load the history of a chatroom of the primary account
+ * - Build frames of 200 message commands each, as received from chatd upon a history fetch
+ * - Replay them through Connection::execCommand, in the thread of the client, and report
+ * the time and the heap allocations per frame
+ * - Decode the same commands into messages that copy their payload, as done before messages
+ * referenced the frame, and into messages that reference it, and report both
+ * - Check that referencing the frame needs one allocation per message plus one per frame
+ *
+ * The commands are NEWMSG of messages already in the history, like those chatd resends
+ * after a reconnection, so the chat discards them once decoded and its state is not altered.
+ * OLDMSG commands are decoded the same way. Allocations are only counted if the test is
+ * built with SDK_TEST_COUNT_ALLOCS.
+ */
+void MegaChatApiTest::TEST_FrameReplay(unsigned int a1, unsigned int a2)
+{
+    char *primarySession = login(a1);
+    char *secondarySession = login(a2);
+
+    MegaUser *user = megaApi[a1]->getContact(mAccounts[a2].getEmail().c_str());
+    if (!user || (user->getVisibility() != MegaUser::VISIBILITY_VISIBLE))
+    {
+        makeContact(a1, a2);
+    }
+    delete user;
+    user = NULL;
+
+    MegaChatHandle chatid = getPeerToPeerChatRoom(a1, a2);
+
+    TestChatRoomListener *chatroomListener = new TestChatRoomListener(this, megaChatApi, chatid);
+    ASSERT_CHAT_TEST(megaChatApi[a1]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(a1+1));
+    ASSERT_CHAT_TEST(megaChatApi[a2]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(a2+1));
+    loadHistory(a1, chatid, chatroomListener);
+    loadHistory(a2, chatid, chatroomListener);
+    MegaChatMessage *msgSent = sendTextMessageOrUpdate(a2, a1, chatid, "Message to be replayed", chatroomListener);
+    ASSERT_CHAT_TEST(msgSent, "Failed to send message");
+    delete msgSent;
+
+    const unsigned int kMsgsPerFrame = 200;
+    const unsigned int kFrames = 50;
+    const size_t kPayloadLen = 200;
+    std::string payload(kPayloadLen, 0);
+    randombytes_buf(&payload[0], payload.size());
+    karere::Id sender(megaChatApi[a2]->getMyUserHandle());
+
+    // the decoding done by the client is measured in its own thread, where the chat lives
+    MegaChatApiImpl *impl = megaChatApi[a1]->pImpl;
+    std::string failure;
+    std::string report;
+    bool done = false;
+    megaChatApi[a1]->setLogLevel(MegaChatApi::LOG_LEVEL_ERROR);
+    karere::marshallCall([impl, chatid, sender, &payload, &failure, &report, &done]()
+    {
+        chatd::Chat &chat = impl->mClient->mChatdClient->chats(chatid);
+        std::vector<karere::Id> msgids;
+        for (chatd::Idx idx = chat.lownum(); idx <= chat.highnum(); idx++)
+        {
+            msgids.push_back(chat.at(idx).id());
+        }
+        if (msgids.empty())
+        {
+            failure = "No messages in the history of the chatroom";
+            done = true;
+            return;
+        }
+
+        Buffer frame(kMsgsPerFrame * (39 + payload.size()));
+        for (unsigned int i = 0; i < kMsgsPerFrame; i++)
+        {
+            frame.append<uint8_t>(chatd::OP_NEWMSG);
+            frame.append<uint64_t>(chatid);
+            frame.append<uint64_t>(sender);
+            frame.append<uint64_t>(msgids[i % msgids.size()]);
+            frame.append<uint32_t>((uint32_t)time(NULL));
+            frame.append<uint16_t>(0);
+            frame.append<uint32_t>(0);
+            frame.append<uint32_t>((uint32_t)payload.size());
+            frame.append(payload);
+        }
+        StaticBuffer received(frame.buf(), frame.dataSize());
+
+        // [replay/copying decode/referencing decode]
+        size_t allocs[3] = { 0, 0, 0 };
+        int64_t usecs[3] = { 0, 0, 0 };
+        for (unsigned int f = 0; f < kFrames; f++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            {
+#ifdef SDK_TEST_COUNT_ALLOCS
+                AllocCounterScope counter(allocs[0]);
+#endif
+                chat.connection().execCommand(received);
+            }
+            usecs[0] += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+            for (int slices = 0; slices < 2; slices++)
+            {
+                start = std::chrono::steady_clock::now();
+                {
+#ifdef SDK_TEST_COUNT_ALLOCS
+                    AllocCounterScope counter(allocs[1 + slices]);
+#endif
+                    std::shared_ptr<Buffer> sharedFrame;
+                    for (size_t pos = 0; pos < received.dataSize();)
+                    {
+                        karere::Id userid = received.read<uint64_t>(pos + 9);
+                        karere::Id msgid = received.read<uint64_t>(pos + 17);
+                        uint32_t ts = received.read<uint32_t>(pos + 25);
+                        uint16_t updated = received.read<uint16_t>(pos + 29);
+                        uint32_t keyid = received.read<uint32_t>(pos + 31);
+                        uint32_t msglen = received.read<uint32_t>(pos + 35);
+                        size_t msgOffset = pos + 39;
+                        std::unique_ptr<chatd::Message> msg;
+                        if (slices)
+                        {
+                            if (!sharedFrame)
+                            {
+                                sharedFrame = std::make_shared<Buffer>(received.buf(), received.dataSize());
+                            }
+                            msg.reset(new chatd::Message(msgid, userid, ts, updated, sharedFrame, msgOffset, msglen, keyid));
+                        }
+                        else
+                        {
+                            msg.reset(new chatd::Message(msgid, userid, ts, updated, received.readPtr(msgOffset, msglen),
+                                                         msglen, false, keyid));
+                        }
+                        pos = msgOffset + msglen;
+                    }
+                }
+                usecs[1 + slices] += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+            }
+        }
+
+        report = "Frames of " + std::to_string(kMsgsPerFrame) + " messages: replayed in "
+                + std::to_string(usecs[0] / kFrames) + " us (" + std::to_string(allocs[0] / kFrames)
+                + " allocations), decoded copying the payloads in " + std::to_string(usecs[1] / kFrames)
+                + " us (" + std::to_string(allocs[1] / kFrames) + " allocations), decoded referencing the frame in "
+                + std::to_string(usecs[2] / kFrames) + " us (" + std::to_string(allocs[2] / kFrames) + " allocations)";
+#ifdef SDK_TEST_COUNT_ALLOCS
+        if (allocs[2] > (kMsgsPerFrame + 1) * kFrames)
+        {
+            failure = "Too many allocations to decode a frame referencing it: " + std::to_string(allocs[2] / kFrames);
+        }
+#endif
+        done = true;
+    }, impl->mClient->appCtx);
+    ASSERT_CHAT_TEST(waitForResponse(&done), "Timeout expired for replaying frames");
+    megaChatApi[a1]->setLogLevel(MegaChatApi::LOG_LEVEL_DEBUG);
+    ASSERT_CHAT_TEST(failure.empty(), failure);
+    postLog(report);
+
+    megaChatApi[a1]->closeChatRoom(chatid, chatroomListener);
+    megaChatApi[a2]->closeChatRoom(chatid, chatroomListener);
+    delete chatroomListener;
+    chatroomListener = NULL;
+
+    delete [] primarySession;
+    primarySession = NULL;
+    delete [] secondarySession;
+    secondarySession = NULL;
+}
@@ -186,6 +186,7 @@ public:
     void TEST_EditAndDeleteMessages(unsigned int a1, unsigned int a2);
     void TEST_GroupChatManagement(unsigned int a1, unsigned int a2);
     void TEST_OfflineMode(unsigned int accountIndex);
+    void TEST_OfflineSendQueue(unsigned int accountIndex, unsigned int count);
     void TEST_ClearHistory(unsigned int a1, unsigned int a2);
     void TEST_SwitchAccounts(unsigned int a1, unsigned int a2);
     void TEST_SendContact(unsigned int a1, unsigned int a2);
@@ -201,6 +202,19 @@ public:
 
     void TEST_RichLinkUserAttribute(unsigned int a1);
     void TEST_SendRichLink(unsigned int a1, unsigned int a2);
+    void TEST_UnreadCount(unsigned int a1, unsigned int a2);
+    void TEST_DecryptWorkers(unsigned int a1, unsigned int a2);
+    void TEST_LazyChatRooms(unsigned int a1, unsigned int a2);
+    void TEST_HistoryRamLimit(unsigned int a1, unsigned int a2);
+    void TEST_DbQueryPlans();
+    void TEST_DbWalMode();
+    void TEST_HistoryStore();
+    void TEST_TimerWheel();
+    void TEST_IdMapLookups();
+    void TEST_EventQueue();
+    void TEST_SharedSecretCache();
+    void TEST_MessageCryptoAllocs(unsigned int a1, unsigned int a2);
+    void TEST_FrameReplay(unsigned int a1, unsigned int a2);
 
     unsigned mOKTests;
     unsigned mFailedTests;
@@ -224,6 +238,8 @@ private:
                                     ::mega::MegaNode *nodeToSend, TestChatRoomListener* chatroomListener);
 
     void clearHistory(unsigned int a1, unsigned int a2, megachat::MegaChatHandle chatid, TestChatRoomListener *chatroomListener);
+    // compares the unread count maintained by the client with the one calculated from scratch
+    bool checkUnreadCount(unsigned int accountIndex, megachat::MegaChatHandle chatid);
     void leaveChat(unsigned int accountIndex, megachat::MegaChatHandle chatid);
 
     unsigned int getMegaChatApiIndex(megachat::MegaChatApi *api);
@@ -262,6 +278,7 @@ private:
     int lastErrorTransfer[NUM_ACCOUNTS];
 
     megachat::MegaChatHandle chatid[NUM_ACCOUNTS];  // chatroom id from request
+    bool chatroomFromRequest[NUM_ACCOUNTS];  // getChatRoom() found the chatroom when its request finished
     megachat::MegaChatRoom *chatroom[NUM_ACCOUNTS];
     megachat::MegaChatListItem *chatListItem[NUM_ACCOUNTS];
     bool chatUpdated[NUM_ACCOUNTS];